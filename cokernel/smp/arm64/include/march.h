@@ -2,4 +2,8 @@
 #ifndef __HEADER_IHK_BUILTIN_MARCH
 #define __HEADER_IHK_BUILTIN_MARCH
 
+/* Call on each CPU frozen on request of the host, see ihk_monitor.h */
+void ihk_mc_ack_freeze(unsigned long *freeze_req, unsigned long *freeze_ack,
+		       int nr_words, int cpu);
+
 #endif /* __HEADER_IHK_BUILTIN_MARCH */
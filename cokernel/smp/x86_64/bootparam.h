@@ -52,6 +52,8 @@ struct ihk_smp_boot_param_memory_chunk {
 struct ihk_smp_boot_param_numa_node {
 	int type;
 	int linux_numa_id;
+	/* Physical address of a copy of the kernel image, 0 if none */
+	unsigned long image_replica;
 };
 
 struct ihk_dump_page {
@@ -67,11 +69,47 @@ struct ihk_dump_page_set {
 	unsigned long phy_page;
 };
 
+/* Free memory of the LWK allocator, physical range [start, end) */
+struct ihk_dump_free_range {
+	unsigned long start;
+	unsigned long end;
+};
+
 #define IHK_DUMP_PAGE_SET_INCOMPLETE 0
 #define IHK_DUMP_PAGE_SET_COMPLETED  1
 #define DUMP_LEVEL_ALL 0
 #define DUMP_LEVEL_USER_UNUSED_EXCLUDE 24
 
+/* Values of smp_boot_param.snapshot_state */
+#define SMP_SNAPSHOT_NONE	0
+#define SMP_SNAPSHOT_REQUESTED	1
+#define SMP_SNAPSHOT_QUIESCED	2
+#define SMP_SNAPSHOT_TAKEN	3
+
+/* Sizes of the panic_info area of smp_boot_param */
+#define SMP_PANIC_MSG_SIZE 256
+#define SMP_PANIC_NR_REGS 40
+#define SMP_PANIC_STACK_DEPTH 16
+
+/*
+ * Last words of the LWK, saved by the first CPU to panic. The host
+ * reads them once valid is set, until the instance is shut down.
+ */
+struct smp_panic_info {
+	unsigned int owner;	/* CPU number + 1 of the saver, 0 if none */
+	volatile unsigned int valid;
+	int cpu;
+	unsigned int nr_regs;	/* valid entries of regs */
+	unsigned long ts;	/* time stamp in ns */
+	unsigned long pc;
+	unsigned long sp;
+	unsigned long fp;
+	unsigned long regs[SMP_PANIC_NR_REGS];	/* in the order of pt_regs */
+	unsigned long depth;	/* valid entries of stack */
+	unsigned long stack[SMP_PANIC_STACK_DEPTH];
+	char msg[SMP_PANIC_MSG_SIZE];
+};
+
 /*
  * smp_boot_param holds various boot time arguments.
  * The layout in the memory is the following:
@@ -139,6 +177,42 @@ struct smp_boot_param {
 	int linux_default_huge_page_shift;
 	struct ihk_dump_page_set dump_page_set;
 
+	/*
+	 * Table of ihk_dump_free_range placed after the bitmaps of
+	 * dump_page_set. The LWK fills it with its free memory before
+	 * it completes dump_page_set and the host clears these ranges
+	 * from the bitmaps when the dump level excludes unused pages.
+	 */
+	unsigned long dump_free_ranges;	/* Physical address */
+	unsigned int dump_free_max;
+	volatile unsigned int dump_free_nr;
+
+	/*
+	 * Pages written by the LWK since the last incremental snapshot,
+	 * laid out like dump_page_set in a separate allocation, zero
+	 * unless the host enabled dirty tracking. All bits are set at
+	 * boot. The LWK sets bits atomically, the host harvests them
+	 * with atomic exchanges.
+	 */
+	struct ihk_dump_page_set dirty_page_set;
+
+	/*
+	 * Fast restart: the LWK sets snapshot_end to the end of the
+	 * bootstrap memory it has used before it sets up IKC and reports
+	 * READY. If the host has set snapshot_state to
+	 * SMP_SNAPSHOT_REQUESTED, the boot CPU then waits in
+	 * SMP_SNAPSHOT_QUIESCED, with the other CPUs not started, until
+	 * the host has copied that memory. The host sets
+	 * snapshot_restored when the memory has been restored from a
+	 * snapshot so that the LWK can skip to arch_ready().
+	 */
+	unsigned long snapshot_end;
+	int snapshot_restored;
+	volatile int snapshot_state;
+
+	/* Filled by ihk_mc_save_panic_info() */
+	struct smp_panic_info panic_info;
+
 #ifdef ENABLE_PERF
 #define PERF_EXTRA_REG_MAX 10
 	unsigned long hw_event_map[PERF_COUNT_HW_MAX];
@@ -38,4 +38,8 @@ enum extra_reg_type {
 
 #define ENABLE_SSE
 
+/* Call on each CPU frozen on request of the host, see ihk_monitor.h */
+void ihk_mc_ack_freeze(unsigned long *freeze_req, unsigned long *freeze_ack,
+		       int nr_words, int cpu);
+
 #endif
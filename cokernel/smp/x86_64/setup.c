@@ -33,6 +33,7 @@ unsigned int ihk_ikc_irq = 0;
 unsigned int ihk_ikc_irq_apicid = 0;
 
 struct ihk_dump_page * dump_page;
+static struct ihk_dump_page *dirty_page_map;
 
 /* NOTEs on parameters: 
  *
@@ -141,6 +142,8 @@ void arch_init(void)
 	boot_param = map_fixed_area(boot_param_pa, boot_param_size, 0);
 
 	dump_page = (struct ihk_dump_page *)map_fixed_area(boot_param->dump_page_set.phy_page, boot_param->dump_page_set.page_size, 0);
+	if (boot_param->dirty_page_set.phy_page)
+		dirty_page_map = (struct ihk_dump_page *)map_fixed_area(boot_param->dirty_page_set.phy_page, boot_param->dirty_page_set.page_size, 0);
 
 	/* Map kmsg_buf, which is out of kernel image, with the non-bootstrap map. */
 	ihk_get_kmsg_buf(&msg_buffer, &msg_buffer_size);
@@ -153,11 +156,127 @@ void arch_init(void)
 	build_ihk_cpu_info();
 }
 
+/* Ring the host so that it doesn't have to poll boot_param->status */
+void ihk_mc_notify_status_change(void)
+{
+	int cpu = ihk_mc_get_ikc_cpu(ihk_mc_get_processor_id());
+
+	if (cpu < 0)
+		return;
+
+	ihk_mc_interrupt_host(cpu, IHK_GV_IKC);
+}
+
+/*
+ * Acknowledge a freeze request of the host for this CPU in the monitor
+ * bitmaps. The CPU completing the requested set rings the host so that
+ * it doesn't have to poll the per-CPU status.
+ */
+void ihk_mc_ack_freeze(unsigned long *freeze_req, unsigned long *freeze_ack,
+		       int nr_words, int cpu)
+{
+	int i;
+	int bits = sizeof(unsigned long) * 8;
+
+	if (cpu < 0 || cpu >= nr_words * bits)
+		return;
+
+	__sync_fetch_and_or(&freeze_ack[cpu / bits], 1UL << (cpu % bits));
+
+	for (i = 0; i < nr_words; i++) {
+		if ((freeze_ack[i] & freeze_req[i]) != freeze_req[i])
+			return;
+	}
+
+	ihk_mc_notify_status_change();
+}
+
+/*
+ * Save up to max return addresses walking the frame pointers from fp,
+ * for the NMI handler answering IHK_NMI_MODE_HANG_INFO. Frames must be
+ * further up the stack of sp, so that a broken chain stops the walk
+ * instead of faulting in the handler. Returns the number saved.
+ */
+#define IHK_MC_BACKTRACE_STACK_SIZE (64 * 1024)
+
+int ihk_mc_save_backtrace(unsigned long sp, unsigned long fp,
+			  unsigned long *stack, int max)
+{
+	int depth = 0;
+	unsigned long *frame;
+
+	while (depth < max) {
+		if (fp < sp || fp - sp >= IHK_MC_BACKTRACE_STACK_SIZE ||
+		    (fp & (sizeof(unsigned long) - 1)))
+			break;
+
+		frame = (unsigned long *)fp;
+		stack[depth++] = frame[1];
+
+		/* The caller's frame is above */
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+
+	return depth;
+}
+
+/*
+ * Save the last words of a panicking LWK to boot_param, where the host
+ * keeps them until shutdown, and ring it so that it can signal
+ * IHK_OS_EVENTFD_TYPE_PANIC right away. Only the first CPU to panic is
+ * recorded, the others get -EBUSY. regs are the registers of the
+ * context that panicked in the order of its pt_regs, ts the time stamp
+ * in ns.
+ */
+int ihk_mc_save_panic_info(const char *msg, unsigned long ts,
+			   unsigned long pc, unsigned long sp,
+			   unsigned long fp, const unsigned long *regs,
+			   int nr_regs)
+{
+	struct smp_panic_info *info = &boot_param->panic_info;
+	int cpu = ihk_mc_get_processor_id();
+	int i;
+
+	if (__sync_val_compare_and_swap(&info->owner, 0, cpu + 1) != 0)
+		return -EBUSY;
+
+	info->cpu = cpu;
+	info->ts = ts;
+	info->pc = pc;
+	info->sp = sp;
+	info->fp = fp;
+
+	if (!regs || nr_regs < 0)
+		nr_regs = 0;
+	if (nr_regs > SMP_PANIC_NR_REGS)
+		nr_regs = SMP_PANIC_NR_REGS;
+	for (i = 0; i < nr_regs; i++)
+		info->regs[i] = regs[i];
+	info->nr_regs = nr_regs;
+
+	info->depth = ihk_mc_save_backtrace(sp, fp, info->stack,
+					    SMP_PANIC_STACK_DEPTH);
+
+	for (i = 0; msg && msg[i] && i < SMP_PANIC_MSG_SIZE - 1; i++)
+		info->msg[i] = msg[i];
+	info->msg[i] = '\0';
+
+	/* The host reads the rest once it sees valid */
+	__sync_synchronize();
+	info->valid = 1;
+	ihk_mc_notify_status_change();
+
+	return 0;
+}
+
 void arch_ready(void)
 {
 	/* Make it ready */
 	boot_param->status = 2;
 	barrier();
+	ihk_mc_notify_status_change();
 }
 
 void done_init(void)
@@ -165,6 +284,7 @@ void done_init(void)
 	/* Make it running */
 	boot_param->status = 3;
 	barrier();
+	ihk_mc_notify_status_change();
 }
 
 void arch_set_mikc_queue(void *rq, void *wq)
@@ -307,6 +427,35 @@ int ihk_set_mckernel_do_futex(unsigned long addr)
 	return 0;
 }
 
+/*
+ * End of bootstrap memory to be saved by the host. Called on the boot
+ * CPU before the other CPUs are started and before IKC is set up, the
+ * memory mustn't change until the host is done with it.
+ */
+int ihk_set_snapshot_end(unsigned long addr)
+{
+	boot_param->snapshot_end = addr;
+	__sync_synchronize();
+
+	/* The host may have given up waiting */
+	if (!__sync_bool_compare_and_swap(&boot_param->snapshot_state,
+					  SMP_SNAPSHOT_REQUESTED,
+					  SMP_SNAPSHOT_QUIESCED))
+		return 0;
+
+	ihk_mc_notify_status_change();
+	while (boot_param->snapshot_state == SMP_SNAPSHOT_QUIESCED)
+		cpu_pause();
+
+	return 0;
+}
+
+/* Bootstrap memory has been restored from a snapshot taken at READY */
+int ihk_mc_snapshot_restored(void)
+{
+	return boot_param->snapshot_restored;
+}
+
 unsigned long ihk_mc_map_memory(void *os, unsigned long phys,
                                 unsigned long size)
 {
@@ -345,6 +494,21 @@ int ihk_mc_get_numa_node(int id, int *linux_numa_id, int *type)
 	return 0;
 }
 
+/* Physical address of the kernel image copy on NUMA node id, 0 if none */
+unsigned long ihk_mc_get_numa_image_replica(int id)
+{
+	struct ihk_smp_boot_param_numa_node *node;
+
+	if (id < 0 || id >= boot_param->nr_numa_nodes)
+		return 0;
+
+	node = (((struct ihk_smp_boot_param_numa_node *)
+		((char *)boot_param + sizeof(*boot_param) +
+		boot_param->nr_cpus * sizeof(struct ihk_smp_boot_param_cpu))) + id);
+
+	return node->image_replica;
+}
+
 int ihk_mc_get_numa_distance(int i, int j)
 {
 	int *distance;
@@ -515,6 +679,86 @@ struct ihk_dump_page *ihk_mc_get_dump_page(void)
 	return (dump_page);
 }
 
+/*
+ * Report free memory to be left out of the dump. Called while
+ * preparing dump_page_set, before completion_flag is set. A range
+ * adjacent to the previous one is merged into it. When the table is
+ * full -ENOSPC is returned and the remaining free memory is dumped.
+ */
+int ihk_mc_dump_add_free_range(unsigned long start, unsigned long end)
+{
+	struct ihk_dump_free_range *ranges;
+	unsigned int nr = boot_param->dump_free_nr;
+
+	if (!boot_param->dump_free_ranges || !dump_page)
+		return -EINVAL;
+
+	/* The table shares the mapping of the bitmaps */
+	ranges = (struct ihk_dump_free_range *)((char *)dump_page +
+			(boot_param->dump_free_ranges -
+			 boot_param->dump_page_set.phy_page));
+
+	if (nr && ranges[nr - 1].end == start) {
+		ranges[nr - 1].end = end;
+		return 0;
+	}
+
+	if (nr >= boot_param->dump_free_max)
+		return -ENOSPC;
+
+	ranges[nr].start = start;
+	ranges[nr].end = end;
+	boot_param->dump_free_nr = nr + 1;
+
+	return 0;
+}
+
+/*
+ * Record that [phys, phys + size) has been written for the next
+ * incremental snapshot. Safe to call concurrently from any CPU.
+ */
+void ihk_mc_dump_mark_dirty(unsigned long phys, unsigned long size)
+{
+	struct ihk_dump_page *dirty_page;
+	unsigned long start, end, chunk_end, bit, end_bit, mask;
+	unsigned int i;
+
+	if (!dirty_page_map || !size)
+		return;
+
+	dirty_page = dirty_page_map;
+
+	for (i = 0; i < boot_param->dirty_page_set.count; i++) {
+		if (i) {
+			dirty_page = (struct ihk_dump_page *)((char *)dirty_page +
+					((dirty_page->map_count * sizeof(unsigned long)) +
+					 sizeof(struct ihk_dump_page)));
+		}
+
+		chunk_end = dirty_page->start +
+			dirty_page->map_count * 64 * PAGE_SIZE;
+		start = phys > dirty_page->start ? phys : dirty_page->start;
+		end = phys + size < chunk_end ? phys + size : chunk_end;
+		if (start >= end)
+			continue;
+
+		bit = (start - dirty_page->start) >> PAGE_SHIFT;
+		end_bit = (end - dirty_page->start + PAGE_SIZE - 1) >>
+			PAGE_SHIFT;
+
+		while (bit < end_bit) {
+			if (end_bit - bit < 64 - bit % 64)
+				mask = ((1UL << (end_bit - bit)) - 1) <<
+					(bit % 64);
+			else
+				mask = ~0UL << (bit % 64);
+
+			__sync_fetch_and_or(&dirty_page->map[bit / 64], mask);
+			bit = (bit / 64 + 1) * 64;
+		}
+	}
+}
+
 #ifdef ENABLE_PERF
 int ihk_mc_get_extra_reg_id(unsigned long hw_config, unsigned long hw_config_ext)
 {
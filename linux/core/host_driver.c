@@ -36,6 +36,7 @@
 #include <linux/mutex.h>
 #include <ihk/ihk_host_user.h>
 #include <ihk/ihk_host_driver.h>
+#include <ihk/ihk_kmsg_ring.h>
 #include <asm/spinlock.h>
 #include <ihk/misc/debug.h>
 #include "host_linux.h"
@@ -110,6 +111,10 @@ static int ihk_host_os_open(struct inode *inode, struct file *file)
 	if (!data || data == OS_DATA_INVALID) {
 		return -ENOENT;
 	}
+	/* Still being set up by IHK_DEVICE_LAUNCH_OS */
+	if (!data->lindev) {
+		return -ENOENT;
+	}
 	if (data->flag & IHK_OS_FLAG_SHARABLE) {
 		atomic_inc(&data->refcount);
 	} else if (atomic_cmpxchg(&data->refcount, 0, 1) != 0) {
@@ -276,6 +281,12 @@ static int __ihk_os_ioctl_load(struct ihk_host_linux_os_data *data,
 	return ret;
 }
 
+static void ihk_os_kmsg_notify_start(struct ihk_host_linux_os_data *os,
+				     struct ihk_kmsg_buf *kmsg_buf);
+static void ihk_os_kmsg_notify_stop(struct ihk_host_linux_os_data *os);
+static void ihk_os_watchdog_start(struct ihk_host_linux_os_data *os);
+static void ihk_os_watchdog_stop(struct ihk_host_linux_os_data *os);
+
 /** \brief Boot a kernel related to the OS file */
 static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 {
@@ -303,6 +314,9 @@ static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 		goto out;
 	}
 
+	ihk_os_kmsg_notify_start(data, cont->kmsg_buf);
+	bitmap_zero(data->hung_cpus, IHK_OS_MONITOR_MAX_CPUS);
+
 	/*
 	 * Take OS notifiers lock here so that we can safely
 	 * return on a signal..
@@ -314,6 +328,14 @@ static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 
 	if (data->ops->boot) {
 		ret = data->ops->boot(data, data->priv, flag);
+
+		/* Before IKC, the LWK waits for it if snapshots are on */
+		if (ret == 0 && data->ops->checkpoint) {
+			if (data->ops->checkpoint(data, data->priv)) {
+				dkprintf("%s: checkpoint failed\n", __func__);
+			}
+		}
+
 		if (ret == 0) {
 			ret = ihk_ikc_master_init(data);
 		}
@@ -337,6 +359,10 @@ static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 
 	up(&ihk_os_notifiers_lock);
 
+	if (ret == 0) {
+		ihk_os_watchdog_start(data);
+	}
+
  out:
 	if (found && ret)
 		atomic_dec(&cont->count);
@@ -394,7 +420,7 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 		/* wait 10 sec for frozen */
 		pr_info("%s: waiting for frozen...\n", __func__);
 		if (ihk_os_wait_for_status((ihk_os_t)data, IHK_OS_STATUS_FROZEN,
-					   0, 100) != 0) {
+					   1, 100) != 0) {
 			pr_info("%s: warning: wait for frozen timeouted\n",
 			       __func__);
 		}
@@ -413,7 +439,7 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 		pr_info("%s: waiting for ready...\n", __func__);
 		if (ihk_os_wait_for_status((ihk_os_t)data,
 					   IHK_OS_STATUS_READY,
-					   0, 200) != 0) {
+					   1, 200) != 0) {
 			pr_info("%s: warning: wait for ready timeouted, "
 			       "trying to wait for running instead...\n",
 			       __func__);
@@ -424,7 +450,7 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 		pr_info("%s: waiting for running...\n", __func__);
 		if (ihk_os_wait_for_status((ihk_os_t)data,
 					   IHK_OS_STATUS_RUNNING,
-					   0, 200) != 0) {
+					   1, 200) != 0) {
 			pr_info("%s: warning: wait for running timeouted, "
 			       "trying to shutdown with nmi...\n",
 			       __func__);
@@ -450,6 +476,9 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 		break;
 	}
 
+	/* The CPUs stop making progress from here */
+	ihk_os_watchdog_stop(data);
+
 	/* Call OS notifiers */
 	if (down_interruptible(&ihk_os_notifiers_lock)) {
 		return -ERESTARTSYS;
@@ -475,6 +504,7 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 	}
 
 	/* Release kmsg_buf */
+	ihk_os_kmsg_notify_stop(data);
 	if (data->kmsg_buf_container) {
 		struct ihk_kmsg_buf_container *cont =
 			data->kmsg_buf_container;
@@ -594,45 +624,29 @@ static int __ihk_os_reserve_mem(struct ihk_host_linux_os_data *data,
 
 static int read_kmsg(struct ihk_kmsg_buf *kmsg_buf, char *buf, int shift)
 {
-	int len_bottom, len_top;
-	unsigned long flags;
+	unsigned long head, old_head;
+	unsigned long dropped = 0;
+	int len;
 
 	if (!kmsg_buf) {
 		return -EINVAL;
 	}
 
-	/* Inter-kernel lock for struct ihk_kmsg_buf */
-	local_irq_save(flags);
-	while(__sync_val_compare_and_swap(&kmsg_buf->lock, 0, 1) != 0) {
-		cpu_relax();
-	}
-  
-	if (kmsg_buf->head > kmsg_buf->tail) {
-		len_bottom = strnlen(&kmsg_buf->str[kmsg_buf->head], kmsg_buf->len - kmsg_buf->head);
-		len_top = kmsg_buf->tail;
-	} else {
-		len_bottom = kmsg_buf->tail - kmsg_buf->head;
-		len_top = 0;
-	}
-	dkprintf("kmsg head=%d,tail=%d,len=%d,len_bottom=%d,len_top=%d\n", kmsg_buf->head, kmsg_buf->tail, kmsg_buf->len, len_bottom, len_top);
-
-	/* Print the end of the buffer */
-	if (len_bottom > 0) {
-		memcpy(buf, &kmsg_buf->str[kmsg_buf->head], len_bottom);
-	}
-
-	/* Then the front of it */
-	if (len_top > 0) {
-		memcpy(buf + len_bottom, kmsg_buf->str, len_top);
-	}
+	/* No lock, LWK CPUs keep writing while the ring is read */
+	old_head = IHK_KMSG_ACCESS_ONCE(kmsg_buf->head);
+	head = old_head;
+	len = ihk_kmsg_read(kmsg_buf, &head, buf, &dropped);
+	dkprintf("kmsg head=%lu->%lu,reserve=%lu,len=%d,dropped=%lu\n",
+		 old_head, head, kmsg_buf->reserve, len, dropped);
 
-	if (shift) {
-		kmsg_buf->head = kmsg_buf->tail; 
+	/* Leave head alone when another reader has consumed it */
+	if (shift &&
+	    cmpxchg(&kmsg_buf->head, old_head, head) == old_head &&
+	    dropped) {
+		__sync_fetch_and_add(&kmsg_buf->dropped, dropped);
 	}
-	kmsg_buf->lock = 0;
-	local_irq_restore(flags);
 
-	return len_bottom + len_top;
+	return len;
 }
 
 /** \brief ioctl handler for reading the kernel message to the buffer */
@@ -766,6 +780,71 @@ setup_rusage(struct ihk_host_linux_os_data *data)
 	data->rusage_len = size;
 }
 
+/* How long to wait for the LWK CPUs to answer IHK_NMI_MODE_HANG_INFO */
+#define IHK_OS_HANG_INFO_TIMEOUT_MS 100
+
+static int __ihk_os_hang_info_answered(struct ihk_host_linux_os_data *data,
+				       unsigned long req)
+{
+	int i;
+
+	for (i = 0; i < data->monitor->num_processors; i++) {
+		if (READ_ONCE(data->monitor->cpu[i].hang_info.seq) != req) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Ask the LWK CPUs to save their registers and a short backtrace to
+ * hang_info of the monitor page, read by IHK_OS_GET_HANG_INFO. CPUs
+ * that can't take the NMI keep the seq of an older request. Only done
+ * when the LWK advertises the NMI mode in the monitor page, the
+ * previous mode is put back once the CPUs have answered. Called with
+ * os_lock held.
+ */
+static void __ihk_os_capture_hang_info(struct ihk_host_linux_os_data *data)
+{
+	int ret;
+	int mode;
+	unsigned long req;
+	unsigned long deadline;
+
+	if (!data->monitor || !READ_ONCE(data->monitor->hang_info_supported)) {
+		return;
+	}
+
+	ret = __ihk_os_get_nmi_mode(data, &mode);
+	if (ret) {
+		pr_warn("%s: get_nmi_mode returned %d\n", __func__, ret);
+		return;
+	}
+
+	req = data->monitor->hang_req + 1;
+	WRITE_ONCE(data->monitor->hang_req, req);
+	smp_wmb();
+
+	ret = __ihk_os_send_nmi(data, IHK_NMI_MODE_HANG_INFO);
+	if (ret) {
+		pr_warn("%s: send_nmi returned %d\n", __func__, ret);
+	} else {
+		/* The LWK reads the mode when it takes the NMI */
+		deadline = jiffies +
+			msecs_to_jiffies(IHK_OS_HANG_INFO_TIMEOUT_MS);
+		while (!__ihk_os_hang_info_answered(data, req) &&
+		       time_before(jiffies, deadline)) {
+			msleep(1);
+		}
+	}
+
+	ret = __ihk_os_set_nmi_mode(data, mode);
+	if (ret) {
+		pr_warn("%s: set_nmi_mode returned %d\n", __func__, ret);
+	}
+}
+
 static int __ihk_device_detect_hungup(struct ihk_host_linux_device_data *dev_data,
 				      unsigned long arg)
 {
@@ -826,6 +905,9 @@ static int __ihk_device_detect_hungup(struct ihk_host_linux_device_data *dev_dat
 			   data->monitor->cpu[i].ocounter) {
 				dkprintf("%s: HUNGUP detected\n", __FUNCTION__);
 				ret = IHK_OS_STATUS_HUNGUP;
+				if (i < IHK_OS_MONITOR_MAX_CPUS) {
+					set_bit(i, data->hung_cpus);
+				}
 				__ihk_os_notify_hungup(data);
 				ihk_os_eventfd((ihk_os_t)data, IHK_OS_EVENTFD_TYPE_STATUS);
 			}
@@ -839,6 +921,10 @@ static int __ihk_device_detect_hungup(struct ihk_host_linux_device_data *dev_dat
 		data->monitor->cpu[i].ocounter = data->monitor->cpu[i].counter;
 	}
 
+	if (ret == IHK_OS_STATUS_HUNGUP) {
+		__ihk_os_capture_hang_info(data);
+	}
+
  unlock_out:
 	mutex_unlock(&os_lock);
  out:
@@ -847,6 +933,180 @@ static int __ihk_device_detect_hungup(struct ihk_host_linux_device_data *dev_dat
 	return ret;
 }
 
+/*
+ * Watchdog finding LWK CPUs stuck in the kernel without ihkmond. A CPU
+ * is hung up when its heartbeat counter hasn't moved for
+ * watchdog->threshold ms while in IHK_OS_MONITOR_KERNEL. The check runs
+ * four times per threshold so that a hangup is caught within 1.25
+ * times the threshold.
+ */
+static unsigned long ihk_watchdog_threshold_ms;
+module_param(ihk_watchdog_threshold_ms, ulong, 0644);
+MODULE_PARM_DESC(ihk_watchdog_threshold_ms,
+		 "Default time in ms an LWK CPU can stay in the kernel without a heartbeat, 0 to disable the watchdog");
+
+static unsigned long ihk_os_watchdog_period(struct ihk_host_watchdog *watchdog)
+{
+	return max(msecs_to_jiffies(watchdog->threshold) / 4, 1UL);
+}
+
+/* Called with watchdog->lock held, returns 1 when a CPU is hung up */
+static int __ihk_os_watchdog_check(struct ihk_host_linux_os_data *data)
+{
+	struct ihk_host_watchdog *watchdog = &data->watchdog;
+	struct ihk_os_monitor *monitor = data->monitor;
+	unsigned long now = jiffies;
+	unsigned long counter;
+	int i;
+
+	if (!watchdog->counter) {
+		watchdog->nr_cpus = min_t(int, monitor->num_processors,
+					  IHK_OS_MONITOR_MAX_CPUS);
+		if (watchdog->nr_cpus <= 0) {
+			return 0;
+		}
+
+		watchdog->counter = kcalloc(watchdog->nr_cpus,
+					    sizeof(*watchdog->counter),
+					    GFP_KERNEL);
+		watchdog->stamp = kcalloc(watchdog->nr_cpus,
+					  sizeof(*watchdog->stamp),
+					  GFP_KERNEL);
+		if (!watchdog->counter || !watchdog->stamp) {
+			kfree(watchdog->counter);
+			kfree(watchdog->stamp);
+			watchdog->counter = NULL;
+			watchdog->stamp = NULL;
+			return 0;
+		}
+
+		for (i = 0; i < watchdog->nr_cpus; i++) {
+			watchdog->counter[i] = monitor->cpu[i].counter;
+			watchdog->stamp[i] = now;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < watchdog->nr_cpus; i++) {
+		counter = READ_ONCE(monitor->cpu[i].counter);
+		if (READ_ONCE(monitor->cpu[i].status) != IHK_OS_MONITOR_KERNEL ||
+		    counter != watchdog->counter[i]) {
+			watchdog->counter[i] = counter;
+			watchdog->stamp[i] = now;
+			continue;
+		}
+
+		if (time_after_eq(now, watchdog->stamp[i] +
+				  msecs_to_jiffies(watchdog->threshold))) {
+			pr_warn("%s: CPU %d of OS %d stuck in the kernel for %u ms\n",
+				__func__, i, data->minor,
+				jiffies_to_msecs(now - watchdog->stamp[i]));
+			set_bit(i, data->hung_cpus);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void ihk_os_watchdog_work(struct work_struct *work)
+{
+	struct ihk_host_watchdog *watchdog =
+		container_of(to_delayed_work(work), struct ihk_host_watchdog,
+			     work);
+	struct ihk_host_linux_os_data *data =
+		container_of(watchdog, struct ihk_host_linux_os_data,
+			     watchdog);
+	int status;
+	int hungup = 0;
+
+	mutex_lock(&watchdog->lock);
+	if (!watchdog->running || !watchdog->threshold) {
+		goto unlock_out;
+	}
+
+	/* Serialized with the ioctls mapping the monitor and destroy,
+	 * which holds os_lock while waiting for this work at shutdown */
+	if (!mutex_trylock(&os_lock)) {
+		goto requeue;
+	}
+
+	status = __ihk_os_query_status(data);
+	if (status == IHK_OS_STATUS_HUNGUP || status == IHK_OS_STATUS_FAILED) {
+		/* Already reported */
+		mutex_unlock(&os_lock);
+		goto unlock_out;
+	}
+
+	if (status == IHK_OS_STATUS_READY || status == IHK_OS_STATUS_RUNNING) {
+		setup_monitor(data);
+		if (data->monitor) {
+			hungup = __ihk_os_watchdog_check(data);
+		}
+	}
+
+	if (hungup) {
+		watchdog->hangups++;
+		__ihk_os_notify_hungup(data);
+		ihk_os_eventfd((ihk_os_t)data, IHK_OS_EVENTFD_TYPE_STATUS);
+		__ihk_os_capture_hang_info(data);
+	}
+	mutex_unlock(&os_lock);
+
+	if (hungup) {
+		goto unlock_out;
+	}
+ requeue:
+	schedule_delayed_work(&watchdog->work,
+			      ihk_os_watchdog_period(watchdog));
+ unlock_out:
+	mutex_unlock(&watchdog->lock);
+}
+
+static void ihk_os_watchdog_init(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_watchdog *watchdog = &os->watchdog;
+
+	mutex_init(&watchdog->lock);
+	INIT_DELAYED_WORK(&watchdog->work, ihk_os_watchdog_work);
+	watchdog->threshold = ihk_watchdog_threshold_ms;
+}
+
+/** \brief Start watching the heartbeats, called at boot. The check
+ *	waits until the LWK is ready. */
+static void ihk_os_watchdog_start(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_watchdog *watchdog = &os->watchdog;
+
+	mutex_lock(&watchdog->lock);
+	watchdog->running = 1;
+	if (watchdog->threshold) {
+		schedule_delayed_work(&watchdog->work,
+				      ihk_os_watchdog_period(watchdog));
+	}
+	mutex_unlock(&watchdog->lock);
+}
+
+/** \brief Stop watching before the LWK CPUs stop at shutdown */
+static void ihk_os_watchdog_stop(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_watchdog *watchdog = &os->watchdog;
+
+	mutex_lock(&watchdog->lock);
+	watchdog->running = 0;
+	mutex_unlock(&watchdog->lock);
+
+	cancel_delayed_work_sync(&watchdog->work);
+
+	mutex_lock(&watchdog->lock);
+	kfree(watchdog->counter);
+	kfree(watchdog->stamp);
+	watchdog->counter = NULL;
+	watchdog->stamp = NULL;
+	watchdog->nr_cpus = 0;
+	mutex_unlock(&watchdog->lock);
+}
+
 static int __ihk_os_status(struct ihk_host_linux_os_data *data)
 {
 	/* (1) LWK sets boot_param->status to 1 in arch_init()
@@ -862,7 +1122,6 @@ static int __ihk_os_status(struct ihk_host_linux_os_data *data)
 static int __ihk_os_clear_kmsg(struct ihk_host_linux_os_data *data)
 {
 	struct ihk_kmsg_buf *kmsg_buf;
-	unsigned long flags;
 
 	if (!data->kmsg_buf_container) {
 		return -EINVAL;
@@ -874,17 +1133,11 @@ static int __ihk_os_clear_kmsg(struct ihk_host_linux_os_data *data)
 
 	kmsg_buf = data->kmsg_buf_container->kmsg_buf;
 
-	local_irq_save(flags);
-	while(__sync_val_compare_and_swap(&kmsg_buf->lock, 0, 1) != 0) {
-		cpu_relax();
-	}
-
-	memset(kmsg_buf->str, 0, kmsg_buf->len);
-	kmsg_buf->head = 0;
-	kmsg_buf->tail = 0;
-
-	kmsg_buf->lock = 0;
-	local_irq_restore(flags);
+	/* Skip what has been written so far, records being written
+	 * are left intact
+	 */
+	IHK_KMSG_ACCESS_ONCE(kmsg_buf->head) =
+		IHK_KMSG_ACCESS_ONCE(kmsg_buf->reserve);
 
 	return 0;
 }
@@ -918,11 +1171,10 @@ static int __ihk_os_register_event(struct ihk_host_linux_os_data *os, void __use
 	return 0;
 }
 
-void ihk_os_eventfd(ihk_os_t data, int type)
+static void __ihk_os_eventfd(struct ihk_host_linux_os_data *os, int type)
 {
 	unsigned long flags;
 	struct ihk_event *ep;
-	struct ihk_host_linux_os_data *os = (struct ihk_host_linux_os_data *)data;
 
 	spin_lock_irqsave(&os->event_list_lock, flags);
 	list_for_each_entry(ep, &os->event_list, list) {
@@ -934,6 +1186,299 @@ void ihk_os_eventfd(ihk_os_t data, int type)
 	spin_unlock_irqrestore(&os->event_list_lock, flags);
 }
 
+/*
+ * kmsg notifications of the LWK are coalesced so that a burst of
+ * messages wakes up ihkmond at most once per interval, plus once per
+ * notify->bytes written. Called with notify->lock held.
+ */
+static void __ihk_os_kmsg_wakeup(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+
+	notify->last = ktime_get();
+	if (notify->kmsg_buf) {
+		notify->last_reserve =
+			IHK_KMSG_ACCESS_ONCE(notify->kmsg_buf->reserve);
+	}
+	notify->wakeups++;
+	__ihk_os_eventfd(os, IHK_OS_EVENTFD_TYPE_KMSG);
+}
+
+static enum hrtimer_restart ihk_os_kmsg_notify_timer(struct hrtimer *timer)
+{
+	struct ihk_host_linux_os_data *os =
+		container_of(timer, struct ihk_host_linux_os_data,
+			     kmsg_notify.timer);
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+	unsigned long flags;
+
+	spin_lock_irqsave(&notify->lock, flags);
+	/* Nothing new when a notification has just woken them up */
+	if (!notify->kmsg_buf ||
+	    IHK_KMSG_ACCESS_ONCE(notify->kmsg_buf->reserve) !=
+	    notify->last_reserve) {
+		__ihk_os_kmsg_wakeup(os);
+	}
+	spin_unlock_irqrestore(&notify->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void ihk_os_kmsg_notify(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+	unsigned long flags;
+	unsigned long written = 0;
+	ktime_t now;
+
+	spin_lock_irqsave(&notify->lock, flags);
+	notify->notifications++;
+
+	if (notify->kmsg_buf) {
+		written = IHK_KMSG_ACCESS_ONCE(notify->kmsg_buf->reserve) -
+			notify->last_reserve;
+	}
+
+	now = ktime_get();
+	if (!notify->kmsg_buf || written >= notify->bytes ||
+	    ktime_us_delta(now, notify->last) >= (s64)notify->interval) {
+		/* Doesn't wait when the timer is running, which finds
+		 * nothing new then */
+		hrtimer_try_to_cancel(&notify->timer);
+		__ihk_os_kmsg_wakeup(os);
+	} else if (!hrtimer_active(&notify->timer)) {
+		hrtimer_start(&notify->timer,
+			      ktime_add_us(notify->last, notify->interval),
+			      HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irqrestore(&notify->lock, flags);
+}
+
+static void ihk_os_kmsg_notify_init(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+
+	spin_lock_init(&notify->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&notify->timer, ihk_os_kmsg_notify_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&notify->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	notify->timer.function = ihk_os_kmsg_notify_timer;
+#endif
+	notify->interval = IHK_KMSG_NOTIFY_INTERVAL;
+	notify->bytes = IHK_KMSG_NOTIFY_BYTES;
+}
+
+/** \brief Start coalescing the notifications about kmsg_buf, called at
+ *	boot */
+static void ihk_os_kmsg_notify_start(struct ihk_host_linux_os_data *os,
+				     struct ihk_kmsg_buf *kmsg_buf)
+{
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+	unsigned long flags;
+
+	spin_lock_irqsave(&notify->lock, flags);
+	notify->kmsg_buf = kmsg_buf;
+	notify->last = ktime_get();
+	notify->last_reserve = IHK_KMSG_ACCESS_ONCE(kmsg_buf->reserve);
+	notify->notifications = 0;
+	notify->wakeups = 0;
+	spin_unlock_irqrestore(&notify->lock, flags);
+}
+
+/** \brief Stop referring to the ring before it's released at shutdown.
+ *	The counters are kept until the next boot. */
+static void ihk_os_kmsg_notify_stop(struct ihk_host_linux_os_data *os)
+{
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+	unsigned long flags;
+
+	hrtimer_cancel(&notify->timer);
+
+	spin_lock_irqsave(&notify->lock, flags);
+	if (notify->kmsg_buf) {
+		notify->total = notify->kmsg_buf->reserve;
+		notify->dropped = notify->kmsg_buf->dropped;
+		notify->kmsg_buf = NULL;
+	}
+	spin_unlock_irqrestore(&notify->lock, flags);
+}
+
+void ihk_os_eventfd(ihk_os_t data, int type)
+{
+	struct ihk_host_linux_os_data *os = (struct ihk_host_linux_os_data *)data;
+
+	if (type == IHK_OS_EVENTFD_TYPE_KMSG) {
+		ihk_os_kmsg_notify(os);
+		return;
+	}
+
+	__ihk_os_eventfd(os, type);
+}
+
+/*
+ * /sys/class/mcos/mcosN/kmsg/: tunables of the coalescing and counters
+ * of the kmsg of the instance
+ */
+static ssize_t kmsg_notify_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ihk_host_linux_os_data *os = dev_get_drvdata(dev);
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+	unsigned long flags;
+	unsigned long val;
+
+	spin_lock_irqsave(&notify->lock, flags);
+	if (!strcmp(attr->attr.name, "notify_interval_us")) {
+		val = notify->interval;
+	} else if (!strcmp(attr->attr.name, "notify_bytes")) {
+		val = notify->bytes;
+	} else if (!strcmp(attr->attr.name, "notifications")) {
+		val = notify->notifications;
+	} else if (!strcmp(attr->attr.name, "wakeups")) {
+		val = notify->wakeups;
+	} else if (!strcmp(attr->attr.name, "bytes")) {
+		val = notify->kmsg_buf ? notify->kmsg_buf->reserve :
+			notify->total;
+	} else {
+		val = notify->kmsg_buf ? notify->kmsg_buf->dropped :
+			notify->dropped;
+	}
+	spin_unlock_irqrestore(&notify->lock, flags);
+
+	return sprintf(buf, "%lu\n", val);
+}
+
+static ssize_t kmsg_notify_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ihk_host_linux_os_data *os = dev_get_drvdata(dev);
+	struct ihk_host_kmsg_notify *notify = &os->kmsg_notify;
+	unsigned long flags;
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret) {
+		return ret;
+	}
+
+	if (!strcmp(attr->attr.name, "notify_interval_us")) {
+		if (val > USEC_PER_SEC) {
+			return -EINVAL;
+		}
+		spin_lock_irqsave(&notify->lock, flags);
+		notify->interval = val;
+		spin_unlock_irqrestore(&notify->lock, flags);
+	} else {
+		/* Messages would be lost before the wakeup */
+		if (val > IHK_KMSG_SIZE) {
+			return -EINVAL;
+		}
+		spin_lock_irqsave(&notify->lock, flags);
+		notify->bytes = val;
+		spin_unlock_irqrestore(&notify->lock, flags);
+	}
+
+	return count;
+}
+
+static DEVICE_ATTR(notify_interval_us, 0644, kmsg_notify_show,
+		   kmsg_notify_store);
+static DEVICE_ATTR(notify_bytes, 0644, kmsg_notify_show, kmsg_notify_store);
+static DEVICE_ATTR(notifications, 0444, kmsg_notify_show, NULL);
+static DEVICE_ATTR(wakeups, 0444, kmsg_notify_show, NULL);
+static DEVICE_ATTR(bytes, 0444, kmsg_notify_show, NULL);
+static DEVICE_ATTR(dropped, 0444, kmsg_notify_show, NULL);
+
+static struct attribute *kmsg_notify_attrs[] = {
+	&dev_attr_notify_interval_us.attr,
+	&dev_attr_notify_bytes.attr,
+	&dev_attr_notifications.attr,
+	&dev_attr_wakeups.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_dropped.attr,
+	NULL,
+};
+
+static const struct attribute_group kmsg_notify_attr_group = {
+	.name = "kmsg",
+	.attrs = kmsg_notify_attrs,
+};
+
+/* /sys/class/mcos/mcosN/watchdog/ */
+static ssize_t watchdog_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct ihk_host_linux_os_data *os = dev_get_drvdata(dev);
+	struct ihk_host_watchdog *watchdog = &os->watchdog;
+	unsigned long val;
+
+	mutex_lock(&watchdog->lock);
+	if (!strcmp(attr->attr.name, "threshold_ms")) {
+		val = watchdog->threshold;
+	} else {
+		val = watchdog->hangups;
+	}
+	mutex_unlock(&watchdog->lock);
+
+	return sprintf(buf, "%lu\n", val);
+}
+
+static ssize_t watchdog_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct ihk_host_linux_os_data *os = dev_get_drvdata(dev);
+	struct ihk_host_watchdog *watchdog = &os->watchdog;
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret) {
+		return ret;
+	}
+
+	/* Counters moving less often than this aren't heartbeats */
+	if (val > 3600 * MSEC_PER_SEC) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&watchdog->lock);
+	watchdog->threshold = val;
+	/* Stops by itself when disabled */
+	if (watchdog->running && val) {
+		mod_delayed_work(system_wq, &watchdog->work,
+				 ihk_os_watchdog_period(watchdog));
+	}
+	mutex_unlock(&watchdog->lock);
+
+	return count;
+}
+
+static DEVICE_ATTR(threshold_ms, 0644, watchdog_show, watchdog_store);
+static DEVICE_ATTR(hangups, 0444, watchdog_show, NULL);
+
+static struct attribute *watchdog_attrs[] = {
+	&dev_attr_threshold_ms.attr,
+	&dev_attr_hangups.attr,
+	NULL,
+};
+
+static const struct attribute_group watchdog_attr_group = {
+	.name = "watchdog",
+	.attrs = watchdog_attrs,
+};
+
+/* Created along with /dev/mcosN so that they exist at uevent time */
+static const struct attribute_group *mcos_attr_groups[] = {
+	&kmsg_notify_attr_group,
+	&watchdog_attr_group,
+	NULL,
+};
+
 static int __ihk_os_dump(struct ihk_host_linux_os_data *data, void __user *uargsp) {
 	dumpargs_t args;
 	int error = -EFAULT;
@@ -952,9 +1497,17 @@ static int __ihk_os_dump(struct ihk_host_linux_os_data *data, void __user *uargs
 	return error;
 }
 
-static int __ihk_os_freeze(struct ihk_host_linux_os_data *data)
+/*
+ * Freeze the LWK CPUs in cpu_set, or all of them if cpu_set is NULL.
+ * The request is posted in the monitor page, where the LWK CPUs
+ * acknowledge it. Freezing a subset leaves the OS status as is, timeout
+ * is how long to wait for the subset to acknowledge in milliseconds.
+ */
+static int __ihk_os_freeze_cpus(struct ihk_host_linux_os_data *data,
+				const unsigned long *cpu_set, int timeout)
 {
 	int ret = 0;
+	int i, n;
 
 	enum ihk_os_status status = __ihk_os_status(data);
 
@@ -979,11 +1532,93 @@ static int __ihk_os_freeze(struct ihk_host_linux_os_data *data)
 		break;
 	}
 
-	if (data->ops->freeze) {
-		ret = (*data->ops->freeze)(data, data->priv);
+	setup_monitor(data);
+	if (!data->monitor && cpu_set) {
+		pr_err("%s: error: no monitor to post the request to\n",
+		       __func__);
+		ret = -ENOSYS;
+		goto out;
+	}
+
+	if (data->monitor) {
+		n = min_t(int, data->monitor->num_processors,
+			  IHK_OS_MONITOR_MAX_CPUS);
+
+		memset(data->monitor->freeze_ack, 0,
+		       sizeof(data->monitor->freeze_ack));
+		memset(data->monitor->freeze_req, 0,
+		       sizeof(data->monitor->freeze_req));
+		/*
+		 * Acks can't cover all CPUs of a bigger OS, status falls
+		 * back to the per-CPU status then
+		 */
+		if (data->monitor->num_processors > IHK_OS_MONITOR_MAX_CPUS) {
+			data->freeze_subset = !!cpu_set;
+			if (!cpu_set)
+				n = 0;
+		} else {
+			data->freeze_subset = 0;
+		}
+		for (i = 0; i < n; i++) {
+			if (!cpu_set || test_bit(i, cpu_set)) {
+				set_bit(i, data->monitor->freeze_req);
+			} else {
+				data->freeze_subset = 1;
+			}
+		}
+		smp_wmb();
+	}
+
+	if (cpu_set) {
+		ret = data->ops->freeze_cpus ?
+			(*data->ops->freeze_cpus)(data, data->priv, timeout) :
+			-ENOSYS;
+	} else if (data->ops->freeze) {
+		ret = (*data->ops->freeze)(data, data->priv);
+	}
+
+ out:
+	return ret;
+}
+
+static int __ihk_os_freeze(struct ihk_host_linux_os_data *data)
+{
+	return __ihk_os_freeze_cpus(data, NULL, 0);
+}
+
+/* Freeze a subset of LWK CPUs and optionally wait for the LWK to ack */
+static int __ihk_os_freeze_vec(struct ihk_host_linux_os_data *data,
+			       void __user *arg)
+{
+	int ret;
+	struct ihk_freeze_desc desc;
+	unsigned long *cpu_set = NULL;
+	size_t size;
+
+	if (copy_from_user(&desc, arg, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	if (desc.nr_cpus <= 0 || desc.nr_cpus > IHK_OS_MONITOR_MAX_CPUS ||
+	    desc.timeout < 0) {
+		return -EINVAL;
+	}
+
+	size = BITS_TO_LONGS(desc.nr_cpus) * sizeof(unsigned long);
+	cpu_set = kzalloc(sizeof(data->monitor->freeze_req), GFP_KERNEL);
+	if (!cpu_set) {
+		return -ENOMEM;
+	}
+
+	if (copy_from_user(cpu_set, desc.cpu_set, size)) {
+		ret = -EFAULT;
+		goto out;
 	}
 
+	ret = __ihk_os_freeze_cpus(data, cpu_set, desc.timeout);
+
  out:
+	kfree(cpu_set);
 	return ret;
 }
 
@@ -993,11 +1628,16 @@ static int __ihk_os_thaw(struct ihk_host_linux_os_data *data)
 	enum ihk_os_status status = __ihk_os_status(data);
 
 	switch (status) {
+	case IHK_OS_STATUS_RUNNING:
+		/* Some of the CPUs are frozen */
+		if (data->freeze_subset) {
+			break;
+		}
+		/* fall through */
 	case IHK_OS_STATUS_NOT_BOOTED:
 	case IHK_OS_STATUS_BOOTING:
 	case IHK_OS_STATUS_BOOTED:
 	case IHK_OS_STATUS_READY:
-	case IHK_OS_STATUS_RUNNING:
 	case IHK_OS_STATUS_SHUTDOWN:
 	case IHK_OS_STATUS_FAILED:
 	case IHK_OS_STATUS_HUNGUP:
@@ -1009,7 +1649,7 @@ static int __ihk_os_thaw(struct ihk_host_linux_os_data *data)
 		/* wait 10 sec for frozen */
 		pr_info("%s: waiting for frozen...\n", __func__);
 		if (ihk_os_wait_for_status((ihk_os_t)data, IHK_OS_STATUS_FROZEN,
-					   0, 100) != 0) {
+					   1, 100) != 0) {
 			pr_info("%s: warning: wait for frozen timeouted\n",
 			       __func__);
 		}
@@ -1019,6 +1659,13 @@ static int __ihk_os_thaw(struct ihk_host_linux_os_data *data)
 		break;
 	}
 
+	if (data->monitor) {
+		memset(data->monitor->freeze_req, 0,
+		       sizeof(data->monitor->freeze_req));
+		smp_wmb();
+	}
+	data->freeze_subset = 0;
+
 	if (data->ops->thaw) {
 		ret = (*data->ops->thaw)(data, data->priv);
 	}
@@ -1064,6 +1711,97 @@ static int __ihk_os_get_cpu_usage(struct ihk_host_linux_os_data *data, unsigned
 	return 0;
 }
 
+/*
+ * Report what each LWK CPU was doing: the last kernel entry recorded
+ * by the LWK and, once a hangup is detected, the registers and
+ * backtrace saved on the NMI
+ */
+static int __ihk_os_get_hang_info(struct ihk_host_linux_os_data *data,
+				  void __user *arg)
+{
+	struct ihk_os_hang_info_desc desc;
+	struct ihk_os_cpu_hang_report report;
+	struct ihk_os_cpu_monitor *cpu;
+	int i, n;
+
+	if (copy_from_user(&desc, arg, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	if (desc.nr_cpus < 0 || (desc.nr_cpus && !desc.reports)) {
+		return -EINVAL;
+	}
+
+	setup_monitor(data);
+	if (data->monitor == NULL) {
+		return -ENOSYS;
+	}
+
+	n = min_t(int, data->monitor->num_processors,
+		  IHK_OS_MONITOR_MAX_CPUS);
+	desc.seq = READ_ONCE(data->monitor->hang_req);
+	smp_rmb();
+
+	for (i = 0; i < min(n, desc.nr_cpus); i++) {
+		cpu = &data->monitor->cpu[i];
+
+		memset(&report, 0, sizeof(report));
+		report.status = READ_ONCE(cpu->status);
+		report.stuck = test_bit(i, data->hung_cpus);
+		report.counter = READ_ONCE(cpu->counter);
+		report.last_pc = READ_ONCE(cpu->last_pc);
+		report.last_syscall = READ_ONCE(cpu->last_syscall);
+		report.last_ts = READ_ONCE(cpu->last_ts);
+		memcpy(&report.hang_info, &cpu->hang_info,
+		       sizeof(report.hang_info));
+		report.captured = desc.seq &&
+			report.hang_info.seq == desc.seq;
+		if (report.hang_info.depth > IHK_OS_MONITOR_STACK_DEPTH) {
+			report.hang_info.depth = IHK_OS_MONITOR_STACK_DEPTH;
+		}
+
+		if (copy_to_user(&desc.reports[i], &report, sizeof(report))) {
+			return -EFAULT;
+		}
+	}
+
+	desc.nr_cpus = n;
+	if (copy_to_user(arg, &desc, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/* Copy the last words the LWK saved on panic, -ENOENT if none */
+static int __ihk_os_get_panic_info(struct ihk_host_linux_os_data *data,
+				   void __user *arg)
+{
+	struct ihk_os_panic_info *info;
+	int ret;
+
+	if (!data->ops->get_panic_info) {
+		return -ENOSYS;
+	}
+
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!info) {
+		return -ENOMEM;
+	}
+
+	ret = data->ops->get_panic_info(data, data->priv, info);
+	if (ret) {
+		goto out;
+	}
+
+	if (copy_to_user(arg, info, sizeof(*info))) {
+		ret = -EFAULT;
+	}
+ out:
+	kfree(info);
+	return ret;
+}
+
 static int __ihk_os_read_kaddr(struct ihk_host_linux_os_data *data, void __user *arg)
 {
 	struct ihk_os_read_kaddr_desc desc;
@@ -1268,6 +2006,10 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_os_set_kargs(data, (char * __user)arg);
 		break;
 
+	case IHK_OS_SET_BOOTSTRAP:
+		ret = __ihk_os_set_bootstrap(data, arg);
+		break;
+
 	case IHK_OS_READ_KMSG:
 		ret = __ihk_os_read_kmsg(data, (char * __user)arg);
 		break;
@@ -1299,6 +2041,11 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		dkprintf("__ihk_os_freeze(ret=%d)\n",ret);
 		break;
 
+	case IHK_OS_FREEZE_VEC:
+		ret = __ihk_os_freeze_vec(data, (void __user *)arg);
+		dkprintf("__ihk_os_freeze_vec(ret=%d)\n",ret);
+		break;
+
 	case IHK_OS_THAW:
 		ret = __ihk_os_thaw(data);
 		dkprintf("__ihk_os_thaw  (ret=%d)\n",ret);
@@ -1318,6 +2065,14 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_os_read_kaddr(data, (void __user *)arg);
 		break;
 
+	case IHK_OS_GET_HANG_INFO:
+		ret = __ihk_os_get_hang_info(data, (void __user *)arg);
+		break;
+
+	case IHK_OS_GET_PANIC_INFO:
+		ret = __ihk_os_get_panic_info(data, (void __user *)arg);
+		break;
+
 	default:
 		if (request >= IHK_OS_DEBUG_START && 
 		    request <= IHK_OS_DEBUG_END) {
@@ -1367,9 +2122,23 @@ static long ihk_host_os_write(struct file *file, const char __user *buf,
 	}
 }
 
+/** \brief mmap handler for an OS device file */
+static int ihk_host_os_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ihk_file *ifile = file->private_data;
+	struct ihk_host_linux_os_data *data = ifile->osdata;
+
+	if (!data->ops->mmap) {
+		return -ENODEV;
+	}
+
+	return data->ops->mmap(data, data->priv, file, vma);
+}
+
 static struct file_operations mcos_cdev_ops = {
 	.open = ihk_host_os_open,
 	.write = ihk_host_os_write,
+	.mmap = ihk_host_os_mmap,
 	.unlocked_ioctl = ihk_host_os_ioctl,
 	.release = ihk_host_os_release,
 };
@@ -1451,6 +2220,49 @@ static int __ihk_device_read_kmsg_buf(struct file *file, void __user *_desc)
 	return ret;
 }
 
+/** \brief ioctl handler for advancing the consumer cursor of the kmsg
+ * buffer after reading it through the mapping */
+static int __ihk_device_shift_kmsg_buf(struct file *file, void __user *_desc)
+{
+	struct ihk_kmsg_buf_container *cont;
+	struct ihk_device_shift_kmsg_buf_desc desc;
+	struct ihk_kmsg_buf *kmsg_buf;
+	unsigned long old_head, reserve;
+
+	if (copy_from_user(&desc, _desc, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	cont = (struct ihk_kmsg_buf_container *)desc.handle;
+	kmsg_buf = cont->kmsg_buf;
+	if (!kmsg_buf) {
+		return -EINVAL;
+	}
+
+	do {
+		old_head = IHK_KMSG_ACCESS_ONCE(kmsg_buf->head);
+		reserve = IHK_KMSG_ACCESS_ONCE(kmsg_buf->reserve);
+
+		/* Only forward, another reader might have consumed it */
+		if ((long)(desc.head - old_head) <= 0) {
+			return 0;
+		}
+
+		/* Not past what the LWK has reserved */
+		if (desc.head - old_head > reserve - old_head) {
+			return -EINVAL;
+		}
+	} while (cmpxchg(&kmsg_buf->head, old_head, desc.head) != old_head);
+
+	if (desc.dropped) {
+		__sync_fetch_and_add(&kmsg_buf->dropped, desc.dropped);
+	}
+
+	dkprintf("%s: kmsg head=%lu->%lu,reserve=%lu,dropped=%lu\n",
+		 __func__, old_head, desc.head, reserve, desc.dropped);
+	return 0;
+}
+
 static int __ihk_device_release_kmsg_buf(struct file *file, unsigned long arg)
 {
 	return release_kmsg_buf((struct ihk_kmsg_buf_container *)arg);
@@ -1547,6 +2359,8 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 	spin_lock_init(&os->listener_lock);
 	spin_lock_init(&os->wait_lock);
 	spin_lock_init(&os->event_list_lock);
+	ihk_os_kmsg_notify_init(os);
+	ihk_os_watchdog_init(os);
 	INIT_LIST_HEAD(&os->ikc_channels);
 
 	os->regular_channels = kzalloc(sizeof(*os->regular_channels) *
@@ -1600,12 +2414,18 @@ static int __ihk_device_get_buildid(struct ihk_host_linux_device_data *data,
 
 static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 				   struct ihk_host_linux_os_data *os);
-
-/** \brief Create a OS file in the kernel
+static int __ihk_device_destroy_os_held(struct ihk_host_linux_device_data *data,
+					struct ihk_host_linux_os_data *os,
+					int held);
+
+/** \brief Create a OS structure in the kernel, without its device
+ * file, see __ihk_device_publish_os(). The caller holds a reference
+ * on it so that it can't be destroyed under it, and drops it when
+ * done.
  *
  * @return minor number */
-static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
-                                  unsigned long arg)
+static int __ihk_device_alloc_os(struct ihk_host_linux_device_data *data,
+				 unsigned long arg)
 {
 	int i, minor, ret;
 	unsigned long flags;
@@ -1642,6 +2462,7 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 		os_data[minor] = NULL;
 		return ret;
 	}
+	os->minor = minor;
 
 	/* Allocate kmsg_buf. Note that IHK-Core owns the buf. */
 	kmsg_buf_size = (sizeof(struct ihk_kmsg_buf) + PAGE_SIZE - 1) & PAGE_MASK;
@@ -1667,11 +2488,9 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 
 	/* Initialize kmsg_buf */
 	kmsg_buf = (struct ihk_kmsg_buf *)pfn_to_kaddr(page_to_pfn(kmsg_buf_pages));
-	kmsg_buf->tail = 0;
-	kmsg_buf->len = sizeof(kmsg_buf->str);
-	kmsg_buf->head = 0;
-	kmsg_buf->lock = 0;
-	memset(kmsg_buf->str, 0, sizeof(kmsg_buf->str));
+	/* Records never cross a block, nor the end of the ring */
+	BUILD_BUG_ON(sizeof(kmsg_buf->str) % IHK_KMSG_BLOCK_SIZE);
+	ihk_kmsg_init(kmsg_buf, sizeof(kmsg_buf->str));
 	dkprintf("%s: kmsg_buf=%p\n", __FUNCTION__, kmsg_buf);
 
 	/* Release stray kmsg_bufs */
@@ -1721,17 +2540,8 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 		return -ERESTARTSYS;
 	}
 
+	atomic_set(&os->refcount, 1);
 	os_data[minor] = os;
-	os->minor = minor;
-
-	os->lindev = device_create(mcos_class, NULL, os->dev_num, NULL,
-			OS_DEV_NAME "%d", minor);
-	if (IS_ERR(os->lindev)) {
-		printk("ihk: device_create failed.\n");
-		ret = -ENOMEM;
-		mutex_unlock(&os_lock);
-		goto error;
-	}
 
 	mutex_unlock(&os_lock);
 
@@ -1745,9 +2555,65 @@ error:
 	return ret;
 }
 
-/** \brief Destroy an OS structure, and also the corresponding device file */
-static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
-                                   struct ihk_host_linux_os_data *os)
+/** \brief Create the device file of an OS once it's usable. Opening
+ * it fails until then. */
+static int __ihk_device_publish_os(struct ihk_host_linux_os_data *os)
+{
+	struct device *lindev;
+	int ret;
+
+	if (mutex_lock_interruptible(&os_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	lindev = device_create_with_groups(mcos_class, NULL, os->dev_num, os,
+					   mcos_attr_groups,
+					   OS_DEV_NAME "%d", os->minor);
+	if (IS_ERR(lindev)) {
+		printk("ihk: device_create_with_groups failed.\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	os->lindev = lindev;
+	ret = 0;
+ out:
+	mutex_unlock(&os_lock);
+	return ret;
+}
+
+/** \brief Create a OS file in the kernel
+ *
+ * @return minor number */
+static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
+                                  unsigned long arg)
+{
+	int minor, ret;
+	struct ihk_host_linux_os_data *os;
+
+	minor = __ihk_device_alloc_os(data, arg);
+	if (minor < 0) {
+		return minor;
+	}
+	os = os_data[minor];
+
+	ret = __ihk_device_publish_os(os);
+	if (ret) {
+		if (__ihk_device_destroy_os_held(data, os, 1)) {
+			atomic_dec(&os->refcount);
+		}
+		return ret;
+	}
+	atomic_dec(&os->refcount);
+
+	return minor;
+}
+
+/** \brief Destroy an OS structure, and also the corresponding device
+ * file, on which the caller holds held references */
+static int __ihk_device_destroy_os_held(struct ihk_host_linux_device_data *data,
+					struct ihk_host_linux_os_data *os,
+					int held)
 {
 	int ret = 0;
 
@@ -1764,9 +2630,9 @@ static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 		goto out;
 	}
 	
-	if (atomic_read(&os->refcount) > 0) {
-		pr_err("%s: error: refcount != 0 (%d)\n",
-		       __func__, atomic_read(&os->refcount));
+	if (atomic_read(&os->refcount) > held) {
+		pr_err("%s: error: refcount != %d (%d)\n",
+		       __func__, held, atomic_read(&os->refcount));
 		ret = -EBUSY;
 		goto out;
 	}
@@ -1801,6 +2667,8 @@ static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 
 	cdev_del(&os->cdev);
 	device_destroy(mcos_class, os->dev_num);
+	hrtimer_cancel(&os->kmsg_notify.timer);
+	ihk_os_watchdog_stop(os);
 
 	if (os->regular_channels)
 		kfree(os->regular_channels);
@@ -1812,6 +2680,14 @@ static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 	return ret;
 }
 
+/** \brief Destroy an OS structure, and also the corresponding device file.
+ * OSes still being created or launched are refused with EBUSY. */
+static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
+                                   struct ihk_host_linux_os_data *os)
+{
+	return __ihk_device_destroy_os_held(data, os, 0);
+}
+
 /** \brief Destroy all the OS kernel stuffs of the specified device */
 static int __destroy_all_os(struct ihk_host_linux_device_data *data)
 {
@@ -1940,6 +2816,132 @@ static int __ihk_device_query_mem(struct ihk_host_linux_device_data *data,
 	return data->ops->query_mem(data, arg);
 }
 
+/** \brief Create, set up, load and optionally boot an OS in one go
+ *
+ * The resource requests in the descriptor are passed down to the
+ * driver as they are, so they are validated only once. Everything done
+ * so far is rolled back on failure.
+ *
+ * @return minor number */
+static int __ihk_device_launch_os(struct ihk_host_linux_device_data *data,
+				  unsigned long arg)
+{
+	struct ihk_os_launch_desc __user *udesc =
+		(struct ihk_os_launch_desc __user *)arg;
+	struct ihk_os_launch_desc desc;
+	struct ihk_host_linux_os_data *os;
+	char *fn = NULL;
+	int minor, ret;
+	int cpu_assigned = 0, mem_assigned = 0;
+
+	if (copy_from_user(&desc, udesc, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	if (!desc.image) {
+		pr_err("%s: error: kernel image isn't specified\n", __func__);
+		return -EINVAL;
+	}
+
+	/* XXX: 256 is too arbitary, the same as IHK_OS_LOAD */
+	fn = strndup_user(desc.image, 256);
+	if (IS_ERR(fn)) {
+		return PTR_ERR(fn);
+	}
+
+	/* Nobody can open the OS until it's published below, nor destroy
+	 * it until the reference taken here is dropped */
+	minor = __ihk_device_alloc_os(data, 0);
+	if (minor < 0) {
+		pr_err("%s: error: __ihk_device_alloc_os returned %d\n",
+		       __func__, minor);
+		ret = minor;
+		goto out;
+	}
+	os = os_data[minor];
+
+	ret = __ihk_os_assign_cpu(os, (unsigned long)&udesc->cpu_req);
+	if (ret) {
+		pr_err("%s: error: assign_cpu returned %d\n",
+		       __func__, ret);
+		goto rollback;
+	}
+	cpu_assigned = 1;
+
+	ret = __ihk_os_assign_mem(os, (unsigned long)&udesc->mem_req);
+	if (ret) {
+		pr_err("%s: error: assign_mem returned %d\n",
+		       __func__, ret);
+		goto rollback;
+	}
+	mem_assigned = 1;
+
+	if (desc.ikc_req.num_cpus) {
+		ret = __ihk_os_set_ikc_map(os, (unsigned long)&udesc->ikc_req);
+		if (ret) {
+			pr_err("%s: error: set_ikc_map returned %d\n",
+			       __func__, ret);
+			goto rollback;
+		}
+	}
+
+	/* Kernel arguments may choose the bootstrap NUMA node */
+	if (desc.kargs) {
+		ret = __ihk_os_set_kargs(os, desc.kargs);
+		if (ret) {
+			pr_err("%s: error: set_kargs returned %d\n",
+			       __func__, ret);
+			goto rollback;
+		}
+	}
+
+	ret = __ihk_os_load_file(os, fn);
+	if (ret) {
+		pr_err("%s: error: loading %s returned %d\n",
+		       __func__, fn, ret);
+		goto rollback;
+	}
+
+	if (desc.boot) {
+		ret = __ihk_os_boot(os, 0);
+		if (ret) {
+			pr_err("%s: error: __ihk_os_boot returned %d\n",
+			       __func__, ret);
+			goto rollback;
+		}
+	}
+
+	ret = __ihk_device_publish_os(os);
+	if (ret) {
+		pr_err("%s: error: __ihk_device_publish_os returned %d\n",
+		       __func__, ret);
+		goto rollback;
+	}
+	atomic_dec(&os->refcount);
+
+	ret = minor;
+	goto out;
+
+ rollback:
+	/* Resources can be released only while not booted */
+	__ihk_os_shutdown(os, FLAG_IHK_OS_SHUTDOWN_FORCE);
+	if (mem_assigned) {
+		__ihk_os_release_mem(os, (unsigned long)&udesc->mem_req);
+	}
+	if (cpu_assigned) {
+		__ihk_os_release_cpu(os, (unsigned long)&udesc->cpu_req);
+	}
+	if (__ihk_device_destroy_os_held(data, os, 1)) {
+		pr_err("%s: error: failed to destroy OS %d\n",
+		       __func__, minor);
+		/* Let IHK_DEVICE_DESTROY_OS have another go */
+		atomic_dec(&os->refcount);
+	}
+ out:
+	kfree(fn);
+	return ret;
+}
+
 /** \brief ioctl handler for the device file */
 static long ihk_host_device_ioctl(struct file *file, unsigned int request,
                                   unsigned long arg)
@@ -2017,10 +3019,18 @@ static long ihk_host_device_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_device_release_kmsg_buf(file, arg);
 		break;
 
+	case IHK_DEVICE_SHIFT_KMSG_BUF:
+		ret = __ihk_device_shift_kmsg_buf(file, (void __user *)arg);
+		break;
+
 	case IHK_DEVICE_DETECT_HUNGUP:
 		ret = __ihk_device_detect_hungup(data, arg);
 		break;
 
+	case IHK_DEVICE_LAUNCH_OS:
+		ret = __ihk_device_launch_os(data, arg);
+		break;
+
 	default:
 		if (request >= IHK_DEVICE_DEBUG_START && 
 		    request <= IHK_DEVICE_DEBUG_END) {
@@ -2131,6 +3141,85 @@ static struct vm_operations_struct ihk_host_mmap_ops = {
 	.close = ihk_host_device_mmap_close,
 };
 
+/*
+ * The mapping holds a reference to the pages of the kmsg buffer, not to
+ * its container, so that the buffer outlives the container when
+ * create_os frees it as a stray one.
+ */
+static void ihk_host_kmsg_mmap_open(struct vm_area_struct *vma)
+{
+	get_page(vma->vm_private_data);
+}
+
+static void ihk_host_kmsg_mmap_close(struct vm_area_struct *vma)
+{
+	put_page(vma->vm_private_data);
+}
+
+static struct vm_operations_struct ihk_host_kmsg_mmap_ops = {
+	.open = ihk_host_kmsg_mmap_open,
+	.close = ihk_host_kmsg_mmap_close,
+};
+
+/** \brief Map the latest kmsg buffer of an OS read-only so that ihkmond
+ * reads new messages in place. The cursor is advanced with
+ * IHK_DEVICE_SHIFT_KMSG_BUF because the LWK trusts the header. */
+static int ihk_host_device_mmap_kmsg(struct file *file,
+				     struct vm_area_struct *vma)
+{
+	unsigned long offset = (vma->vm_pgoff << PAGE_SHIFT) -
+		IHK_DEVICE_KMSG_MMAP_BASE;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int os_index = offset >> IHK_DEVICE_KMSG_MMAP_SHIFT;
+	struct ihk_kmsg_buf_container *cont;
+	struct page *page = NULL;
+	unsigned long flags;
+	int ret;
+
+	if (offset & ((1UL << IHK_DEVICE_KMSG_MMAP_SHIFT) - 1)) {
+		return -EINVAL;
+	}
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+
+	spin_lock_irqsave(&ihk_kmsg_bufs_lock, flags);
+	list_for_each_entry_reverse(cont, &ihk_kmsg_bufs, list) {
+		if (cont->os_index == os_index) {
+			if (size <= (PAGE_SIZE << cont->order)) {
+				page = virt_to_page(cont->kmsg_buf);
+				get_page(page);
+			}
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&ihk_kmsg_bufs_lock, flags);
+
+	if (!page) {
+		dprintf("%s: no kmsg_buf of size %lu for os_index %d\n",
+			__func__, size, os_index);
+		return -ENOENT;
+	}
+
+	ret = remap_pfn_range(vma, vma->vm_start, page_to_pfn(page), size,
+			      vma->vm_page_prot);
+	if (ret) {
+		put_page(page);
+		return ret;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	vma->vm_private_data = page;
+	vma->vm_ops = &ihk_host_kmsg_mmap_ops;
+
+	return 0;
+}
+
 /** \brief mmap handler for the device file */
 int ihk_host_device_mmap(struct file *file, struct vm_area_struct *vma)
 {
@@ -2142,6 +3231,10 @@ int ihk_host_device_mmap(struct file *file, struct vm_area_struct *vma)
 	dprint_func_enter;
 	dprint_var_x8(vma->vm_pgoff);
 
+	if (vma->vm_pgoff >= (IHK_DEVICE_KMSG_MMAP_BASE >> PAGE_SHIFT)) {
+		return ihk_host_device_mmap_kmsg(file, vma);
+	}
+
 	pa = ihk_device_map_memory(data, vma->vm_pgoff << PAGE_SHIFT,
 	                           vma->vm_end - vma->vm_start);
 	if ((long)pa <= 0) {
@@ -2179,7 +3272,7 @@ static int ihk_panic(struct notifier_block *this, unsigned long ev, void *ptr)
 	int i;
 
 	for (i = 0; i < os_max_minor; i++) {
-		if (!os_data[i])
+		if (!os_data[i] || os_data[i] == OS_DATA_INVALID)
 			continue;
 		if (os_data[i]->ops->panic_notifier)
 			os_data[i]->ops->panic_notifier(os_data[i],
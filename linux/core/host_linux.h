@@ -11,8 +11,11 @@
 #define __HEADER_IHK_HOST_LINUX_H
 
 #include <linux/cdev.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 #include <ikc/master.h>
 #include <ihk/ihk_debug.h>
+#include <ihk/ihk_monitor.h>
 
 /** \brief Structure that manages a manycore device in Linux */
 struct ihk_host_linux_device_data {
@@ -39,6 +42,51 @@ struct ihk_host_linux_device_data {
 	void *priv;
 };
 
+/** \brief Coalescing of the kmsg notifications of a kernel instance */
+struct ihk_host_kmsg_notify {
+	/** \brief Lock for this structure */
+	spinlock_t lock;
+	/** \brief Ring of the kernel, NULL when it isn't booted */
+	struct ihk_kmsg_buf *kmsg_buf;
+	/** \brief Timer waking up the readers at the end of the interval */
+	struct hrtimer timer;
+	/** \brief Minimum interval between wakeups in us */
+	unsigned long interval;
+	/** \brief Bytes written that wake up the readers at once */
+	unsigned long bytes;
+	/** \brief Time of the last wakeup */
+	ktime_t last;
+	/** \brief Position of the ring at the last wakeup */
+	unsigned long last_reserve;
+	/** \brief Notifications from the kernel */
+	unsigned long notifications;
+	/** \brief Wakeups of the readers */
+	unsigned long wakeups;
+	/** \brief Bytes written and lost by the last ring, kept at shutdown */
+	unsigned long total;
+	unsigned long dropped;
+};
+
+/** \brief Watchdog checking the heartbeat counters of the monitor page */
+struct ihk_host_watchdog {
+	/** \brief Lock for this structure */
+	struct mutex lock;
+	/** \brief Periodic check */
+	struct delayed_work work;
+	/** \brief Time in ms a CPU can stay in the kernel without a
+	 * heartbeat, 0 to disable */
+	unsigned long threshold;
+	/** \brief Set from boot to shutdown */
+	int running;
+	/** \brief Number of CPUs of counter and stamp */
+	int nr_cpus;
+	/** \brief Counters seen last and when they changed in jiffies */
+	unsigned long *counter;
+	unsigned long *stamp;
+	/** \brief Hangups detected */
+	unsigned long hangups;
+};
+
 /** \brief Structure that manages a kernel instance in Linux */
 struct ihk_host_linux_os_data {
 	/** \brief Pointer to the device structure */
@@ -69,6 +117,8 @@ struct ihk_host_linux_os_data {
 	struct mutex kmsg_mutex;
 	/** \brief Kernel message buffer */
 	struct ihk_kmsg_buf_container *kmsg_buf_container;
+	/** \brief Coalescing of the kmsg notifications */
+	struct ihk_host_kmsg_notify kmsg_notify;
 
 	/** \brief monitor */
 	struct ihk_os_monitor *monitor;
@@ -76,6 +126,13 @@ struct ihk_host_linux_os_data {
 	unsigned long monitor_len;
 	/** \brief Host physical address to monitor  */
 	unsigned long monitor_pa;
+	/** \brief Hungup detection without ihkmond */
+	struct ihk_host_watchdog watchdog;
+	/** \brief LWK CPUs found stuck in the kernel since boot */
+	DECLARE_BITMAP(hung_cpus, IHK_OS_MONITOR_MAX_CPUS);
+	/** \brief freeze_req of the monitor holds a subset of the CPUs,
+	 * which doesn't change the status of the OS */
+	int freeze_subset;
 
 	void *rusage;
 	/** \brief Size of the rusage */
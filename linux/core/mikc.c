@@ -57,7 +57,7 @@ struct ihk_ikc_channel_desc *ihk_host_ikc_init_first(ihk_os_t ihk_os,
 	ihk_ikc_system_init(ihk_os);
 	os->ikc_initialized = 1;
 
-	if (ihk_os_wait_for_status(ihk_os, IHK_OS_STATUS_READY, 0, 600) == 0) {
+	if (ihk_os_wait_for_status(ihk_os, IHK_OS_STATUS_READY, 1, 600) == 0) {
 		/* XXX: 
 		 * We assume this address is remote, 
 		 * but the local is possible... */
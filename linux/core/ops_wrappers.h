@@ -141,6 +141,12 @@ IHK_OS_OPS_BEGIN(int, query_mem,
 	IHK_OPS_BODY(query_mem, arg);
 }
 
+IHK_OS_OPS_BEGIN(int, set_bootstrap,
+                 unsigned long arg)
+{
+	IHK_OPS_BODY(set_bootstrap, arg);
+}
+
 IHK_OS_OPS_BEGIN(unsigned long, map_memory,
                  unsigned long rphys, unsigned long size)
 {
@@ -191,6 +197,16 @@ IHK_OS_OPS_BEGIN(int, send_nmi, int mode)
 	IHK_OPS_BODY(send_nmi, mode);
 }
 
+IHK_OS_OPS_BEGIN(int, get_nmi_mode, int *mode)
+{
+	IHK_OPS_BODY(get_nmi_mode, mode);
+}
+
+IHK_OS_OPS_BEGIN(int, set_nmi_mode, int mode)
+{
+	IHK_OPS_BODY(set_nmi_mode, mode);
+}
+
 IHK_OS_OPS_BEGIN_NOARG(struct ihk_mem_info *, get_memory_info)
 {
 	IHK_OPS_BODY_PTR_NOARG(get_memory_info);
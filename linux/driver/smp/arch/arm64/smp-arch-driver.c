@@ -36,12 +36,22 @@
 #endif
 #include <linux/psci.h>
 #include <linux/fs.h>
+#include <linux/cpu.h>
+#include <linux/topology.h>
+#include <linux/mutex.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+#include <linux/cacheinfo.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#include <linux/cpuhotplug.h>
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
 #include <linux/kallsyms.h>
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0) */
 #include <uapi/linux/psci.h>
 #include <ihk/misc/debug.h>
 #include <ihk/ihk_host_user.h>
+#include <ihk/ihk_dump_bitmap.h>
 #include <dt-bindings/interrupt-controller/arm-gic.h>
 #include "config.h"
 #include "smp-driver.h"
@@ -297,6 +307,9 @@ static struct arm_pmu **ihk_cpu_pmu;
 #ifdef ENABLE_TOFU
 struct mm_struct *ihk__init_mm;
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static struct cpu_cacheinfo *(*ihk_get_cpu_cacheinfo)(unsigned int cpu);
+#endif
 
 int (*ihk___irq_set_affinity)(unsigned int irq, const struct cpumask *mask,
 			      bool force);
@@ -437,6 +450,12 @@ int ihk_smp_arch_symbols_init(void)
 		return -EFAULT;
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	/* Optional, caches are read from sysfs without it */
+	ihk_get_cpu_cacheinfo =
+		(void *) kallsyms_lookup_name("get_cpu_cacheinfo");
+#endif
+
 	return 0;
 }
 
@@ -1329,6 +1348,17 @@ enum ihk_os_status smp_ihk_os_query_status(ihk_os_t ihk_os, void *priv)
 
 	}
 
+	/* Frozen CPUs of a subset don't make the OS freezing or frozen */
+	if (data->freeze_subset) {
+		goto out;
+	}
+
+	/* Every CPU asked to freeze has acked in the monitor page */
+	if (smp_ihk_os_freeze_acked(data->monitor)) {
+		ret = IHK_OS_STATUS_FROZEN;
+		goto out;
+	}
+
 	freezing = data->monitor->cpu[0].status;
 	if (freezing == IHK_OS_MONITOR_KERNEL_FREEZING) {
 		ret = IHK_OS_STATUS_FREEZING;
@@ -1388,6 +1418,13 @@ int smp_ihk_os_send_nmi(ihk_os_t ihk_os, void *priv, int mode)
 }
 
 int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
+{
+	return smp_ihk_os_send_multi_intr_mask(ihk_os, priv, mode, NULL);
+}
+
+/* Send to the LWK CPUs set in lwk_cpus, or to all of them if NULL */
+int smp_ihk_os_send_multi_intr_mask(ihk_os_t ihk_os, void *priv, int mode,
+				    const unsigned long *lwk_cpus)
 {
 	struct smp_os_data *os = priv;
 	int i, ret;
@@ -1401,6 +1438,10 @@ int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
 	for (i = 0; i < os->cpu_info.n_cpus; ++i) {
 		int hwid = os->cpu_info.hw_ids[i];
 
+		if (lwk_cpus && (i >= IHK_OS_MONITOR_MAX_CPUS ||
+				 !test_bit(i, lwk_cpus)))
+			continue;
+
 #if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
 		ihk___smp_cross_call(cpumask_of(hwid), INTRID_MULTI_INTR);
 #else
@@ -1414,15 +1455,10 @@ int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
 static long get_dump_num_mem_areas(struct smp_os_data *os)
 {
 	struct ihk_dump_page *dump_page = NULL;
-	int i, j, k, mem_num;
-	unsigned long bit_count;
+	int i;
+	unsigned long mem_num;
 
-	while (1) {
-		if (IHK_DUMP_PAGE_SET_COMPLETED == os->param->dump_page_set.completion_flag) {
-			break;
-		}
-		msleep(10); /* 10ms sleep */
-	}
+	smp_ihk_os_wait_for_dump_completion(os);
 	dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
 
 	for (i = 0, mem_num = 0; i < os->param->dump_page_set.count; i++) {
@@ -1430,23 +1466,8 @@ static long get_dump_num_mem_areas(struct smp_os_data *os)
 			dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 		}
 
-		for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-			for (k = 0; k < 64; k++) {
-				if ((dump_page->map[j] >> k) & 0x1) {
-					bit_count++;
-				}
-				else {
-					if (bit_count) {
-						mem_num++;
-						bit_count = 0;
-					}
-				}
-			}
-		}
-
-		if (bit_count) {
-			mem_num++;
-		}
+		mem_num += ihk_dump_bitmap_nr_runs(dump_page->map,
+				dump_page->map_count * BITS_PER_LONG);
 	}
 	return (sizeof(dump_mem_chunks_t) + (sizeof(struct dump_mem_chunk) * mem_num));
 }
@@ -1455,10 +1476,10 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 {
 	struct smp_os_data *os = priv;
 	struct ihk_dump_page *dump_page = NULL;
-	int i,j,k,index;
+	int i,index;
 	long mem_size;
 	struct ihk_os_mem_chunk *os_mem_chunk;
-	unsigned long map_start, bit_count;
+	unsigned long nbits, pos, run_start, run_len;
 	dump_mem_chunks_t *mem_chunks;
 	void *va;
 	extern struct list_head ihk_mem_used_chunks;
@@ -1493,6 +1514,15 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 		}
 		break;
 
+	case DUMP_QUERY_NUM_DIRTY_AREAS:
+		args->size = smp_ihk_os_snapshot_num_areas(os);
+		if (args->size < 0)
+			return args->size;
+		break;
+
+	case DUMP_QUERY_DIRTY_AREAS:
+		return smp_ihk_os_snapshot_areas(os, args);
+
 	case DUMP_QUERY_NUM_MEM_AREAS:
 		args->size = get_dump_num_mem_areas(os);
 		break;
@@ -1548,28 +1578,18 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 				dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 			}
 
-			for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-				for (k = 0; k < 64; k++) {
-					if ((dump_page->map[j] >> k) & 0x1) {
-						if (!bit_count) {
-							map_start = (unsigned long)(dump_page->start + ((unsigned long)j << (PAGE_SHIFT+6)));
-							map_start = map_start + ((unsigned long)k << PAGE_SHIFT);
-						}
-						bit_count++;
-					} else {
-						if (bit_count) {
-							mem_chunks->chunks[index].addr = map_start;
-							mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
-							index++;
-							bit_count = 0;
-						}
-					}
-				}
-			}
-
-			if (bit_count) {
-				mem_chunks->chunks[index].addr = map_start;
-				mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
+			nbits = dump_page->map_count * BITS_PER_LONG;
+			pos = 0;
+			while (ihk_dump_bitmap_next_run(dump_page->map, nbits,
+							&pos, 1, &run_start,
+							&run_len)) {
+				if (mem_size < sizeof(dump_mem_chunks_t) +
+						(sizeof(struct dump_mem_chunk) * (index+1)))
+					break;
+
+				mem_chunks->chunks[index].addr = dump_page->start +
+					(run_start << PAGE_SHIFT);
+				mem_chunks->chunks[index].size = run_len << PAGE_SHIFT;
 				index++;
 			}
 		}
@@ -2211,6 +2231,50 @@ static int ihk_smp_cpu_kill(unsigned int hwid, u64 affi)
 LIST_HEAD(cpu_topology_list);
 LIST_HEAD(node_topology_list);
 
+/*
+ * Serializes collect_topology() and the CPU hotplug callback.
+ * Entries are only added until free_info(), so lookups walk the
+ * lists without taking it.
+ */
+static DEFINE_MUTEX(topology_lock);
+
+static struct ihk_cpu_topology *find_cpu_topology(int cpu)
+{
+	struct ihk_cpu_topology *p;
+
+	list_for_each_entry(p, &cpu_topology_list, chain) {
+		if (p->cpu_number == cpu) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static struct ihk_cache_topology *find_cache_topology(
+		struct ihk_cpu_topology *cpu_topo, int index)
+{
+	struct ihk_cache_topology *p;
+
+	list_for_each_entry(p, &cpu_topo->cache_topology_list, chain) {
+		if (p->index == index) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static struct ihk_node_topology *find_node_topology(int node)
+{
+	struct ihk_node_topology *p;
+
+	list_for_each_entry(p, &node_topology_list, chain) {
+		if (p->node_number == node) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
 static int ensure_continue(const char *errmsg, int result)
 {
 	int is_error = 0;
@@ -2231,14 +2295,15 @@ static int ensure_continue(const char *errmsg, int result)
 	return is_error;
 }
 
-static int collect_cache_topology(struct ihk_cpu_topology *cpu_topo, int index)
+/* Used when the kernel doesn't have generic cacheinfo */
+static int collect_cache_topology_sysfs(struct ihk_cpu_topology *cpu_topo, int index)
 {
 	int error;
 	char *prefix = NULL;
 	int n;
 	struct ihk_cache_topology *p = NULL;
 
-	dprintk("collect_cache_topology(%p,%d)\n", cpu_topo, index);
+	dprintk("collect_cache_topology_sysfs(%p,%d)\n", cpu_topo, index);
 	prefix = kmalloc(PATH_MAX, GFP_KERNEL);
 	if (!prefix) {
 		error = -ENOMEM;
@@ -2330,7 +2395,7 @@ static int collect_cache_topology(struct ihk_cpu_topology *cpu_topo, int index)
 	}
 
 	error = 0;
-	list_add(&p->chain, &cpu_topo->cache_topology_list);
+	list_add_rcu(&p->chain, &cpu_topo->cache_topology_list);
 	p = NULL;
 
 out:
@@ -2340,77 +2405,118 @@ out:
 		kfree(p);
 	}
 	kfree(prefix);
-	dprintk("collect_cache_topology(%p,%d): %d\n", cpu_topo, index, error);
+	dprintk("collect_cache_topology_sysfs(%p,%d): %d\n", cpu_topo, index, error);
 	return error;
-} /* collect_cache_topology() */
+} /* collect_cache_topology_sysfs() */
 
-static int collect_cpu_topology(int cpu)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static int collect_cache_topology(struct ihk_cpu_topology *cpu_topo, int index)
 {
 	int error;
-	char *prefix = NULL;
-	int n;
-	struct ihk_cpu_topology *p = NULL;
-	int index;
+	struct cpu_cacheinfo *ci;
+	struct cacheinfo *leaf;
+	struct ihk_cache_topology *p = NULL;
+	const char *type;
 
-	dprintk("collect_cpu_topology(%d)\n", cpu);
-	prefix = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!prefix) {
-		error = -ENOMEM;
-		eprintk("ihk:collect_cpu_topology:"
-				"kmalloc failed. %d\n", error);
-		goto out;
+	if (!ihk_get_cpu_cacheinfo) {
+		return collect_cache_topology_sysfs(cpu_topo, index);
 	}
 
-	n = snprintf(prefix, PATH_MAX, "/sys/devices/system/cpu/cpu%d", cpu);
-	if (n >= PATH_MAX) {
-		error = -ENAMETOOLONG;
-		eprintk("ihk:collect_cpu_topology:"
-				"snprintf failed. %d\n", error);
+	dprintk("collect_cache_topology(%p,%d)\n", cpu_topo, index);
+	ci = ihk_get_cpu_cacheinfo(cpu_topo->cpu_number);
+	if (!ci->info_list || index >= ci->num_leaves) {
+		/* No such cache, it's not an error */
+		error = 0;
 		goto out;
 	}
+	leaf = ci->info_list + index;
+
+	/* Same strings as /sys/devices/system/cpu/cpuN/cache/indexI/type */
+	switch (leaf->type) {
+	case CACHE_TYPE_DATA:
+		type = "Data";
+		break;
+	case CACHE_TYPE_INST:
+		type = "Instruction";
+		break;
+	case CACHE_TYPE_UNIFIED:
+		type = "Unified";
+		break;
+	default:
+		type = "Unknown";
+		break;
+	}
 
 	p = kzalloc(sizeof(*p), GFP_KERNEL);
 	if (!p) {
 		error = -ENOMEM;
-		eprintk("ihk:collect_cpu_topology:"
+		eprintk("ihk:collect_cache_topology:"
 				"kzalloc failed. %d\n", error);
 		goto out;
 	}
 
-	INIT_LIST_HEAD(&p->cache_topology_list);
-	p->cpu_number = cpu;
-	p->hw_id = cpu;
-
-	error = read_long(&p->core_id, "%s/topology/core_id", prefix);
-	if(ensure_continue(KERN_ERR "ihk:collect_cpu_info:"
-				"read_long(core_id) failed. %d\n", error)) {
+	p->index = index;
+	p->level = leaf->level;
+	p->size = leaf->size;
+	p->coherency_line_size = leaf->coherency_line_size;
+	p->number_of_sets = leaf->number_of_sets;
+	p->physical_line_partition = leaf->physical_line_partition;
+	p->ways_of_associativity = leaf->ways_of_associativity;
+	cpumask_copy(&p->shared_cpu_map, &leaf->shared_cpu_map);
+
+	p->type = kstrdup(type, GFP_KERNEL);
+	p->size_str = kasprintf(GFP_KERNEL, "%uK", leaf->size >> 10);
+	if (!p->type || !p->size_str) {
+		error = -ENOMEM;
+		eprintk("ihk:collect_cache_topology:"
+				"kstrdup failed. %d\n", error);
 		goto out;
 	}
 
-	error = read_bitmap(&p->core_siblings, nr_cpumask_bits,
-			"%s/topology/core_siblings", prefix);
-	if(ensure_continue(KERN_ERR "ihk:collect_cpu_info:"
-				"read_bitmap(core_siblings) failed. %d\n",
-				error)) {
-		goto out;
-	}
+	error = 0;
+	list_add_rcu(&p->chain, &cpu_topo->cache_topology_list);
+	p = NULL;
 
-	error = read_long(&p->physical_package_id,
-			"%s/topology/physical_package_id", prefix);
-	if(ensure_continue(KERN_ERR "ihk:collect_cpu_info:"
-				"read_long(physical_package_id) failed. %d\n",
-				error)) {
-		goto out;
+out:
+	if (p) {
+		kfree(p->type);
+		kfree(p->size_str);
+		kfree(p);
 	}
+	dprintk("collect_cache_topology(%p,%d): %d\n", cpu_topo, index, error);
+	return error;
+} /* collect_cache_topology() */
+#else
+#define collect_cache_topology collect_cache_topology_sysfs
+#endif
 
-	error = read_bitmap(&p->thread_siblings, nr_cpumask_bits,
-			"%s/topology/thread_siblings", prefix);
-	if(ensure_continue(KERN_ERR "ihk:collect_cpu_info:"
-				"read_bitmap(thread_siblings) failed. %d\n",
-				error)) {
+static int collect_cpu_topology(int cpu)
+{
+	int error;
+	struct ihk_cpu_topology *p = NULL;
+	int index;
+
+	dprintk("collect_cpu_topology(%d)\n", cpu);
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p) {
+		error = -ENOMEM;
+		eprintk("ihk:collect_cpu_topology:"
+				"kzalloc failed. %d\n", error);
 		goto out;
 	}
 
+	INIT_LIST_HEAD(&p->cache_topology_list);
+	p->cpu_number = cpu;
+	p->hw_id = cpu;
+	p->core_id = topology_core_id(cpu);
+	p->physical_package_id = topology_physical_package_id(cpu);
+	cpumask_copy(&p->core_siblings, topology_core_cpumask(cpu));
+#ifdef topology_sibling_cpumask
+	cpumask_copy(&p->thread_siblings, topology_sibling_cpumask(cpu));
+#else
+	cpumask_copy(&p->thread_siblings, topology_thread_cpumask(cpu));
+#endif
+
 	for (index = 0; index < 10; ++index) {
 		error = collect_cache_topology(p, index);
 		if (error) {
@@ -2422,12 +2528,11 @@ static int collect_cpu_topology(int cpu)
 	}
 
 	error = 0;
-	list_add(&p->chain, &cpu_topology_list);
+	list_add_rcu(&p->chain, &cpu_topology_list);
 	p = NULL;
 
 out:
 	kfree(p);
-	kfree(prefix);
 	dprintk("collect_cpu_topology(%d): %d\n", cpu, error);
 	return error;
 } /* collect_cpu_topology() */
@@ -2447,17 +2552,10 @@ static int collect_node_topology(int node)
 	}
 
 	p->node_number = node;
-
-	error = read_bitmap(&p->cpumap, nr_cpumask_bits,
-			"/sys/devices/system/node/node%d/cpumap", node);
-	if (error) {
-		eprintk("ihk:collect_node_topology:"
-				"read_bitmap failed. %d\n", error);
-		// goto out;
-	}
+	cpumask_copy(&p->cpumap, cpumask_of_node(node));
 
 	error = 0;
-	list_add(&p->chain, &node_topology_list);
+	list_add_rcu(&p->chain, &node_topology_list);
 	p = NULL;
 
 out:
@@ -2466,6 +2564,146 @@ out:
 	return error;
 } /* collect_node_topology() */
 
+/*
+ * Called with topology_lock held when a CPU comes online. Adds the
+ * entry of a CPU not seen before and sets its bit in the masks of the
+ * CPUs and the node it shares a core, package or cache with. Nothing
+ * is cleared when a CPU goes offline because IHK offlines the CPUs it
+ * reserves and the LWK still needs their topology.
+ */
+static int update_cpu_topology(int cpu)
+{
+	int error;
+	int node = cpu_to_node(cpu);
+	struct ihk_cpu_topology *p;
+	struct ihk_cpu_topology *sibling;
+	struct ihk_cache_topology *cache;
+	struct ihk_cache_topology *shared;
+	struct ihk_node_topology *node_topo;
+
+	dprintk("update_cpu_topology(%d)\n", cpu);
+	p = find_cpu_topology(cpu);
+	if (!p) {
+		error = collect_cpu_topology(cpu);
+		if (error) {
+			goto out;
+		}
+		p = find_cpu_topology(cpu);
+	}
+	else {
+		cpumask_or(&p->core_siblings, &p->core_siblings,
+			   topology_core_cpumask(cpu));
+#ifdef topology_sibling_cpumask
+		cpumask_or(&p->thread_siblings, &p->thread_siblings,
+			   topology_sibling_cpumask(cpu));
+#else
+		cpumask_or(&p->thread_siblings, &p->thread_siblings,
+			   topology_thread_cpumask(cpu));
+#endif
+	}
+
+	list_for_each_entry(sibling, &cpu_topology_list, chain) {
+		if (cpumask_test_cpu(sibling->cpu_number, &p->core_siblings)) {
+			cpumask_set_cpu(cpu, &sibling->core_siblings);
+		}
+
+		if (cpumask_test_cpu(sibling->cpu_number,
+				     &p->thread_siblings)) {
+			cpumask_set_cpu(cpu, &sibling->thread_siblings);
+		}
+
+		list_for_each_entry(cache, &p->cache_topology_list, chain) {
+			if (!cpumask_test_cpu(sibling->cpu_number,
+					      &cache->shared_cpu_map)) {
+				continue;
+			}
+
+			shared = find_cache_topology(sibling, cache->index);
+			if (shared) {
+				cpumask_set_cpu(cpu, &shared->shared_cpu_map);
+			}
+		}
+	}
+
+	node_topo = find_node_topology(node);
+	if (!node_topo) {
+		error = collect_node_topology(node);
+		goto out;
+	}
+	cpumask_set_cpu(cpu, &node_topo->cpumap);
+
+	error = 0;
+out:
+	dprintk("update_cpu_topology(%d): %d\n", cpu, error);
+	return error;
+} /* update_cpu_topology() */
+
+static int topology_cpu_online(unsigned int cpu)
+{
+	int error;
+
+	mutex_lock(&topology_lock);
+	error = update_cpu_topology(cpu);
+	mutex_unlock(&topology_lock);
+	if (error) {
+		eprintk("ihk:topology_cpu_online:"
+				"update_cpu_topology(%u) failed. %d\n",
+				cpu, error);
+	}
+
+	/* Don't fail the hotplug operation */
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+static int topology_hp_state;
+#else
+static int topology_cpu_callback(struct notifier_block *nb,
+				 unsigned long action, void *hcpu)
+{
+	if ((action & ~CPU_TASKS_FROZEN) == CPU_ONLINE) {
+		topology_cpu_online((unsigned long)hcpu);
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block topology_cpu_notifier = {
+	.notifier_call = topology_cpu_callback,
+};
+#endif
+
+static int register_topology_hotplug(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	int ret;
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN,
+					"ihk/smp:topology",
+					topology_cpu_online, NULL);
+	if (ret < 0) {
+		return ret;
+	}
+
+	topology_hp_state = ret;
+	return 0;
+#else
+	return register_cpu_notifier(&topology_cpu_notifier);
+#endif
+}
+
+static void unregister_topology_hotplug(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	if (topology_hp_state > 0) {
+		cpuhp_remove_state_nocalls(topology_hp_state);
+		topology_hp_state = 0;
+	}
+#else
+	unregister_cpu_notifier(&topology_cpu_notifier);
+#endif
+}
+
 int collect_topology(void)
 {
 	int error;
@@ -2473,27 +2711,54 @@ int collect_topology(void)
 	int node;
 
 	dprintk("collect_topology()\n");
+
+	/*
+	 * Registered first so that no CPU coming online during the scan
+	 * is missed. Entries the callback already added are skipped.
+	 */
+	error = register_topology_hotplug();
+	if (error) {
+		eprintk("ihk:collect_topology:"
+				"register_topology_hotplug failed. %d\n",
+				error);
+		goto out;
+	}
+
+	mutex_lock(&topology_lock);
 	for_each_cpu(cpu, cpu_online_mask) {
+		if (find_cpu_topology(cpu)) {
+			continue;
+		}
+
 		error = collect_cpu_topology(cpu);
 		if (error) {
 			eprintk("ihk:collect_topology:"
 					"collect_cpu_topology failed. %d\n",
 					error);
-			goto out;
+			goto out_unlock;
 		}
 	}
 
 	for_each_online_node(node) {
+		if (find_node_topology(node)) {
+			continue;
+		}
+
 		error = collect_node_topology(node);
 		if (error) {
 			eprintk("ihk:collect_topology:"
 					"collect_node_topology failed. %d\n",
 					error);
-			goto out;
+			goto out_unlock;
 		}
 	}
 
 	error = 0;
+out_unlock:
+	mutex_unlock(&topology_lock);
+	if (error) {
+		unregister_topology_hotplug();
+	}
 out:
 	dprintk("collect_topology(): %d\n", error);
 	return error;
@@ -2592,6 +2857,75 @@ int ihk_smp_reset_cpu(int hw_id)
 	return ret;
 }
 
+/*
+ * Reset all CPUs of an OS instance at once. A single cross call stops
+ * every CPU that is still on, then each CPU is polled until PSCI
+ * reports it off, which serves as the per-CPU completion fence.
+ */
+int ihk_smp_reset_cpus(ihk_os_t ihk_os)
+{
+	int ret = 0;
+	int i;
+	u64 affi;
+	cpumask_var_t stop_mask;
+
+	if (!ihk_psci_ops->affinity_info) {
+		pr_warn("IHK-SMP: Undefined reference to 'affinity_info'\n");
+		return -EFAULT;
+	}
+
+	if (!zalloc_cpumask_var(&stop_mask, GFP_KERNEL)) {
+		/* Fall back to one by one */
+		for (i = 0; i < SMP_MAX_CPUS; ++i) {
+			if (ihk_smp_cpus[i].os != ihk_os)
+				continue;
+
+			ret = ihk_smp_reset_cpu(ihk_smp_cpus[i].hw_id);
+		}
+		return ret;
+	}
+
+	for (i = 0; i < SMP_MAX_CPUS; ++i) {
+		if (ihk_smp_cpus[i].os != ihk_os ||
+		    ihk_smp_cpus[i].status != IHK_SMP_CPU_ASSIGNED)
+			continue;
+
+		if (ihk_smp_get_cpu_affinity(ihk_smp_cpus[i].hw_id, &affi))
+			continue;
+
+		if (ihk_psci_ops->affinity_info(affi, 0) ==
+		    PSCI_0_2_AFFINITY_LEVEL_ON) {
+			cpumask_set_cpu(ihk_smp_cpus[i].hw_id, stop_mask);
+		}
+	}
+
+	if (!cpumask_empty(stop_mask)) {
+		ihk___smp_cross_call(stop_mask, INTRID_CPU_STOP);
+	}
+
+	for (i = 0; i < SMP_MAX_CPUS; ++i) {
+		int hw_id = ihk_smp_cpus[i].hw_id;
+
+		if (ihk_smp_cpus[i].os != ihk_os ||
+		    ihk_smp_cpus[i].status != IHK_SMP_CPU_ASSIGNED)
+			continue;
+
+		dprintk(KERN_INFO "IHK-SMP: resetting CPU %d.\n", hw_id);
+
+		ret = ihk_smp_get_cpu_affinity(hw_id, &affi);
+		if (ret) {
+			pr_warn("IHK-SMP: ihk_smp_get_cpu_affinity failed.(ret=%d)\n",
+				ret);
+			continue;
+		}
+
+		ret = ihk_smp_cpu_kill(hw_id, affi);
+	}
+
+	free_cpumask_var(stop_mask);
+	return ret;
+}
+
 void smp_ihk_arch_exit(void)
 {
 #ifndef IHK_IKC_USE_LINUX_WORK_IRQ
@@ -2623,6 +2957,8 @@ void smp_ihk_arch_exit(void)
 		free_pages((unsigned long)ident_page_table_virt,
 		           ident_npages_order);
 	}
+
+	unregister_topology_hotplug();
 }
 
 #ifdef ENABLE_PERF
@@ -2642,6 +2978,11 @@ void ihk_smp_free_page_tables(pgd_t *pt)
 	printk(KERN_WARNING "%s: function not implemented.\n", __FUNCTION__);
 }
 
+void ihk_smp_put_boot_pt(pgd_t *pt)
+{
+	ihk_smp_free_page_tables(pt);
+}
+
 int ihk_smp_map_kernel(pgd_t *pt, unsigned long vaddr, phys_addr_t paddr)
 {
 	printk(KERN_WARNING "%s: function not implemented.\n", __FUNCTION__);
@@ -18,8 +18,17 @@
 #include <linux/radix-tree.h>
 #include <linux/irq.h>
 #include <linux/vmalloc.h>
-#include <asm/hw_irq.h>
+#include <linux/cpu.h>
+#include <linux/topology.h>
+#include <linux/mutex.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+#include <linux/cacheinfo.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#include <linux/cpuhotplug.h>
+#endif
+#include <asm/hw_irq.h>
 #include <linux/kallsyms.h>
 #include <linux/mc146818rtc.h>
 #include <asm/tlbflush.h>
@@ -37,6 +46,7 @@
 #include <asm/nmi.h>
 #include <ihk/ihk_host_driver.h>
 #include <ihk/ihk_host_user.h>
+#include <ihk/ihk_dump_bitmap.h>
 #include <ihk/misc/debug.h>
 #include "config.h"
 #include "smp-driver.h"
@@ -130,6 +140,10 @@ static pgd_t *_init_level4_pgt;
 
 static unsigned long *_used_vectors;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static struct cpu_cacheinfo *(*_get_cpu_cacheinfo)(unsigned int cpu);
+#endif
+
 int ihk_smp_arch_symbols_init(void)
 {
 	_real_mode_header = (void *) kallsyms_lookup_name("real_mode_header");
@@ -182,6 +196,12 @@ int ihk_smp_arch_symbols_init(void)
 	if (WARN_ON(!_used_vectors))
 		return -EFAULT;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	/* Optional, caches are read from sysfs without it */
+	_get_cpu_cacheinfo =
+		(void *) kallsyms_lookup_name("get_cpu_cacheinfo");
+#endif
+
 	return 0;
 }
 
@@ -464,62 +484,200 @@ int smp_ihk_arch_vmap_area_taken(void)
 }
 #endif
 
-int smp_ihk_os_setup_startup(void *priv, unsigned long phys,
-                            unsigned long entry)
+#define IHK_SMP_HUGE_PAGE	(1UL << PTL3_SHIFT)
+
+/*
+ * Boot page tables only depend on where the kernel image is loaded,
+ * keep the most recent ones around so that relaunches can reuse them.
+ */
+struct ihk_smp_boot_pt {
+	struct list_head list;
+	unsigned long phys;
+	pgd_t *pt;
+	int refcount;
+};
+
+#define IHK_SMP_MAX_BOOT_PTS	4
+
+static LIST_HEAD(ihk_smp_boot_pts);
+static DEFINE_MUTEX(ihk_smp_boot_pts_lock);
+static int ihk_smp_nr_boot_pts;
+
+static int ihk_smp_map_kernel_huge(pgd_t *pt, unsigned long vaddr,
+				   phys_addr_t paddr);
+
+/* Map with 1GB pages where alignment allows, 2MB pages otherwise */
+static int ihk_smp_map_kernel_range(pgd_t *pt, unsigned long vaddr,
+				    phys_addr_t paddr, unsigned long len)
 {
-	struct smp_os_data *os = priv;
-	unsigned long _virt, _phys, _len;
-	unsigned long stack_p;
-	extern char startup_data[];
-	extern char startup_data_end[];
-	unsigned long startup_p;
-	unsigned long *startup;
+	unsigned long end = vaddr + len;
+	int ret;
 
-	os->boot_pt = (pgd_t *)get_zeroed_page(GFP_KERNEL);
-	if (!os->boot_pt) {
+	while (vaddr < end) {
+		if (boot_cpu_has(X86_FEATURE_GBPAGES) &&
+		    !(vaddr & (IHK_SMP_HUGE_PAGE - 1)) &&
+		    !(paddr & (IHK_SMP_HUGE_PAGE - 1)) &&
+		    end - vaddr >= IHK_SMP_HUGE_PAGE) {
+			ret = ihk_smp_map_kernel_huge(pt, vaddr, paddr);
+			if (ret < 0)
+				return ret;
+
+			vaddr += IHK_SMP_HUGE_PAGE;
+			paddr += IHK_SMP_HUGE_PAGE;
+			continue;
+		}
+
+		ret = ihk_smp_map_kernel(pt, vaddr, paddr);
+		if (ret < 0)
+			return ret;
+
+		vaddr += IHK_SMP_LARGE_PAGE;
+		paddr += IHK_SMP_LARGE_PAGE;
+	}
+
+	return 0;
+}
+
+static pgd_t *ihk_smp_build_boot_pt(unsigned long phys)
+{
+	pgd_t *pt;
+	unsigned long _len;
+
+	pt = (pgd_t *)get_zeroed_page(GFP_KERNEL);
+	if (!pt) {
 		printk("%s: error: allocating boot PT\n", __FUNCTION__);
-		return -ENOMEM;
+		return NULL;
 	}
 
 	/* Map identity (256GB) */
 	_len = 0x4000000000UL;
-	for (_virt = 0, _phys = 0; _virt < _len;
-			_virt += IHK_SMP_LARGE_PAGE, _phys += IHK_SMP_LARGE_PAGE) {
-		if (ihk_smp_map_kernel(os->boot_pt, _virt, _phys) < 0) {
-			printk("%s: error: mapping identity\n", __FUNCTION__);
-			return -ENOMEM;
-		}
+	if (ihk_smp_map_kernel_range(pt, 0, 0, _len) < 0) {
+		printk("%s: error: mapping identity\n", __FUNCTION__);
+		goto err;
+	}
+
+	/* Map ST */
+	if (ihk_smp_map_kernel_range(pt, IHK_SMP_MAP_ST_START, 0, _len) < 0) {
+		printk("%s: error: mapping straight area\n", __FUNCTION__);
+		goto err;
 	}
 
-#if 0
-	/* Map PAGE_OFFSET */
-	for (_virt = PAGE_OFFSET, _phys = 0; _virt < (PAGE_OFFSET + _len);
-			_virt += IHK_SMP_LARGE_PAGE, _phys += IHK_SMP_LARGE_PAGE) {
-		if (ihk_smp_map_kernel(os->boot_pt, _virt, _phys) < 0) {
-			printk("%s: error: mapping Linux area\n", __FUNCTION__);
-			return -ENOMEM;
+	/* Map kernel image */
+	_len = (4 * IHK_SMP_LARGE_PAGE);
+	if (ihk_smp_map_kernel_range(pt, IHK_SMP_MAP_KERNEL_START,
+				     phys, _len) < 0) {
+		printk("%s: error: mapping kernel image\n", __FUNCTION__);
+		goto err;
+	}
+
+	return pt;
+
+err:
+	ihk_smp_free_page_tables(pt);
+	return NULL;
+}
+
+static pgd_t *ihk_smp_get_boot_pt(unsigned long phys)
+{
+	struct ihk_smp_boot_pt *bpt, *next;
+	pgd_t *pt = NULL;
+
+	mutex_lock(&ihk_smp_boot_pts_lock);
+	list_for_each_entry(bpt, &ihk_smp_boot_pts, list) {
+		if (bpt->phys == phys) {
+			dprintk("%s: reusing boot PT for 0x%lx\n",
+				__func__, phys);
+			bpt->refcount++;
+			list_move_tail(&bpt->list, &ihk_smp_boot_pts);
+			pt = bpt->pt;
+			goto out;
 		}
 	}
-#endif
 
-	/* Map ST */
-	for (_virt = IHK_SMP_MAP_ST_START, _phys = 0; _virt < (IHK_SMP_MAP_ST_START + _len);
-			_virt += IHK_SMP_LARGE_PAGE, _phys += IHK_SMP_LARGE_PAGE) {
-		if (ihk_smp_map_kernel(os->boot_pt, _virt, _phys) < 0) {
-			printk("%s: error: mapping straight area\n", __FUNCTION__);
-			return -ENOMEM;
+	pt = ihk_smp_build_boot_pt(phys);
+	if (!pt)
+		goto out;
+
+	bpt = kmalloc(sizeof(*bpt), GFP_KERNEL);
+	if (!bpt) {
+		/* Still usable, freed by ihk_smp_put_boot_pt() */
+		goto out;
+	}
+
+	bpt->phys = phys;
+	bpt->pt = pt;
+	bpt->refcount = 1;
+	list_add_tail(&bpt->list, &ihk_smp_boot_pts);
+	ihk_smp_nr_boot_pts++;
+
+	/* Evict the least recently used ones not in use */
+	list_for_each_entry_safe(bpt, next, &ihk_smp_boot_pts, list) {
+		if (ihk_smp_nr_boot_pts <= IHK_SMP_MAX_BOOT_PTS)
+			break;
+		if (bpt->refcount)
+			continue;
+
+		list_del(&bpt->list);
+		ihk_smp_free_page_tables(bpt->pt);
+		kfree(bpt);
+		ihk_smp_nr_boot_pts--;
+	}
+out:
+	mutex_unlock(&ihk_smp_boot_pts_lock);
+	return pt;
+}
+
+void ihk_smp_put_boot_pt(pgd_t *pt)
+{
+	struct ihk_smp_boot_pt *bpt;
+
+	if (!pt)
+		return;
+
+	mutex_lock(&ihk_smp_boot_pts_lock);
+	list_for_each_entry(bpt, &ihk_smp_boot_pts, list) {
+		if (bpt->pt == pt) {
+			bpt->refcount--;
+			goto out;
 		}
 	}
 
-	/* Map kernel image */
-	_len = (4 * IHK_SMP_LARGE_PAGE);
-	for (_virt = IHK_SMP_MAP_KERNEL_START, _phys = phys; 
-			_virt < (IHK_SMP_MAP_KERNEL_START + _len);
-			_virt += IHK_SMP_LARGE_PAGE, _phys += IHK_SMP_LARGE_PAGE) {
-		if (ihk_smp_map_kernel(os->boot_pt, _virt, _phys) < 0) {
-			printk("%s: error: mapping kernel image\n", __FUNCTION__);
-			return -ENOMEM;
+	ihk_smp_free_page_tables(pt);
+out:
+	mutex_unlock(&ihk_smp_boot_pts_lock);
+}
+
+static void ihk_smp_free_boot_pts(void)
+{
+	struct ihk_smp_boot_pt *bpt, *next;
+
+	mutex_lock(&ihk_smp_boot_pts_lock);
+	list_for_each_entry_safe(bpt, next, &ihk_smp_boot_pts, list) {
+		if (bpt->refcount) {
+			printk("%s: WARNING: boot PT for 0x%lx still in use\n",
+			       __func__, bpt->phys);
 		}
+		list_del(&bpt->list);
+		ihk_smp_free_page_tables(bpt->pt);
+		kfree(bpt);
+	}
+	ihk_smp_nr_boot_pts = 0;
+	mutex_unlock(&ihk_smp_boot_pts_lock);
+}
+
+int smp_ihk_os_setup_startup(void *priv, unsigned long phys,
+                            unsigned long entry)
+{
+	struct smp_os_data *os = priv;
+	unsigned long stack_p;
+	extern char startup_data[];
+	extern char startup_data_end[];
+	unsigned long startup_p;
+	unsigned long *startup;
+
+	os->boot_pt = ihk_smp_get_boot_pt(phys);
+	if (!os->boot_pt) {
+		return -ENOMEM;
 	}
 
 	/* Stack grows down.. */
@@ -574,6 +732,13 @@ int smp_ihk_os_send_nmi(ihk_os_t ihk_os, void *priv, int mode)
 }
 
 int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
+{
+	return smp_ihk_os_send_multi_intr_mask(ihk_os, priv, mode, NULL);
+}
+
+/* Send to the LWK CPUs set in lwk_cpus, or to all of them if NULL */
+int smp_ihk_os_send_multi_intr_mask(ihk_os_t ihk_os, void *priv, int mode,
+				    const unsigned long *lwk_cpus)
 {
 	const int MULT_INTR_VECTOR = 242;
 	struct smp_os_data *os = priv;
@@ -587,6 +752,10 @@ int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
 
 	local_irq_save(flags);
 	for (i = 0; i < os->cpu_info.n_cpus; i++) {
+		if (lwk_cpus && (i >= IHK_OS_MONITOR_MAX_CPUS ||
+				 !test_bit(i, lwk_cpus)))
+			continue;
+
 #ifdef CONFIG_X86_X2APIC
 		if (x2apic_is_enabled()) {
 			native_x2apic_icr_write(MULT_INTR_VECTOR,
@@ -614,15 +783,10 @@ int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
 static long get_dump_num_mem_areas(struct smp_os_data *os)
 {
 	struct ihk_dump_page *dump_page = NULL;
-	int i, j, k, mem_num;
-	unsigned long bit_count;
+	int i;
+	unsigned long mem_num;
 
-	while (1) {
-		if (IHK_DUMP_PAGE_SET_COMPLETED == os->param->dump_page_set.completion_flag) {
-			break;
-		}
-		msleep(10); /* 10ms sleep */
-	}
+	smp_ihk_os_wait_for_dump_completion(os);
 	dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
 
 	for (i = 0, mem_num = 0; i < os->param->dump_page_set.count; i++) {
@@ -630,23 +794,8 @@ static long get_dump_num_mem_areas(struct smp_os_data *os)
 			dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 		}
 
-		for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-			for (k = 0; k < 64; k++) {
-				if ((dump_page->map[j] >> k) & 0x1) {
-					bit_count++;
-				}
-				else {
-					if (bit_count) {
-						mem_num++;
-						bit_count = 0;
-					}
-				}
-			}
-		}
-
-		if (bit_count) {
-			mem_num++;
-		}
+		mem_num += ihk_dump_bitmap_nr_runs(dump_page->map,
+				dump_page->map_count * BITS_PER_LONG);
 	}
 	return (sizeof(dump_mem_chunks_t) + (sizeof(struct dump_mem_chunk) * mem_num));
 }
@@ -655,10 +804,10 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 {
 	struct smp_os_data *os = priv;
 	struct ihk_dump_page *dump_page = NULL;
-	int i,j,k,index;
+	int i,index;
 	long mem_size;
 	struct ihk_os_mem_chunk *os_mem_chunk;
-	unsigned long map_start, bit_count;
+	unsigned long nbits, pos, run_start, run_len;
 	dump_mem_chunks_t *mem_chunks;
 	void *va;
 	extern struct list_head ihk_mem_used_chunks;
@@ -694,6 +843,15 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 			}
 			break;
 
+		case DUMP_QUERY_NUM_DIRTY_AREAS:
+			args->size = smp_ihk_os_snapshot_num_areas(os);
+			if (args->size < 0)
+				return args->size;
+			break;
+
+		case DUMP_QUERY_DIRTY_AREAS:
+			return smp_ihk_os_snapshot_areas(os, args);
+
 		case DUMP_QUERY_NUM_MEM_AREAS:
 			args->size = get_dump_num_mem_areas(os);
 
@@ -756,28 +914,18 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 					dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 				}
 
-				for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-					for (k = 0; k < 64; k++) {
-						if ((dump_page->map[j] >> k) & 0x1) {
-							if (!bit_count) {
-								map_start = (unsigned long)(dump_page->start + ((unsigned long)j << (PAGE_SHIFT+6)));
-								map_start = map_start + ((unsigned long)k << PAGE_SHIFT);
-							}
-							bit_count++;
-						} else {
-							if (bit_count) {
-								mem_chunks->chunks[index].addr = map_start;
-								mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
-								index++;
-								bit_count = 0;
-							}
-						}
-					}
-				}
-
-				if (bit_count) {
-					mem_chunks->chunks[index].addr = map_start;
-					mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
+				nbits = dump_page->map_count * BITS_PER_LONG;
+				pos = 0;
+				while (ihk_dump_bitmap_next_run(dump_page->map, nbits,
+								&pos, 1, &run_start,
+								&run_len)) {
+					if (mem_size < sizeof(dump_mem_chunks_t) +
+							(sizeof(struct dump_mem_chunk) * (index+1)))
+						break;
+
+					mem_chunks->chunks[index].addr = dump_page->start +
+						(run_start << PAGE_SHIFT);
+					mem_chunks->chunks[index].size = run_len << PAGE_SHIFT;
 					index++;
 				}
 			}
@@ -834,7 +982,7 @@ enum ihk_os_status smp_ihk_os_query_status(ihk_os_t ihk_os, void *priv)
 	int status;
 
 	status = os->status;
-	pr_info("%s: builtin os status: %d, param status: %ld\n",
+	dprintk("%s: builtin os status: %d, param status: %ld\n",
 		__func__, status, os->param->status);
 
 	switch (status) {
@@ -873,7 +1021,7 @@ enum ihk_os_status smp_ihk_os_query_status(ihk_os_t ihk_os, void *priv)
 		break;
 	}
 
-	pr_info("%s: status before checking monitor info: %d\n",
+	dprintk("%s: status before checking monitor info: %d\n",
 		__func__, ret);
 
 	if (ret != IHK_OS_STATUS_READY && ret != IHK_OS_STATUS_RUNNING)
@@ -896,6 +1044,17 @@ enum ihk_os_status smp_ihk_os_query_status(ihk_os_t ihk_os, void *priv)
 
 	}
 
+	/* Frozen CPUs of a subset don't make the OS freezing or frozen */
+	if (data->freeze_subset) {
+		goto out;
+	}
+
+	/* Every CPU asked to freeze has acked in the monitor page */
+	if (smp_ihk_os_freeze_acked(data->monitor)) {
+		ret = IHK_OS_STATUS_FROZEN;
+		goto out;
+	}
+
 	freezing = data->monitor->cpu[0].status;
 	if (freezing == IHK_OS_MONITOR_KERNEL_FREEZING) {
 		ret = IHK_OS_STATUS_FREEZING;
@@ -927,7 +1086,7 @@ enum ihk_os_status smp_ihk_os_query_status(ihk_os_t ihk_os, void *priv)
 	}
 
  out:
-	pr_info("%s: status after checking monitor info: %d",
+	dprintk("%s: status after checking monitor info: %d\n",
 		__func__, ret);
 
 	return ret;
@@ -1412,14 +1571,59 @@ error_free_trampoline:
 LIST_HEAD(cpu_topology_list);
 LIST_HEAD(node_topology_list);
 
-static int collect_cache_topology(struct ihk_cpu_topology *cpu_topo, int index)
+/*
+ * Serializes collect_topology() and the CPU hotplug callback.
+ * Entries are only added until free_info(), so lookups walk the
+ * lists without taking it.
+ */
+static DEFINE_MUTEX(topology_lock);
+
+static struct ihk_cpu_topology *find_cpu_topology(int cpu)
+{
+	struct ihk_cpu_topology *p;
+
+	list_for_each_entry(p, &cpu_topology_list, chain) {
+		if (p->cpu_number == cpu) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static struct ihk_cache_topology *find_cache_topology(
+		struct ihk_cpu_topology *cpu_topo, int index)
+{
+	struct ihk_cache_topology *p;
+
+	list_for_each_entry(p, &cpu_topo->cache_topology_list, chain) {
+		if (p->index == index) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static struct ihk_node_topology *find_node_topology(int node)
+{
+	struct ihk_node_topology *p;
+
+	list_for_each_entry(p, &node_topology_list, chain) {
+		if (p->node_number == node) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Used when the kernel doesn't have generic cacheinfo */
+static int collect_cache_topology_sysfs(struct ihk_cpu_topology *cpu_topo, int index)
 {
 	int error;
 	char *prefix = NULL;
 	int n;
 	struct ihk_cache_topology *p = NULL;
 
-	dprintk("collect_cache_topology(%p,%d)\n", cpu_topo, index);
+	dprintk("collect_cache_topology_sysfs(%p,%d)\n", cpu_topo, index);
 	prefix = kmalloc(PATH_MAX, GFP_KERNEL);
 	if (!prefix) {
 		error = -ENOMEM;
@@ -1528,7 +1732,7 @@ static int collect_cache_topology(struct ihk_cpu_topology *cpu_topo, int index)
 	}
 
 	error = 0;
-	list_add(&p->chain, &cpu_topo->cache_topology_list);
+	list_add_rcu(&p->chain, &cpu_topo->cache_topology_list);
 	p = NULL;
 
 out:
@@ -1538,81 +1742,118 @@ out:
 		kfree(p);
 	}
 	kfree(prefix);
-	dprintk("collect_cache_topology(%p,%d): %d\n", cpu_topo, index, error);
+	dprintk("collect_cache_topology_sysfs(%p,%d): %d\n", cpu_topo, index, error);
 	return error;
-} /* collect_cache_topology() */
+} /* collect_cache_topology_sysfs() */
 
-static int collect_cpu_topology(int cpu)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static int collect_cache_topology(struct ihk_cpu_topology *cpu_topo, int index)
 {
 	int error;
-	char *prefix = NULL;
-	int n;
-	struct ihk_cpu_topology *p = NULL;
-	int index;
+	struct cpu_cacheinfo *ci;
+	struct cacheinfo *leaf;
+	struct ihk_cache_topology *p = NULL;
+	const char *type;
 
-	dprintk("collect_cpu_topology(%d)\n", cpu);
-	prefix = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!prefix) {
-		error = -ENOMEM;
-		eprintk("ihk:collect_cpu_topology:"
-				"kmalloc failed. %d\n", error);
-		goto out;
+	if (!_get_cpu_cacheinfo) {
+		return collect_cache_topology_sysfs(cpu_topo, index);
 	}
 
-	n = snprintf(prefix, PATH_MAX, "/sys/devices/system/cpu/cpu%d", cpu);
-	if (n >= PATH_MAX) {
-		error = -ENAMETOOLONG;
-		eprintk("ihk:collect_cpu_topology:"
-				"snprintf failed. %d\n", error);
+	dprintk("collect_cache_topology(%p,%d)\n", cpu_topo, index);
+	ci = _get_cpu_cacheinfo(cpu_topo->cpu_number);
+	if (!ci->info_list || index >= ci->num_leaves) {
+		/* No such cache, it's not an error */
+		error = 0;
 		goto out;
 	}
+	leaf = ci->info_list + index;
+
+	/* Same strings as /sys/devices/system/cpu/cpuN/cache/indexI/type */
+	switch (leaf->type) {
+	case CACHE_TYPE_DATA:
+		type = "Data";
+		break;
+	case CACHE_TYPE_INST:
+		type = "Instruction";
+		break;
+	case CACHE_TYPE_UNIFIED:
+		type = "Unified";
+		break;
+	default:
+		type = "Unknown";
+		break;
+	}
 
 	p = kzalloc(sizeof(*p), GFP_KERNEL);
 	if (!p) {
 		error = -ENOMEM;
-		eprintk("ihk:collect_cpu_topology:"
+		eprintk("ihk:collect_cache_topology:"
 				"kzalloc failed. %d\n", error);
 		goto out;
 	}
 
-	INIT_LIST_HEAD(&p->cache_topology_list);
-	p->cpu_number = cpu;
-	p->hw_id = per_cpu(x86_cpu_to_apicid, cpu);
-
-	error = read_long(&p->core_id, "%s/topology/core_id", prefix);
-	if (error) {
-		eprintk("ihk:collect_cpu_info:"
-				"read_long(core_id) failed. %d\n", error);
+	p->index = index;
+	p->level = leaf->level;
+	p->size = leaf->size;
+	p->coherency_line_size = leaf->coherency_line_size;
+	p->number_of_sets = leaf->number_of_sets;
+	p->physical_line_partition = leaf->physical_line_partition;
+	p->ways_of_associativity = leaf->ways_of_associativity;
+	cpumask_copy(&p->shared_cpu_map, &leaf->shared_cpu_map);
+
+	p->type = kstrdup(type, GFP_KERNEL);
+	p->size_str = kasprintf(GFP_KERNEL, "%uK", leaf->size >> 10);
+	if (!p->type || !p->size_str) {
+		error = -ENOMEM;
+		eprintk("ihk:collect_cache_topology:"
+				"kstrdup failed. %d\n", error);
 		goto out;
 	}
 
-	error = read_bitmap(&p->core_siblings, nr_cpumask_bits,
-			"%s/topology/core_siblings", prefix);
-	if (error) {
-		eprintk("ihk:collect_cpu_info:"
-				"read_bitmap(core_siblings) failed. %d\n",
-				error);
-		goto out;
-	}
+	error = 0;
+	list_add_rcu(&p->chain, &cpu_topo->cache_topology_list);
+	p = NULL;
 
-	error = read_long(&p->physical_package_id,
-			"%s/topology/physical_package_id", prefix);
-	if (error) {
-		eprintk("ihk:collect_cpu_info:"
-				"read_long(physical_package_id) failed. %d\n",
-				error);
-		goto out;
+out:
+	if (p) {
+		kfree(p->type);
+		kfree(p->size_str);
+		kfree(p);
 	}
+	dprintk("collect_cache_topology(%p,%d): %d\n", cpu_topo, index, error);
+	return error;
+} /* collect_cache_topology() */
+#else
+#define collect_cache_topology collect_cache_topology_sysfs
+#endif
 
-	error = read_bitmap(&p->thread_siblings, nr_cpumask_bits,
-			"%s/topology/thread_siblings", prefix);
-	if (error) {
-		eprintk("ihk:collect_cpu_info:"
-				"read_bitmap(thread_siblings) failed. %d\n",
-				error);
+static int collect_cpu_topology(int cpu)
+{
+	int error;
+	struct ihk_cpu_topology *p = NULL;
+	int index;
+
+	dprintk("collect_cpu_topology(%d)\n", cpu);
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p) {
+		error = -ENOMEM;
+		eprintk("ihk:collect_cpu_topology:"
+				"kzalloc failed. %d\n", error);
 		goto out;
 	}
 
+	INIT_LIST_HEAD(&p->cache_topology_list);
+	p->cpu_number = cpu;
+	p->hw_id = per_cpu(x86_cpu_to_apicid, cpu);
+	p->core_id = topology_core_id(cpu);
+	p->physical_package_id = topology_physical_package_id(cpu);
+	cpumask_copy(&p->core_siblings, topology_core_cpumask(cpu));
+#ifdef topology_sibling_cpumask
+	cpumask_copy(&p->thread_siblings, topology_sibling_cpumask(cpu));
+#else
+	cpumask_copy(&p->thread_siblings, topology_thread_cpumask(cpu));
+#endif
+
 	for (index = 0; index < 10; ++index) {
 		error = collect_cache_topology(p, index);
 		if (error) {
@@ -1624,12 +1865,11 @@ static int collect_cpu_topology(int cpu)
 	}
 
 	error = 0;
-	list_add(&p->chain, &cpu_topology_list);
+	list_add_rcu(&p->chain, &cpu_topology_list);
 	p = NULL;
 
 out:
 	kfree(p);
-	kfree(prefix);
 	dprintk("collect_cpu_topology(%d): %d\n", cpu, error);
 	return error;
 } /* collect_cpu_topology() */
@@ -1649,17 +1889,10 @@ static int collect_node_topology(int node)
 	}
 
 	p->node_number = node;
-
-	error = read_bitmap(&p->cpumap, nr_cpumask_bits,
-			"/sys/devices/system/node/node%d/cpumap", node);
-	if (error) {
-		eprintk("ihk:collect_node_topology:"
-				"read_bitmap failed. %d\n", error);
-		goto out;
-	}
+	cpumask_copy(&p->cpumap, cpumask_of_node(node));
 
 	error = 0;
-	list_add(&p->chain, &node_topology_list);
+	list_add_rcu(&p->chain, &node_topology_list);
 	p = NULL;
 
 out:
@@ -1668,6 +1901,146 @@ out:
 	return error;
 } /* collect_node_topology() */
 
+/*
+ * Called with topology_lock held when a CPU comes online. Adds the
+ * entry of a CPU not seen before and sets its bit in the masks of the
+ * CPUs and the node it shares a core, package or cache with. Nothing
+ * is cleared when a CPU goes offline because IHK offlines the CPUs it
+ * reserves and the LWK still needs their topology.
+ */
+static int update_cpu_topology(int cpu)
+{
+	int error;
+	int node = cpu_to_node(cpu);
+	struct ihk_cpu_topology *p;
+	struct ihk_cpu_topology *sibling;
+	struct ihk_cache_topology *cache;
+	struct ihk_cache_topology *shared;
+	struct ihk_node_topology *node_topo;
+
+	dprintk("update_cpu_topology(%d)\n", cpu);
+	p = find_cpu_topology(cpu);
+	if (!p) {
+		error = collect_cpu_topology(cpu);
+		if (error) {
+			goto out;
+		}
+		p = find_cpu_topology(cpu);
+	}
+	else {
+		cpumask_or(&p->core_siblings, &p->core_siblings,
+			   topology_core_cpumask(cpu));
+#ifdef topology_sibling_cpumask
+		cpumask_or(&p->thread_siblings, &p->thread_siblings,
+			   topology_sibling_cpumask(cpu));
+#else
+		cpumask_or(&p->thread_siblings, &p->thread_siblings,
+			   topology_thread_cpumask(cpu));
+#endif
+	}
+
+	list_for_each_entry(sibling, &cpu_topology_list, chain) {
+		if (cpumask_test_cpu(sibling->cpu_number, &p->core_siblings)) {
+			cpumask_set_cpu(cpu, &sibling->core_siblings);
+		}
+
+		if (cpumask_test_cpu(sibling->cpu_number,
+				     &p->thread_siblings)) {
+			cpumask_set_cpu(cpu, &sibling->thread_siblings);
+		}
+
+		list_for_each_entry(cache, &p->cache_topology_list, chain) {
+			if (!cpumask_test_cpu(sibling->cpu_number,
+					      &cache->shared_cpu_map)) {
+				continue;
+			}
+
+			shared = find_cache_topology(sibling, cache->index);
+			if (shared) {
+				cpumask_set_cpu(cpu, &shared->shared_cpu_map);
+			}
+		}
+	}
+
+	node_topo = find_node_topology(node);
+	if (!node_topo) {
+		error = collect_node_topology(node);
+		goto out;
+	}
+	cpumask_set_cpu(cpu, &node_topo->cpumap);
+
+	error = 0;
+out:
+	dprintk("update_cpu_topology(%d): %d\n", cpu, error);
+	return error;
+} /* update_cpu_topology() */
+
+static int topology_cpu_online(unsigned int cpu)
+{
+	int error;
+
+	mutex_lock(&topology_lock);
+	error = update_cpu_topology(cpu);
+	mutex_unlock(&topology_lock);
+	if (error) {
+		eprintk("ihk:topology_cpu_online:"
+				"update_cpu_topology(%u) failed. %d\n",
+				cpu, error);
+	}
+
+	/* Don't fail the hotplug operation */
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+static int topology_hp_state;
+#else
+static int topology_cpu_callback(struct notifier_block *nb,
+				 unsigned long action, void *hcpu)
+{
+	if ((action & ~CPU_TASKS_FROZEN) == CPU_ONLINE) {
+		topology_cpu_online((unsigned long)hcpu);
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block topology_cpu_notifier = {
+	.notifier_call = topology_cpu_callback,
+};
+#endif
+
+static int register_topology_hotplug(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	int ret;
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN,
+					"ihk/smp:topology",
+					topology_cpu_online, NULL);
+	if (ret < 0) {
+		return ret;
+	}
+
+	topology_hp_state = ret;
+	return 0;
+#else
+	return register_cpu_notifier(&topology_cpu_notifier);
+#endif
+}
+
+static void unregister_topology_hotplug(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	if (topology_hp_state > 0) {
+		cpuhp_remove_state_nocalls(topology_hp_state);
+		topology_hp_state = 0;
+	}
+#else
+	unregister_cpu_notifier(&topology_cpu_notifier);
+#endif
+}
+
 static int collect_topology(void)
 {
 	int error;
@@ -1675,27 +2048,54 @@ static int collect_topology(void)
 	int node;
 
 	dprintk("collect_topology()\n");
+
+	/*
+	 * Registered first so that no CPU coming online during the scan
+	 * is missed. Entries the callback already added are skipped.
+	 */
+	error = register_topology_hotplug();
+	if (error) {
+		eprintk("ihk:collect_topology:"
+				"register_topology_hotplug failed. %d\n",
+				error);
+		goto out;
+	}
+
+	mutex_lock(&topology_lock);
 	for_each_cpu(cpu, cpu_online_mask) {
+		if (find_cpu_topology(cpu)) {
+			continue;
+		}
+
 		error = collect_cpu_topology(cpu);
 		if (error) {
 			eprintk("ihk:collect_topology:"
 					"collect_cpu_topology failed. %d\n",
 					error);
-			goto out;
+			goto out_unlock;
 		}
 	}
 
 	for_each_online_node(node) {
+		if (find_node_topology(node)) {
+			continue;
+		}
+
 		error = collect_node_topology(node);
 		if (error) {
 			eprintk("ihk:collect_topology:"
 					"collect_node_topology failed. %d\n",
 					error);
-			goto out;
+			goto out_unlock;
 		}
 	}
 
 	error = 0;
+out_unlock:
+	mutex_unlock(&topology_lock);
+	if (error) {
+		unregister_topology_hotplug();
+	}
 out:
 	dprintk("collect_topology(): %d\n", error);
 	return error;
@@ -1754,6 +2154,54 @@ int ihk_smp_reset_cpu(int phys_apicid)
 	return 0;
 }
 
+/*
+ * Reset all CPUs of an OS instance at once. INIT is asserted on every
+ * CPU with the ICR idle check as the per-CPU delivery fence, then the
+ * 10ms settle time is spent only once for the whole set.
+ */
+int ihk_smp_reset_cpus(ihk_os_t ihk_os)
+{
+	int i;
+	int maxlvt;
+	int phys_apicid;
+
+	preempt_disable();
+
+	maxlvt = _lapic_get_maxlvt();
+
+	for (i = 0; i < SMP_MAX_CPUS; ++i) {
+		if (ihk_smp_cpus[i].os != ihk_os)
+			continue;
+
+		phys_apicid = ihk_smp_cpus[i].hw_id;
+		dprintk(KERN_INFO "IHK-SMP: resetting CPU %d.\n", phys_apicid);
+
+		if (APIC_INTEGRATED(apic_version[phys_apicid])) {
+			if (maxlvt > 3) /* Due to the Pentium erratum 3AP. */
+				apic_write(APIC_ESR, 0);
+			apic_read(APIC_ESR);
+		}
+
+		apic_icr_write(APIC_INT_LEVELTRIG | APIC_INT_ASSERT |
+			       APIC_DM_INIT, phys_apicid);
+		safe_apic_wait_icr_idle();
+	}
+
+	mdelay(10);
+
+	for (i = 0; i < SMP_MAX_CPUS; ++i) {
+		if (ihk_smp_cpus[i].os != ihk_os)
+			continue;
+
+		apic_icr_write(APIC_INT_LEVELTRIG | APIC_DM_INIT,
+			       ihk_smp_cpus[i].hw_id);
+		safe_apic_wait_icr_idle();
+	}
+
+	preempt_enable();
+	return 0;
+}
+
 void smp_ihk_arch_exit(void)
 {
 #ifndef IHK_IKC_USE_LINUX_WORK_IRQ
@@ -1797,6 +2245,10 @@ void smp_ihk_arch_exit(void)
 		free_pages((unsigned long)ident_page_table_virt,
 		           ident_npages_order);
 	}
+
+	ihk_smp_free_boot_pts();
+
+	unregister_topology_hotplug();
 }
 
 #ifdef ENABLE_PERF
@@ -1884,6 +2336,9 @@ void ihk_smp_free_page_tables(pgd_t *pt)
 				if (pud_none(*pud) || !pud_present(*pud))
 					continue;
 
+				if (pud_large(*pud))
+					continue;
+
 				for (pmd_i = 0; pmd_i < PTRS_PER_PMD; ++pmd_i) {
 					pmd = ((pmd_t *)pud_page_vaddr(*pud)) + pmd_i;
 
@@ -1922,18 +2377,14 @@ void ihk_smp_free_page_tables(pgd_t *pt)
 	free_page((unsigned long)pt);
 }
 
-int ihk_smp_map_kernel(pgd_t *pt,
-		unsigned long vaddr,
-		phys_addr_t paddr)
+/* Walk down to the PUD entry of vaddr, allocating tables on the way */
+static pud_t *ihk_smp_map_kernel_pud(pgd_t *pt, unsigned long vaddr)
 {
 	pgd_t *pgd;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
 	p4d_t *p4d;
 #endif
 	pud_t *pud;
-	pmd_t *pmd;
-	pte_t *pte;
-	int result = -ENOMEM;
 
 	pgd = pt + pgd_index(vaddr);
 	if (!pgd_present(*pgd)) {
@@ -1962,6 +2413,50 @@ int ihk_smp_map_kernel(pgd_t *pt,
 #else
 	pud = pud_offset(pgd, vaddr);
 #endif
+	return pud;
+err:
+	return NULL;
+}
+
+static int ihk_smp_map_kernel_huge(pgd_t *pt, unsigned long vaddr,
+				   phys_addr_t paddr)
+{
+	pud_t *pud;
+
+	pud = ihk_smp_map_kernel_pud(pt, vaddr);
+	if (!pud)
+		return -ENOMEM;
+
+	if (pud_present(*pud)) {
+		printk("%s: ERROR: mapping 0x%lx: PUD is busy\n",
+			__FUNCTION__, vaddr);
+		return -EBUSY;
+	}
+
+	set_pud(pud, __pud(paddr | (pgprot_val(PAGE_KERNEL_LARGE_EXEC) &
+				    __supported_pte_mask)));
+	return 0;
+}
+
+int ihk_smp_map_kernel(pgd_t *pt,
+		unsigned long vaddr,
+		phys_addr_t paddr)
+{
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	int result = -ENOMEM;
+
+	pud = ihk_smp_map_kernel_pud(pt, vaddr);
+	if (!pud)
+		goto err;
+
+	if (pud_present(*pud) && pud_large(*pud)) {
+		printk("%s: ERROR: mapping 0x%lx: PUD is busy\n",
+			__FUNCTION__, vaddr);
+		return -EBUSY;
+	}
+
 	if (!pud_present(*pud)) {
 		pmd = (pmd_t *)get_zeroed_page(GFP_KERNEL | GFP_DMA32);
 		if (!pmd)
@@ -56,13 +56,17 @@ int smp_ihk_arch_init(void);
 int ihk_smp_arch_symbols_init(void);
 int smp_ihk_os_check_ikc_map(ihk_os_t ihk_os);
 int ihk_smp_reset_cpu(int hw_id);
+int ihk_smp_reset_cpus(ihk_os_t ihk_os);
 void smp_ihk_arch_exit(void);
 int smp_ihk_arch_vmap_area_taken(void);
 int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode);
+int smp_ihk_os_send_multi_intr_mask(ihk_os_t ihk_os, void *priv, int mode,
+				    const unsigned long *lwk_cpus);
 int smp_ihk_os_send_nmi(ihk_os_t ihk_os, void *priv, int mode);
 int smp_ihk_arch_get_perf_event_map(struct smp_boot_param *param);
 
 void ihk_smp_free_page_tables(pgd_t *pt);
+void ihk_smp_put_boot_pt(pgd_t *pt);
 int ihk_smp_map_kernel(pgd_t *pt, unsigned long vaddr, phys_addr_t paddr);
 int ihk_smp_print_pte(struct mm_struct *mm, unsigned long address);
 
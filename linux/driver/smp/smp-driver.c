@@ -27,6 +27,13 @@
 #include <linux/swap.h>
 #include <linux/time.h>
 #include <linux/hugetlb.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+#include <linux/pfn_t.h>
+#endif
 #include <asm/hw_irq.h>
 #include <asm/pgtable.h>
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,32)
@@ -38,6 +45,8 @@
 #include <ihk/ihk_host_misc.h>
 #include <ihk/ihk_host_user.h>
 #include <ihk/ihklib_private.h>
+#include <ihk/ihk_dump_bitmap.h>
+#include <ihk/ihk_dump_exclude.h>
 //#define IHK_DEBUG
 #include <ihk/misc/debug.h>
 #include <ikc/msg.h>
@@ -52,11 +61,6 @@
 #include "smp-arch-driver.h"
 #include "smp-defines-driver.h"
 
-/** Get the index in the map array */
-#define MAP_INDEX(n)    ((n) >> 6)
-/** Get the bit number in a map element */
-#define MAP_BIT(n)      ((n) & 0x3f)
-
 #define IHK_SMP_MEM_ALL	(-1UL)
 
 #define REQ_STR_MAXLEN 1024
@@ -83,6 +87,27 @@ static unsigned int ihk_cores = 0;
 module_param(ihk_cores, uint, 0644);
 MODULE_PARM_DESC(ihk_cores, "IHK reserved CPU cores");
 
+static unsigned int ihk_snapshot = 0;
+module_param(ihk_snapshot, uint, 0444);
+MODULE_PARM_DESC(ihk_snapshot, "Save LWK bootstrap memory at READY and restore it on identical relaunch");
+
+static unsigned int ihk_dump_exclude_ranges = 0;
+module_param(ihk_dump_exclude_ranges, uint, 0444);
+MODULE_PARM_DESC(ihk_dump_exclude_ranges, "Export McKernel memory excluded from Linux dump as a range table in vmcoreinfo instead of marking each page");
+
+static unsigned int ihk_dump_dirty = 0;
+module_param(ihk_dump_dirty, uint, 0644);
+MODULE_PARM_DESC(ihk_dump_dirty, "Track pages written by the LWK for incremental snapshots, taken into account at OS boot");
+
+#define IHK_SMP_MAX_SNAPSHOTS	4
+/* How long boot waits for the LWK to stop at snapshot_end */
+#define IHK_SMP_SNAPSHOT_TIMEOUT_MS	10000
+
+/* Range table handed to makedumpfile, see ihk_dump_exclude.h */
+#define IHK_DUMP_EXCLUDE_ORDER	4
+static struct ihk_dump_exclude_table *ihk_dump_exclude_table;
+static void (*ihk_vmcoreinfo_append_str)(const char *fmt, ...);
+
 //#define BUILTIN_COM_VECTOR	0xf1
 
 #define BUILTIN_DEV_STATUS_READY	0
@@ -96,6 +121,16 @@ unsigned long ident_page_table;
 static struct list_head ihk_mem_free_chunks;
 struct list_head ihk_mem_used_chunks;
 
+/* Chunks of shut down OS instances not yet returned to the free list */
+static LIST_HEAD(ihk_mem_released_chunks);
+static DEFINE_SPINLOCK(ihk_mem_released_lock);
+/* Protects ihk_mem_free_chunks, also taken by the release worker */
+static DEFINE_MUTEX(ihk_mem_free_lock);
+
+/* OS instances, walked by the status doorbell */
+static LIST_HEAD(smp_os_list);
+static DEFINE_SPINLOCK(smp_os_list_lock);
+
 static struct vmap_area *lwk_va;
 static int (*ihk_ioremap_page_range)(unsigned long addr, unsigned long end,
 				     phys_addr_t phys_addr, pgprot_t prot);
@@ -164,6 +199,8 @@ struct chunk {
 
 /* ----------------------------------------------- */
 static unsigned long dump_page_set_addr;
+/* Size of the free range table the LWK reports for dumps, 64 KiB */
+#define IHK_DUMP_FREE_RANGES_MAX 4096
 static unsigned long dump_bootstrap_mem_start;
 
 static int truncate_snprintf(char *str, size_t size,
@@ -490,6 +527,85 @@ static tof_smmu_get_ipa_cq_t tofu_smmu_get_ipa = NULL;
 static tof_smmu_release_ipa_cq_t tofu_smmu_release_ipa = NULL;
 #endif
 
+/* Size of the kernel image area mapped at IHK_SMP_MAP_KERNEL_START */
+#define IHK_SMP_IMAGE_SIZE	(4 * IHK_SMP_LARGE_PAGE)
+
+/*
+ * Pick a place for a copy of the kernel image on each NUMA node other
+ * than the bootstrap one, at the start of its largest chunk. Nodes
+ * without room are left to use the bootstrap copy.
+ */
+static void smp_ihk_os_place_image_replicas(ihk_os_t ihk_os,
+					    struct smp_os_data *os)
+{
+	int linux_numa_id;
+	unsigned long start;
+	struct ihk_os_mem_chunk *os_mem_chunk, *largest;
+
+	memset(os->image_replicas, 0, sizeof(os->image_replicas));
+	if (!os->bootstrap_replicate)
+		return;
+
+	for_each_set_bit(linux_numa_id, &os->numa_mask, BITS_PER_LONG) {
+		if (linux_numa_id == os->bootstrap_numa_id) {
+			os->image_replicas[linux_numa_id] =
+				(os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) &
+				IHK_SMP_LARGE_PAGE_MASK;
+			continue;
+		}
+
+		largest = NULL;
+		list_for_each_entry(os_mem_chunk, &ihk_mem_used_chunks, list) {
+			if (os_mem_chunk->os != ihk_os ||
+			    os_mem_chunk->numa_id != linux_numa_id)
+				continue;
+
+			if (!largest || largest->size < os_mem_chunk->size)
+				largest = os_mem_chunk;
+		}
+
+		if (!largest)
+			continue;
+
+		start = ALIGN(largest->addr, IHK_SMP_LARGE_PAGE);
+		if (start + IHK_SMP_IMAGE_SIZE >=
+		    largest->addr + largest->size) {
+			pr_info("IHK-SMP: no room for kernel image on "
+				"NUMA %d\n", linux_numa_id);
+			continue;
+		}
+
+		os->image_replicas[linux_numa_id] = start;
+		dprintf("IHK-SMP: OS: %p, kernel image replica @ 0x%lx, "
+			"NUMA: %d\n", os, start, linux_numa_id);
+	}
+}
+
+/*
+ * Copy the kernel image to the places picked above. image is the image
+ * as loaded, before the LWK has started to run it.
+ */
+static void smp_ihk_os_copy_image_replicas(struct smp_os_data *os,
+					   const void *image)
+{
+	int linux_numa_id;
+	unsigned long phys = os->image_replicas[os->bootstrap_numa_id];
+
+	if (!os->bootstrap_replicate || !phys || !image)
+		return;
+
+	for_each_set_bit(linux_numa_id, &os->numa_mask, BITS_PER_LONG) {
+		unsigned long replica = os->image_replicas[linux_numa_id];
+
+		if (!replica || replica == phys)
+			continue;
+
+		memcpy(phys_to_virt(replica), image, IHK_SMP_IMAGE_SIZE);
+		smp_ihk_arch_dcache_flush(phys_to_virt(replica),
+					  IHK_SMP_IMAGE_SIZE);
+	}
+}
+
 /** \brief Boot a kernel. */
 static int smp_ihk_os_boot(ihk_os_t ihk_os, void *priv, int flag)
 {
@@ -511,7 +627,8 @@ static int smp_ihk_os_boot(ihk_os_t ihk_os, void *priv, int flag)
 	int lwk_cpu;
 	int *ihk_smp_boot_numa_distance;
 	int i, j;
-	unsigned long buffer_size, map_end, index;
+	unsigned long buffer_size, map_end;
+	unsigned long bitmap_size;
 	struct ihk_dump_page *dump_page;
 	int ret;
 
@@ -580,6 +697,11 @@ static int smp_ihk_os_boot(ihk_os_t ihk_os, void *priv, int flag)
 			 sizeof(struct ihk_dump_page));
 	}
 
+	/* Free range table follows the bitmaps */
+	bitmap_size = buffer_size;
+	buffer_size += IHK_DUMP_FREE_RANGES_MAX *
+		sizeof(struct ihk_dump_free_range);
+
 	param_size += (nr_memory_chunks *
 			sizeof(struct ihk_smp_boot_param_memory_chunk));
 
@@ -600,6 +722,8 @@ static int smp_ihk_os_boot(ihk_os_t ihk_os, void *priv, int flag)
 	}
 
 	os->param = pfn_to_kaddr(page_to_pfn(param_pages));
+	os->param_status = 0;
+	os->panic_notified = 0;
 	os->param->param_size = param_size;
 	os->param_pages_order = param_pages_order;
 	printk("IHK-SMP: boot param size: %d, nr_pages: %lu\n",
@@ -646,6 +770,8 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 
 	bp_numa_node = (struct ihk_smp_boot_param_numa_node *)bp_cpu;
 
+	smp_ihk_os_place_image_replicas(ihk_os, os);
+
 	/* Fill in NUMA nodes information */
 	numa_id = 0;
 	for (linux_numa_id = find_first_bit(&os->numa_mask,
@@ -656,6 +782,7 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 
 		bp_numa_node->type = IHK_SMP_MEMORY_TYPE_DRAM;
 		bp_numa_node->linux_numa_id = linux_numa_id;
+		bp_numa_node->image_replica = os->image_replicas[linux_numa_id];
 
 		dprintf("IHK-SMP: OS: %p, NUMA: %d => Linux NUMA: %d\n",
 				os, numa_id, linux_numa_id);
@@ -698,6 +825,15 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 
 			bp_mem_chunk->start = os_mem_chunk->addr;
 			bp_mem_chunk->end = os_mem_chunk->addr + os_mem_chunk->size;
+
+			/* Keep the LWK away from a kernel image replica */
+			if (linux_numa_id != os->bootstrap_numa_id &&
+			    os->image_replicas[linux_numa_id] >= bp_mem_chunk->start &&
+			    os->image_replicas[linux_numa_id] < bp_mem_chunk->end) {
+				bp_mem_chunk->start =
+					os->image_replicas[linux_numa_id] +
+					IHK_SMP_IMAGE_SIZE;
+			}
 			bp_mem_chunk->numa_id =
 				linux_numa_2_lwk_numa(os, os_mem_chunk->numa_id);
 
@@ -776,6 +912,37 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 	os->param->msg_buffer_size = sizeof(struct ihk_kmsg_buf); /* Note that it's used for map_fixed_area */
 	dprintk("%s: msg_buffer=%lx,size=%ld\n", __FUNCTION__, os->param->msg_buffer, os->param->msg_buffer_size);
 
+	if (os->image_from_snapshot) {
+		ret = smp_ihk_snapshot_restore(ihk_os, os);
+		if (ret) {
+			goto revert_os_status;
+		}
+	}
+
+	/* Replicas of a restored image have been copied by the restore */
+	if (!os->param->snapshot_restored &&
+	    os->image_replicas[os->bootstrap_numa_id]) {
+		smp_ihk_os_copy_image_replicas(os,
+			phys_to_virt(os->image_replicas[os->bootstrap_numa_id]));
+	}
+
+	/* Taken by the checkpoint op once the LWK waits at snapshot_end */
+	if (ihk_snapshot && os->image_fn && !os->param->snapshot_restored) {
+		os->param->snapshot_state = SMP_SNAPSHOT_REQUESTED;
+
+		vfree(os->pristine_image);
+		os->pristine_image = NULL;
+		if (os->bootstrap_replicate &&
+		    os->image_replicas[os->bootstrap_numa_id]) {
+			os->pristine_image = vmalloc(IHK_SMP_IMAGE_SIZE);
+			if (os->pristine_image) {
+				memcpy(os->pristine_image,
+				       phys_to_virt(os->image_replicas[os->bootstrap_numa_id]),
+				       IHK_SMP_IMAGE_SIZE);
+			}
+		}
+	}
+
 	os->param->ns_per_tsc = calc_ns_per_tsc();
 	getnstimeofday(&now);
 	os->param->boot_tsc = rdtsc();
@@ -814,6 +981,11 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 		os->param->dump_page_set.page_size = dump_size;
 		os->param->dump_page_set.phy_page = __pa(dump_page);
 
+		os->param->dump_free_ranges = __pa((char *)dump_page +
+						   bitmap_size);
+		os->param->dump_free_max = IHK_DUMP_FREE_RANGES_MAX;
+		os->param->dump_free_nr = 0;
+
 		/* Perform initial setting of dump_page information */
 		/* Turn on the BIT of the physical memory allocation range. */
 		if (nr_memory_chunks) {
@@ -822,6 +994,9 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 			list_for_each_entry(os_mem_chunk, &ihk_mem_used_chunks, list) {
 				const size_t csize = os_mem_chunk->size;
 
+				if (os_mem_chunk->os != ihk_os)
+					continue;
+
 				if (i) {
 					dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 				}
@@ -833,20 +1008,51 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 				map_end = ((csize + PAGE_SIZE - 1) >>
 					   PAGE_SHIFT);
 
-				for (index = 0; index < map_end; index++) {
-					if(MAP_INDEX(index) >= dump_page->map_count) {
-						printk("%s:used chunk is out of range(max:%ld): %ld\n", __FUNCTION__, dump_page->map_count, MAP_INDEX(index));
-						break;
-					}
-					dump_page->map[MAP_INDEX(index)] |= (1UL << MAP_BIT(index));
-				}
+				ihk_dump_bitmap_set_range(dump_page->map, 0,
+							  map_end);
 
 				i++;
 			}
 		}
+
+		/*
+		 * Dirty page bitmaps are a separate allocation so that they
+		 * don't grow the dump buffer when snapshots aren't used.
+		 * Everything is dirty for the first snapshot.
+		 */
+		os->param->dirty_page_set.count = 0;
+		os->param->dirty_page_set.phy_page = 0;
+		os->dirty_pages = NULL;
+		if (ihk_dump_dirty && nr_memory_chunks) {
+			os->dirty_pages_order = 0;
+			while (((size_t)PAGE_SIZE << os->dirty_pages_order) <
+			       bitmap_size)
+				++os->dirty_pages_order;
+
+			os->dirty_pages = alloc_pages(GFP_KERNEL,
+						      os->dirty_pages_order);
+			if (os->dirty_pages) {
+				void *dirty_page =
+					pfn_to_kaddr(page_to_pfn(os->dirty_pages));
+
+				dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
+				memcpy(dirty_page, dump_page, bitmap_size);
+				os->param->dirty_page_set.count = nr_memory_chunks;
+				os->param->dirty_page_set.page_size = bitmap_size;
+				os->param->dirty_page_set.phy_page =
+					__pa(dirty_page);
+			} else {
+				pr_warn("IHK-SMP: warning: allocating dirty page bitmaps (size:%ld), incremental snapshots disabled\n",
+					bitmap_size);
+			}
+		}
 	} else {
 		os->param->dump_page_set.count = 0;
 		os->param->dump_page_set.page_size = 0;
+		os->param->dump_free_ranges = 0;
+		os->param->dump_free_max = 0;
+		os->param->dirty_page_set.count = 0;
+		os->param->dirty_page_set.phy_page = 0;
 		dprintf("IHK-SMP: error: allocating dump_page_set(size:%ld)\n",buffer_size);
 	}
 
@@ -956,101 +1162,35 @@ static int smp_ihk_os_vtop(ihk_os_t ihk_os,
 	return 0;
 }
 
-static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
+/* Load the PT_LOAD segments of an ELF image into the bootstrap chunk */
+static int __smp_ihk_os_load_elf(ihk_os_t ihk_os, struct smp_os_data *os,
+				 const char *fn, unsigned long *entryp)
 {
 	int ret;
-	struct smp_os_data *os = priv;
 	struct file *file = NULL;
 	loff_t pos = 0;
 	long r;
 	unsigned long phys;
 	unsigned long offset;
 	unsigned long maxoffset;
-	unsigned long flags;
 	Elf64_Ehdr *elf64 = NULL;
 	Elf64_Phdr *elf64p;
 	int i;
 	unsigned long entry;
-	struct ihk_os_mem_chunk *os_mem_chunk_iter;
-	struct ihk_os_mem_chunk *os_mem_chunk = NULL;
-	os->bootstrap_mem_start = 0;
-	os->bootstrap_mem_end = 0;
-
-	/* Update bootstrap_numa_id with the lowest NUMA id if not set */
-	/* TODO: add IHK API to set bootstrap_numa_id */
-	if (os->bootstrap_numa_id == -1) {
-		int min_numa_id = -1;
-
-		list_for_each_entry(os_mem_chunk_iter, &ihk_mem_used_chunks, list) {
-			if (min_numa_id != -1 &&
-					min_numa_id <= os_mem_chunk_iter->numa_id) {
-				continue;
-			}
-
-			min_numa_id = os_mem_chunk_iter->numa_id;
-		}
-
-		os->bootstrap_numa_id = min_numa_id;
-	}
-
-	/* Find the bootstrap memory chunk for image and page table */
-	list_for_each_entry(os_mem_chunk_iter, &ihk_mem_used_chunks, list) {
-		if (os_mem_chunk_iter->os != ihk_os ||
-				os_mem_chunk_iter->numa_id != os->bootstrap_numa_id) {
-			continue;
-		}
-
-		/* Find the largest memory chunk on the bootstrap NUMA node */
-		if ((os->bootstrap_mem_end - os->bootstrap_mem_start) <
-				os_mem_chunk_iter->size) {
-			os_mem_chunk = os_mem_chunk_iter;
-			os->bootstrap_mem_start = os_mem_chunk->addr;
-			os->bootstrap_mem_end = os_mem_chunk->addr + os_mem_chunk->size;
-		}
-	}
-
-	if (os_mem_chunk == NULL) {
-		printk("%s: couldn't find NUMA node to load kernel image\n",
-				__FUNCTION__);
-		ret = -EINVAL;
-		goto out;
-	}
-
-	printk("IHK-SMP: bootstrap addr: 0x%lx, chunk size: %lu @ NUMA: %d\n",
-			os->bootstrap_mem_start,
-			os->bootstrap_mem_end - os->bootstrap_mem_start,
-			os->bootstrap_numa_id);
-
-	if (!CORE_ISSET_ANY(&os->cpu_hw_ids_map) ||
-			os->bootstrap_mem_end < os->bootstrap_mem_start) {
-		printk("%s: OS is not ready to boot\n", __FUNCTION__);
-		ret = -EINVAL;
-		goto out;
-	}
-
-	spin_lock_irqsave(&os->lock, flags);
-	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
-		printk("builtin: OS status is not initial.\n");
-		spin_unlock_irqrestore(&os->lock, flags);
-		ret = -EBUSY;
-		goto out;
-
-	}
-	os->status = BUILTIN_OS_STATUS_LOADING;
-	spin_unlock_irqrestore(&os->lock, flags);
 
 	file = filp_open(fn, O_RDONLY, 0);
 	if (IS_ERR(file)) {
 		printk("open failed: %s\n", fn);
+		file = NULL;
 		ret = -ENOENT;
-		goto revert_state;
+		goto out;
 	}
 
 	elf64 = ihk_smp_map_virtual(os->bootstrap_mem_end - PAGE_SIZE, PAGE_SIZE);
 	if (!elf64) {
 		printk("error: ioremap() returns NULL\n");
 		ret = -EINVAL;
-		goto revert_state;
+		goto out;
 	}
 
 	printk("IHK-SMP: loading ELF header for OS 0x%lx, phys=0x%lx\n",
@@ -1064,7 +1204,7 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 	if (r <= 0) {
 		pr_err("kernel_read failed: %ld\n", r);
 		ret = r;
-		goto revert_state;
+		goto out;
 	}
 	if(elf64->e_ident[0] != 0x7f ||
 	   elf64->e_ident[1] != 'E' ||
@@ -1073,7 +1213,7 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 	   elf64->e_phoff + sizeof(Elf64_Phdr) * elf64->e_phnum > PAGE_SIZE){
 		printk("kernel: BAD ELF\n");
 		ret = -EINVAL;
-		goto revert_state;
+		goto out;
 	}
 	entry = elf64->e_entry;
 	elf64p = (Elf64_Phdr *)(((char *)elf64) + elf64->e_phoff);
@@ -1109,13 +1249,13 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 			if (offset + PAGE_SIZE > os->bootstrap_mem_end) {
 				printk("builtin: OS is too big to load.\n");
 				ret = -E2BIG;
-				goto revert_state;
+				goto out;
 			}
 
 			buf = ihk_smp_map_virtual(offset, PAGE_SIZE);
 			if (!buf) {
 				ret = -EFAULT;
-				goto revert_state;
+				goto out;
 			}
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
 			r = kernel_read(file, buf, l, &pos);
@@ -1130,7 +1270,7 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 			if (r <= 0) {
 				pr_err("kernel_read failed: %ld\n", r);
 				ret = (int)r;
-				goto revert_state;
+				goto out;
 			}
 			offset += PAGE_SIZE;
 		}
@@ -1141,7 +1281,7 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 			if (offset + PAGE_SIZE > os->bootstrap_mem_end) {
 				printk("builtin: OS is too big to load.\n");
 				ret = -E2BIG;
-				goto revert_state;
+				goto out;
 			}
 
 			buf = ihk_smp_map_virtual(offset, PAGE_SIZE);
@@ -1154,130 +1294,592 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 			maxoffset = offset;
 	}
 
-
-	if ((ret = smp_ihk_os_map_lwk(phys))) {
-		pr_info("%s: WARNING: smp_ihk_os_map_lwk failed: %d\n",
-			__func__, ret);
-	}
-
-	if ((ret = smp_ihk_os_setup_startup(os, phys, entry))) {
-		printk("%s: ERROR: smp_ihk_os_setup_startup failed (%d)\n", __FUNCTION__, ret);
-		goto revert_state;
-	}
-
-	dump_bootstrap_mem_start = os->bootstrap_mem_start;
+	*entryp = entry;
 	ret = 0;
 
- revert_state:
+ out:
 	if (elf64) {
 		ihk_smp_unmap_virtual(elf64);
 	}
 	if (file) {
 		fput(file);
 	}
-	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
- out:
 	return ret;
 }
 
-static int smp_ihk_os_load_mem(ihk_os_t ihk_os, void *priv, const char *buf,
-                               unsigned long size, long offset)
-{
-	struct smp_os_data *os = priv;
-	unsigned long phys, to_read, flags;
-	void *virt;
-
-	dprint_func_enter;
-
-	/* We just load from the lowest address of the private memory */
-	if (!CORE_ISSET_ANY(&os->cpu_hw_ids_map) || os->mem_end < os->mem_start) {
-		printk("builtin: OS is not ready to boot.\n");
-		return -EINVAL;
-	}
-	if (os->mem_start + size > os->mem_end) {
-		printk("builtin: OS is too big to load.\n");
-		return -E2BIG;
-	}
-
-	spin_lock_irqsave(&os->lock, flags);
-	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
-		printk("builtin: OS status is not initial.\n");
-		spin_unlock_irqrestore(&os->lock, flags);
-		return -EBUSY;
-	}
-	os->status = BUILTIN_OS_STATUS_LOADING;
-	spin_unlock_irqrestore(&os->lock, flags);
-
-	offset += os->mem_start;
-	phys = (offset & PAGE_MASK);
-	offset -= phys;
-
-	for (; size > 0; ) {
-		virt = ihk_smp_map_virtual(phys, PAGE_SIZE);
-		if (!virt) {
-			dprintf("builtin: Failed to map %lx\n", phys);
+/*
+ * Snapshot of an LWK instance taken while its boot CPU waits at
+ * param->snapshot_end, before IKC is set up. The image covers the
+ * bootstrap chunk from its start up to that end. An instance
+ * relaunched with the same image file, bootstrap chunk, resources,
+ * kernel arguments, boot parameter and kmsg buffer addresses gets the
+ * image restored and skips ELF loading and early LWK init.
+ */
+struct ihk_smp_snapshot {
+	struct list_head list;
+	char *image_fn;
+	struct ihk_smp_image_id image_id;
+	unsigned long entry;
+	/* Per-boot addresses the image refers to */
+	unsigned long param_phys;
+	unsigned long msg_buffer;
+	unsigned long bootstrap_mem_start;
+	unsigned long bootstrap_mem_end;
+	void *image;
+	unsigned long image_size;
+	/* Image as loaded, for the replicas, NULL if not replicated */
+	void *pristine_image;
+	/* Copy of the boot parameters, including the resource description */
+	struct smp_boot_param *param;
+	int param_size;
+};
 
-			set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+static LIST_HEAD(ihk_smp_snapshots);
+static DEFINE_MUTEX(ihk_smp_snapshots_lock);
+static int ihk_smp_nr_snapshots;
 
-			return -ENOMEM;
-		}
-		if ((offset & (PAGE_SIZE - 1)) + size > PAGE_SIZE) {
-			to_read = PAGE_SIZE - (offset & (PAGE_SIZE - 1));
-		} else {
-			to_read = size;
-		}
-		dprintf("memcpy(%p[%lx], buf + %lx, %lx)\n",
-		        virt, phys, offset, to_read);
-		memcpy(virt, buf + offset, to_read);
+static void smp_ihk_snapshot_free(struct ihk_smp_snapshot *snap)
+{
+	vfree(snap->image);
+	vfree(snap->pristine_image);
+	kfree(snap->param);
+	kfree(snap->image_fn);
+	kfree(snap);
+}
 
-		/* Offset is only non-aligned at the first copy */
-		offset += to_read;
-		size -= to_read;
-		ihk_smp_unmap_virtual(virt);
+/* Identify the image file so that a rebuilt one doesn't match a snapshot */
+static int smp_ihk_os_stat_image(struct smp_os_data *os, const char *fn)
+{
+	struct file *file;
+	struct inode *inode;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct timespec64 mtime;
+#endif
 
-		phys += PAGE_SIZE;
+	file = filp_open(fn, O_RDONLY, 0);
+	if (IS_ERR(file)) {
+		printk("open failed: %s\n", fn);
+		return -ENOENT;
 	}
 
-	os->boot_rip = os->mem_start;
-
-	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+	inode = file_inode(file);
+	os->image_id.dev = inode->i_sb->s_dev;
+	os->image_id.ino = inode->i_ino;
+	os->image_id.size = i_size_read(inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	mtime = inode_get_mtime(inode);
+	os->image_id.mtime_sec = mtime.tv_sec;
+	os->image_id.mtime_nsec = mtime.tv_nsec;
+#else
+	os->image_id.mtime_sec = inode->i_mtime.tv_sec;
+	os->image_id.mtime_nsec = inode->i_mtime.tv_nsec;
+#endif
+	fput(file);
 
 	return 0;
 }
 
-static void add_free_mem_chunk(struct chunk *chunk)
+static int smp_ihk_image_id_equal(struct ihk_smp_image_id *a,
+				  struct ihk_smp_image_id *b)
 {
-	struct chunk *chunk_iter;
-	int added = 0;
-
-	list_for_each_entry(chunk_iter, &ihk_mem_free_chunks, chain) {
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime_sec == b->mtime_sec &&
+		a->mtime_nsec == b->mtime_nsec;
+}
 
-		if (chunk_iter->addr > chunk->addr) {
+/* Called with ihk_smp_snapshots_lock held */
+static struct ihk_smp_snapshot *__smp_ihk_snapshot_find(struct smp_os_data *os)
+{
+	struct ihk_smp_snapshot *snap;
 
-			/* Add in front of this chunk */
-			list_add_tail(&chunk->chain, &chunk_iter->chain);
+	if (!os->image_fn)
+		return NULL;
 
-			added = 1;
-			break;
+	list_for_each_entry(snap, &ihk_smp_snapshots, list) {
+		if (snap->bootstrap_mem_start == os->bootstrap_mem_start &&
+		    snap->bootstrap_mem_end == os->bootstrap_mem_end &&
+		    smp_ihk_image_id_equal(&snap->image_id, &os->image_id) &&
+		    !strcmp(snap->image_fn, os->image_fn)) {
+			return snap;
 		}
 	}
 
-	/* All chunks start on lower memory or list was empty */
-	if (!added) {
-		list_add_tail(&chunk->chain, &ihk_mem_free_chunks);
-	}
-
-	dprintf("IHK-SMP: free mem chunk 0x%lx - 0x%lx added\n",
-	        chunk->addr, chunk->addr + chunk->size);
+	return NULL;
 }
 
-static void merge_mem_chunks(struct list_head *chunks)
+/* Check for a snapshot of the image at load time */
+static int smp_ihk_snapshot_lookup(struct smp_os_data *os,
+				   unsigned long *entry)
 {
-	struct chunk *mem_chunk;
-	struct chunk *mem_chunk_next;
+	struct ihk_smp_snapshot *snap;
+	int found = 0;
 
-rerun:
-	list_for_each_entry_safe(mem_chunk, mem_chunk_next, chunks, chain) {
+	if (!ihk_snapshot)
+		return 0;
+
+	mutex_lock(&ihk_smp_snapshots_lock);
+	snap = __smp_ihk_snapshot_find(os);
+	if (snap) {
+		*entry = snap->entry;
+		found = 1;
+	}
+	mutex_unlock(&ihk_smp_snapshots_lock);
+
+	return found;
+}
+
+/*
+ * Restore the image at boot time. Falls back to loading the ELF image
+ * if the snapshot has been dropped or the resource set or the per-boot
+ * addresses differ. os->param must be filled in except for the
+ * snapshot fields.
+ */
+static int smp_ihk_snapshot_restore(ihk_os_t ihk_os, struct smp_os_data *os)
+{
+	struct ihk_smp_snapshot *snap;
+	unsigned long entry;
+	int ret;
+
+	mutex_lock(&ihk_smp_snapshots_lock);
+	snap = __smp_ihk_snapshot_find(os);
+	if (snap &&
+	    (!os->bootstrap_replicate || snap->pristine_image) &&
+	    snap->param_phys == __pa(os->param) &&
+	    snap->msg_buffer == os->param->msg_buffer &&
+	    snap->param_size == os->param->param_size &&
+	    !strcmp(snap->param->kernel_args, os->param->kernel_args) &&
+	    !memcmp(snap->param + 1, os->param + 1,
+		    os->param->param_size - sizeof(*os->param))) {
+		memcpy(phys_to_virt(snap->bootstrap_mem_start), snap->image,
+		       snap->image_size);
+		smp_ihk_arch_dcache_flush(phys_to_virt(snap->bootstrap_mem_start),
+					  snap->image_size);
+		smp_ihk_os_copy_image_replicas(os, snap->pristine_image);
+		os->param->snapshot_restored = 1;
+		mutex_unlock(&ihk_smp_snapshots_lock);
+
+		printk("IHK-SMP: restored %lu bytes of bootstrap memory "
+		       "from snapshot\n", snap->image_size);
+		return 0;
+	}
+	mutex_unlock(&ihk_smp_snapshots_lock);
+
+	printk("IHK-SMP: snapshot doesn't match, loading %s\n", os->image_fn);
+	ret = __smp_ihk_os_load_elf(ihk_os, os, os->image_fn, &entry);
+	if (ret) {
+		return ret;
+	}
+
+	/* Startup code has been set up with the entry of the snapshot */
+	if (entry != os->image_entry) {
+		pr_err("%s: error: entry of %s has changed\n",
+		       __func__, os->image_fn);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int smp_ihk_os_snapshot_waited(struct smp_os_data *os)
+{
+	return READ_ONCE(os->param->snapshot_state) != SMP_SNAPSHOT_REQUESTED ||
+		READ_ONCE(os->param->status) >= 2;
+}
+
+/*
+ * Save the bootstrap memory and the boot parameters of a booting
+ * kernel. Called right after boot, the boot CPU of the LWK waits at
+ * snapshot_end until the state is set to SMP_SNAPSHOT_TAKEN.
+ */
+static int smp_ihk_os_checkpoint(ihk_os_t ihk_os, void *priv)
+{
+	struct smp_os_data *os = priv;
+	struct ihk_smp_snapshot *snap = NULL, *old;
+	unsigned long end;
+	unsigned long deadline;
+	int ret;
+
+	if (!os->param ||
+	    READ_ONCE(os->param->snapshot_state) != SMP_SNAPSHOT_REQUESTED)
+		return 0;
+
+	/* Woken up by the status doorbell, re-check every 10ms otherwise */
+	deadline = jiffies + msecs_to_jiffies(IHK_SMP_SNAPSHOT_TIMEOUT_MS);
+	while (!smp_ihk_os_snapshot_waited(os) &&
+	       time_before(jiffies, deadline)) {
+		wait_event_timeout(os->status_wq,
+				   smp_ihk_os_snapshot_waited(os),
+				   msecs_to_jiffies(10));
+	}
+
+	/* The LWK went on without waiting, or never got there */
+	if (cmpxchg(&os->param->snapshot_state, SMP_SNAPSHOT_REQUESTED,
+		    SMP_SNAPSHOT_NONE) == SMP_SNAPSHOT_REQUESTED) {
+		dprintk("%s: LWK doesn't support snapshots\n", __func__);
+		return -EOPNOTSUPP;
+	}
+
+	/* The LWK reports how much of the bootstrap chunk it has used */
+	end = os->param->snapshot_end;
+	if (end <= os->bootstrap_mem_start || end > os->bootstrap_mem_end) {
+		pr_err("%s: error: snapshot end 0x%lx out of bootstrap memory\n",
+		       __func__, end);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* IKC queues are per boot, they can't be part of the image */
+	if (os->param->mikc_queue_recv || os->param->mikc_queue_send) {
+		pr_err("%s: error: IKC set up before snapshot end\n",
+		       __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	snap->image_fn = kstrdup(os->image_fn, GFP_KERNEL);
+	snap->image_size = end - os->bootstrap_mem_start;
+	snap->image = vmalloc(snap->image_size);
+	snap->param_size = os->param->param_size;
+	snap->param = kmalloc(snap->param_size, GFP_KERNEL);
+	if (!snap->image_fn || !snap->image || !snap->param) {
+		pr_err("%s: error: allocating snapshot of %lu bytes\n",
+		       __func__, snap->image_size);
+		smp_ihk_snapshot_free(snap);
+		snap = NULL;
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	snap->image_id = os->image_id;
+	snap->pristine_image = os->pristine_image;
+	os->pristine_image = NULL;
+	snap->param_phys = __pa(os->param);
+	snap->msg_buffer = os->param->msg_buffer;
+	snap->entry = os->image_entry;
+	snap->bootstrap_mem_start = os->bootstrap_mem_start;
+	snap->bootstrap_mem_end = os->bootstrap_mem_end;
+	memcpy(snap->image, phys_to_virt(os->bootstrap_mem_start),
+	       snap->image_size);
+	memcpy(snap->param, os->param, snap->param_size);
+	ret = 0;
+
+ out:
+	/* Let the LWK go on */
+	smp_wmb();
+	WRITE_ONCE(os->param->snapshot_state, SMP_SNAPSHOT_TAKEN);
+	if (!snap)
+		return ret;
+
+	mutex_lock(&ihk_smp_snapshots_lock);
+	old = __smp_ihk_snapshot_find(os);
+	if (old) {
+		list_del(&old->list);
+		--ihk_smp_nr_snapshots;
+		smp_ihk_snapshot_free(old);
+	}
+
+	/* Drop the oldest one */
+	if (ihk_smp_nr_snapshots >= IHK_SMP_MAX_SNAPSHOTS) {
+		old = list_first_entry(&ihk_smp_snapshots,
+				       struct ihk_smp_snapshot, list);
+		list_del(&old->list);
+		--ihk_smp_nr_snapshots;
+		smp_ihk_snapshot_free(old);
+	}
+
+	list_add_tail(&snap->list, &ihk_smp_snapshots);
+	++ihk_smp_nr_snapshots;
+	mutex_unlock(&ihk_smp_snapshots_lock);
+
+	printk("IHK-SMP: saved snapshot of %s, %lu bytes\n",
+	       snap->image_fn, snap->image_size);
+	return 0;
+}
+
+static void smp_ihk_snapshot_free_all(void)
+{
+	struct ihk_smp_snapshot *snap, *next;
+
+	mutex_lock(&ihk_smp_snapshots_lock);
+	list_for_each_entry_safe(snap, next, &ihk_smp_snapshots, list) {
+		list_del(&snap->list);
+		smp_ihk_snapshot_free(snap);
+	}
+	ihk_smp_nr_snapshots = 0;
+	mutex_unlock(&ihk_smp_snapshots_lock);
+}
+
+static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
+{
+	int ret;
+	struct smp_os_data *os = priv;
+	unsigned long phys;
+	unsigned long flags;
+	unsigned long entry;
+	struct ihk_os_mem_chunk *os_mem_chunk_iter;
+	struct ihk_os_mem_chunk *os_mem_chunk = NULL;
+	os->bootstrap_mem_start = 0;
+	os->bootstrap_mem_end = 0;
+
+	/* IHK_OS_SET_BOOTSTRAP takes precedence over the kernel arguments */
+	if (os->bootstrap_api_set) {
+		os->bootstrap_numa_req = os->bootstrap_api.numa_id;
+		os->bootstrap_chunk_req = os->bootstrap_api.chunk_addr;
+		os->bootstrap_replicate = os->bootstrap_api.replicate;
+	}
+	else {
+		os->bootstrap_numa_req = os->kargs_bootstrap_numa;
+		os->bootstrap_chunk_req = 0;
+		os->bootstrap_replicate = os->kargs_bootstrap_replicate;
+	}
+
+	/*
+	 * Default to the NUMA node of the boot CPU so that kernel text
+	 * fetches and early allocations stay local, fall back to the
+	 * lowest NUMA id with memory if that node has none
+	 */
+	os->bootstrap_numa_id = os->bootstrap_numa_req;
+	if (os->bootstrap_numa_id == -1 && os->nr_cpus > 0) {
+		int boot_node = cpu_to_node(os->cpu_mapping[0]);
+
+		list_for_each_entry(os_mem_chunk_iter, &ihk_mem_used_chunks, list) {
+			if (os_mem_chunk_iter->os == ihk_os &&
+					os_mem_chunk_iter->numa_id == boot_node) {
+				os->bootstrap_numa_id = boot_node;
+				break;
+			}
+		}
+	}
+
+	if (os->bootstrap_numa_id == -1) {
+		int min_numa_id = -1;
+
+		list_for_each_entry(os_mem_chunk_iter, &ihk_mem_used_chunks, list) {
+			if (os_mem_chunk_iter->os != ihk_os)
+				continue;
+
+			if (min_numa_id != -1 &&
+					min_numa_id <= os_mem_chunk_iter->numa_id) {
+				continue;
+			}
+
+			min_numa_id = os_mem_chunk_iter->numa_id;
+		}
+
+		os->bootstrap_numa_id = min_numa_id;
+	}
+
+	/* Find the bootstrap memory chunk for image and page table */
+	list_for_each_entry(os_mem_chunk_iter, &ihk_mem_used_chunks, list) {
+		if (os_mem_chunk_iter->os != ihk_os ||
+				os_mem_chunk_iter->numa_id != os->bootstrap_numa_id) {
+			continue;
+		}
+
+		/* Use the designated chunk if any */
+		if (os->bootstrap_chunk_req) {
+			if (os_mem_chunk_iter->addr != os->bootstrap_chunk_req)
+				continue;
+
+			os_mem_chunk = os_mem_chunk_iter;
+			os->bootstrap_mem_start = os_mem_chunk->addr;
+			os->bootstrap_mem_end = os_mem_chunk->addr + os_mem_chunk->size;
+			break;
+		}
+
+		/* Find the largest memory chunk on the bootstrap NUMA node */
+		if ((os->bootstrap_mem_end - os->bootstrap_mem_start) <
+				os_mem_chunk_iter->size) {
+			os_mem_chunk = os_mem_chunk_iter;
+			os->bootstrap_mem_start = os_mem_chunk->addr;
+			os->bootstrap_mem_end = os_mem_chunk->addr + os_mem_chunk->size;
+		}
+	}
+
+	if (os_mem_chunk == NULL) {
+		printk("%s: couldn't find NUMA node to load kernel image\n",
+				__FUNCTION__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	printk("IHK-SMP: bootstrap addr: 0x%lx, chunk size: %lu @ NUMA: %d\n",
+			os->bootstrap_mem_start,
+			os->bootstrap_mem_end - os->bootstrap_mem_start,
+			os->bootstrap_numa_id);
+
+	if (!CORE_ISSET_ANY(&os->cpu_hw_ids_map) ||
+			os->bootstrap_mem_end < os->bootstrap_mem_start) {
+		printk("%s: OS is not ready to boot\n", __FUNCTION__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	spin_lock_irqsave(&os->lock, flags);
+	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
+		printk("builtin: OS status is not initial.\n");
+		spin_unlock_irqrestore(&os->lock, flags);
+		ret = -EBUSY;
+		goto out;
+
+	}
+	os->status = BUILTIN_OS_STATUS_LOADING;
+	spin_unlock_irqrestore(&os->lock, flags);
+
+	kfree(os->image_fn);
+	os->image_fn = kstrdup(fn, GFP_KERNEL);
+	if (!os->image_fn) {
+		ret = -ENOMEM;
+		goto revert_state;
+	}
+
+	ret = smp_ihk_os_stat_image(os, fn);
+	if (ret) {
+		goto revert_state;
+	}
+
+	phys = (os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) & IHK_SMP_LARGE_PAGE_MASK;
+
+	/*
+	 * If the same image was checkpointed at READY on this bootstrap
+	 * chunk, the image is restored at boot time instead
+	 */
+	os->image_from_snapshot = smp_ihk_snapshot_lookup(os, &entry);
+	if (os->image_from_snapshot) {
+		printk("IHK-SMP: %s: found snapshot, skipping ELF load\n",
+		       fn);
+	}
+	else {
+		ret = __smp_ihk_os_load_elf(ihk_os, os, fn, &entry);
+		if (ret) {
+			goto revert_state;
+		}
+	}
+	os->image_entry = entry;
+
+	if ((ret = smp_ihk_os_map_lwk(phys))) {
+		pr_info("%s: WARNING: smp_ihk_os_map_lwk failed: %d\n",
+			__func__, ret);
+	}
+
+	if ((ret = smp_ihk_os_setup_startup(os, phys, entry))) {
+		printk("%s: ERROR: smp_ihk_os_setup_startup failed (%d)\n", __FUNCTION__, ret);
+		goto revert_state;
+	}
+
+	dump_bootstrap_mem_start = os->bootstrap_mem_start;
+	ret = 0;
+
+ revert_state:
+	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+ out:
+	return ret;
+}
+
+static int smp_ihk_os_load_mem(ihk_os_t ihk_os, void *priv, const char *buf,
+                               unsigned long size, long offset)
+{
+	struct smp_os_data *os = priv;
+	unsigned long phys, to_read, flags;
+	void *virt;
+
+	dprint_func_enter;
+
+	/* We just load from the lowest address of the private memory */
+	if (!CORE_ISSET_ANY(&os->cpu_hw_ids_map) || os->mem_end < os->mem_start) {
+		printk("builtin: OS is not ready to boot.\n");
+		return -EINVAL;
+	}
+	if (os->mem_start + size > os->mem_end) {
+		printk("builtin: OS is too big to load.\n");
+		return -E2BIG;
+	}
+
+	spin_lock_irqsave(&os->lock, flags);
+	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
+		printk("builtin: OS status is not initial.\n");
+		spin_unlock_irqrestore(&os->lock, flags);
+		return -EBUSY;
+	}
+	os->status = BUILTIN_OS_STATUS_LOADING;
+	spin_unlock_irqrestore(&os->lock, flags);
+
+	offset += os->mem_start;
+	phys = (offset & PAGE_MASK);
+	offset -= phys;
+
+	for (; size > 0; ) {
+		virt = ihk_smp_map_virtual(phys, PAGE_SIZE);
+		if (!virt) {
+			dprintf("builtin: Failed to map %lx\n", phys);
+
+			set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+
+			return -ENOMEM;
+		}
+		if ((offset & (PAGE_SIZE - 1)) + size > PAGE_SIZE) {
+			to_read = PAGE_SIZE - (offset & (PAGE_SIZE - 1));
+		} else {
+			to_read = size;
+		}
+		dprintf("memcpy(%p[%lx], buf + %lx, %lx)\n",
+		        virt, phys, offset, to_read);
+		memcpy(virt, buf + offset, to_read);
+
+		/* Offset is only non-aligned at the first copy */
+		offset += to_read;
+		size -= to_read;
+		ihk_smp_unmap_virtual(virt);
+
+		phys += PAGE_SIZE;
+	}
+
+	os->boot_rip = os->mem_start;
+
+	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+
+	return 0;
+}
+
+static void add_free_mem_chunk(struct chunk *chunk)
+{
+	struct chunk *chunk_iter;
+	int added = 0;
+
+	list_for_each_entry(chunk_iter, &ihk_mem_free_chunks, chain) {
+
+		if (chunk_iter->addr > chunk->addr) {
+
+			/* Add in front of this chunk */
+			list_add_tail(&chunk->chain, &chunk_iter->chain);
+
+			added = 1;
+			break;
+		}
+	}
+
+	/* All chunks start on lower memory or list was empty */
+	if (!added) {
+		list_add_tail(&chunk->chain, &ihk_mem_free_chunks);
+	}
+
+	dprintf("IHK-SMP: free mem chunk 0x%lx - 0x%lx added\n",
+	        chunk->addr, chunk->addr + chunk->size);
+}
+
+static void merge_mem_chunks(struct list_head *chunks)
+{
+	struct chunk *mem_chunk;
+	struct chunk *mem_chunk_next;
+
+rerun:
+	list_for_each_entry_safe(mem_chunk, mem_chunk_next, chunks, chain) {
 
 		if (mem_chunk != mem_chunk_next &&
 		    mem_chunk_next->addr == mem_chunk->addr + mem_chunk->size &&
@@ -1339,6 +1941,323 @@ static int smp_ihk_os_unmap_lwk(void)
 	return 0;
 }
 
+/*
+ * Return chunks of shut down OS instances to the free list. This is
+ * done in the background so that shutdown doesn't wait for it; users
+ * of the free list take it with smp_ihk_mem_lock_free(), which waits
+ * for the chunks released so far.
+ */
+static void smp_ihk_mem_release_work_fn(struct work_struct *work)
+{
+	LIST_HEAD(chunks);
+	unsigned long flags;
+	struct ihk_os_mem_chunk *os_mem_chunk = NULL;
+	struct ihk_os_mem_chunk *next_chunk = NULL;
+	struct chunk *mem_chunk;
+
+	spin_lock_irqsave(&ihk_mem_released_lock, flags);
+	list_splice_init(&ihk_mem_released_chunks, &chunks);
+	spin_unlock_irqrestore(&ihk_mem_released_lock, flags);
+
+	list_for_each_entry_safe(os_mem_chunk, next_chunk, &chunks, list) {
+		list_del(&os_mem_chunk->list);
+		mem_chunk = (struct chunk*)phys_to_virt(os_mem_chunk->addr);
+		mem_chunk->addr = os_mem_chunk->addr;
+		mem_chunk->size = os_mem_chunk->size;
+		mem_chunk->numa_id = os_mem_chunk->numa_id;
+		INIT_LIST_HEAD(&mem_chunk->chain);
+
+		dprintk("IHK-SMP: mem chunk: 0x%lx - 0x%lx (len: %lu) freed\n",
+				mem_chunk->addr, mem_chunk->addr + mem_chunk->size,
+				mem_chunk->size);
+
+#ifdef ENABLE_TOFU
+		{
+			int tni, cq;
+			for (tni = 0; tni < 6; ++tni) {
+				for (cq = 0; cq < 11; ++cq) {
+
+					if (!os_mem_chunk->tofu_dma_addr[tni][cq])
+						continue;
+
+					tofu_smmu_release_ipa(tni, cq,
+						os_mem_chunk->tofu_dma_addr[tni][cq],
+						os_mem_chunk->size);
+#ifdef ENABLE_FUGAKU_HACKS
+					if (0)
+#endif
+					dprintf("%s: chunk 0x%lx:%lu TNI %d, CQ %d,"
+							" DMA addr: 0x%lx released\n",
+							__func__,
+							os_mem_chunk->addr,
+							os_mem_chunk->size,
+							tni, cq,
+							(unsigned long)os_mem_chunk->tofu_dma_addr[tni][cq]);
+				}
+			}
+		}
+#endif
+
+		mutex_lock(&ihk_mem_free_lock);
+		add_free_mem_chunk(mem_chunk);
+		mutex_unlock(&ihk_mem_free_lock);
+
+		kfree(os_mem_chunk);
+	}
+}
+
+static DECLARE_WORK(smp_ihk_mem_release_work, smp_ihk_mem_release_work_fn);
+
+static void smp_ihk_mem_lock_free(void)
+{
+	flush_work(&smp_ihk_mem_release_work);
+	mutex_lock(&ihk_mem_free_lock);
+}
+
+static void smp_ihk_mem_unlock_free(void)
+{
+	mutex_unlock(&ihk_mem_free_lock);
+}
+
+/*
+ * Read-only mappings of the memory of an OS instance on /dev/mcosN,
+ * used for dumping. The file offset is the physical address. Pages
+ * are inserted at fault time so that returning the memory can revoke
+ * the mappings: the generation is bumped and the mappings zapped under
+ * mmap_lock, faults of an older generation get SIGBUS.
+ */
+struct smp_os_mmap_data {
+	/* One per VMA, open and close may run from different mms */
+	atomic_t count;
+	struct smp_os_data *os;
+	unsigned long gen;
+};
+
+#if (!defined(RHEL_RELEASE_CODE) && LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)) || \
+	(defined(RHEL_RELEASE_CODE) && RHEL_RELEASE_CODE < RHEL_RELEASE_VERSION(8, 0))
+typedef int vm_fault_t;
+
+static vm_fault_t vmf_insert_pfn(struct vm_area_struct *vma,
+				 unsigned long addr, unsigned long pfn)
+{
+	int err = vm_insert_pfn(vma, addr, pfn);
+
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (err < 0 && err != -EBUSY)
+		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+#endif
+
+/* PMD / PUD mappings need the vm_fault based helpers of 5.2 - 6.5 */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && !defined(RHEL_RELEASE_CODE) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+#define IHK_SMP_MMAP_HUGE
+#endif
+
+static inline unsigned long smp_ihk_os_mmap_phys(struct vm_area_struct *vma,
+						 unsigned long addr)
+{
+	return (vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start);
+}
+
+static vm_fault_t smp_ihk_os_mmap_fault_pte(struct vm_area_struct *vma,
+					    unsigned long addr)
+{
+	struct smp_os_mmap_data *md = vma->vm_private_data;
+	struct smp_os_data *os = md->os;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+
+	addr &= PAGE_MASK;
+
+	down_read(&os->mmap_lock);
+	if (md->gen == os->mmap_gen) {
+		ret = vmf_insert_pfn(vma, addr,
+				smp_ihk_os_mmap_phys(vma, addr) >> PAGE_SHIFT);
+	}
+	up_read(&os->mmap_lock);
+
+	return ret;
+}
+
+#if (!defined(RHEL_RELEASE_CODE) && LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)) || \
+	(defined(RHEL_RELEASE_CODE) && RHEL_RELEASE_CODE < RHEL_RELEASE_VERSION(8, 0))
+static int smp_ihk_os_mmap_fault(struct vm_area_struct *vma,
+				 struct vm_fault *vmf)
+{
+	return smp_ihk_os_mmap_fault_pte(vma,
+			(unsigned long)vmf->virtual_address);
+}
+#else
+static vm_fault_t smp_ihk_os_mmap_fault(struct vm_fault *vmf)
+{
+	return smp_ihk_os_mmap_fault_pte(vmf->vma, vmf->address);
+}
+#endif
+
+#ifdef IHK_SMP_MMAP_HUGE
+static vm_fault_t smp_ihk_os_mmap_huge_fault(struct vm_fault *vmf,
+					     enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct smp_os_mmap_data *md = vma->vm_private_data;
+	struct smp_os_data *os = md->os;
+	unsigned long size, addr, phys;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	pfn_t pfn;
+
+	switch (pe_size) {
+	case PE_SIZE_PTE:
+		return smp_ihk_os_mmap_fault_pte(vma, vmf->address);
+	case PE_SIZE_PMD:
+		size = PMD_SIZE;
+		break;
+#ifdef CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD
+	case PE_SIZE_PUD:
+		size = PUD_SIZE;
+		break;
+#endif
+	default:
+		return VM_FAULT_FALLBACK;
+	}
+
+	/* Both the virtual and the physical range need to be aligned */
+	addr = vmf->address & ~(size - 1);
+	if (addr < vma->vm_start || addr + size > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	phys = smp_ihk_os_mmap_phys(vma, addr);
+	if (phys & (size - 1))
+		return VM_FAULT_FALLBACK;
+
+	pfn = __pfn_to_pfn_t(phys >> PAGE_SHIFT, PFN_DEV);
+
+	down_read(&os->mmap_lock);
+	if (md->gen == os->mmap_gen) {
+#ifdef CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD
+		if (size == PUD_SIZE)
+			ret = vmf_insert_pfn_pud(vmf, pfn, false);
+		else
+#endif
+			ret = vmf_insert_pfn_pmd(vmf, pfn, false);
+	}
+	up_read(&os->mmap_lock);
+
+	return ret;
+}
+#endif
+
+static void smp_ihk_os_mmap_open(struct vm_area_struct *vma)
+{
+	struct smp_os_mmap_data *md = vma->vm_private_data;
+
+	atomic_inc(&md->count);
+}
+
+static void smp_ihk_os_mmap_close(struct vm_area_struct *vma)
+{
+	struct smp_os_mmap_data *md = vma->vm_private_data;
+
+	if (!atomic_dec_and_test(&md->count)) {
+		return;
+	}
+
+	kfree(md);
+}
+
+static struct vm_operations_struct smp_ihk_os_mmap_ops = {
+	.open = smp_ihk_os_mmap_open,
+	.close = smp_ihk_os_mmap_close,
+	.fault = smp_ihk_os_mmap_fault,
+#ifdef IHK_SMP_MMAP_HUGE
+	.huge_fault = smp_ihk_os_mmap_huge_fault,
+#endif
+};
+
+static int smp_ihk_os_mmap(ihk_os_t ihk_os, void *priv, void *file,
+			   void *_vma)
+{
+	struct smp_os_data *os = priv;
+	struct vm_area_struct *vma = _vma;
+	struct ihk_os_mem_chunk *os_mem_chunk;
+	struct smp_os_mmap_data *md;
+	unsigned long start, end;
+	int found = 0;
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+
+	start = vma->vm_pgoff << PAGE_SHIFT;
+	end = start + (vma->vm_end - vma->vm_start);
+
+	md = kzalloc(sizeof(*md), GFP_KERNEL);
+	if (!md) {
+		return -ENOMEM;
+	}
+
+	/* The whole range needs to be in one chunk of this OS */
+	down_read(&os->mmap_lock);
+	list_for_each_entry(os_mem_chunk, &ihk_mem_used_chunks, list) {
+		if (os_mem_chunk->os != ihk_os)
+			continue;
+
+		if (start >= os_mem_chunk->addr &&
+		    end <= os_mem_chunk->addr + os_mem_chunk->size) {
+			found = 1;
+			break;
+		}
+	}
+	md->gen = os->mmap_gen;
+	up_read(&os->mmap_lock);
+
+	if (!found) {
+		dprintf("%s: 0x%lx - 0x%lx isn't memory of this OS\n",
+			__func__, start, end);
+		kfree(md);
+		return -EACCES;
+	}
+
+	os->mmap_mapping = ((struct file *)file)->f_mapping;
+	md->os = os;
+	atomic_set(&md->count, 1);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+	vm_flags_clear(vma, VM_MAYWRITE);
+#ifdef IHK_SMP_MMAP_HUGE
+	vm_flags_set(vma, VM_HUGEPAGE);
+#endif
+#else
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_flags &= ~VM_MAYWRITE;
+#ifdef IHK_SMP_MMAP_HUGE
+	vma->vm_flags |= VM_HUGEPAGE;
+#endif
+#endif
+	vma->vm_private_data = md;
+	vma->vm_ops = &smp_ihk_os_mmap_ops;
+
+	smp_ihk_os_mmap_open(vma);
+
+	return 0;
+}
+
+/*
+ * Invalidate the mappings of the OS device file. The caller holds
+ * mmap_lock for writing until the memory is off ihk_mem_used_chunks.
+ */
+static void smp_ihk_os_revoke_mmap(struct smp_os_data *os)
+{
+	os->mmap_gen++;
+
+	if (os->mmap_mapping) {
+		unmap_mapping_range(os->mmap_mapping, 0, 0, 1);
+	}
+}
+
 static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 {
 	struct smp_os_data *os = priv;
@@ -1346,7 +2265,7 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 	int i, ret = 0;
 	struct ihk_os_mem_chunk *os_mem_chunk = NULL;
 	struct ihk_os_mem_chunk *next_chunk = NULL;
-	struct chunk *mem_chunk;
+	unsigned long flags;
 
 	switch (os->status) {
 	case BUILTIN_OS_STATUS_INITIAL:
@@ -1367,12 +2286,13 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 	}
 	set_os_status(os, BUILTIN_OS_STATUS_SHUTDOWN);
 
-	/* Reset CPU cores used by this OS */
+	/* Reset CPU cores used by this OS all at once */
+	ret = ihk_smp_reset_cpus(ihk_os);
+
 	for (i = 0; i < SMP_MAX_CPUS; ++i) {
 		if (ihk_smp_cpus[i].os != ihk_os)
 			continue;
 
-		ret = ihk_smp_reset_cpu(ihk_smp_cpus[i].hw_id);
 		ihk_smp_cpus[i].status = IHK_SMP_CPU_AVAILABLE;
 		ihk_smp_cpus[i].os = (ihk_os_t)0;
 
@@ -1385,13 +2305,17 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 		printk("%s: ERROR: smp_ihk_os_unmap_lwk failed (%d)\n", __FUNCTION__, ret);
 	}
 
-	/* Free bootstrap page tables */
+	/* Drop bootstrap page tables, they may be kept for reuse */
 	if (os->boot_pt) {
-		ihk_smp_free_page_tables(os->boot_pt);
+		ihk_smp_put_boot_pt(os->boot_pt);
 		os->boot_pt = NULL;
 	}
 
-	/* Drop memory chunk used by this OS */
+	/* Hand memory chunks used by this OS to the release worker */
+	down_write(&os->mmap_lock);
+	smp_ihk_os_revoke_mmap(os);
+
+	spin_lock_irqsave(&ihk_mem_released_lock, flags);
 	list_for_each_entry_safe(os_mem_chunk, next_chunk,
 			&ihk_mem_used_chunks, list) {
 
@@ -1399,59 +2323,43 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 			continue;
 		}
 
-		list_del(&os_mem_chunk->list);
-		mem_chunk = (struct chunk*)phys_to_virt(os_mem_chunk->addr);
-		mem_chunk->addr = os_mem_chunk->addr;
-		mem_chunk->size = os_mem_chunk->size;
-		mem_chunk->numa_id = os_mem_chunk->numa_id;
-		INIT_LIST_HEAD(&mem_chunk->chain);
-
-		dprintk("IHK-SMP: mem chunk: 0x%lx - 0x%lx (len: %lu) freed\n",
-				mem_chunk->addr, mem_chunk->addr + mem_chunk->size,
-				mem_chunk->size);
-
-#ifdef ENABLE_TOFU
-		{
-			int tni, cq;
-			for (tni = 0; tni < 6; ++tni) {
-				for (cq = 0; cq < 11; ++cq) {
-
-					if (!os_mem_chunk->tofu_dma_addr[tni][cq])
-						continue;
-
-					tofu_smmu_release_ipa(tni, cq,
-						os_mem_chunk->tofu_dma_addr[tni][cq],
-						os_mem_chunk->size);
-#ifdef ENABLE_FUGAKU_HACKS
-					if (0)
-#endif
-					dprintf("%s: chunk 0x%lx:%lu TNI %d, CQ %d,"
-							" DMA addr: 0x%lx released\n",
-							__func__,
-							os_mem_chunk->addr,
-							os_mem_chunk->size,
-							tni, cq,
-							(unsigned long)os_mem_chunk->tofu_dma_addr[tni][cq]);
-				}
-			}
-		}
-#endif
-
-		add_free_mem_chunk(mem_chunk);
-
-		kfree(os_mem_chunk);
+		list_move_tail(&os_mem_chunk->list, &ihk_mem_released_chunks);
 	}
+	spin_unlock_irqrestore(&ihk_mem_released_lock, flags);
+	up_write(&os->mmap_lock);
+	schedule_work(&smp_ihk_mem_release_work);
 
 	if (os->numa_mapping) {
 		kfree(os->numa_mapping);
 		os->numa_mapping = NULL;
 	}
 
+	vfree(os->pristine_image);
+	os->pristine_image = NULL;
+
+	/* Snapshot queries walk param->dirty_page_set */
+	mutex_lock(&os->snapshot_lock);
 	if (os->param) {
-		free_pages((unsigned long)os->param, os->param_pages_order);
+		struct smp_boot_param *param = os->param;
+
+		/* Detach from the status doorbell */
+		spin_lock_irqsave(&smp_os_list_lock, flags);
 		os->param = NULL;
+		spin_unlock_irqrestore(&smp_os_list_lock, flags);
+		wake_up_all(&os->status_wq);
+
+		free_pages((unsigned long)param, os->param_pages_order);
+	}
+
+	if (os->dirty_pages) {
+		__free_pages(os->dirty_pages, os->dirty_pages_order);
+		os->dirty_pages = NULL;
 	}
 
+	vfree(os->snapshot_map);
+	os->snapshot_map = NULL;
+	mutex_unlock(&os->snapshot_lock);
+
 	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
 	set_dev_status(dev, BUILTIN_DEV_STATUS_READY);
 
@@ -1528,6 +2436,7 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 		os_mem_chunk->addr = 0;
 		INIT_LIST_HEAD(&os_mem_chunk->list);
 
+		smp_ihk_mem_lock_free();
 		list_for_each_entry(mem_chunk_iter, &ihk_mem_free_chunks,
 		                    chain) {
 			if (mem_chunk_iter->size >= resource->mem_size) {
@@ -1543,6 +2452,7 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 		}
 
 		if (!os_mem_chunk->addr) {
+			smp_ihk_mem_unlock_free();
 			printk("IHK-SMP: error: not enough memory\n");
 			ret = -ENOMEM;
 			goto error_drop_cores;
@@ -1564,6 +2474,7 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 
 			add_free_mem_chunk(mem_chunk_leftover);
 		}
+		smp_ihk_mem_unlock_free();
 
 		os->mem_start = resource->mem_start;
 		os->mem_end = os->mem_start + resource->mem_size;
@@ -1606,6 +2517,39 @@ static int smp_ihk_os_get_num_numa_nodes(ihk_os_t ihk_os, void *priv)
 	return os->mem_info.n_numa_nodes;
 }
 
+/*
+ * Pick up bootstrap_numa=<node> and bootstrap_replicate from the kernel
+ * arguments. They are passed to the LWK as well, which ignores them.
+ * Each call starts over, options absent from the new arguments are off.
+ */
+static void smp_ihk_os_parse_bootstrap_kargs(struct smp_os_data *os)
+{
+	char *opt;
+	int numa_id;
+
+	os->kargs_bootstrap_numa = -1;
+	os->kargs_bootstrap_replicate = 0;
+
+	opt = strstr(os->kernel_args, "bootstrap_numa=");
+	if (opt && (opt == os->kernel_args || *(opt - 1) == ' ')) {
+		if (sscanf(opt + strlen("bootstrap_numa="), "%d",
+			   &numa_id) == 1 &&
+		    numa_id >= 0 && numa_id < BITS_PER_LONG &&
+		    node_online(numa_id)) {
+			os->kargs_bootstrap_numa = numa_id;
+		}
+		else {
+			pr_warn("IHK-SMP: warning: ignoring invalid "
+				"bootstrap_numa argument\n");
+		}
+	}
+
+	opt = strstr(os->kernel_args, "bootstrap_replicate");
+	if (opt && (opt == os->kernel_args || *(opt - 1) == ' ')) {
+		os->kargs_bootstrap_replicate = 1;
+	}
+}
+
 static int smp_ihk_os_set_kargs(ihk_os_t ihk_os, void *priv, char *buf)
 {
 	unsigned long flags;
@@ -1617,15 +2561,50 @@ static int smp_ihk_os_set_kargs(ihk_os_t ihk_os, void *priv, char *buf)
 		spin_unlock_irqrestore(&os->lock, flags);
 		return -EBUSY;
 	}
-	os->status = BUILTIN_OS_STATUS_LOADING;
+	os->status = BUILTIN_OS_STATUS_LOADING;
+	spin_unlock_irqrestore(&os->lock, flags);
+
+	strncpy(os->kernel_args, buf, sizeof(os->kernel_args) - 1);
+	os->kernel_args[sizeof(os->kernel_args) - 1] = '\0';
+	dprintk("%s,kernel_args=%s\n", __FUNCTION__, os->kernel_args);
+
+	smp_ihk_os_parse_bootstrap_kargs(os);
+
+	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+
+	return 0;
+}
+
+static int smp_ihk_os_set_bootstrap(ihk_os_t ihk_os, void *priv,
+				    unsigned long arg)
+{
+	unsigned long flags;
+	struct smp_os_data *os = priv;
+	struct ihk_bootstrap_req req;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+		return -EFAULT;
+	}
+
+	if (req.numa_id < -1 || req.numa_id >= BITS_PER_LONG ||
+	    (req.numa_id != -1 && !node_online(req.numa_id)) ||
+	    (req.chunk_addr && req.numa_id == -1)) {
+		pr_err("IHK-SMP: error: invalid bootstrap NUMA node %d "
+		       "or chunk 0x%lx\n", req.numa_id, req.chunk_addr);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&os->lock, flags);
+	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
+		printk("builtin: OS status is not initial.\n");
+		spin_unlock_irqrestore(&os->lock, flags);
+		return -EBUSY;
+	}
+	/* Setting the defaults gives control back to the kernel arguments */
+	os->bootstrap_api = req;
+	os->bootstrap_api_set = (req.numa_id != -1 || req.replicate);
 	spin_unlock_irqrestore(&os->lock, flags);
 
-	strncpy(os->kernel_args, buf, sizeof(os->kernel_args) - 1);
-	os->kernel_args[sizeof(os->kernel_args) - 1] = '\0';
-	dprintk("%s,kernel_args=%s\n", __FUNCTION__, os->kernel_args);
-
-	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
-
 	return 0;
 }
 
@@ -1678,26 +2657,343 @@ int ihk_smp_set_nmi_mode(ihk_os_t ihk_os, void *priv, int mode)
 	return 0;
 }
 
+int ihk_smp_get_nmi_mode(ihk_os_t ihk_os, void *priv, int *mode)
+{
+	unsigned long rpa;
+	unsigned long size;
+	int *nmi_mode;
+	unsigned long pa;
+	unsigned long psize;
+
+	if (smp_ihk_os_get_special_addr(ihk_os, priv, IHK_SPADDR_NMI_MODE,
+					&rpa, &size)) {
+		return -EINVAL;
+	}
+
+	psize = PAGE_SIZE;
+	pa = smp_ihk_os_map_memory(ihk_os, priv, rpa, psize);
+	nmi_mode = smp_ihk_map_virtual(ihk_os, priv, pa, psize,
+					  NULL, 0);
+	*mode = *nmi_mode;
+	smp_ihk_unmap_virtual(ihk_os, priv, nmi_mode, psize);
+	smp_ihk_unmap_memory(ihk_os, priv, pa, psize);
+
+	return 0;
+}
+
+/* param->status seen by the waiters once shutdown has detached param */
+#define SMP_PARAM_STATUS_DETACHED (~0UL)
+
+/*
+ * Shutdown detaches param under smp_os_list_lock before it frees it,
+ * so waiters other than the shutdown thread read it under the lock
+ */
+static unsigned long smp_ihk_os_read_param_status(struct smp_os_data *os)
+{
+	unsigned long flags;
+	unsigned long param_status = SMP_PARAM_STATUS_DETACHED;
+
+	spin_lock_irqsave(&smp_os_list_lock, flags);
+	if (os->param)
+		param_status = READ_ONCE(os->param->status);
+	spin_unlock_irqrestore(&smp_os_list_lock, flags);
+
+	return param_status;
+}
+
+static int smp_ihk_os_param_status_changed(struct smp_os_data *os,
+					   unsigned long param_status,
+					   unsigned long doorbell_count)
+{
+	return smp_ihk_os_read_param_status(os) != param_status ||
+		READ_ONCE(os->doorbell_count) != doorbell_count;
+}
+
 static int smp_ihk_os_wait_for_status(ihk_os_t ihk_os, void *priv,
                                       enum ihk_os_status status,
                                       int sleepable, int timeout)
 {
+	struct smp_os_data *os = priv;
 	enum ihk_os_status s;
-	if (sleepable) {
-		/* TODO: Enable notification of status change, and wait */
-		return -1;
-	} else {
-		/* Polling */
-		while ((s = smp_ihk_os_query_status(ihk_os, priv)),
-		       s != status && s < IHK_OS_STATUS_SHUTDOWN
-		       && timeout > 0) {
+	unsigned long param_status;
+	unsigned long doorbell_count;
+	unsigned long deadline = jiffies + msecs_to_jiffies(timeout * 100);
+
+	while ((s = smp_ihk_os_query_status(ihk_os, priv)),
+	       s != status && s < IHK_OS_STATUS_SHUTDOWN
+	       && timeout > 0) {
+		if (sleepable) {
+			/*
+			 * Woken up by the status doorbell, e.g. by the
+			 * last CPU to freeze. Still re-check every 100ms
+			 * for the transitions the LWK doesn't ring for.
+			 */
+			if (time_after_eq(jiffies, deadline))
+				break;
+
+			param_status = smp_ihk_os_read_param_status(os);
+			doorbell_count = READ_ONCE(os->doorbell_count);
+			wait_event_timeout(os->status_wq,
+					   smp_ihk_os_param_status_changed(os,
+						param_status, doorbell_count),
+					   min_t(unsigned long,
+						 msecs_to_jiffies(100),
+						 deadline - jiffies));
+		} else {
+			/* Polling */
 			mdelay(100);
-			dprintk("%s: waiting for: %d, status: %d\n",
-				__FUNCTION__, status, s);
 			timeout--;
 		}
-		return s == status ? 0 : -1;
+		dprintk("%s: waiting for: %d, status: %d\n",
+			__FUNCTION__, status, s);
+	}
+	return s == status ? 0 : -1;
+}
+
+/*
+ * All CPUs asked to freeze have acknowledged it. Returns 0 if no freeze
+ * was requested through the monitor page.
+ */
+int smp_ihk_os_freeze_acked(struct ihk_os_monitor *monitor)
+{
+	int i;
+	int requested = 0;
+
+	for (i = 0; i < IHK_OS_MONITOR_CPU_WORDS; i++) {
+		unsigned long req = READ_ONCE(monitor->freeze_req[i]);
+
+		if ((READ_ONCE(monitor->freeze_ack[i]) & req) != req)
+			return 0;
+
+		requested |= !!req;
+	}
+
+	return requested;
+}
+
+/*
+ * Clear the free ranges reported by the LWK from the dump bitmaps.
+ * The table is consumed so that it is applied once per dump.
+ */
+static void smp_ihk_os_dump_exclude_free(struct smp_os_data *os)
+{
+	struct ihk_dump_free_range *ranges;
+	struct ihk_dump_page *dump_page;
+	unsigned int nr, i, j;
+	unsigned long chunk_end, start, end;
+
+	nr = xchg(&os->param->dump_free_nr, 0);
+	if (!nr || !os->param->dump_free_ranges)
+		return;
+
+	if (os->param->dump_level == DUMP_LEVEL_ALL)
+		return;
+
+	nr = min(nr, os->param->dump_free_max);
+	ranges = phys_to_virt(os->param->dump_free_ranges);
+	dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
+
+	for (i = 0; i < os->param->dump_page_set.count; i++) {
+		if (i) {
+			dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
+		}
+
+		chunk_end = dump_page->start +
+			((dump_page->map_count * BITS_PER_LONG) << PAGE_SHIFT);
+
+		for (j = 0; j < nr; j++) {
+			/* Only whole pages can be left out */
+			start = max(PAGE_ALIGN(ranges[j].start),
+				    dump_page->start);
+			end = min(ranges[j].end & PAGE_MASK, chunk_end);
+			if (start >= end)
+				continue;
+
+			ihk_dump_bitmap_clear_range(dump_page->map,
+					(start - dump_page->start) >> PAGE_SHIFT,
+					(end - start) >> PAGE_SHIFT);
+		}
+	}
+
+	dprintk("%s: excluded %u free ranges\n", __func__, nr);
+}
+
+/*
+ * Incremental snapshot. The LWK sets bits in param->dirty_page_set for
+ * the pages it writes to. A query moves them to snapshot_map with
+ * atomic exchanges, so that a page written again while the host copies
+ * it is reported by the next query. The functions below are called
+ * with snapshot_lock held.
+ */
+#define for_each_snapshot_map(os, dirty_page, map, i)			\
+	for (i = 0, dirty_page = phys_to_virt((os)->param->dirty_page_set.phy_page), \
+	     map = (os)->snapshot_map;					\
+	     i < (os)->param->dirty_page_set.count;			\
+	     i++, map += dirty_page->map_count,				\
+	     dirty_page = (struct ihk_dump_page *)((char *)dirty_page +	\
+		((dirty_page->map_count * sizeof(unsigned long)) +	\
+		 sizeof(struct ihk_dump_page))))
+
+static int smp_ihk_os_snapshot_harvest(struct smp_os_data *os)
+{
+	struct ihk_dump_page *dirty_page;
+	unsigned long *map;
+	unsigned long j;
+	int i;
+
+	if (!os->param || !os->param->dirty_page_set.phy_page)
+		return -EINVAL;
+
+	if (!os->snapshot_map) {
+		os->snapshot_map = vzalloc(os->param->dirty_page_set.page_size);
+		if (!os->snapshot_map)
+			return -ENOMEM;
+	}
+
+	for_each_snapshot_map(os, dirty_page, map, i) {
+		for (j = 0; j < dirty_page->map_count; j++) {
+			map[j] |= xchg(&dirty_page->map[j], 0UL);
+		}
+	}
+
+	return 0;
+}
+
+static unsigned long smp_ihk_os_snapshot_nr_runs(struct smp_os_data *os)
+{
+	struct ihk_dump_page *dirty_page;
+	unsigned long *map;
+	unsigned long nr = 0;
+	int i;
+
+	for_each_snapshot_map(os, dirty_page, map, i) {
+		nr += ihk_dump_bitmap_nr_runs(map,
+				dirty_page->map_count * BITS_PER_LONG);
+	}
+
+	return nr;
+}
+
+/* Put back ranges which couldn't be reported */
+static void smp_ihk_os_snapshot_restore(struct smp_os_data *os,
+					dump_mem_chunks_t *mem_chunks)
+{
+	struct ihk_dump_page *dirty_page;
+	unsigned long *map;
+	int i, j;
+
+	for_each_snapshot_map(os, dirty_page, map, i) {
+		for (j = 0; j < mem_chunks->nr_chunks; j++) {
+			unsigned long addr = mem_chunks->chunks[j].addr;
+
+			if (addr < dirty_page->start ||
+			    addr >= dirty_page->start +
+			    ((dirty_page->map_count * BITS_PER_LONG) <<
+			     PAGE_SHIFT))
+				continue;
+
+			ihk_dump_bitmap_set_range(map,
+				(addr - dirty_page->start) >> PAGE_SHIFT,
+				mem_chunks->chunks[j].size >> PAGE_SHIFT);
+		}
+	}
+}
+
+/* Size of the dump_mem_chunks_t describing the pages to copy */
+long smp_ihk_os_snapshot_num_areas(struct smp_os_data *os)
+{
+	long ret;
+
+	mutex_lock(&os->snapshot_lock);
+	ret = smp_ihk_os_snapshot_harvest(os);
+	if (!ret) {
+		ret = sizeof(dump_mem_chunks_t) +
+			sizeof(struct dump_mem_chunk) *
+			smp_ihk_os_snapshot_nr_runs(os);
+	}
+	mutex_unlock(&os->snapshot_lock);
+
+	return ret;
+}
+
+/*
+ * Report the pages written since the previous call as ranges, as many
+ * as fit in args->size bytes. Ranges that don't fit are kept for the
+ * next call.
+ */
+int smp_ihk_os_snapshot_areas(struct smp_os_data *os, dumpargs_t *args)
+{
+	struct ihk_dump_page *dirty_page;
+	dump_mem_chunks_t *mem_chunks = NULL;
+	unsigned long *map;
+	unsigned long nbits, pos, run_start, run_len;
+	long mem_size;
+	int i, index = 0;
+	int ret;
+
+	if (args->size < (long)sizeof(dump_mem_chunks_t))
+		return -EINVAL;
+
+	mutex_lock(&os->snapshot_lock);
+	ret = smp_ihk_os_snapshot_harvest(os);
+	if (ret)
+		goto out;
+
+	mem_size = min(args->size, (long)(sizeof(dump_mem_chunks_t) +
+			sizeof(struct dump_mem_chunk) *
+			smp_ihk_os_snapshot_nr_runs(os)));
+	mem_chunks = kzalloc(mem_size, GFP_KERNEL);
+	if (!mem_chunks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for_each_snapshot_map(os, dirty_page, map, i) {
+		nbits = dirty_page->map_count * BITS_PER_LONG;
+		pos = 0;
+		while (mem_size >= sizeof(dump_mem_chunks_t) +
+		       (sizeof(struct dump_mem_chunk) * (index + 1)) &&
+		       ihk_dump_bitmap_next_run(map, nbits, &pos, 1,
+						&run_start, &run_len)) {
+			mem_chunks->chunks[index].addr = dirty_page->start +
+				(run_start << PAGE_SHIFT);
+			mem_chunks->chunks[index].size = run_len << PAGE_SHIFT;
+			ihk_dump_bitmap_clear_range(map, run_start, run_len);
+			index++;
+		}
+	}
+
+	mem_chunks->nr_chunks = index;
+	/* See load_file() for the calculation below */
+	mem_chunks->kernel_base =
+		(os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) &
+		IHK_SMP_LARGE_PAGE_MASK;
+
+	if (copy_to_user(args->buf, mem_chunks, mem_size)) {
+		smp_ihk_os_snapshot_restore(os, mem_chunks);
+		ret = -EFAULT;
+		goto out;
 	}
+
+	ret = 0;
+ out:
+	mutex_unlock(&os->snapshot_lock);
+	kfree(mem_chunks);
+	return ret;
+}
+
+void smp_ihk_os_wait_for_dump_completion(struct smp_os_data *os)
+{
+	/* Woken up by the status doorbell, re-check every 10ms otherwise */
+	while (READ_ONCE(os->param->dump_page_set.completion_flag) !=
+	       IHK_DUMP_PAGE_SET_COMPLETED) {
+		wait_event_timeout(os->status_wq,
+				   READ_ONCE(os->param->dump_page_set.completion_flag) ==
+				   IHK_DUMP_PAGE_SET_COMPLETED,
+				   msecs_to_jiffies(10));
+	}
+
+	smp_ihk_os_dump_exclude_free(os);
 }
 
 static int smp_ihk_os_get_special_addr(ihk_os_t ihk_os, void *priv,
@@ -1787,6 +3083,97 @@ static long smp_ihk_os_debug_request(ihk_os_t ihk_os, void *priv,
 
 static LIST_HEAD(builtin_interrupt_handlers);
 
+/*
+ * The LWK raises the IKC IRQ after it writes param->status.
+ * Wake up status waiters and signal the status change eventfd.
+ */
+static int smp_ihk_os_status_doorbell(void)
+{
+	struct smp_os_data *os;
+	unsigned long flags;
+	unsigned long param_status;
+	int changed = 0;
+
+	spin_lock_irqsave(&smp_os_list_lock, flags);
+	list_for_each_entry(os, &smp_os_list, list) {
+		if (!os->param)
+			continue;
+
+		/* Waiters re-evaluate their conditions, e.g. dump completion */
+		os->doorbell_count++;
+		if (waitqueue_active(&os->status_wq))
+			wake_up_all(&os->status_wq);
+
+		/* The LWK rings once it has saved its last words */
+		if (!os->panic_notified &&
+		    READ_ONCE(os->param->panic_info.valid)) {
+			dprintk("%s: OS: 0x%lx, panic on CPU %d\n", __func__,
+				(unsigned long)os->ihk_os,
+				os->param->panic_info.cpu);
+			os->panic_notified = 1;
+			ihk_os_eventfd(os->ihk_os, IHK_OS_EVENTFD_TYPE_PANIC);
+		}
+
+		param_status = READ_ONCE(os->param->status);
+		if (param_status == os->param_status)
+			continue;
+
+		dprintk("%s: OS: 0x%lx, status: %lu -> %lu\n", __func__,
+			(unsigned long)os->ihk_os, os->param_status,
+			param_status);
+		os->param_status = param_status;
+		ihk_os_eventfd(os->ihk_os, IHK_OS_EVENTFD_TYPE_STATUS_CHANGE);
+		changed = 1;
+	}
+	spin_unlock_irqrestore(&smp_os_list_lock, flags);
+
+	return changed;
+}
+
+/*
+ * Copy the last words saved by ihk_mc_save_panic_info(). They stay in
+ * the boot parameters until shutdown, which detaches them under
+ * smp_os_list_lock.
+ */
+static int smp_ihk_os_get_panic_info(ihk_os_t ihk_os, void *priv,
+				     struct ihk_os_panic_info *info)
+{
+	struct smp_os_data *os = priv;
+	struct smp_panic_info *panic_info;
+	unsigned long flags;
+	int ret = -ENOENT;
+
+	spin_lock_irqsave(&smp_os_list_lock, flags);
+	if (!os->param)
+		goto out;
+
+	panic_info = &os->param->panic_info;
+	if (!READ_ONCE(panic_info->valid))
+		goto out;
+	smp_rmb();
+
+	info->cpu = panic_info->cpu;
+	info->nr_regs = min_t(unsigned int, panic_info->nr_regs,
+			      min(SMP_PANIC_NR_REGS, IHK_OS_PANIC_NR_REGS));
+	info->ts = panic_info->ts;
+	info->pc = panic_info->pc;
+	info->sp = panic_info->sp;
+	info->fp = panic_info->fp;
+	memcpy(info->regs, panic_info->regs,
+	       sizeof(info->regs[0]) * info->nr_regs);
+	info->depth = min_t(unsigned long, panic_info->depth,
+			    min(SMP_PANIC_STACK_DEPTH,
+				IHK_OS_PANIC_STACK_DEPTH));
+	memcpy(info->stack, panic_info->stack,
+	       sizeof(info->stack[0]) * info->depth);
+	strncpy(info->msg, panic_info->msg, sizeof(info->msg) - 1);
+	info->msg[sizeof(info->msg) - 1] = '\0';
+	ret = 0;
+ out:
+	spin_unlock_irqrestore(&smp_os_list_lock, flags);
+	return ret;
+}
+
 static int smp_ihk_os_register_handler(ihk_os_t os, void *os_priv, int itype,
                                        struct ihk_host_interrupt_handler *h)
 {
@@ -1809,6 +3196,9 @@ irqreturn_t smp_ihk_irq_call_handlers(int irq, void *data)
 	struct ihk_host_interrupt_handler *h;
 	int found = 0;
 
+	/* The doorbell may ring before IKC handlers are registered */
+	found = smp_ihk_os_status_doorbell();
+
 	/* XXX: Linear search? */
 	list_for_each_entry(h, &builtin_interrupt_handlers, list) {
 		if (h->func) {
@@ -2438,6 +3828,8 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 	size_t want = mem_size;
 	struct list_head to_be_assigned_chunks;
 
+	smp_ihk_mem_lock_free();
+
 	INIT_LIST_HEAD(&to_be_assigned_chunks);
 
 	while (mem_size_left) {
@@ -2650,6 +4042,7 @@ out:
 		merge_mem_chunks(&ihk_mem_free_chunks);
 		kfree(os_mem_chunk);
 	}
+	smp_ihk_mem_unlock_free();
 
 	return ret;
 }
@@ -2747,6 +4140,8 @@ static int _smp_ihk_os_release_mem(ihk_os_t ihk_os, size_t size, int numa_id)
 	struct ihk_os_mem_chunk *next_chunk = NULL;
 	struct chunk *mem_chunk;
 
+	smp_ihk_mem_lock_free();
+
 	list_for_each_entry_safe(os_mem_chunk, next_chunk,
 				 &ihk_mem_used_chunks, list) {
 
@@ -2806,6 +4201,7 @@ static int _smp_ihk_os_release_mem(ihk_os_t ihk_os, size_t size, int numa_id)
 
 	ret = -EINVAL;
  out:
+	smp_ihk_mem_unlock_free();
 	return ret;
 }
 
@@ -2876,6 +4272,8 @@ static int smp_ihk_os_release_mem(ihk_os_t ihk_os, void *priv, unsigned long arg
 	}
 
 	/* Drop specified memory chunks */
+	down_write(&os->mmap_lock);
+	smp_ihk_os_revoke_mmap(os);
 	for (i = 0; i < req.num_chunks; i++) {
 		ret = _smp_ihk_os_release_mem(ihk_os, req_sizes[i],
 					      req_numa_ids[i]);
@@ -2883,9 +4281,11 @@ static int smp_ihk_os_release_mem(ihk_os_t ihk_os, void *priv, unsigned long arg
 			pr_err("%s: error: _smp_ihk_os_release_mem"
 			       " returned %d\n",
 			       __func__, ret);
+			up_write(&os->mmap_lock);
 			goto out;
 		}
 	}
+	up_write(&os->mmap_lock);
 
 	ret = 0;
  out:
@@ -3005,22 +4405,161 @@ static int smp_ihk_os_freeze(ihk_os_t ihk_os, void *priv)
 	return 0;
 }
 
+/*
+ * All CPUs asked to freeze are frozen, either acknowledged in
+ * freeze_ack or, for LWKs not calling ihk_mc_ack_freeze(), reported in
+ * their per-CPU status.
+ */
+static int smp_ihk_os_freeze_cpus_done(struct ihk_os_monitor *monitor)
+{
+	int i, n;
+	int bits = sizeof(unsigned long) * 8;
+	int requested = 0;
+
+	if (smp_ihk_os_freeze_acked(monitor))
+		return 1;
+
+	n = min_t(unsigned long, READ_ONCE(monitor->num_processors),
+		  IHK_OS_MONITOR_MAX_CPUS);
+	for (i = 0; i < n; i++) {
+		if (!(READ_ONCE(monitor->freeze_req[i / bits]) &
+		      (1UL << (i % bits))))
+			continue;
+
+		if (READ_ONCE(monitor->cpu[i].status) !=
+		    IHK_OS_MONITOR_KERNEL_FROZEN)
+			return 0;
+
+		requested = 1;
+	}
+
+	return requested;
+}
+
+static int smp_ihk_os_freeze_cpus(ihk_os_t ihk_os, void *priv, int timeout)
+{
+	struct ihk_host_linux_os_data *data = ihk_os;
+	struct smp_os_data *os = priv;
+	unsigned long deadline = jiffies + msecs_to_jiffies(timeout);
+
+	if (!data->monitor)
+		return -ENOSYS;
+
+	/* Interrupt only the CPUs asked to freeze in the monitor page */
+	smp_ihk_os_send_multi_intr_mask(ihk_os, priv, 1,
+					data->monitor->freeze_req);
+	if (!timeout)
+		return 0;
+
+	/* The last CPU to ack rings the host, the status is polled */
+	while (!smp_ihk_os_freeze_cpus_done(data->monitor)) {
+		if (time_after_eq(jiffies, deadline))
+			return -ETIMEDOUT;
+
+		wait_event_timeout(os->status_wq,
+				   smp_ihk_os_freeze_cpus_done(data->monitor),
+				   min_t(unsigned long, msecs_to_jiffies(100),
+					 deadline - jiffies));
+	}
+
+	return 0;
+}
+
 static int smp_ihk_os_thaw(ihk_os_t ihk_os, void *priv)
 {
 	smp_ihk_os_send_multi_intr(ihk_os, priv, 2);
 	return 0;
 }
 
+static void smp_ihk_dump_exclude_init(void)
+{
+	if (!ihk_dump_exclude_ranges)
+		return;
+
+	if (!ihk_vmcoreinfo_append_str) {
+		pr_warn("IHK-SMP: vmcoreinfo_append_str not found, marking each page excluded from dump\n");
+		return;
+	}
+
+	ihk_dump_exclude_table = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+						  IHK_DUMP_EXCLUDE_ORDER);
+	if (!ihk_dump_exclude_table) {
+		pr_warn("IHK-SMP: allocating dump exclusion table failed, marking each page excluded from dump\n");
+		return;
+	}
+
+	ihk_dump_exclude_table->magic = IHK_DUMP_EXCLUDE_MAGIC;
+	ihk_dump_exclude_table->version = IHK_DUMP_EXCLUDE_VERSION;
+	ihk_dump_exclude_table->max_ranges =
+		((PAGE_SIZE << IHK_DUMP_EXCLUDE_ORDER) -
+		 sizeof(struct ihk_dump_exclude_table)) /
+		sizeof(struct ihk_dump_exclude_range);
+
+	/* The crash kernel sees vmcoreinfo as it was when kdump was
+	 * loaded, so the fixed address is published now rather than
+	 * from the panic notifier
+	 */
+	ihk_vmcoreinfo_append_str("%s=%lx\n", IHK_DUMP_EXCLUDE_VMCOREINFO,
+				  (unsigned long)__pa(ihk_dump_exclude_table));
+	pr_info("IHK-SMP: dump exclusion table published in vmcoreinfo, (re)load kdump for it to take effect\n");
+}
+
+static void smp_ihk_dump_exclude_exit(void)
+{
+	if (!ihk_dump_exclude_table)
+		return;
+
+	/* vmcoreinfo keeps pointing here until kdump is reloaded */
+	ihk_dump_exclude_table->magic = 0;
+	free_pages((unsigned long)ihk_dump_exclude_table,
+		   IHK_DUMP_EXCLUDE_ORDER);
+	ihk_dump_exclude_table = NULL;
+}
+
+/*
+ * Exclude [phys, phys + size) from the Linux dump. The range is
+ * recorded in the table when there is room, and the pages are marked
+ * PAGE_MAPPING_ANON one by one otherwise.
+ */
+static void smp_ihk_dump_exclude(unsigned long phys, unsigned long size)
+{
+	struct ihk_dump_exclude_table *table = ihk_dump_exclude_table;
+	struct ihk_dump_exclude_range *last;
+	unsigned long end = phys + size;
+	struct page *pg;
+
+	if (table) {
+		last = table->nr_ranges ?
+			&table->ranges[table->nr_ranges - 1] : NULL;
+
+		if (last && last->end == phys) {
+			last->end = end;
+			return;
+		}
+
+		if (table->nr_ranges < table->max_ranges) {
+			table->ranges[table->nr_ranges].start = phys;
+			table->ranges[table->nr_ranges].end = end;
+			table->nr_ranges++;
+			return;
+		}
+	}
+
+	for (; phys < end; phys += PAGE_SIZE) {
+		pg = virt_to_page(phys_to_virt(phys));
+		pg->mapping = (struct address_space *)((unsigned long)pg->mapping |
+						       PAGE_MAPPING_ANON);
+	}
+}
+
 static void smp_ihk_os_panic_notifier(ihk_os_t ihk_os, void *priv)
 {
 	struct smp_os_data *os = priv;
 	struct ihk_dump_page *dump_page = NULL;
-	unsigned long map_start;
-	unsigned long i,j,k;
-	struct page *pg;
+	unsigned long nbits, pos, run_start, run_len;
+	unsigned long i;
 	enum ihk_os_status status;
 	struct ihk_os_mem_chunk *os_mem_chunk;
-	unsigned long phys;
 
 #ifdef ENABLE_PANIC_NOTIFIER_WORKAROUND
 	pr_err("%s: excluding McKernel memory from Linux dump because of cmake option\n",
@@ -3075,16 +4614,14 @@ static void smp_ihk_os_panic_notifier(ihk_os_t ihk_os, void *priv)
 				dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 			}
 
-			for (j = 0; j < dump_page->map_count; j++) {
-				for (k = 0; k < 64; k++) {
-					if (!((dump_page->map[j] >> k) & 0x1)) {
-						map_start = (unsigned long)(dump_page->start + (j << (PAGE_SHIFT+6)));
-						map_start = map_start + (k << PAGE_SHIFT);
-						pg = virt_to_page(phys_to_virt(map_start));
-						pg->mapping = (struct address_space *)((unsigned long)pg->mapping |
-										       PAGE_MAPPING_ANON);
-					}
-				}
+			nbits = dump_page->map_count * BITS_PER_LONG;
+			pos = 0;
+			while (ihk_dump_bitmap_next_run(dump_page->map, nbits,
+							&pos, 0, &run_start,
+							&run_len)) {
+				smp_ihk_dump_exclude(dump_page->start +
+						     (run_start << PAGE_SHIFT),
+						     run_len << PAGE_SHIFT);
 			}
 		}
 	}
@@ -3097,21 +4634,16 @@ static void smp_ihk_os_panic_notifier(ihk_os_t ihk_os, void *priv)
 		if (os_mem_chunk->os != ihk_os)
 			continue;
 
-		for (phys = os_mem_chunk->addr;
-		     phys < os_mem_chunk->addr + os_mem_chunk->size;
-		     phys += PAGE_SIZE) {
-			pg = virt_to_page(phys_to_virt(phys));
-			pg->mapping = (struct address_space *)((unsigned long)pg->mapping |
-							       PAGE_MAPPING_ANON);
-		}
+		smp_ihk_dump_exclude(os_mem_chunk->addr, os_mem_chunk->size);
 	}
-	pr_err("%s: marking all pages as PAGE_MAPPING_ANON done\n",
+	pr_err("%s: excluding all pages done\n",
 	       __func__);
 	return;
 
 }
 
 static struct ihk_os_ops smp_ihk_os_ops = {
+	.mmap = smp_ihk_os_mmap,
 	.load_mem = smp_ihk_os_load_mem,
 	.load_file = smp_ihk_os_load_file,
 	.boot = smp_ihk_os_boot,
@@ -3122,10 +4654,13 @@ static struct ihk_os_ops smp_ihk_os_ops = {
 	.get_num_numa_nodes = smp_ihk_os_get_num_numa_nodes,
 	.wait_for_status = smp_ihk_os_wait_for_status,
 	.set_kargs = smp_ihk_os_set_kargs,
+	.set_bootstrap = smp_ihk_os_set_bootstrap,
 	.dump = smp_ihk_os_dump,
 	.issue_interrupt = smp_ihk_os_issue_interrupt,
 	.send_multi_intr = smp_ihk_os_send_multi_intr,
 	.send_nmi = smp_ihk_os_send_nmi,
+	.get_nmi_mode = ihk_smp_get_nmi_mode,
+	.set_nmi_mode = ihk_smp_set_nmi_mode,
 	.map_memory = smp_ihk_os_map_memory,
 	.unmap_memory = smp_ihk_os_unmap_memory,
 	.register_handler = smp_ihk_os_register_handler,
@@ -3145,9 +4680,12 @@ static struct ihk_os_ops smp_ihk_os_ops = {
 	.release_mem = smp_ihk_os_release_mem,
 	.query_mem = smp_ihk_os_query_mem,
 	.freeze = smp_ihk_os_freeze,
+	.freeze_cpus = smp_ihk_os_freeze_cpus,
 	.thaw = smp_ihk_os_thaw,
 	.panic_notifier = smp_ihk_os_panic_notifier,
 	.vtop = smp_ihk_os_vtop,
+	.checkpoint = smp_ihk_os_checkpoint,
+	.get_panic_info = smp_ihk_os_get_panic_info,
 };
 
 static struct ihk_register_os_data builtin_os_reg_data = {
@@ -3162,6 +4700,7 @@ static int smp_ihk_create_os(ihk_device_t ihk_dev, void *priv,
 {
 	struct builtin_device_data *data = priv;
 	struct smp_os_data *os;
+	unsigned long flags;
 
 	if (!priv || !regdata) {
 		return -EFAULT;
@@ -3179,10 +4718,20 @@ static int smp_ihk_create_os(ihk_device_t ihk_dev, void *priv,
 	spin_lock_init(&os->lock);
 	os->dev = data;
 	regdata->priv = os;
-	/* Put the image into the smallest NUMA id if value is -1,
+	/* Put the image into the NUMA node of the boot CPU if value is -1,
 	 * use the designated NUMA node otherwise */
 	os->bootstrap_numa_id = -1;
+	os->bootstrap_numa_req = -1;
+	os->kargs_bootstrap_numa = -1;
 	os->boot_pt = NULL;
+	os->ihk_os = ihk_os;
+	init_waitqueue_head(&os->status_wq);
+	init_rwsem(&os->mmap_lock);
+	mutex_init(&os->snapshot_lock);
+
+	spin_lock_irqsave(&smp_os_list_lock, flags);
+	list_add_tail(&os->list, &smp_os_list);
+	spin_unlock_irqrestore(&smp_os_list_lock, flags);
 
 	return 0;
 }
@@ -3191,6 +4740,14 @@ static int smp_ihk_destroy_os(ihk_device_t ihk_dev, void *ihk_dev_priv,
 							  ihk_os_t ihk_os, void *ihk_os_priv)
 {
 	struct smp_os_data *smp_os = ihk_os_priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&smp_os_list_lock, flags);
+	list_del(&smp_os->list);
+	spin_unlock_irqrestore(&smp_os_list_lock, flags);
+
+	kfree(smp_os->image_fn);
+	vfree(smp_os->pristine_image);
 	kfree(smp_os);
 	return 0;
 }
@@ -3862,6 +5419,7 @@ pre_out:
 		}
 
 		/* Insert the chunk in physical address ascending order */
+		smp_ihk_mem_lock_free();
 		list_for_each_entry(q, &ihk_mem_free_chunks, chain) {
 			if (p->addr < q->addr) {
 				break;
@@ -3874,6 +5432,7 @@ pre_out:
 		else {
 			list_add_tail(&p->chain, &q->chain);
 		}
+		smp_ihk_mem_unlock_free();
 
 		printk(KERN_INFO "IHK-SMP: chunk 0x%lx - 0x%lx"
 				" (len: %lu) @ NUMA node: %d is available\n",
@@ -3956,6 +5515,8 @@ static int __ihk_smp_release_mem(size_t ihk_mem, int numa_id)
 	struct chunk *mem_chunk;
 	struct chunk *mem_chunk_next;
 
+	smp_ihk_mem_lock_free();
+
 	list_for_each_entry_safe(mem_chunk,
 			mem_chunk_next, &ihk_mem_free_chunks, chain) {
 		if(mem_chunk->size != ihk_mem || mem_chunk->numa_id != numa_id) {
@@ -3984,6 +5545,7 @@ static int __ihk_smp_release_mem(size_t ihk_mem, int numa_id)
 #endif
 	ret = -EINVAL;
  out:
+	smp_ihk_mem_unlock_free();
 	return ret;
 }
 
@@ -4029,6 +5591,8 @@ static int __ihk_smp_release_mem_partially(size_t ihk_mem, int numa_id)
 	unsigned long va;
 	struct rb_root tmp_chunks = RB_ROOT;
 
+	smp_ihk_mem_lock_free();
+
 	pr_info("IHK-SMP: partial release size: %ld, numa_id: %d\n",
 		ihk_mem, numa_id);
 
@@ -4164,7 +5728,7 @@ next_chunk:
 	}
 
 out:
-
+	smp_ihk_mem_unlock_free();
 	return ret;
 }
 
@@ -4842,6 +6406,8 @@ static int smp_ihk_query_mem(ihk_device_t ihk_dev, unsigned long arg)
 		return -EFAULT;
 	}
 
+	smp_ihk_mem_lock_free();
+
 	/* Count memory chunks */
 	list_for_each_entry(mem_chunk, &ihk_mem_free_chunks, chain) {
 		num_chunks++;
@@ -4938,6 +6504,7 @@ static int smp_ihk_query_mem(ihk_device_t ihk_dev, unsigned long arg)
 
 	ret = 0;
 out:
+	smp_ihk_mem_unlock_free();
 	kfree(query_res_size);
 	kfree(query_res_numa_id);
 	return ret;
@@ -5327,7 +6894,11 @@ static int smp_ihk_exit(ihk_device_t ihk_dev, void *priv)
 	}
 
 	/* Free memory */
+	smp_ihk_mem_lock_free();
 	__smp_ihk_free_mem_from_list(&ihk_mem_free_chunks);
+	smp_ihk_mem_unlock_free();
+
+	smp_ihk_snapshot_free_all();
 
 	free_info();
 
@@ -5431,6 +7002,10 @@ static int ihk_smp_symbols_init(void)
 		return -EFAULT;
 #endif // IHK_IKC_USE_LINUX_WORK_IRQ
 
+	/* Optional, page marking is used when not found */
+	ihk_vmcoreinfo_append_str =
+		(void *)kallsyms_lookup_name("vmcoreinfo_append_str");
+
 	smp_ihk_hstates = (struct hstate *)kallsyms_lookup_name("hstates");
 	if (WARN_ON(!smp_ihk_hstates))
 		goto err;
@@ -5470,6 +7045,8 @@ static int __init smp_module_init(void)
 
 	builtin_data.ihk_dev = ihkd;
 
+	smp_ihk_dump_exclude_init();
+
 	return 0;
 }
 
@@ -5477,6 +7054,7 @@ static void __exit smp_module_exit(void)
 {
 	printk(KERN_INFO "IHK-SMP: finalizing...\n");
 	ihk_unregister_device(builtin_data.ihk_dev);
+	smp_ihk_dump_exclude_exit();
 }
 
 module_init(smp_module_init);
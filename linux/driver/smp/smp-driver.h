@@ -17,6 +17,9 @@
 #include <linux/limits.h>
 #include <linux/slab.h>
 #include <linux/irq.h>
+#include <linux/wait.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include <linux/version.h>
 #include <ihk/ihk_host_driver.h>
 #include <bootparam.h>
@@ -64,6 +67,15 @@ struct ihk_smp_cpu {
 	int ikc_map_cpu;
 };
 
+/* Tells a rebuilt kernel image apart from the one snapshotted */
+struct ihk_smp_image_id {
+	dev_t dev;
+	unsigned long ino;
+	loff_t size;
+	long mtime_sec;
+	long mtime_nsec;
+};
+
 /** \brief BUILTIN driver-specific OS structure */
 struct smp_os_data {
 	/** \brief Lock for this structure */
@@ -83,6 +95,27 @@ struct smp_os_data {
 	/* Memory chunk for kernel image and bootstrap page table */
 	unsigned long bootstrap_mem_start, bootstrap_mem_end; 
 	int bootstrap_numa_id;
+	/** \brief Requested bootstrap NUMA node, -1 for the node of
+	 * the boot CPU */
+	int bootstrap_numa_req;
+	/** \brief Requested bootstrap chunk address, 0 for the largest
+	 * chunk on the bootstrap NUMA node */
+	unsigned long bootstrap_chunk_req;
+	/** \brief Replicate the kernel image on every NUMA node */
+	int bootstrap_replicate;
+	/** \brief The above are taken from bootstrap_api if it was set
+	 * through IHK_OS_SET_BOOTSTRAP, from the bootstrap_numa= and
+	 * bootstrap_replicate kernel arguments otherwise */
+	struct ihk_bootstrap_req bootstrap_api;
+	int bootstrap_api_set;
+	int kargs_bootstrap_numa;
+	int kargs_bootstrap_replicate;
+	/** \brief Kernel image as loaded, for the replicas of an image
+	 * restored from the snapshot taken on this boot */
+	void *pristine_image;
+	/** \brief Physical address of the kernel image copy on each
+	 * Linux NUMA node, 0 if none */
+	unsigned long image_replicas[BITS_PER_LONG];
 
 	unsigned long numa_mask;
 
@@ -92,6 +125,14 @@ struct smp_os_data {
 	unsigned long boot_rip;
 	pgd_t *boot_pt;
 
+	/** \brief Path of the loaded kernel image */
+	char *image_fn;
+	/** \brief Identity of the image file at load time */
+	struct ihk_smp_image_id image_id;
+	unsigned long image_entry;
+	/** \brief Image is restored from a snapshot at boot */
+	int image_from_snapshot;
+
 	/** \brief IHK Memory information */
 	struct ihk_mem_info mem_info;
 	/** \brief IHK Memory region information */
@@ -128,6 +169,38 @@ struct smp_os_data {
 
 	/** \brief Status of the kernel */
 	int status;
+
+	/** \brief IHK OS structure of this instance */
+	ihk_os_t ihk_os;
+	/** \brief Entry in the list of OS instances */
+	struct list_head list;
+	/** \brief Woken up by the status doorbell of the kernel */
+	wait_queue_head_t status_wq;
+	/** \brief param->status last seen by the doorbell handler */
+	unsigned long param_status;
+	/** \brief Number of doorbells rung by the kernel */
+	unsigned long doorbell_count;
+	/** \brief param->panic_info has been signaled to the subscribers */
+	int panic_notified;
+
+	/** \brief Serializes faults on /dev/mcosN mappings against
+	 * returning the memory */
+	struct rw_semaphore mmap_lock;
+	/** \brief Incremented when the memory is returned, mappings of
+	 * an older generation fault with SIGBUS */
+	unsigned long mmap_gen;
+	/** \brief Address space of the OS device file, for zapping */
+	struct address_space *mmap_mapping;
+
+	/** \brief Serializes incremental snapshot queries */
+	struct mutex snapshot_lock;
+	/** \brief Dirty bits harvested from param->dirty_page_set and
+	 * not reported yet, the bitmaps of all chunks back to back */
+	unsigned long *snapshot_map;
+	/** \brief Pages of param->dirty_page_set, NULL unless
+	 * ihk_dump_dirty was set at boot */
+	struct page *dirty_pages;
+	int dirty_pages_order;
 };
 
 /* ihk_os_mem_chunk represents a memory range which is used by
@@ -153,7 +226,12 @@ void *ihk_smp_map_virtual(unsigned long phys, unsigned long size);
 void ihk_smp_unmap_virtual(void *virt);
 int ihk_smp_set_multi_intr_mode(ihk_os_t ihk_os, void *priv, int mode);
 int ihk_smp_set_nmi_mode(ihk_os_t ihk_os, void *priv, int mode);
+int ihk_smp_get_nmi_mode(ihk_os_t ihk_os, void *priv, int *mode);
 irqreturn_t smp_ihk_irq_call_handlers(int irq, void *data);
+void smp_ihk_os_wait_for_dump_completion(struct smp_os_data *os);
+long smp_ihk_os_snapshot_num_areas(struct smp_os_data *os);
+int smp_ihk_os_snapshot_areas(struct smp_os_data *os, dumpargs_t *args);
+int smp_ihk_os_freeze_acked(struct ihk_os_monitor *monitor);
 int ihk_smp_map_kernel(pgd_t *pt, unsigned long vaddr, phys_addr_t paddr);
 void smp_ihk_arch_dcache_flush(void *addr, size_t len);
 
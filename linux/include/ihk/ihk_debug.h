@@ -19,12 +19,30 @@
 #define IHK_KMSG_NOTIFY_DELAY    400 /* Unit is us, 400 us would avoid overloading fwrite of ihkmond */
 #endif
 
+/*
+ * The host coalesces the notifications of the LWK into at most one
+ * wakeup of the readers per interval unless this many bytes have been
+ * written since the last one. Both can be set per OS instance in
+ * /sys/class/mcos/mcosN/kmsg/.
+ */
+#define IHK_KMSG_NOTIFY_INTERVAL 10000 /* Unit is us */
+#define IHK_KMSG_NOTIFY_BYTES    IHK_KMSG_HIGH_WATER_MARK
+
+/*
+ * Multi-producer ring of records shared by the LWK CPUs (writers) and
+ * the host (reader), see ihk_kmsg_ring.h. Each record has a header with
+ * the time stamp, CPU, level and sequence number of the message.
+ * Positions are byte offsets that only grow. The writer and the reader
+ * fields are on different cache lines.
+ */
 struct ihk_kmsg_buf {
-	int lock; /* Be careful, it's inter-kernel lock */
-	int tail;
-	int len;
-	int head;
-	char padding[4096 - sizeof(int) * 4]; /* Alignmment needed for some systems */
+	unsigned long reserve;	/* next position to reserve, LWK */
+	unsigned long seq;	/* next sequence number, LWK */
+	char padding0[64 - sizeof(unsigned long) * 2];
+	unsigned long head;	/* next position to read, host */
+	unsigned long dropped;	/* bytes overwritten before read, host */
+	int len;		/* size of str, multiple of the block size */
+	char padding[4096 - 64 - sizeof(unsigned long) * 2 - sizeof(int)]; /* Alignmment needed for some systems */
 	char str[IHK_KMSG_SIZE];
 };
 
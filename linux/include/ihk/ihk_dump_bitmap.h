@@ -0,0 +1,125 @@
+/**
+ * \file ihk_dump_bitmap.h
+ * \brief
+ *	IHK-Master: word-at-a-time scan of the dump page bitmaps
+ *
+ *	Shared by the SMP driver and user-space tests, so only plain C
+ *	and compiler builtins are used here.
+ */
+#ifndef IHK_DUMP_BITMAP_H_INCLUDED
+#define IHK_DUMP_BITMAP_H_INCLUDED
+
+#define IHK_DUMP_BITS_PER_WORD	(sizeof(unsigned long) * 8)
+
+/** \brief Find the first bit at or after pos whose value is set
+ *	(1 or 0), or nbits when there is none */
+static inline unsigned long ihk_dump_bitmap_find(const unsigned long *map,
+						 unsigned long nbits,
+						 unsigned long pos, int set)
+{
+	unsigned long idx, word;
+
+	if (pos >= nbits)
+		return nbits;
+
+	idx = pos / IHK_DUMP_BITS_PER_WORD;
+	word = set ? map[idx] : ~map[idx];
+	word &= ~0UL << (pos % IHK_DUMP_BITS_PER_WORD);
+
+	while (!word) {
+		if (++idx * IHK_DUMP_BITS_PER_WORD >= nbits)
+			return nbits;
+		word = set ? map[idx] : ~map[idx];
+	}
+
+	pos = idx * IHK_DUMP_BITS_PER_WORD + __builtin_ctzl(word);
+	return pos < nbits ? pos : nbits;
+}
+
+/** \brief Extract the next run of bits with value set at or after *pos.
+ *	Returns 1 and fills start and len when a run is found, 0 otherwise.
+ *	*pos is moved past the run so that calls can be chained. */
+static inline int ihk_dump_bitmap_next_run(const unsigned long *map,
+					   unsigned long nbits,
+					   unsigned long *pos, int set,
+					   unsigned long *start,
+					   unsigned long *len)
+{
+	unsigned long s, e;
+
+	s = ihk_dump_bitmap_find(map, nbits, *pos, set);
+	if (s >= nbits) {
+		*pos = nbits;
+		return 0;
+	}
+
+	e = ihk_dump_bitmap_find(map, nbits, s, !set);
+	*start = s;
+	*len = e - s;
+	*pos = e;
+	return 1;
+}
+
+/** \brief Number of runs of set bits */
+static inline unsigned long ihk_dump_bitmap_nr_runs(const unsigned long *map,
+						    unsigned long nbits)
+{
+	unsigned long pos = 0, start, len, nr = 0;
+
+	while (ihk_dump_bitmap_next_run(map, nbits, &pos, 1, &start, &len))
+		nr++;
+
+	return nr;
+}
+
+/** \brief Set len bits starting at start, filling whole words at once */
+static inline void ihk_dump_bitmap_set_range(unsigned long *map,
+					     unsigned long start,
+					     unsigned long len)
+{
+	unsigned long idx = start / IHK_DUMP_BITS_PER_WORD;
+	unsigned long off = start % IHK_DUMP_BITS_PER_WORD;
+	unsigned long nr;
+
+	while (len) {
+		nr = IHK_DUMP_BITS_PER_WORD - off;
+		if (nr > len)
+			nr = len;
+
+		if (nr == IHK_DUMP_BITS_PER_WORD)
+			map[idx] = ~0UL;
+		else
+			map[idx] |= ((1UL << nr) - 1) << off;
+
+		len -= nr;
+		off = 0;
+		idx++;
+	}
+}
+
+/** \brief Clear len bits starting at start */
+static inline void ihk_dump_bitmap_clear_range(unsigned long *map,
+					       unsigned long start,
+					       unsigned long len)
+{
+	unsigned long idx = start / IHK_DUMP_BITS_PER_WORD;
+	unsigned long off = start % IHK_DUMP_BITS_PER_WORD;
+	unsigned long nr;
+
+	while (len) {
+		nr = IHK_DUMP_BITS_PER_WORD - off;
+		if (nr > len)
+			nr = len;
+
+		if (nr == IHK_DUMP_BITS_PER_WORD)
+			map[idx] = 0;
+		else
+			map[idx] &= ~(((1UL << nr) - 1) << off);
+
+		len -= nr;
+		off = 0;
+		idx++;
+	}
+}
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * \file ihk_dump_exclude.h
+ * \brief
+ *	IHK-Master: physical ranges excluded from the Linux kdump
+ *
+ *	When the ihk_smp module is loaded with ihk_dump_exclude_ranges=1,
+ *	the panic notifier records the McKernel memory to be left out of
+ *	the Linux dump in this table instead of setting PAGE_MAPPING_ANON
+ *	in every struct page. The physical address of the table is
+ *	appended to vmcoreinfo as
+ *
+ *		IHK_DUMP_EXCLUDE=<hex physical address>
+ *
+ *	so that makedumpfile can read it from the crashed kernel's memory
+ *	and filter the ranges out in O(ranges). The table lives in Linux
+ *	memory which is itself part of the dump.
+ *
+ *	The key is appended when the module is loaded. Since Linux 4.13
+ *	the crash kernel gets the copy of vmcoreinfo taken when kdump was
+ *	loaded, so kdump must be (re)loaded after insmod, e.g. with
+ *	"systemctl restart kdump". After rmmod the key stays until the next
+ *	reload, with magic cleared in the freed table, so makedumpfile
+ *	must check magic and version before using it.
+ *
+ *	Note that Linux runs panic notifiers before kdump only when booted
+ *	with crash_kexec_post_notifiers.
+ */
+#ifndef IHK_DUMP_EXCLUDE_H_INCLUDED
+#define IHK_DUMP_EXCLUDE_H_INCLUDED
+
+#define IHK_DUMP_EXCLUDE_VMCOREINFO	"IHK_DUMP_EXCLUDE"
+#define IHK_DUMP_EXCLUDE_MAGIC		0x49484b44554d5058UL /* "IHKDUMPX" */
+#define IHK_DUMP_EXCLUDE_VERSION	1
+
+/** \brief Physical range [start, end) */
+struct ihk_dump_exclude_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+struct ihk_dump_exclude_table {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long nr_ranges;
+	unsigned long max_ranges;
+	struct ihk_dump_exclude_range ranges[0];
+};
+
+#endif
@@ -51,6 +51,7 @@ struct ihk_mem_info;
 struct ihk_cpu_info;
 struct ihk_dma_request;
 struct ihk_dma_channel_info;
+struct ihk_os_panic_info;
 
 /** \brief IHK-Host DMA channel descriptor */
 struct ihk_dma_channel {
@@ -125,6 +126,14 @@ struct ihk_os_ops {
 	 *  \param file   Identifier of the device file
 	 **/
 	int (*close)(ihk_os_t os, void *priv, const void *file);
+	/** \brief When a user maps an OS device file
+	 *
+	 *  The file offset is the physical address. Only memory assigned
+	 *  to the instance can be mapped, and only for reading.
+	 *  \param file   Identifier of the device file
+	 *  \param vma    VM area to map (struct vm_area_struct)
+	 **/
+	int (*mmap)(ihk_os_t os, void *priv, void *file, void *vma);
 
 	/** \brief Load a kernel image for the kernel instance from a file
 	 *
@@ -219,10 +228,22 @@ struct ihk_os_ops {
 	 **/
 	int (*send_nmi)(ihk_os_t, void *, int mode);
 
+	/** \brief Get and set the mode the kernel reads on NMI, without
+	 *  sending one
+	 **/
+	int (*get_nmi_mode)(ihk_os_t, void *, int *mode);
+	int (*set_nmi_mode)(ihk_os_t, void *, int mode);
+
 	/** \brief Set a kernel command line paramter
 	 *
 	 * \param buf Parameter string */
 	int (*set_kargs)(ihk_os_t, void *, char *buf);
+
+	/** \brief Choose the NUMA node and the memory chunk for the
+	 *  kernel image and the bootstrap page table
+	 *
+	 * \param arg Pointer to struct ihk_bootstrap_req in user space */
+	int (*set_bootstrap)(ihk_os_t, void *, unsigned long arg);
 	int (*dump)(ihk_os_t ihk_os, void *priv, struct dumpargs_s *args);
 
 	/** \note Obsolete. */
@@ -349,6 +370,15 @@ struct ihk_os_ops {
 	 **/
 	int (*freeze)(ihk_os_t ihk_os, void *priv);
 
+	/** \brief Freeze the CPUs set in freeze_req of the monitor page
+	 *
+	 *  \param timeout Time in milliseconds to wait for the CPUs to
+	 *                 acknowledge in freeze_ack or report FROZEN in
+	 *                 their status, 0 not to wait.
+	 *  \return Success or failure, -ETIMEDOUT if not frozen in time.
+	 **/
+	int (*freeze_cpus)(ihk_os_t ihk_os, void *priv, int timeout);
+
 	/** \brief Wake up CPU
 	 *
 	 *  \return Success or failure.
@@ -362,6 +392,23 @@ struct ihk_os_ops {
 	/** \brief Virtual to physical translation
 	 **/
 	int (*vtop)(ihk_os_t, void *priv, unsigned long virt, unsigned long *phys);
+
+	/** \brief Save the state of a booting kernel
+	 *
+	 *  Called after boot and before the master IKC channel is set up.
+	 *  The driver waits for the kernel to stop at a consistent point
+	 *  and may use the saved state to restart an identical instance
+	 *  faster.
+	 *  \return Success or failure. Failure doesn't fail the boot.
+	 **/
+	int (*checkpoint)(ihk_os_t ihk_os, void *priv);
+
+	/** \brief Get the last words the kernel saved on panic
+	 *
+	 *  \return 0 on success, -ENOENT if the kernel hasn't panicked.
+	 **/
+	int (*get_panic_info)(ihk_os_t ihk_os, void *priv,
+			      struct ihk_os_panic_info *info);
 };
 
 struct ihk_register_os_data;
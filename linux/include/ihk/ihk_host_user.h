@@ -33,6 +33,9 @@
 #endif
 #define IHK_DEVICE_DETECT_HUNGUP      0x11290f
 
+#define IHK_DEVICE_LAUNCH_OS          0x112910
+#define IHK_DEVICE_SHIFT_KMSG_BUF     0x112911
+
 #define IHK_DEVICE_DEBUG_START        0x122900
 #define IHK_DEVICE_DEBUG_END          0x1229ff
 
@@ -71,6 +74,10 @@
 #define IHK_OS_GET_BUILDID            0x112a37
 #define IHK_OS_GET_NUM_CPUS           0x112a38
 #define IHK_OS_READ_KADDR             0x112a39
+#define IHK_OS_SET_BOOTSTRAP          0x112a3a
+#define IHK_OS_FREEZE_VEC             0x112a3b
+#define IHK_OS_GET_HANG_INFO          0x112a3c
+#define IHK_OS_GET_PANIC_INFO         0x112a3d
 
 #define IHK_OS_DEBUG_START            0x122a00
 #define IHK_OS_DEBUG_END              0x122aff
@@ -115,6 +122,8 @@ typedef struct dumpargs_s {
 #define DUMP_QUERY_MEM_AREAS 8
 #define DUMP_QUERY_PHYS_START 9
 #define DUMP_NMI_CONT 10
+#define DUMP_QUERY_NUM_DIRTY_AREAS 11
+#define DUMP_QUERY_DIRTY_AREAS 12
 	unsigned int level;
 #define DUMP_LEVEL_ALL 0
 #define DUMP_LEVEL_USER_UNUSED_EXCLUDE 24
@@ -126,6 +135,42 @@ typedef struct dumpargs_s {
 #define DUMP_ALL_MEM 0
 #define DUMP_CHUNK_MEM 24
 
+/*
+ * Sequential dump written by ihk_os_makedumpfile_stream() to a pipe or
+ * socket. Layout: header, dump_mem_chunks_t of DUMP_QUERY_MEM_AREAS
+ * (chunks_size bytes), then a record per block of at most
+ * IHK_SDUMP_BLOCK_SIZE bytes in the order of the table, each followed
+ * by its data unless it is all zero, and a record with IHK_SDUMP_END.
+ * ihk_os_makedumpfile_compressed() writes the same stream with the
+ * data of the blocks compressed with zlib where it makes them smaller.
+ * ihk_dump_stream_to_elf() converts it to the ELF dump written by
+ * ihk_os_makedumpfile().
+ */
+#define IHK_SDUMP_MAGIC "IHKSDUMP"
+#define IHK_SDUMP_VERSION 2
+#define IHK_SDUMP_BLOCK_SIZE 0x100000
+#define IHK_SDUMP_ZERO 0x1	/* all zero, no data follows */
+#define IHK_SDUMP_END 0x2	/* end of the stream */
+#define IHK_SDUMP_ZLIB 0x4	/* csize bytes of zlib data follow */
+
+struct ihk_sdump_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int dump_level;
+	unsigned long chunks_size;
+	unsigned long data_size;	/* sum of the sizes of the areas */
+	char date[32];
+	char hostname[128];
+	char user[64];
+};
+
+struct ihk_sdump_block {
+	unsigned long phys;
+	unsigned int size;
+	unsigned int flags;
+	unsigned long csize;	/* with IHK_SDUMP_ZLIB, 0 otherwise */
+};
+
 struct ihk_cpu_req {
 	int *cpus;
 	int num_cpus;
@@ -159,6 +204,77 @@ struct ihk_ikc_req {
 	int num_cpus;
 };
 
+/*
+ * Used by IHK-core and ihklib. Takes precedence over the bootstrap_numa=
+ * and bootstrap_replicate kernel arguments unless numa_id is -1 and
+ * replicate is 0.
+ */
+struct ihk_bootstrap_req {
+	int numa_id;			/* -1: NUMA node of the boot CPU */
+	unsigned long chunk_addr;	/* 0: largest chunk on the node */
+	int replicate;			/* copy kernel image to each node */
+};
+
+/* Used by IHK-core and ihklib */
+struct ihk_freeze_desc {
+	unsigned long *cpu_set;	/* IN: bitmap of LWK CPUs to freeze */
+	int nr_cpus;		/* IN: number of bits in cpu_set */
+	int timeout;		/* IN: msec to wait for the LWK to ack,
+				 * 0 to return without waiting
+				 */
+};
+
+/* Used by IHK-core and ihklib */
+struct ihk_os_cpu_hang_report {
+	int status;		/* IHK_OS_MONITOR_* */
+	int stuck;		/* found stuck in the kernel by the host */
+	int captured;		/* hang_info answers the last request */
+	unsigned long counter;
+	unsigned long last_pc;
+	long last_syscall;
+	unsigned long last_ts;
+	struct ihk_os_cpu_hang_info hang_info;
+};
+
+/* Used by IHK-core and ihklib */
+struct ihk_os_hang_info_desc {
+	struct ihk_os_cpu_hang_report *reports;	/* OUT: one per LWK CPU */
+	int nr_cpus;		/* IN: entries of reports,
+				 * OUT: number of LWK CPUs
+				 */
+	unsigned long seq;	/* OUT: last capture request, 0 if none */
+};
+
+#define IHK_OS_PANIC_MSG_SIZE 256
+#define IHK_OS_PANIC_NR_REGS 40
+#define IHK_OS_PANIC_STACK_DEPTH 16
+
+/* Used by IHK-core, IHK-SMP and ihklib */
+struct ihk_os_panic_info {
+	int cpu;		/* LWK CPU that panicked */
+	int nr_regs;		/* valid entries of regs */
+	unsigned long ts;	/* time stamp in ns */
+	unsigned long pc;
+	unsigned long sp;
+	unsigned long fp;
+	unsigned long regs[IHK_OS_PANIC_NR_REGS];
+	unsigned long depth;	/* valid entries of stack */
+	unsigned long stack[IHK_OS_PANIC_STACK_DEPTH];
+	char msg[IHK_OS_PANIC_MSG_SIZE];
+};
+
+/* Used by IHK-core and ihklib */
+struct ihk_os_launch_desc {
+	struct ihk_cpu_req cpu_req;	/* IN: CPUs to assign */
+	struct ihk_mem_req mem_req;	/* IN: memory chunks to assign */
+	struct ihk_ikc_req ikc_req;	/* IN: IKC map, driver default if
+					 * num_cpus is zero
+					 */
+	char *image;			/* IN: kernel image path */
+	char *kargs;			/* IN: kernel arguments, or NULL */
+	int boot;			/* IN: boot after loading or not */
+};
+
 /* Used by IHK-core and ihklib */
 struct ihk_os_ioctl_eventfd_desc {
 	int fd;
@@ -188,4 +304,22 @@ struct ihk_device_read_kmsg_buf_desc {
 	char* buf;    /* OUT: Buffer */
 };
 
+/*
+ * mmap offset of the kmsg ring of OS os_index on the device file.
+ * The mapping is read-only and stays valid after the OS instance is
+ * destroyed. Offsets below are physical addresses.
+ */
+#define IHK_DEVICE_KMSG_MMAP_BASE	(1UL << 60)
+#define IHK_DEVICE_KMSG_MMAP_SHIFT	32
+#define IHK_DEVICE_KMSG_MMAP_OFFSET(os_index) \
+	(IHK_DEVICE_KMSG_MMAP_BASE + \
+	 ((unsigned long)(os_index) << IHK_DEVICE_KMSG_MMAP_SHIFT))
+
+/* Used by IHK-core and ihkmond */
+struct ihk_device_shift_kmsg_buf_desc {
+	void *handle;		/* IN: "Pointer" to kmsg_buf container */
+	unsigned long head;	/* IN: Position read up to in the mapping */
+	unsigned long dropped;	/* IN: Bytes skipped because of lapping */
+};
+
 #endif /* !defined(__HEADER_IHK_HOST_USER_H) */
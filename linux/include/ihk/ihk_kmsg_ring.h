@@ -0,0 +1,297 @@
+/**
+ * \file ihk_kmsg_ring.h
+ * \brief
+ *	IHK-Master: lock-free access to the kmsg ring
+ *
+ *	Shared by the LWK (writers), the host driver and user-space
+ *	tests (reader), so only plain C and compiler builtins are used
+ *	here. memcpy() and memset() must be declared by the includer.
+ *
+ *	LWK CPUs reserve space by advancing reserve with compare-and-swap,
+ *	write the text and commit the record by storing its position to
+ *	its header. Headers start out with IHK_KMSG_POS_NONE, which is
+ *	never the position of a record. Records don't cross IHK_KMSG_BLOCK_SIZE boundaries so
+ *	that every block starts with a record. The reader walks committed
+ *	records from its cursor without taking a lock. Writers never wait
+ *	for it: when they lap the cursor, the reader skips to the oldest
+ *	block that can't have been overwritten yet.
+ *
+ *	Sequence numbers are taken right after the reservation, so records
+ *	reserved at the same time by different CPUs may be out of order by
+ *	as many as the CPUs racing. Readers count the records lost when
+ *	lapped from the gap in sequence numbers.
+ */
+#ifndef IHK_KMSG_RING_H_INCLUDED
+#define IHK_KMSG_RING_H_INCLUDED
+
+#include <ihk/ihk_debug.h>
+
+#define IHK_KMSG_BLOCK_SIZE	4096
+#define IHK_KMSG_REC_ALIGN	32	/* a pad record needs a full header */
+#define IHK_KMSG_REC_PAD	0x1	/* filler up to the next block */
+#define IHK_KMSG_POS_NONE	(~0UL)	/* pos of a header never committed */
+
+/* Levels of records, same values as syslog priorities */
+#define IHK_KMSG_LEVEL_EMERG	0
+#define IHK_KMSG_LEVEL_ALERT	1
+#define IHK_KMSG_LEVEL_CRIT	2
+#define IHK_KMSG_LEVEL_ERR	3
+#define IHK_KMSG_LEVEL_WARNING	4
+#define IHK_KMSG_LEVEL_NOTICE	5
+#define IHK_KMSG_LEVEL_INFO	6
+#define IHK_KMSG_LEVEL_DEBUG	7
+
+struct ihk_kmsg_rec {
+	unsigned long pos;	/* position of the record once committed */
+	unsigned long seq;	/* sequence number, set when reserved */
+	unsigned long ts;	/* time stamp of the writer in ns, 0 if unknown */
+	unsigned int len;	/* bytes of text following the header */
+	unsigned short cpu;	/* LWK CPU of the writer */
+	unsigned char level;	/* IHK_KMSG_LEVEL_* */
+	unsigned char flags;
+};
+
+#define IHK_KMSG_REC_MAX_LEN \
+	(IHK_KMSG_BLOCK_SIZE - sizeof(struct ihk_kmsg_rec))
+
+#define IHK_KMSG_ACCESS_ONCE(x)	(*(volatile __typeof__(x) *)&(x))
+
+/** \brief Bytes taken in the ring by a record of len bytes of text */
+static inline unsigned long ihk_kmsg_rec_size(unsigned int len)
+{
+	return (sizeof(struct ihk_kmsg_rec) + len + IHK_KMSG_REC_ALIGN - 1) &
+		~(unsigned long)(IHK_KMSG_REC_ALIGN - 1);
+}
+
+static inline struct ihk_kmsg_rec *ihk_kmsg_rec(struct ihk_kmsg_buf *kmsg,
+						unsigned long pos)
+{
+	return (struct ihk_kmsg_rec *)(kmsg->str + pos % kmsg->len);
+}
+
+/** \brief Where to write the text of the record reserved at pos */
+static inline char *ihk_kmsg_rec_text(struct ihk_kmsg_buf *kmsg,
+				      unsigned long pos)
+{
+	return (char *)(ihk_kmsg_rec(kmsg, pos) + 1);
+}
+
+/** \brief Empty the ring of len bytes, a multiple of
+ *	IHK_KMSG_BLOCK_SIZE. Every header is marked as not committed so
+ *	that the zeroed one at position 0 isn't taken for a record. */
+static inline void ihk_kmsg_init(struct ihk_kmsg_buf *kmsg, int len)
+{
+	unsigned long pos;
+
+	kmsg->reserve = 0;
+	kmsg->seq = 0;
+	kmsg->head = 0;
+	kmsg->dropped = 0;
+	kmsg->len = len;
+	memset(kmsg->str, 0, len);
+	for (pos = 0; pos < (unsigned long)len; pos += IHK_KMSG_REC_ALIGN) {
+		ihk_kmsg_rec(kmsg, pos)->pos = IHK_KMSG_POS_NONE;
+	}
+}
+
+/** \brief Reserve a record for len bytes of text, at most
+ *	IHK_KMSG_REC_MAX_LEN. A record that would cross a block is moved
+ *	to the next one and the space left behind is committed as a pad
+ *	record. Returns the position to pass to ihk_kmsg_commit(). */
+static inline unsigned long ihk_kmsg_reserve(struct ihk_kmsg_buf *kmsg,
+					     unsigned int len)
+{
+	unsigned long size = ihk_kmsg_rec_size(len);
+	unsigned long old, pos;
+	struct ihk_kmsg_rec *pad;
+
+	do {
+		old = IHK_KMSG_ACCESS_ONCE(kmsg->reserve);
+		pos = old;
+		if (pos / IHK_KMSG_BLOCK_SIZE !=
+		    (pos + size - 1) / IHK_KMSG_BLOCK_SIZE) {
+			pos = (pos + IHK_KMSG_BLOCK_SIZE - 1) &
+				~(unsigned long)(IHK_KMSG_BLOCK_SIZE - 1);
+		}
+	} while (__sync_val_compare_and_swap(&kmsg->reserve, old,
+					     pos + size) != old);
+
+	ihk_kmsg_rec(kmsg, pos)->seq = __sync_fetch_and_add(&kmsg->seq, 1);
+
+	if (pos != old) {
+		pad = ihk_kmsg_rec(kmsg, old);
+		pad->len = pos - old - sizeof(*pad);
+		pad->flags = IHK_KMSG_REC_PAD;
+		__sync_synchronize();
+		IHK_KMSG_ACCESS_ONCE(pad->pos) = old;
+	}
+
+	return pos;
+}
+
+/** \brief Make the record reserved at pos visible to the reader. ts is
+ *	the time stamp in ns of the writer, 0 if it has no clock yet. */
+static inline void ihk_kmsg_commit(struct ihk_kmsg_buf *kmsg,
+				   unsigned long pos, unsigned int len,
+				   int level, int cpu, unsigned long ts)
+{
+	struct ihk_kmsg_rec *rec = ihk_kmsg_rec(kmsg, pos);
+
+	rec->ts = ts;
+	rec->len = len;
+	rec->cpu = cpu;
+	rec->level = level;
+	rec->flags = 0;
+	__sync_synchronize();
+	IHK_KMSG_ACCESS_ONCE(rec->pos) = pos;
+}
+
+/** \brief Append len bytes of text as one record, truncated to
+ *	IHK_KMSG_REC_MAX_LEN. Returns the number of bytes written. */
+static inline unsigned int ihk_kmsg_write(struct ihk_kmsg_buf *kmsg,
+					  const char *str, unsigned int len,
+					  int level, int cpu, unsigned long ts)
+{
+	unsigned long pos;
+
+	if (len > IHK_KMSG_REC_MAX_LEN) {
+		len = IHK_KMSG_REC_MAX_LEN;
+	}
+
+	pos = ihk_kmsg_reserve(kmsg, len);
+	memcpy(ihk_kmsg_rec_text(kmsg, pos), str, len);
+	ihk_kmsg_commit(kmsg, pos, len, level, cpu, ts);
+
+	return len;
+}
+
+/** \brief Move *head to the oldest intact block when the writers have
+ *	lapped it and add the bytes skipped to *dropped */
+static inline unsigned long ihk_kmsg_resync(struct ihk_kmsg_buf *kmsg,
+					    unsigned long head,
+					    unsigned long reserve,
+					    unsigned long *dropped)
+{
+	unsigned long oldest;
+
+	if (reserve - head > (unsigned long)kmsg->len) {
+		oldest = (reserve - kmsg->len + IHK_KMSG_BLOCK_SIZE - 1) &
+			~(unsigned long)(IHK_KMSG_BLOCK_SIZE - 1);
+		*dropped += oldest - head;
+		head = oldest;
+	}
+
+	return head;
+}
+
+/** \brief Copy the text of the records committed from *head up to the
+ *	first one not committed yet to buf, which must hold kmsg->len
+ *	bytes, and move *head past them. When the writers have lapped
+ *	*head, it's moved to the oldest intact block first and the bytes
+ *	skipped are added to *dropped. Returns the number of bytes
+ *	copied. */
+static inline int ihk_kmsg_read(struct ihk_kmsg_buf *kmsg,
+				unsigned long *head, char *buf,
+				unsigned long *dropped)
+{
+	unsigned long start, pos, reserve;
+	struct ihk_kmsg_rec *rec;
+	unsigned int len;
+	int size;
+
+retry:
+	reserve = IHK_KMSG_ACCESS_ONCE(kmsg->reserve);
+	__sync_synchronize();
+	start = ihk_kmsg_resync(kmsg, *head, reserve, dropped);
+
+	pos = start;
+	size = 0;
+	while (pos < reserve) {
+		rec = ihk_kmsg_rec(kmsg, pos);
+		if (IHK_KMSG_ACCESS_ONCE(rec->pos) != pos) {
+			break;
+		}
+		__sync_synchronize();
+
+		len = rec->len;
+		if (len > IHK_KMSG_REC_MAX_LEN) {
+			/* Overwritten, caught below */
+			break;
+		}
+
+		if (!(rec->flags & IHK_KMSG_REC_PAD)) {
+			memcpy(buf + size, rec + 1, len);
+			size += len;
+		}
+		pos += ihk_kmsg_rec_size(len);
+	}
+
+	/* Writers reserving past start + len might have overwritten
+	 * what was just copied
+	 */
+	__sync_synchronize();
+	if (IHK_KMSG_ACCESS_ONCE(kmsg->reserve) - start >
+	    (unsigned long)kmsg->len) {
+		*head = start;
+		goto retry;
+	}
+
+	*head = pos;
+	return size;
+}
+
+/** \brief Copy the header of the first record with text committed from
+ *	*head to rec and its text to text, which must hold
+ *	IHK_KMSG_REC_MAX_LEN bytes, and move *head past it. Lapping is
+ *	handled as in ihk_kmsg_read(). Returns 1 when a record is copied,
+ *	0 when none is committed at *head yet. */
+static inline int ihk_kmsg_read_rec(struct ihk_kmsg_buf *kmsg,
+				    unsigned long *head,
+				    struct ihk_kmsg_rec *rec, char *text,
+				    unsigned long *dropped)
+{
+	unsigned long pos, reserve;
+	struct ihk_kmsg_rec *src;
+
+retry:
+	reserve = IHK_KMSG_ACCESS_ONCE(kmsg->reserve);
+	__sync_synchronize();
+	pos = ihk_kmsg_resync(kmsg, *head, reserve, dropped);
+
+	while (pos < reserve) {
+		src = ihk_kmsg_rec(kmsg, pos);
+		if (IHK_KMSG_ACCESS_ONCE(src->pos) != pos) {
+			break;
+		}
+		__sync_synchronize();
+
+		memcpy(rec, src, sizeof(*rec));
+		if (rec->len <= IHK_KMSG_REC_MAX_LEN &&
+		    !(rec->flags & IHK_KMSG_REC_PAD)) {
+			memcpy(text, src + 1, rec->len);
+		}
+
+		/* Check it hasn't been overwritten while copying */
+		__sync_synchronize();
+		if (IHK_KMSG_ACCESS_ONCE(kmsg->reserve) - pos >
+		    (unsigned long)kmsg->len) {
+			*head = pos;
+			goto retry;
+		}
+
+		if (rec->len > IHK_KMSG_REC_MAX_LEN) {
+			break;
+		}
+
+		pos += ihk_kmsg_rec_size(rec->len);
+		if (!(rec->flags & IHK_KMSG_REC_PAD)) {
+			*head = pos;
+			return 1;
+		}
+	}
+
+	*head = pos;
+	return 0;
+}
+
+#endif
@@ -8,6 +8,24 @@
 #ifndef IHK_MONITOR_H_INCLUDED
 #define IHK_MONITOR_H_INCLUDED
 
+/* NMI mode asking the LWK CPUs to save their hang_info, after the
+ * modes 0 to 4 used by dump and shutdown */
+#define IHK_NMI_MODE_HANG_INFO 5
+
+/* Return addresses saved in hang_info */
+#define IHK_OS_MONITOR_STACK_DEPTH 16
+
+/* Saved by an LWK CPU on the NMI the host sends when it's found hung up */
+struct ihk_os_cpu_hang_info {
+	unsigned long seq;	/* hang_req of the monitor answered */
+	unsigned long ts;	/* time stamp in ns */
+	unsigned long pc;
+	unsigned long sp;
+	unsigned long fp;
+	unsigned long depth;	/* valid entries of stack */
+	unsigned long stack[IHK_OS_MONITOR_STACK_DEPTH];
+};
+
 /** \brief IHK-Monitor */
 struct ihk_os_cpu_monitor {
 	int status;
@@ -25,11 +43,30 @@ struct ihk_os_cpu_monitor {
 	int status_bak;
 	unsigned long counter;
 	unsigned long ocounter;
+	/* Updated by the LWK on each kernel entry */
+	unsigned long last_pc;	/* PC interrupted by the entry */
+	long last_syscall;	/* -1 when not entered by a system call */
+	unsigned long last_ts;	/* time stamp in ns */
+	struct ihk_os_cpu_hang_info hang_info;
 };
 
+/* Number of LWK CPUs covered by the freeze bitmaps */
+#define IHK_OS_MONITOR_MAX_CPUS 2048
+#define IHK_OS_MONITOR_CPU_WORDS \
+	(IHK_OS_MONITOR_MAX_CPUS / (8 * sizeof(unsigned long)))
+
 struct ihk_os_monitor {
 	unsigned long num_processors;
-	unsigned long reserve[128];
+	/* Bit i is set by the host when LWK CPU i is asked to freeze */
+	unsigned long freeze_req[IHK_OS_MONITOR_CPU_WORDS];
+	/* Bit i is set by LWK CPU i once it is frozen. The last CPU to
+	 * complete freeze_req interrupts the host. */
+	unsigned long freeze_ack[IHK_OS_MONITOR_CPU_WORDS];
+	/* Bumped by the host before sending IHK_NMI_MODE_HANG_INFO */
+	unsigned long hang_req;
+	/* Set by the LWK if it answers IHK_NMI_MODE_HANG_INFO */
+	unsigned long hang_info_supported;
+	unsigned long reserve[128 - 2 * IHK_OS_MONITOR_CPU_WORDS - 2];
 	struct ihk_os_cpu_monitor cpu[0]; /* clv[i].monitor = &cpu[i] */
 };
 
@@ -39,6 +76,8 @@ struct ihk_os_monitor {
 enum ihk_os_eventfd_type {
 	IHK_OS_EVENTFD_TYPE_OOM = 0, /* Tell the subscribers that physical memory used exceeds the limit */
 	IHK_OS_EVENTFD_TYPE_STATUS = 2, /* Tell the subscribers that LWK state transitions to hung-up or panic */
+	IHK_OS_EVENTFD_TYPE_STATUS_CHANGE = 3, /* Tell the subscribers that the LWK advanced its boot status */
+	IHK_OS_EVENTFD_TYPE_PANIC = 4, /* Tell the subscribers that the LWK saved its last words on panic */
 	IHK_OS_EVENTFD_TYPE_KMSG = 101,
 	/* Tells the subscribers that kmsg buffer is full. The thread of relaying kmsg is expected to
 	   take the kmsg to free it up. */
@@ -17,6 +17,8 @@
 enum ihk_os_eventfd_type {
 	IHK_OS_EVENTFD_TYPE_OOM = 0, /* Raise an event when physical memory used exceeds the limit */
 	IHK_OS_EVENTFD_TYPE_STATUS = 2, /* Raise an event when detecting hung-up or panic */
+	IHK_OS_EVENTFD_TYPE_STATUS_CHANGE = 3, /* Raise an event when the LWK advances its boot status */
+	IHK_OS_EVENTFD_TYPE_PANIC = 4, /* Raise an event when the LWK panics, see ihk_os_get_panic_info() */
 	IHK_OS_EVENTFD_TYPE_KMSG = 101,
 	/* Raise an event when kmsg buffer is full. The kmsg taker is expected to take the kmsg. */
 };
@@ -32,6 +34,19 @@ struct ihk_ikc_cpu_map {
 	int dst_cpu; /* Linux CPU as IKC destination */
 };
 
+/* Used by ihk_os_launch() */
+struct ihk_os_launch_attr {
+	int *cpus;
+	int num_cpus;
+	struct ihk_mem_chunk *mem_chunks;
+	int num_mem_chunks;
+	struct ihk_ikc_cpu_map *ikc_map; /* NULL for the default map */
+	int num_ikc_map;
+	char *kernel_image;
+	char *kargs;
+	int boot; /* Boot and wait for RUNNING or not */
+};
+
 enum ihklib_os_status {
 	IHK_STATUS_INACTIVE,
 	IHK_STATUS_BOOTING,
@@ -73,6 +88,74 @@ enum ihk_reserve_mem_conf_keys {
 	IHK_RESERVE_MEM_TIMEOUT,
 };
 
+/* Used by ihk_os_kmsg_records() */
+#define IHK_KMSG_RECORD_TEXT_SIZE 4096	/* IHK_KMSG_REC_MAX_LEN and NUL */
+#define IHK_KMSG_RECORD_DROPPED 0x1	/* marker of records lost */
+
+struct ihk_kmsg_record {
+	unsigned long seq;	/* sequence number */
+	unsigned long ts;	/* time stamp of the LWK in ns, 0 if unknown */
+	int cpu;		/* LWK CPU */
+	int level;		/* IHK_KMSG_LEVEL_*, same as syslog priorities */
+	int flags;		/* IHK_KMSG_RECORD_* */
+	unsigned long dropped;	/* number of records lost, for the marker */
+	int len;		/* length of text without NUL */
+	char text[IHK_KMSG_RECORD_TEXT_SIZE];
+};
+
+/* Where ihk_os_kmsg_records() continues. Zero it to start at the
+ * oldest record in the buffer.
+ */
+struct ihk_kmsg_cursor {
+	unsigned long pos;	/* position in the buffer */
+	unsigned long seq;	/* sequence number expected next */
+};
+
+/* Used by ihk_os_get_hang_info() */
+#define IHK_HANG_INFO_STACK_DEPTH 16	/* IHK_OS_MONITOR_STACK_DEPTH */
+
+struct ihk_cpu_hang_info {
+	int cpu;		/* LWK CPU */
+	int status;		/* IHK_OS_MONITOR_* of ihk_monitor.h */
+	int stuck;		/* found stuck in the kernel by IHK */
+	unsigned long counter;	/* heartbeat counter */
+	/* Last kernel entry */
+	unsigned long last_pc;
+	long last_syscall;	/* -1 when not a system call */
+	unsigned long last_ts;	/* time stamp of the LWK in ns */
+	/* Saved on the NMI sent when the OS was found hung up, only
+	 * valid when captured is set
+	 */
+	int captured;
+	unsigned long ts;
+	unsigned long pc;
+	unsigned long sp;
+	unsigned long fp;
+	int depth;		/* valid entries of stack */
+	unsigned long stack[IHK_HANG_INFO_STACK_DEPTH];
+};
+
+/* Used by ihk_os_get_panic_info() */
+#define IHK_PANIC_INFO_MSG_SIZE 256	/* IHK_OS_PANIC_MSG_SIZE */
+#define IHK_PANIC_INFO_NR_REGS 40	/* IHK_OS_PANIC_NR_REGS */
+#define IHK_PANIC_INFO_STACK_DEPTH 16	/* IHK_OS_PANIC_STACK_DEPTH */
+
+/* Last words saved by the first LWK CPU to panic, kept until shutdown */
+struct ihk_panic_info {
+	int cpu;		/* LWK CPU */
+	unsigned long ts;	/* time stamp of the LWK in ns */
+	unsigned long pc;
+	unsigned long sp;
+	unsigned long fp;
+	int nr_regs;		/* valid entries of regs, in the order of
+				 * pt_regs of the LWK
+				 */
+	unsigned long regs[IHK_PANIC_INFO_NR_REGS];
+	int depth;		/* valid entries of stack */
+	unsigned long stack[IHK_PANIC_INFO_STACK_DEPTH];
+	char msg[IHK_PANIC_INFO_MSG_SIZE];
+};
+
 extern int loglevel;
 
 int ihk_reserve_cpu(int index, int* cpus, int num_cpus);
@@ -106,6 +189,8 @@ int ihk_os_release_mem(int index, struct ihk_mem_chunk* mem_chunks, int num_mem_
 int ihk_os_get_eventfd(int index, int type);
 int ihk_os_load(int index, char* fn);
 int ihk_os_kargs(int index, char* kargs);
+int ihk_os_set_bootstrap(int index, int numa_node_number,
+			 unsigned long chunk_addr, int replicate);
 int ihk_os_kargs_str(int os_index, const char *envp, int num_env,
 		     const char *default_kargs);
 int ihk_create_os_str(int dev_index, int *os_index,
@@ -114,11 +199,14 @@ int ihk_create_os_str(int dev_index, int *os_index,
 		      const char *default_kargs,
 		      char *err_msg);
 int ihk_os_boot(int index);
+int ihk_os_launch(int dev_index, struct ihk_os_launch_attr *attr);
 int ihk_os_shutdown(int index);
 int ihk_os_get_status(int index);
 int ihk_os_get_kmsg_size(int index);
 int ihk_os_kmsg(int index, char* kmsg, ssize_t sz_kmsg);
 int ihk_os_clear_kmsg(int index);
+int ihk_os_kmsg_records(int index, struct ihk_kmsg_cursor *cursor,
+			struct ihk_kmsg_record *records, int num_records);
 int ihk_os_get_num_numa_nodes(int index);
 int ihk_os_query_free_mem(int os_index, unsigned long *memfree, int num_numa_nodes);
 int ihk_os_query_total_mem(int os_index, unsigned long *memtotal, int num_numa_nodes);
@@ -130,7 +218,17 @@ int ihk_os_perfctl(int index, int comm);
 int ihk_os_getperfevent(int index, unsigned long *counter, int n);
 int ihk_os_freeze(unsigned long *os_set, int n);
 int ihk_os_thaw(unsigned long *os_set, int n);
+int ihk_os_freeze_cpus(int index, unsigned long *cpu_set, int nr_cpus,
+		       int timeout);
+int ihk_os_get_hang_info(int index, struct ihk_cpu_hang_info *info,
+			 int num_cpus);
+int ihk_os_get_panic_info(int index, struct ihk_panic_info *info);
 int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interactive);
+int ihk_os_makedumpfile_compressed(int index, char *dump_file, int dump_level,
+				   int nr_threads);
+int ihk_os_makedumpfile_stream(int index, int fd, int dump_level);
+int ihk_dump_stream_to_elf(int fd, char *dump_file);
+int ihk_os_snapshot(int index, int fd);
 int ihk_set_loglevel(enum IHKLIB_LOGLEVEL level);
 
 #endif
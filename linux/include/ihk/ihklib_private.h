@@ -127,6 +127,9 @@ int _ihk_reserve_mem_str(int dev_index, char *list, char *err_msg);
 #define IHKLIB_MAX_SIZE_KARGS (1UL << 20)
 #define IHKLIB_LINUX_KMSG_SIZE (4096 - 256)
 
+/* Abstract UNIX socket where ihkmond serves the kmsg history of an OS */
+#define IHKMOND_HISTORY_SOCKET "ihkmond/mcos%d"
+
 /* taking more than this percentage of memory would
  * make Linux panic due to out of memory
  */
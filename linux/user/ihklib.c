@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <sys/eventfd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <linux/limits.h>
 #include <sched.h>
 #include <linux/version.h>
@@ -30,6 +31,7 @@
 #include <ihk/ihk_host_user.h>
 #include <ihk/ihklib.h>
 #include <ihk/ihklib_private.h>
+#include <ihk/ihk_kmsg_ring.h>
 
 //#define DEBUG
 
@@ -2804,6 +2806,8 @@ int ihk_os_get_eventfd(int index, int type)
 	switch (type) {
 	case IHK_OS_EVENTFD_TYPE_OOM:
 	case IHK_OS_EVENTFD_TYPE_STATUS:
+	case IHK_OS_EVENTFD_TYPE_STATUS_CHANGE:
+	case IHK_OS_EVENTFD_TYPE_PANIC:
 	case IHK_OS_EVENTFD_TYPE_KMSG:
 		break;
 	default:
@@ -2949,27 +2953,44 @@ int ihk_os_kargs(int index, char* kargs)
 	return ret;
 }
 
-int ihk_os_boot(int index)
+int ihk_os_set_bootstrap(int index, int numa_node_number,
+			 unsigned long chunk_addr, int replicate)
 {
 	int ret;
 	int fd = -1;
-	int i;
+	struct ihk_bootstrap_req req = {
+		.numa_id = numa_node_number,
+		.chunk_addr = chunk_addr,
+		.replicate = replicate,
+	};
 
-	dprintk("%s: enter\n", __func__);
 	if ((fd = ihklib_os_open(index)) < 0) {
-		dprintf("%s: error: ihklib_os_open returned %d\n",
-			__func__, fd);
+		dprintf("%s: error: ihklib_os_open\n",
+			__func__);
 		ret = fd;
 		goto out;
 	}
 
-	if ((ret = ioctl(fd, IHK_OS_BOOT, 0)) == -1) {
+	ret = ioctl(fd, IHK_OS_SET_BOOTSTRAP, &req);
+	if (ret) {
 		ret = -errno;
-		dprintf("%s: error: IHK_OS_BOOT returned %d\n",
+		dprintf("%s: error: IHK_OS_SET_BOOTSTRAP returned %d\n",
 			__func__, -ret);
 		goto out;
 	}
 
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+static int ihklib_os_wait_for_running(int fd)
+{
+	int ret;
+	int i;
+
 	for (i = 0; i < 50; i++) { /* 10 second */
 		ret = ioctl(fd, IHK_OS_STATUS);
 
@@ -3001,9 +3022,221 @@ int ihk_os_boot(int index)
 
 	ret = 0;
  out:
+	return ret;
+}
+
+int ihk_os_boot(int index)
+{
+	int ret;
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+	if ((fd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open returned %d\n",
+			__func__, fd);
+		ret = fd;
+		goto out;
+	}
+
+	if ((ret = ioctl(fd, IHK_OS_BOOT, 0)) == -1) {
+		ret = -errno;
+		dprintf("%s: error: IHK_OS_BOOT returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+	ret = ihklib_os_wait_for_running(fd);
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+/* Undo a successful IHK_DEVICE_LAUNCH_OS whose OS didn't come up */
+static void ihklib_os_launch_rollback(int dev_index, int os_index,
+				      struct ihk_os_launch_attr *attr)
+{
+	int ret;
+	int i;
+
+	ret = ihk_os_shutdown(os_index);
+	if (ret) {
+		dprintf("%s: error: ihk_os_shutdown returned %d\n",
+			__func__, ret);
+	}
+
+	for (i = 0; i < 50; i++) { /* 10 second */
+		ret = ihk_os_get_status(os_index);
+		if (ret < 0 || ret == IHK_STATUS_INACTIVE) {
+			break;
+		}
+		usleep(200000);
+	}
+
+	ret = ihk_os_release_mem(os_index, attr->mem_chunks,
+				 attr->num_mem_chunks);
+	if (ret) {
+		dprintf("%s: error: ihk_os_release_mem returned %d\n",
+			__func__, ret);
+	}
+
+	ret = ihk_os_release_cpu(os_index, attr->cpus, attr->num_cpus);
+	if (ret) {
+		dprintf("%s: error: ihk_os_release_cpu returned %d\n",
+			__func__, ret);
+	}
+
+	ret = ihk_destroy_os(dev_index, os_index);
+	if (ret) {
+		eprintf("%s: error: failed to destroy OS %d (%d)\n",
+			__func__, os_index, ret);
+	}
+}
+
+int ihk_os_launch(int dev_index, struct ihk_os_launch_attr *attr)
+{
+	int ret, i;
+	int fd = -1, os_fd = -1;
+	struct ihk_os_launch_desc desc = { 0 };
+	int os_index;
+
+	dprintk("%s: enter\n", __func__);
+
+	if (attr == NULL || attr->kernel_image == NULL) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (attr->num_cpus <= 0 || attr->num_cpus > IHK_MAX_NUM_CPUS) {
+		dprintf("%s: error: invalid # of cpus (%d)\n",
+			__func__, attr->num_cpus);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (attr->num_mem_chunks <= 0 ||
+	    attr->num_mem_chunks > IHK_MAX_NUM_MEM_CHUNKS) {
+		dprintf("%s: error: invalid # of chunks (%d)\n",
+			__func__, attr->num_mem_chunks);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (attr->cpus == NULL || attr->mem_chunks == NULL) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (attr->ikc_map) {
+		if (attr->num_ikc_map != attr->num_cpus) {
+			dprintf("%s: error: # of IKC map entries (%d) is"
+				" different than # of cpus (%d)\n",
+				__func__, attr->num_ikc_map, attr->num_cpus);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (attr->kargs &&
+	    strnlen(attr->kargs, IHKLIB_MAX_SIZE_KARGS) ==
+	    IHKLIB_MAX_SIZE_KARGS) {
+		dprintf("%s: error: missing NULL character\n", __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	desc.cpu_req.cpus = attr->cpus;
+	desc.cpu_req.num_cpus = attr->num_cpus;
+
+	desc.mem_req.sizes = calloc(attr->num_mem_chunks, sizeof(size_t));
+	desc.mem_req.numa_ids = calloc(attr->num_mem_chunks, sizeof(int));
+	if (!desc.mem_req.sizes || !desc.mem_req.numa_ids) {
+		dprintf("%s: error: allocating memory request\n",
+			__func__);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < attr->num_mem_chunks; i++) {
+		desc.mem_req.sizes[i] = (size_t)attr->mem_chunks[i].size;
+		desc.mem_req.numa_ids[i] =
+			attr->mem_chunks[i].numa_node_number;
+	}
+	desc.mem_req.num_chunks = attr->num_mem_chunks;
+
+	if (attr->ikc_map) {
+		desc.ikc_req.src_cpus = calloc(attr->num_ikc_map, sizeof(int));
+		desc.ikc_req.dst_cpus = calloc(attr->num_ikc_map, sizeof(int));
+		if (!desc.ikc_req.src_cpus || !desc.ikc_req.dst_cpus) {
+			dprintf("%s: error: allocating IKC map request\n",
+				__func__);
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		for (i = 0; i < attr->num_ikc_map; i++) {
+			desc.ikc_req.src_cpus[i] = attr->ikc_map[i].src_cpu;
+			desc.ikc_req.dst_cpus[i] = attr->ikc_map[i].dst_cpu;
+		}
+		desc.ikc_req.num_cpus = attr->num_ikc_map;
+	}
+
+	desc.image = attr->kernel_image;
+	desc.kargs = attr->kargs;
+	desc.boot = attr->boot;
+
+	if ((fd = ihklib_device_open(dev_index)) < 0) {
+		dprintf("%s: error: ihklib_device_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret = ioctl(fd, IHK_DEVICE_LAUNCH_OS, &desc);
+	if (ret < 0) {
+		ret = -errno;
+		dprintf("%s: error: IHK_DEVICE_LAUNCH_OS returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+	os_index = ret;
+
+	if (attr->boot) {
+		if ((os_fd = ihklib_os_open(os_index)) < 0) {
+			dprintf("%s: error: ihklib_os_open returned %d\n",
+				__func__, os_fd);
+			ret = os_fd;
+			goto rollback;
+		}
+
+		ret = ihklib_os_wait_for_running(os_fd);
+		if (ret) {
+			goto rollback;
+		}
+	}
+
+	ret = os_index;
+	goto out;
+
+ rollback:
+	/* Don't leave a booted OS behind that the caller can't find */
+	if (os_fd != -1) {
+		close(os_fd);
+		os_fd = -1;
+	}
+	ihklib_os_launch_rollback(dev_index, os_index, attr);
+ out:
+	if (os_fd != -1) {
+		close(os_fd);
+	}
 	if (fd != -1) {
 		close(fd);
 	}
+	free(desc.mem_req.sizes);
+	free(desc.mem_req.numa_ids);
+	free(desc.ikc_req.src_cpus);
+	free(desc.ikc_req.dst_cpus);
 	return ret;
 }
 
@@ -3201,6 +3434,102 @@ int ihk_os_clear_kmsg(int index)
 	return ret;
 }
 
+/*
+ * Read the records of the kmsg buffer of OS <index> from <cursor>
+ * through the read-only mapping of the device file without consuming
+ * them. When the LWK has overwritten records not read yet, a record
+ * with IHK_KMSG_RECORD_DROPPED and the number of records lost is
+ * stored before the next one. Returns the number of records stored.
+ */
+int ihk_os_kmsg_records(int index, struct ihk_kmsg_cursor *cursor,
+			struct ihk_kmsg_record *records, int num_records)
+{
+	int ret;
+	int fd = -1;
+	struct ihk_kmsg_buf *kmsg = MAP_FAILED;
+	struct ihk_kmsg_rec rec;
+	struct ihk_kmsg_record *record;
+	unsigned long pos, dropped;
+	int i = 0;
+
+	dprintk("%s: enter\n", __func__);
+
+	if (cursor == NULL || records == NULL || num_records < 0) {
+		dprintf("%s: error: invalid argument\n", __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if ((fd = ihklib_device_open(0)) < 0) {
+		dprintf("%s: error: ihklib_device_open returned %d\n",
+			__func__, fd);
+		ret = fd;
+		goto out;
+	}
+
+	kmsg = mmap(NULL, sizeof(*kmsg), PROT_READ, MAP_SHARED, fd,
+		    IHK_DEVICE_KMSG_MMAP_OFFSET(index));
+	if (kmsg == MAP_FAILED) {
+		ret = -errno;
+		dprintf("%s: error: mmap: %s\n",
+			__func__, strerror(-ret));
+		goto out;
+	}
+
+	while (i < num_records) {
+		record = &records[i];
+		pos = cursor->pos;
+		dropped = 0;
+		if (!ihk_kmsg_read_rec(kmsg, &pos, &rec, record->text,
+				       &dropped)) {
+			cursor->pos = pos;
+			break;
+		}
+
+		/* Records before rec have been overwritten */
+		if (dropped && (long)(rec.seq - cursor->seq) > 0) {
+			memset(record, 0, sizeof(*record));
+			record->seq = cursor->seq;
+			record->flags = IHK_KMSG_RECORD_DROPPED;
+			record->dropped = rec.seq - cursor->seq;
+			record->len = snprintf(record->text,
+					       sizeof(record->text),
+					       "dropped %lu records",
+					       record->dropped);
+			cursor->pos = rec.pos;
+			cursor->seq = rec.seq;
+			i++;
+			continue;
+		}
+
+		record->seq = rec.seq;
+		record->ts = rec.ts;
+		record->cpu = rec.cpu;
+		record->level = rec.level;
+		record->flags = 0;
+		record->dropped = 0;
+		record->len = rec.len;
+		record->text[rec.len] = '\0';
+
+		/* Sequence numbers of racing CPUs may be out of order */
+		cursor->pos = pos;
+		if ((long)(rec.seq + 1 - cursor->seq) > 0) {
+			cursor->seq = rec.seq + 1;
+		}
+		i++;
+	}
+
+	ret = i;
+ out:
+	if (kmsg != MAP_FAILED) {
+		munmap(kmsg, sizeof(*kmsg));
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
 int ihk_os_get_num_numa_nodes(int index)
 {
 	int ret;
@@ -3727,82 +4056,374 @@ int ihk_os_thaw(unsigned long *os_set, int n)
 	return ret;
 }
 
-#ifdef ENABLE_MEMDUMP
-#include <bfd.h>
-#include <inttypes.h>
-#include <time.h>
-#include <limits.h>
-#include <pwd.h>
-
-int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interactive)
+int ihk_os_freeze_cpus(int index, unsigned long *cpu_set, int nr_cpus,
+		       int timeout)
 {
 	int ret;
-	static char hname[HOST_NAME_MAX+1];
-	bfd *abfd = NULL;
-	bfd_boolean ok;
-	asection *scn;
-	dumpargs_t args;
-	unsigned long phys_size, phys_offset;
-	int error, i;
-	size_t bsize;
-	void *buf = NULL;
-	uintptr_t addr;
-	size_t cpsize;
-	time_t t;
-	struct tm *tm;
-	char *date;
-	struct passwd *pw;
-	dump_mem_chunks_t *mem_chunks;
-	long mem_size;
-	char *physmem_name_buf = NULL;
-	char physmem_name[PHYSMEM_NAME_SIZE];
-	int osfd = -1;
-	char *token;
-	int dump_nmi_sent = 0;
+	int fd = -1;
+	struct ihk_freeze_desc desc = {
+		.cpu_set = cpu_set,
+		.nr_cpus = nr_cpus,
+		.timeout = timeout,
+	};
 
 	dprintk("%s: enter\n", __func__);
-	dprintf("%s: index=%d,dump_file=%s,dump_level=%d,interactive=%d\n",
-		__func__, index, dump_file, dump_level, interactive);
-
-	if ((osfd = ihklib_os_open(index)) < 0) {
-		dprintf("%s: error: ihklib_os_open returned %d\n",
-			__func__, osfd);
-		ret = osfd;
-		goto out;
-	}
-
-	ret = ihk_os_get_status(index);
-	if (ret < 0) {
-		dprintf("%s: ihk_os_get_status returned %d\n",
-			__func__, ret);
-		goto out;
-	}
 
-	if (ret == IHK_STATUS_INACTIVE) {
+	if (cpu_set == NULL || nr_cpus <= 0 || timeout < 0) {
+		dprintf("%s: invalid CPU set or timeout\n", __func__);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	t = time(NULL);
-	if (t == (time_t)-1) {
-		ret = -errno;
-		dprintf("%s: error: time returned %d\n",
-			__func__, -ret);
-		goto out;
-	}
-
-	tm = localtime(&t);
-	if (!tm) {
-		ret = -EINVAL;
-		dprintf("%s: error: localtime failed\n",
+	if ((fd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open\n",
 			__func__);
+		ret = fd;
 		goto out;
 	}
 
-	error = gethostname(hname, sizeof(hname));
-	if (error != 0) {
+	ret = ioctl(fd, IHK_OS_FREEZE_VEC, &desc);
+	if (ret) {
 		ret = -errno;
-		dprintf("%s: error: gethostname returned %d\n",
+		dprintf("%s: IHK_OS_FREEZE_VEC returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+int ihk_os_get_hang_info(int index, struct ihk_cpu_hang_info *info,
+			 int num_cpus)
+{
+	int ret;
+	int fd = -1;
+	int i, j;
+	struct ihk_os_cpu_hang_report *reports = NULL;
+	struct ihk_os_hang_info_desc desc = { 0 };
+
+	dprintk("%s: enter\n", __func__);
+
+	if (num_cpus < 0 || (num_cpus > 0 && info == NULL)) {
+		dprintf("%s: invalid buffer\n", __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (num_cpus > 0) {
+		reports = calloc(num_cpus, sizeof(*reports));
+		if (!reports) {
+			dprintf("%s: calloc failed\n", __func__);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	desc.reports = reports;
+	desc.nr_cpus = num_cpus;
+	ret = ioctl(fd, IHK_OS_GET_HANG_INFO, &desc);
+	if (ret) {
+		ret = -errno;
+		dprintf("%s: IHK_OS_GET_HANG_INFO returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+	for (i = 0; i < num_cpus && i < desc.nr_cpus; i++) {
+		struct ihk_os_cpu_hang_report *report = &reports[i];
+
+		memset(&info[i], 0, sizeof(info[i]));
+		info[i].cpu = i;
+		info[i].status = report->status;
+		info[i].stuck = report->stuck;
+		info[i].counter = report->counter;
+		info[i].last_pc = report->last_pc;
+		info[i].last_syscall = report->last_syscall;
+		info[i].last_ts = report->last_ts;
+
+		info[i].captured = report->captured;
+		if (!report->captured) {
+			continue;
+		}
+
+		info[i].ts = report->hang_info.ts;
+		info[i].pc = report->hang_info.pc;
+		info[i].sp = report->hang_info.sp;
+		info[i].fp = report->hang_info.fp;
+		info[i].depth = report->hang_info.depth;
+		if (info[i].depth > IHK_HANG_INFO_STACK_DEPTH) {
+			info[i].depth = IHK_HANG_INFO_STACK_DEPTH;
+		}
+		for (j = 0; j < info[i].depth; j++) {
+			info[i].stack[j] = report->hang_info.stack[j];
+		}
+	}
+
+	/* Number of LWK CPUs, may be more than num_cpus */
+	ret = desc.nr_cpus;
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	free(reports);
+	return ret;
+}
+
+/* Returns -ENOENT when the LWK hasn't panicked */
+int ihk_os_get_panic_info(int index, struct ihk_panic_info *info)
+{
+	int ret;
+	int fd = -1;
+	int i;
+	struct ihk_os_panic_info panic_info = { 0 };
+
+	dprintk("%s: enter\n", __func__);
+
+	if (info == NULL) {
+		dprintf("%s: invalid buffer\n", __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret = ioctl(fd, IHK_OS_GET_PANIC_INFO, &panic_info);
+	if (ret) {
+		ret = -errno;
+		dprintf("%s: IHK_OS_GET_PANIC_INFO returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+	memset(info, 0, sizeof(*info));
+	info->cpu = panic_info.cpu;
+	info->ts = panic_info.ts;
+	info->pc = panic_info.pc;
+	info->sp = panic_info.sp;
+	info->fp = panic_info.fp;
+
+	info->nr_regs = panic_info.nr_regs;
+	if (info->nr_regs > IHK_PANIC_INFO_NR_REGS) {
+		info->nr_regs = IHK_PANIC_INFO_NR_REGS;
+	}
+	for (i = 0; i < info->nr_regs; i++) {
+		info->regs[i] = panic_info.regs[i];
+	}
+
+	info->depth = panic_info.depth;
+	if (info->depth > IHK_PANIC_INFO_STACK_DEPTH) {
+		info->depth = IHK_PANIC_INFO_STACK_DEPTH;
+	}
+	for (i = 0; i < info->depth; i++) {
+		info->stack[i] = panic_info.stack[i];
+	}
+
+	memcpy(info->msg, panic_info.msg, sizeof(info->msg));
+	info->msg[sizeof(info->msg) - 1] = '\0';
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+#ifdef ENABLE_MEMDUMP
+#include <bfd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <limits.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/* Largest page size the driver may map OS memory with */
+#define IHKLIB_OS_MMAP_ALIGN (1UL << 30)
+
+/*
+ * Map [phys, phys + size) of the memory of the OS read-only. The
+ * virtual address is congruent to phys modulo 1 GiB so that the
+ * driver can use PMD / PUD mappings.
+ */
+static void *ihklib_os_mmap(int osfd, unsigned long phys, size_t size)
+{
+	char *resv, *addr;
+	size_t resv_size = size + IHKLIB_OS_MMAP_ALIGN;
+
+	resv = mmap(NULL, resv_size, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (resv == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	addr = resv + ((phys - (unsigned long)resv) &
+		       (IHKLIB_OS_MMAP_ALIGN - 1));
+
+	if (mmap(addr, size, PROT_READ, MAP_SHARED | MAP_FIXED,
+		 osfd, phys) == MAP_FAILED) {
+		dprintf("%s: mmap 0x%lx:%lu failed: %d\n",
+			__func__, phys, size, errno);
+		munmap(resv, resv_size);
+		return MAP_FAILED;
+	}
+
+	if (addr > resv) {
+		munmap(resv, addr - resv);
+	}
+	if (addr + size < resv + resv_size) {
+		munmap(addr + size, resv + resv_size - (addr + size));
+	}
+
+	return addr;
+}
+
+/* Plain loop without early exit so that the compiler vectorizes it */
+static int ihklib_page_is_zero(const void *page)
+{
+	const unsigned long *p = page;
+	unsigned long acc = 0;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++) {
+		acc |= p[i];
+	}
+
+	return acc == 0;
+}
+
+/*
+ * Write size bytes of buf at offset of the section, skipping all-zero
+ * pages. They are left as holes in the file and read back as zeros.
+ * The page at the end of the section is always written so that the
+ * file covers the whole section.
+ */
+static int ihklib_write_sparse(bfd *abfd, asection *scn, const char *buf,
+			       unsigned long offset, size_t size,
+			       unsigned long *skipped)
+{
+	size_t pos, run = 0;
+	int zero, in_run = 0;
+	bfd_boolean ok;
+
+	for (pos = 0; pos < size; pos += PAGE_SIZE) {
+		zero = size - pos >= PAGE_SIZE &&
+			offset + pos + PAGE_SIZE < scn->size &&
+			ihklib_page_is_zero(buf + pos);
+
+		if (!zero && !in_run) {
+			run = pos;
+			in_run = 1;
+		} else if (zero && in_run) {
+			ok = bfd_set_section_contents(abfd, scn, buf + run,
+						      offset + run, pos - run);
+			if (!ok) {
+				return -EINVAL;
+			}
+			in_run = 0;
+		}
+
+		if (zero) {
+			*skipped += PAGE_SIZE;
+		}
+	}
+
+	if (in_run) {
+		ok = bfd_set_section_contents(abfd, scn, buf + run,
+					      offset + run, size - run);
+		if (!ok) {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interactive)
+{
+	int ret;
+	static char hname[HOST_NAME_MAX+1];
+	bfd *abfd = NULL;
+	bfd_boolean ok;
+	asection *scn;
+	dumpargs_t args;
+	unsigned long phys_size, phys_offset;
+	int error, i;
+	size_t bsize;
+	void *buf = NULL;
+	uintptr_t addr;
+	size_t cpsize;
+	time_t t;
+	struct tm *tm;
+	char *date;
+	struct passwd *pw;
+	dump_mem_chunks_t *mem_chunks;
+	long mem_size;
+	char *physmem_name_buf = NULL;
+	char physmem_name[PHYSMEM_NAME_SIZE];
+	int osfd = -1;
+	char *token;
+	int dump_nmi_sent = 0;
+	void *map;
+	unsigned long skipped = 0;
+
+	dprintk("%s: enter\n", __func__);
+	dprintf("%s: index=%d,dump_file=%s,dump_level=%d,interactive=%d\n",
+		__func__, index, dump_file, dump_level, interactive);
+
+	if ((osfd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open returned %d\n",
+			__func__, osfd);
+		ret = osfd;
+		goto out;
+	}
+
+	ret = ihk_os_get_status(index);
+	if (ret < 0) {
+		dprintf("%s: ihk_os_get_status returned %d\n",
+			__func__, ret);
+		goto out;
+	}
+
+	if (ret == IHK_STATUS_INACTIVE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	t = time(NULL);
+	if (t == (time_t)-1) {
+		ret = -errno;
+		dprintf("%s: error: time returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+	tm = localtime(&t);
+	if (!tm) {
+		ret = -EINVAL;
+		dprintf("%s: error: localtime failed\n",
+			__func__);
+		goto out;
+	}
+
+	error = gethostname(hname, sizeof(hname));
+	if (error != 0) {
+		ret = -errno;
+		dprintf("%s: error: gethostname returned %d\n",
 			__func__, -ret);
 		goto out;
 	}
@@ -3975,243 +4596,1252 @@ int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interact
 			goto out;
 		}
 
-		ok = bfd_set_section_flags(abfd, scn, SEC_HAS_CONTENTS);
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_flags: %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
+		ok = bfd_set_section_flags(abfd, scn, SEC_HAS_CONTENTS);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_flags: %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+	}
+	pw = getpwuid(getuid());
+	if (pw) {
+		cpsize = strlen(pw->pw_name);
+		scn = bfd_make_section_anyway(abfd, "user");
+		if (!scn) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_make_section_anyway(user): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+
+		ok = bfd_set_section_size(abfd, scn, cpsize);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_size: %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+
+		ok = bfd_set_section_flags(abfd, scn, SEC_HAS_CONTENTS);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_flags: %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+	}
+
+	/* Add section for physical memory chunks information */
+	scn = bfd_make_section_anyway(abfd, "physchunks");
+	if (!scn) {
+		ret = -EINVAL;
+		dprintf("%s: error: "
+			"bfd_make_section_anyway(physchunks): %s\n",
+			__func__, bfd_errmsg(bfd_get_error()));
+		goto out;
+	}
+
+	ok = bfd_set_section_size(abfd, scn, mem_size);
+	if (!ok) {
+		ret = -EINVAL;
+		dprintf("%s: error: "
+			"bfd_set_section_size: %s\n",
+			__func__, bfd_errmsg(bfd_get_error()));
+		goto out;
+	}
+
+	ok = bfd_set_section_flags(abfd, scn, SEC_ALLOC|SEC_HAS_CONTENTS);
+	if (!ok) {
+		ret = -EINVAL;
+		dprintf("%s: error: "
+			"bfd_set_section_flags: %s\n",
+			__func__, bfd_errmsg(bfd_get_error()));
+		goto out;
+	}
+
+	for (i = 0; i < mem_chunks->nr_chunks; ++i) {
+
+		physmem_name_buf = malloc(PHYSMEM_NAME_SIZE);
+		memset(physmem_name_buf,0,PHYSMEM_NAME_SIZE);
+		sprintf(physmem_name_buf, "physmem%d",i);
+
+		/* Physical memory contents section */
+		scn = bfd_make_section_anyway(abfd, physmem_name_buf);
+		if (!scn) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_make_section_anyway(physmem): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+
+		if (interactive) {
+			ok = bfd_set_section_size(abfd, scn, PAGE_SIZE);
+		}
+		else {
+			ok = bfd_set_section_size(abfd, scn, mem_chunks->chunks[i].size);
+		}
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_size: %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+
+		ok = bfd_set_section_flags(abfd, scn, SEC_ALLOC|SEC_HAS_CONTENTS);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_flags: %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+
+		scn->vma = mem_chunks->chunks[i].addr;
+	}
+
+	scn = bfd_get_section_by_name(abfd, "date");
+	if (scn) {
+		ok = bfd_set_section_contents(abfd, scn, date, 0, scn->size);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_contents(date): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+	}
+
+	scn = bfd_get_section_by_name(abfd, "hostname");
+	if (scn) {
+		ok = bfd_set_section_contents(abfd, scn, hname, 0, scn->size);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_contents(hostname): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+	}
+
+	scn = bfd_get_section_by_name(abfd, "user");
+	if (scn) {
+		ok = bfd_set_section_contents(abfd, scn, pw->pw_name, 0, scn->size);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_contents(user): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+	}
+
+	scn = bfd_get_section_by_name(abfd, "physchunks");
+	if (scn) {
+		ok = bfd_set_section_contents(abfd, scn, mem_chunks, 0, mem_size);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_set_section_contents(physchunks): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+	}
+
+	if (interactive) {
+		ret = 0;
+		goto out;
+	}
+
+	for (i = 0; i < mem_chunks->nr_chunks; ++i) {
+
+		phys_offset = 0;
+
+		memset(physmem_name,0,sizeof(physmem_name));
+		sprintf(physmem_name, "physmem%d",i);
+
+		scn = bfd_get_section_by_name(abfd, physmem_name);
+		if (!scn) {
+			ret = -EINVAL;
+			dprintf("%s: error: "
+				"bfd_get_section_by_name(physmem_name): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
+		}
+
+		/* Write straight from a mapping of the OS memory */
+		map = ihklib_os_mmap(osfd, mem_chunks->chunks[i].addr,
+				     mem_chunks->chunks[i].size);
+		if (map != MAP_FAILED) {
+			ret = ihklib_write_sparse(abfd, scn, map, 0,
+						  mem_chunks->chunks[i].size,
+						  &skipped);
+			munmap(map, mem_chunks->chunks[i].size);
+			if (ret) {
+				dprintf("%s: error: "
+					"bfd_set_section_contents(physmem): %s\n",
+					__func__, bfd_errmsg(bfd_get_error()));
+				goto out;
+			}
+			continue;
+		}
+
+		/* Driver without mmap support, copy with DUMP_READ */
+		for (addr = mem_chunks->chunks[i].addr;
+				addr < (mem_chunks->chunks[i].addr + mem_chunks->chunks[i].size);
+				addr += cpsize) {
+
+			cpsize = (mem_chunks->chunks[i].addr + mem_chunks->chunks[i].size) - addr;
+			if (cpsize > bsize) {
+				cpsize = bsize;
+			}
+
+			args.cmd = DUMP_READ;
+			args.start = addr;
+			args.size = cpsize;
+			args.buf = buf;
+
+			error = ioctl(osfd, IHK_OS_DUMP, &args);
+			if (error != 0) {
+				ret = -errno;
+				dprintf("%s: error: DUMP_HEAD returned %d\n",
+					__func__, -ret);
+				goto out;
+			}
+
+			ret = ihklib_write_sparse(abfd, scn, buf, phys_offset,
+						  cpsize, &skipped);
+			if (ret) {
+				dprintf("%s: error: "
+					"bfd_set_section_contents(physmem): %s\n",
+					__func__, bfd_errmsg(bfd_get_error()));
+				goto out;
+			}
+
+			phys_offset += cpsize;
+		}
+	}
+
+	dprintf("%s: %lu of %lu bytes are zero, left as holes\n",
+		__func__, skipped, phys_size);
+
+	ret = 0;
+ out:
+	if (dump_nmi_sent) {
+		args.cmd = DUMP_NMI_CONT;
+		ioctl(osfd, IHK_OS_DUMP, &args);
+	}
+
+	if (abfd) {
+		ok = bfd_close(abfd);
+		if (!ok) {
+			ret = -EINVAL;
+			dprintf("%s: error: bfd_close: %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+		}
+	}
+	if (osfd >= 0) {
+		error = close(osfd);
+		if (error) {
+			ret = -errno;
+			dprintf("%s: error: close: %s\n",
+				__func__, strerror(-ret));
+		}
+	}
+	return ret;
+}
+
+static int ihklib_write_all(int fd, const void *data, size_t size)
+{
+	ssize_t written;
+	size_t len;
+
+	for (len = 0; len < size; len += written) {
+		written = write(fd, (const char *)data + len, size - len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				written = 0;
+				continue;
+			}
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns -EIO when the stream ends before size bytes */
+static int ihklib_read_all(int fd, void *data, size_t size)
+{
+	ssize_t nread;
+	size_t len;
+
+	for (len = 0; len < size; len += nread) {
+		nread = read(fd, (char *)data + len, size - len);
+		if (nread < 0) {
+			if (errno == EINTR) {
+				nread = 0;
+				continue;
+			}
+			return -errno;
+		}
+		if (nread == 0) {
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+static int ihklib_block_is_zero(const char *buf, size_t size)
+{
+	size_t pos;
+
+	if (size % PAGE_SIZE) {
+		return 0;
+	}
+
+	for (pos = 0; pos < size; pos += PAGE_SIZE) {
+		if (!ihklib_page_is_zero(buf + pos)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void ihklib_sdump_header_init(struct ihk_sdump_header *header,
+				     int dump_level)
+{
+	time_t t;
+	struct tm *tm;
+	struct passwd *pw;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, IHK_SDUMP_MAGIC, sizeof(header->magic));
+	header->version = IHK_SDUMP_VERSION;
+	header->dump_level = dump_level;
+
+	t = time(NULL);
+	tm = (t == (time_t)-1) ? NULL : localtime(&t);
+	if (tm) {
+		strftime(header->date, sizeof(header->date),
+			 "%a %b %e %H:%M:%S %Y", tm);
+	}
+	gethostname(header->hostname, sizeof(header->hostname) - 1);
+	pw = getpwuid(getuid());
+	if (pw) {
+		strncpy(header->user, pw->pw_name, sizeof(header->user) - 1);
+	}
+}
+
+/* Write the header and the table of the areas */
+static int ihklib_sdump_write_head(int fd, struct ihk_sdump_header *header,
+				   dump_mem_chunks_t *mem_chunks,
+				   long mem_size)
+{
+	int ret;
+	int i;
+
+	header->chunks_size = mem_size;
+	header->data_size = 0;
+	for (i = 0; i < mem_chunks->nr_chunks; i++) {
+		header->data_size += mem_chunks->chunks[i].size;
+	}
+
+	ret = ihklib_write_all(fd, header, sizeof(*header));
+	if (ret) {
+		dprintf("%s: error: writing header: %d\n",
+			__func__, -ret);
+		return ret;
+	}
+
+	ret = ihklib_write_all(fd, mem_chunks, mem_size);
+	if (ret) {
+		dprintf("%s: error: writing mem_chunks: %d\n",
+			__func__, -ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Lets the reader tell a complete stream from a truncated one */
+static int ihklib_sdump_write_end(int fd)
+{
+	struct ihk_sdump_block block;
+	int ret;
+
+	memset(&block, 0, sizeof(block));
+	block.flags = IHK_SDUMP_END;
+	ret = ihklib_write_all(fd, &block, sizeof(block));
+	if (ret) {
+		dprintf("%s: error: writing end record: %d\n",
+			__func__, -ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Write the header, the table and the contents of the areas in it to
+ * fd. The areas are read through a mapping when the driver allows it,
+ * with DUMP_READ otherwise.
+ */
+static int ihklib_sdump_write(int osfd, int fd,
+			      struct ihk_sdump_header *header,
+			      dump_mem_chunks_t *mem_chunks, long mem_size)
+{
+	int ret;
+	int i;
+	dumpargs_t args;
+	struct ihk_sdump_block block;
+	unsigned long addr, end;
+	char *buf = NULL;
+	const char *src;
+	void *map = MAP_FAILED;
+
+	buf = malloc(IHK_SDUMP_BLOCK_SIZE);
+	if (!buf) {
+		ret = -ENOMEM;
+		dprintf("%s: error: allocating buf\n", __func__);
+		goto out;
+	}
+
+	ret = ihklib_sdump_write_head(fd, header, mem_chunks, mem_size);
+	if (ret) {
+		goto out;
+	}
+
+	memset(&block, 0, sizeof(block));
+	for (i = 0; i < mem_chunks->nr_chunks; i++) {
+		map = ihklib_os_mmap(osfd, mem_chunks->chunks[i].addr,
+				     mem_chunks->chunks[i].size);
+
+		end = mem_chunks->chunks[i].addr + mem_chunks->chunks[i].size;
+		for (addr = mem_chunks->chunks[i].addr; addr < end;
+		     addr += block.size) {
+			block.phys = addr;
+			block.size = (end - addr < IHK_SDUMP_BLOCK_SIZE) ?
+				end - addr : IHK_SDUMP_BLOCK_SIZE;
+
+			if (map != MAP_FAILED) {
+				src = (char *)map +
+					(addr - mem_chunks->chunks[i].addr);
+			} else {
+				memset(&args, 0, sizeof(args));
+				args.cmd = DUMP_READ;
+				args.start = addr;
+				args.size = block.size;
+				args.buf = buf;
+
+				if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+					ret = -errno;
+					dprintf("%s: error: DUMP_READ returned %d\n",
+						__func__, -ret);
+					goto out;
+				}
+				src = buf;
+			}
+
+			block.flags = ihklib_block_is_zero(src, block.size) ?
+				IHK_SDUMP_ZERO : 0;
+
+			ret = ihklib_write_all(fd, &block, sizeof(block));
+			if (!ret && !(block.flags & IHK_SDUMP_ZERO)) {
+				ret = ihklib_write_all(fd, src, block.size);
+			}
+			if (ret) {
+				dprintf("%s: error: writing block 0x%lx: %d\n",
+					__func__, addr, -ret);
+				goto out;
+			}
+		}
+
+		if (map != MAP_FAILED) {
+			munmap(map, mem_chunks->chunks[i].size);
+			map = MAP_FAILED;
+		}
+	}
+
+	ret = ihklib_sdump_write_end(fd);
+ out:
+	if (map != MAP_FAILED) {
+		munmap(map, mem_chunks->chunks[i].size);
+	}
+	free(buf);
+	return ret;
+}
+
+/*
+ * Stop the LWK for a dump of dump_level and get the table of the
+ * memory areas to dump in *mem_chunks, to be freed by the caller.
+ * *nmi_sent is set once DUMP_NMI_CONT is needed to resume the LWK,
+ * even on failure.
+ */
+static int ihklib_dump_start(int index, int osfd, int dump_level,
+			     dump_mem_chunks_t **mem_chunks, long *mem_size,
+			     int *nmi_sent)
+{
+	int ret;
+	dumpargs_t args;
+
+	ret = ihk_os_get_status(index);
+	if (ret < 0) {
+		dprintf("%s: ihk_os_get_status returned %d\n",
+			__func__, ret);
+		return ret;
+	}
+
+	if (ret == IHK_STATUS_INACTIVE) {
+		return -EINVAL;
+	}
+
+	args.cmd = DUMP_SET_LEVEL;
+	args.level = dump_level;
+	if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		dprintf("%s: error: DUMP_SET_LEVEL returned %d\n",
+			__func__, -ret);
+		return ret;
+	}
+
+	args.cmd = DUMP_NMI;
+	if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		dprintf("%s: error: DUMP_NMI returned %d\n",
+			__func__, -ret);
+		return ret;
+	}
+	*nmi_sent = 1;
+
+	args.cmd = DUMP_QUERY_NUM_MEM_AREAS;
+	args.size = 0;
+	if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		dprintf("%s: error: "
+			"DUMP_QUERY_NUM_MEM_AREAS returned %d\n",
+			__func__, -ret);
+		return ret;
+	}
+
+	*mem_size = args.size;
+	*mem_chunks = calloc(1, *mem_size);
+	if (!*mem_chunks) {
+		dprintf("%s: error: allocating mem_chunks\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	args.cmd = DUMP_QUERY_MEM_AREAS;
+	args.buf = (void *)*mem_chunks;
+	if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		dprintf("%s: error: DUMP_QUERY_MEM_AREAS returned %d\n",
+			__func__, -ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Same as ihk_os_makedumpfile(), but the dump is written to fd
+ * sequentially so that it can be a pipe or a socket. The format is
+ * described in ihk_host_user.h (struct ihk_sdump_header).
+ */
+int ihk_os_makedumpfile_stream(int index, int fd, int dump_level)
+{
+	int ret;
+	int osfd = -1;
+	dumpargs_t args;
+	struct ihk_sdump_header header;
+	dump_mem_chunks_t *mem_chunks = NULL;
+	long mem_size;
+	int dump_nmi_sent = 0;
+
+	dprintk("%s: enter\n", __func__);
+	dprintf("%s: index=%d,fd=%d,dump_level=%d\n",
+		__func__, index, fd, dump_level);
+
+	if ((osfd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open returned %d\n",
+			__func__, osfd);
+		ret = osfd;
+		goto out;
+	}
+
+	ihklib_sdump_header_init(&header, dump_level);
+
+	ret = ihklib_dump_start(index, osfd, dump_level, &mem_chunks,
+				&mem_size, &dump_nmi_sent);
+	if (ret) {
+		goto out;
+	}
+
+	ret = ihklib_sdump_write(osfd, fd, &header, mem_chunks, mem_size);
+ out:
+	if (dump_nmi_sent) {
+		args.cmd = DUMP_NMI_CONT;
+		ioctl(osfd, IHK_OS_DUMP, &args);
+	}
+
+	if (osfd >= 0) {
+		close(osfd);
+	}
+	free(mem_chunks);
+	return ret;
+}
+
+struct ihklib_zdump {
+	int osfd;
+	int fd;
+	struct ihk_sdump_block *blocks;	/* in the order of the stream */
+	/* Source of each block in a mapping, NULL to use DUMP_READ */
+	const char **srcs;
+	unsigned long nr_blocks;
+	unsigned long next_block;	/* claimed atomically */
+	unsigned long next_write;	/* protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* next_write or error changed */
+	int error;
+};
+
+/*
+ * Read and compress blocks in parallel with the other threads, and
+ * write them when it's their turn so that the stream stays in the
+ * order of the table.
+ */
+static void *ihklib_zdump_thread(void *arg)
+{
+	struct ihklib_zdump *zd = arg;
+	struct ihk_sdump_block block;
+	dumpargs_t args;
+	char *buf = NULL;
+	Bytef *cbuf = NULL;
+	uLongf clen;
+	const char *src;
+	const void *data;
+	size_t len;
+	unsigned long i;
+	int ret = 0;
+
+	buf = malloc(IHK_SDUMP_BLOCK_SIZE);
+	cbuf = malloc(compressBound(IHK_SDUMP_BLOCK_SIZE));
+	if (!buf || !cbuf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (!zd->error) {
+		i = __sync_fetch_and_add(&zd->next_block, 1);
+		if (i >= zd->nr_blocks)
+			break;
+
+		block = zd->blocks[i];
+		src = zd->srcs[i];
+
+		if (!src) {
+			memset(&args, 0, sizeof(args));
+			args.cmd = DUMP_READ;
+			args.start = block.phys;
+			args.size = block.size;
+			args.buf = buf;
+
+			if (ioctl(zd->osfd, IHK_OS_DUMP, &args)) {
+				ret = -errno;
+				dprintf("%s: error: DUMP_READ returned %d\n",
+					__func__, -ret);
+				goto out;
+			}
+			src = buf;
+		}
+
+		clen = compressBound(IHK_SDUMP_BLOCK_SIZE);
+		if (ihklib_block_is_zero(src, block.size)) {
+			block.flags = IHK_SDUMP_ZERO;
+			data = NULL;
+			len = 0;
+		} else if (compress2(cbuf, &clen, (const Bytef *)src,
+				     block.size, Z_BEST_SPEED) == Z_OK &&
+			   clen < block.size) {
+			block.flags = IHK_SDUMP_ZLIB;
+			block.csize = clen;
+			data = cbuf;
+			len = clen;
+		} else {
+			data = src;
+			len = block.size;
+		}
+
+		pthread_mutex_lock(&zd->lock);
+		while (!zd->error && zd->next_write != i) {
+			pthread_cond_wait(&zd->cond, &zd->lock);
+		}
+		if (zd->error) {
+			pthread_mutex_unlock(&zd->lock);
+			break;
+		}
+
+		ret = ihklib_write_all(zd->fd, &block, sizeof(block));
+		if (!ret && data) {
+			ret = ihklib_write_all(zd->fd, data, len);
+		}
+		if (!ret) {
+			zd->next_write++;
+			pthread_cond_broadcast(&zd->cond);
+		}
+		pthread_mutex_unlock(&zd->lock);
+
+		if (ret) {
+			dprintf("%s: error: writing block 0x%lx: %d\n",
+				__func__, block.phys, -ret);
+			goto out;
+		}
+	}
+
+ out:
+	if (ret) {
+		pthread_mutex_lock(&zd->lock);
+		if (!zd->error)
+			zd->error = ret;
+		pthread_cond_broadcast(&zd->cond);
+		pthread_mutex_unlock(&zd->lock);
+	}
+	free(cbuf);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Same as ihk_os_makedumpfile_stream(), but nr_threads threads read
+ * blocks of the LWK memory and compress them with zlib in parallel.
+ * The dump is written to dump_file and ihk_dump_stream_to_elf()
+ * converts it to ELF. nr_threads <= 0 means the number of online CPUs.
+ */
+int ihk_os_makedumpfile_compressed(int index, char *dump_file, int dump_level,
+				   int nr_threads)
+{
+	int ret;
+	int error, i;
+	dumpargs_t args;
+	struct ihk_sdump_header header;
+	struct ihklib_zdump zd = {
+		.osfd = -1,
+		.fd = -1,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	dump_mem_chunks_t *mem_chunks = NULL;
+	long mem_size;
+	unsigned long addr, end, nr_blocks;
+	pthread_t *threads = NULL;
+	void **maps = NULL;
+	int nr_started = 0;
+	int dump_nmi_sent = 0;
+
+	dprintk("%s: enter\n", __func__);
+	dprintf("%s: index=%d,dump_file=%s,dump_level=%d,nr_threads=%d\n",
+		__func__, index, dump_file, dump_level, nr_threads);
+
+	if (dump_file == NULL) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (nr_threads <= 0) {
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_threads <= 0)
+			nr_threads = 1;
+	}
+
+	if ((zd.osfd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open returned %d\n",
+			__func__, zd.osfd);
+		ret = zd.osfd;
+		goto out;
+	}
+
+	ihklib_sdump_header_init(&header, dump_level);
+
+	ret = ihklib_dump_start(index, zd.osfd, dump_level, &mem_chunks,
+				&mem_size, &dump_nmi_sent);
+	if (ret) {
+		goto out;
+	}
+
+	/* Split the areas into blocks, the unit of work of the threads */
+	nr_blocks = 0;
+	for (i = 0; i < mem_chunks->nr_chunks; i++) {
+		nr_blocks += (mem_chunks->chunks[i].size +
+			      IHK_SDUMP_BLOCK_SIZE - 1) / IHK_SDUMP_BLOCK_SIZE;
+	}
+
+	zd.blocks = calloc(nr_blocks ? nr_blocks : 1,
+			   sizeof(struct ihk_sdump_block));
+	zd.srcs = calloc(nr_blocks ? nr_blocks : 1,
+			 sizeof(*zd.srcs));
+	maps = calloc(mem_chunks->nr_chunks ? mem_chunks->nr_chunks : 1,
+		      sizeof(*maps));
+	if (!zd.blocks || !zd.srcs || !maps) {
+		ret = -ENOMEM;
+		dprintf("%s: error: allocating blocks\n",
+			__func__);
+		goto out;
+	}
+
+	zd.nr_blocks = 0;
+	for (i = 0; i < mem_chunks->nr_chunks; i++) {
+		/* Read through a mapping when the driver allows it */
+		maps[i] = ihklib_os_mmap(zd.osfd, mem_chunks->chunks[i].addr,
+					 mem_chunks->chunks[i].size);
+		if (maps[i] == MAP_FAILED) {
+			maps[i] = NULL;
+		}
+
+		end = mem_chunks->chunks[i].addr + mem_chunks->chunks[i].size;
+		for (addr = mem_chunks->chunks[i].addr; addr < end;
+		     addr += IHK_SDUMP_BLOCK_SIZE) {
+			if (maps[i]) {
+				zd.srcs[zd.nr_blocks] = (char *)maps[i] +
+					(addr - mem_chunks->chunks[i].addr);
+			}
+			zd.blocks[zd.nr_blocks].phys = addr;
+			zd.blocks[zd.nr_blocks].size =
+				(end - addr < IHK_SDUMP_BLOCK_SIZE) ?
+				end - addr : IHK_SDUMP_BLOCK_SIZE;
+			zd.nr_blocks++;
+		}
+	}
+
+	zd.fd = open(dump_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (zd.fd < 0) {
+		ret = -errno;
+		dprintf("%s: error: opening %s: %d\n",
+			__func__, dump_file, -ret);
+		goto out;
+	}
+
+	ret = ihklib_sdump_write_head(zd.fd, &header, mem_chunks, mem_size);
+	if (ret) {
+		goto out;
+	}
+
+	if ((unsigned long)nr_threads > zd.nr_blocks)
+		nr_threads = zd.nr_blocks ? zd.nr_blocks : 1;
+
+	threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		error = pthread_create(&threads[i], NULL,
+				       ihklib_zdump_thread, &zd);
+		if (error) {
+			pthread_mutex_lock(&zd.lock);
+			if (!zd.error)
+				zd.error = -error;
+			pthread_cond_broadcast(&zd.cond);
+			pthread_mutex_unlock(&zd.lock);
+			dprintf("%s: error: pthread_create returned %d\n",
+				__func__, error);
+			break;
+		}
+		nr_started++;
+	}
+
+	for (i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (zd.error) {
+		ret = zd.error;
+		goto out;
+	}
+
+	ret = ihklib_sdump_write_end(zd.fd);
+ out:
+	if (dump_nmi_sent) {
+		args.cmd = DUMP_NMI_CONT;
+		ioctl(zd.osfd, IHK_OS_DUMP, &args);
+	}
+
+	if (zd.fd >= 0) {
+		if (close(zd.fd) && !ret) {
+			ret = -errno;
+		}
+	}
+	if (zd.osfd >= 0) {
+		close(zd.osfd);
+	}
+	if (maps) {
+		for (i = 0; i < mem_chunks->nr_chunks; i++) {
+			if (maps[i]) {
+				munmap(maps[i], mem_chunks->chunks[i].size);
+			}
+		}
+	}
+	free(maps);
+	free(threads);
+	free(zd.srcs);
+	free(zd.blocks);
+	free(mem_chunks);
+	return ret;
+}
+
+/*
+ * Write the memory the LWK has written since the previous call, all of
+ * it on the first call, to fd in the format of
+ * ihk_os_makedumpfile_stream(). The LWK keeps running. A page written
+ * while it is being copied is reported again by the next call, so
+ * applying the snapshots in order converges to the LWK memory.
+ */
+int ihk_os_snapshot(int index, int fd)
+{
+	int ret;
+	int osfd = -1;
+	dumpargs_t args;
+	struct ihk_sdump_header header;
+	dump_mem_chunks_t *mem_chunks = NULL;
+	long mem_size;
+
+	dprintk("%s: enter\n", __func__);
+	dprintf("%s: index=%d,fd=%d\n", __func__, index, fd);
+
+	if ((osfd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: error: ihklib_os_open returned %d\n",
+			__func__, osfd);
+		ret = osfd;
+		goto out;
+	}
+
+	ret = ihk_os_get_status(index);
+	if (ret < 0) {
+		dprintf("%s: ihk_os_get_status returned %d\n",
+			__func__, ret);
+		goto out;
+	}
+
+	if (ret == IHK_STATUS_INACTIVE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ihklib_sdump_header_init(&header, DUMP_LEVEL_ALL);
+
+	memset(&args, 0, sizeof(args));
+	args.cmd = DUMP_QUERY_NUM_DIRTY_AREAS;
+	if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		dprintf("%s: error: "
+			"DUMP_QUERY_NUM_DIRTY_AREAS returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+	mem_size = args.size;
+	mem_chunks = calloc(1, mem_size);
+	if (!mem_chunks) {
+		ret = -ENOMEM;
+		dprintf("%s: error: allocating mem_chunks\n",
+			__func__);
+		goto out;
+	}
+
+	/* Ranges dirtied after the query above are left for the next call */
+	args.cmd = DUMP_QUERY_DIRTY_AREAS;
+	args.size = mem_size;
+	args.buf = (void *)mem_chunks;
+	if (ioctl(osfd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		dprintf("%s: error: DUMP_QUERY_DIRTY_AREAS returned %d\n",
+			__func__, -ret);
+		goto out;
+	}
+
+	ret = ihklib_sdump_write(osfd, fd, &header, mem_chunks, mem_size);
+ out:
+	if (osfd >= 0) {
+		close(osfd);
+	}
+	free(mem_chunks);
+	return ret;
+}
+
+static asection *ihklib_bfd_make_section(bfd *abfd, const char *name,
+					 size_t size, flagword flags)
+{
+	asection *scn;
+
+	scn = bfd_make_section_anyway(abfd, name);
+	if (!scn) {
+		dprintf("%s: error: bfd_make_section_anyway(%s): %s\n",
+			__func__, name, bfd_errmsg(bfd_get_error()));
+		return NULL;
+	}
+
+	if (!bfd_set_section_size(abfd, scn, size) ||
+	    !bfd_set_section_flags(abfd, scn, flags)) {
+		dprintf("%s: error: setting up section %s: %s\n",
+			__func__, name, bfd_errmsg(bfd_get_error()));
+		return NULL;
+	}
+
+	return scn;
+}
+
+/*
+ * Convert a stream written by ihk_os_makedumpfile_stream() and read
+ * from fd into the ELF dump written by ihk_os_makedumpfile(). All-zero
+ * pages are left as holes in the file.
+ */
+int ihk_dump_stream_to_elf(int fd, char *dump_file)
+{
+	int ret;
+	int i;
+	bfd *abfd = NULL;
+	struct ihk_sdump_header header;
+	struct ihk_sdump_block block;
+	dump_mem_chunks_t *mem_chunks = NULL;
+	asection **scns = NULL;
+	asection *scn;
+	char (*names)[PHYSMEM_NAME_SIZE] = NULL;
+	char *buf = NULL;
+	Bytef *cbuf = NULL;
+	uLongf len;
+	unsigned long offset, skipped = 0;
+	const char *strs[] = { "date", "hostname", "user" };
+	char *vals[] = { header.date, header.hostname, header.user };
+	size_t lens[] = { sizeof(header.date), sizeof(header.hostname),
+			  sizeof(header.user) };
+
+	dprintk("%s: enter\n", __func__);
+
+	if (dump_file == NULL) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = ihklib_read_all(fd, &header, sizeof(header));
+	if (ret) {
+		dprintf("%s: error: reading header: %d\n", __func__, -ret);
+		goto out;
+	}
+
+	if (memcmp(header.magic, IHK_SDUMP_MAGIC, sizeof(header.magic)) ||
+	    header.version != IHK_SDUMP_VERSION ||
+	    header.chunks_size < sizeof(dump_mem_chunks_t)) {
+		ret = -EINVAL;
+		dprintf("%s: error: not a stream dump\n", __func__);
+		goto out;
 	}
-	pw = getpwuid(getuid());
-	if (pw) {
-		cpsize = strlen(pw->pw_name);
-		scn = bfd_make_section_anyway(abfd, "user");
-		if (!scn) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_make_section_anyway(user): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
 
-		ok = bfd_set_section_size(abfd, scn, cpsize);
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_size: %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
+	mem_chunks = malloc(header.chunks_size);
+	buf = malloc(IHK_SDUMP_BLOCK_SIZE);
+	cbuf = malloc(compressBound(IHK_SDUMP_BLOCK_SIZE));
+	if (!mem_chunks || !buf || !cbuf) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-		ok = bfd_set_section_flags(abfd, scn, SEC_HAS_CONTENTS);
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_flags: %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
+	ret = ihklib_read_all(fd, mem_chunks, header.chunks_size);
+	if (ret) {
+		dprintf("%s: error: reading mem_chunks: %d\n",
+			__func__, -ret);
+		goto out;
 	}
 
-	/* Add section for physical memory chunks information */
-	scn = bfd_make_section_anyway(abfd, "physchunks");
-	if (!scn) {
+	if (mem_chunks->nr_chunks < 0 ||
+	    sizeof(dump_mem_chunks_t) + mem_chunks->nr_chunks *
+	    sizeof(struct dump_mem_chunk) > header.chunks_size) {
 		ret = -EINVAL;
-		dprintf("%s: error: "
-			"bfd_make_section_anyway(physchunks): %s\n",
-			__func__, bfd_errmsg(bfd_get_error()));
+		dprintf("%s: error: invalid number of chunks: %d\n",
+			__func__, mem_chunks->nr_chunks);
 		goto out;
 	}
 
-	ok = bfd_set_section_size(abfd, scn, mem_size);
-	if (!ok) {
+	scns = calloc(mem_chunks->nr_chunks + 1, sizeof(*scns));
+	names = calloc(mem_chunks->nr_chunks + 1, sizeof(*names));
+	if (!scns || !names) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	bfd_init();
+
+	abfd = bfd_fopen(dump_file, NULL, "w", -1);
+	if (!abfd) {
 		ret = -EINVAL;
-		dprintf("%s: error: "
-			"bfd_set_section_size: %s\n",
+		dprintf("%s: bfd_fopen failed: %s\n",
 			__func__, bfd_errmsg(bfd_get_error()));
 		goto out;
 	}
 
-	ok = bfd_set_section_flags(abfd, scn, SEC_ALLOC|SEC_HAS_CONTENTS);
-	if (!ok) {
+	if (!bfd_set_format(abfd, bfd_object)) {
 		ret = -EINVAL;
-		dprintf("%s: error: "
-			"bfd_set_section_flags: %s\n",
+		dprintf("%s: error: bfd_set_format: %s\n",
 			__func__, bfd_errmsg(bfd_get_error()));
 		goto out;
 	}
 
-	for (i = 0; i < mem_chunks->nr_chunks; ++i) {
-
-		physmem_name_buf = malloc(PHYSMEM_NAME_SIZE);
-		memset(physmem_name_buf,0,PHYSMEM_NAME_SIZE);
-		sprintf(physmem_name_buf, "physmem%d",i);
-
-		/* Physical memory contents section */
-		scn = bfd_make_section_anyway(abfd, physmem_name_buf);
-		if (!scn) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_make_section_anyway(physmem): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
-
-		if (interactive) {
-			ok = bfd_set_section_size(abfd, scn, PAGE_SIZE);
-		}
-		else {
-			ok = bfd_set_section_size(abfd, scn, mem_chunks->chunks[i].size);
-		}
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_size: %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
+	/* Same sections as ihk_os_makedumpfile() */
+	for (i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+		if (!strnlen(vals[i], lens[i])) {
+			continue;
 		}
-
-		ok = bfd_set_section_flags(abfd, scn, SEC_ALLOC|SEC_HAS_CONTENTS);
-		if (!ok) {
+		if (!ihklib_bfd_make_section(abfd, strs[i],
+					     strnlen(vals[i], lens[i]),
+					     SEC_HAS_CONTENTS)) {
 			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_flags: %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
 			goto out;
 		}
-
-		scn->vma = mem_chunks->chunks[i].addr;
 	}
 
-	scn = bfd_get_section_by_name(abfd, "date");
-	if (scn) {
-		ok = bfd_set_section_contents(abfd, scn, date, 0, scn->size);
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_contents(date): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
+	if (!ihklib_bfd_make_section(abfd, "physchunks", header.chunks_size,
+				     SEC_ALLOC | SEC_HAS_CONTENTS)) {
+		ret = -EINVAL;
+		goto out;
 	}
 
-	scn = bfd_get_section_by_name(abfd, "hostname");
-	if (scn) {
-		ok = bfd_set_section_contents(abfd, scn, hname, 0, scn->size);
-		if (!ok) {
+	for (i = 0; i < mem_chunks->nr_chunks; i++) {
+		snprintf(names[i], sizeof(names[i]), "physmem%d", i);
+		scns[i] = ihklib_bfd_make_section(abfd, names[i],
+						  mem_chunks->chunks[i].size,
+						  SEC_ALLOC | SEC_HAS_CONTENTS);
+		if (!scns[i]) {
 			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_contents(hostname): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
 			goto out;
 		}
+		scns[i]->vma = mem_chunks->chunks[i].addr;
 	}
 
-	scn = bfd_get_section_by_name(abfd, "user");
-	if (scn) {
-		ok = bfd_set_section_contents(abfd, scn, pw->pw_name, 0, scn->size);
-		if (!ok) {
+	for (i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+		scn = bfd_get_section_by_name(abfd, strs[i]);
+		if (scn && !bfd_set_section_contents(abfd, scn, vals[i], 0,
+						     scn->size)) {
 			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_contents(user): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
 			goto out;
 		}
 	}
 
 	scn = bfd_get_section_by_name(abfd, "physchunks");
-	if (scn) {
-		ok = bfd_set_section_contents(abfd, scn, mem_chunks, 0, mem_size);
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_set_section_contents(physchunks): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-			goto out;
-		}
-	}
-
-	if (interactive) {
-		ret = 0;
+	if (!bfd_set_section_contents(abfd, scn, mem_chunks, 0,
+				      header.chunks_size)) {
+		ret = -EINVAL;
+		dprintf("%s: error: "
+			"bfd_set_section_contents(physchunks): %s\n",
+			__func__, bfd_errmsg(bfd_get_error()));
 		goto out;
 	}
 
-	for (i = 0; i < mem_chunks->nr_chunks; ++i) {
+	i = 0;
+	offset = 0;
+	for (;;) {
+		ret = ihklib_read_all(fd, &block, sizeof(block));
+		if (ret) {
+			dprintf("%s: error: reading block record: %d\n",
+				__func__, -ret);
+			goto out;
+		}
 
-		phys_offset = 0;
+		/* Move on to the next area when this one is complete */
+		while (i < mem_chunks->nr_chunks &&
+		       offset == mem_chunks->chunks[i].size) {
+			i++;
+			offset = 0;
+		}
 
-		memset(physmem_name,0,sizeof(physmem_name));
-		sprintf(physmem_name, "physmem%d",i);
+		if (block.flags & IHK_SDUMP_END) {
+			break;
+		}
 
-		scn = bfd_get_section_by_name(abfd, physmem_name);
-		if (!scn) {
+		if (i >= mem_chunks->nr_chunks ||
+		    block.phys != mem_chunks->chunks[i].addr + offset ||
+		    block.size > IHK_SDUMP_BLOCK_SIZE ||
+		    block.size > mem_chunks->chunks[i].size - offset) {
 			ret = -EINVAL;
-			dprintf("%s: error: "
-				"bfd_get_section_by_name(physmem_name): %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
+			dprintf("%s: error: unexpected block 0x%lx:%u\n",
+				__func__, block.phys, block.size);
 			goto out;
 		}
 
-		for (addr = mem_chunks->chunks[i].addr;
-				addr < (mem_chunks->chunks[i].addr + mem_chunks->chunks[i].size);
-				addr += cpsize) {
-
-			cpsize = (mem_chunks->chunks[i].addr + mem_chunks->chunks[i].size) - addr;
-			if (cpsize > bsize) {
-				cpsize = bsize;
+		if (block.flags & IHK_SDUMP_ZERO) {
+			memset(buf, 0, block.size);
+		} else if (block.flags & IHK_SDUMP_ZLIB) {
+			if (block.csize > compressBound(IHK_SDUMP_BLOCK_SIZE)) {
+				ret = -EINVAL;
+				dprintf("%s: error: block 0x%lx: "
+					"invalid compressed size %lu\n",
+					__func__, block.phys, block.csize);
+				goto out;
 			}
 
-			args.cmd = DUMP_READ;
-			args.start = addr;
-			args.size = cpsize;
-			args.buf = buf;
-
-			error = ioctl(osfd, IHK_OS_DUMP, &args);
-			if (error != 0) {
-				ret = -errno;
-				dprintf("%s: error: DUMP_HEAD returned %d\n",
-					__func__, -ret);
+			ret = ihklib_read_all(fd, cbuf, block.csize);
+			if (ret) {
+				dprintf("%s: error: reading block 0x%lx: %d\n",
+					__func__, block.phys, -ret);
 				goto out;
 			}
 
-			ok = bfd_set_section_contents(abfd, scn, buf, phys_offset, cpsize);
-			if (!ok) {
+			len = block.size;
+			if (uncompress((Bytef *)buf, &len, cbuf,
+				       block.csize) != Z_OK ||
+			    len != block.size) {
 				ret = -EINVAL;
-				dprintf("%s: error: "
-					"bfd_set_section_contents(physmem): %s\n",
-					__func__, bfd_errmsg(bfd_get_error()));
+				dprintf("%s: error: inflating block 0x%lx "
+					"failed\n", __func__, block.phys);
+				goto out;
+			}
+		} else {
+			ret = ihklib_read_all(fd, buf, block.size);
+			if (ret) {
+				dprintf("%s: error: reading block 0x%lx: %d\n",
+					__func__, block.phys, -ret);
 				goto out;
 			}
+		}
 
-			phys_offset += cpsize;
+		ret = ihklib_write_sparse(abfd, scns[i], buf, offset,
+					  block.size, &skipped);
+		if (ret) {
+			dprintf("%s: error: "
+				"bfd_set_section_contents(physmem): %s\n",
+				__func__, bfd_errmsg(bfd_get_error()));
+			goto out;
 		}
-	}
 
-	ret = 0;
- out:
-	if (dump_nmi_sent) {
-		args.cmd = DUMP_NMI_CONT;
-		ioctl(osfd, IHK_OS_DUMP, &args);
+		offset += block.size;
 	}
 
-	if (abfd) {
-		ok = bfd_close(abfd);
-		if (!ok) {
-			ret = -EINVAL;
-			dprintf("%s: error: bfd_close: %s\n",
-				__func__, bfd_errmsg(bfd_get_error()));
-		}
+	if (i < mem_chunks->nr_chunks) {
+		ret = -EIO;
+		dprintf("%s: error: stream ends in area %d\n", __func__, i);
+		goto out;
 	}
-	if (osfd >= 0) {
-		error = close(osfd);
-		if (error) {
-			ret = -errno;
-			dprintf("%s: error: close: %s\n",
-				__func__, strerror(-ret));
-		}
+
+	dprintf("%s: %lu of %lu bytes are zero, left as holes\n",
+		__func__, skipped, header.data_size);
+
+	ret = 0;
+ out:
+	if (abfd && !bfd_close(abfd) && !ret) {
+		ret = -EINVAL;
+		dprintf("%s: error: bfd_close: %s\n",
+			__func__, bfd_errmsg(bfd_get_error()));
 	}
+	free(names);
+	free(scns);
+	free(cbuf);
+	free(buf);
+	free(mem_chunks);
 	return ret;
 }
 #else /* ENABLE_MEMDUMP */
@@ -4221,6 +5851,35 @@ int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interact
 	fprintf(stderr, "dump is not supported.\n");
 	return -ENOSYS;
 }
+
+int ihk_os_makedumpfile_compressed(int index, char *dump_file, int dump_level,
+				   int nr_threads)
+{
+	dprintk("%s: enter\n", __func__);
+	fprintf(stderr, "dump is not supported.\n");
+	return -ENOSYS;
+}
+
+int ihk_os_makedumpfile_stream(int index, int fd, int dump_level)
+{
+	dprintk("%s: enter\n", __func__);
+	fprintf(stderr, "dump is not supported.\n");
+	return -ENOSYS;
+}
+
+int ihk_dump_stream_to_elf(int fd, char *dump_file)
+{
+	dprintk("%s: enter\n", __func__);
+	fprintf(stderr, "dump is not supported.\n");
+	return -ENOSYS;
+}
+
+int ihk_os_snapshot(int index, int fd)
+{
+	dprintk("%s: enter\n", __func__);
+	fprintf(stderr, "dump is not supported.\n");
+	return -ENOSYS;
+}
 #endif /* ENABLE_MEMDUMP */
 
 /*
@@ -5145,21 +6804,22 @@ int ihk_create_os_str(int dev_index, int *_os_index,
 		}
 	}
 
-	ret = ihk_os_load(os_index, (char *)kernel_image);
+	/* Kernel arguments may choose the bootstrap NUMA node */
+	ret = ihk_os_kargs(os_index, kargs);
 	if (ret) {
 		if (err_msg) {
 			sprintf(err_msg,
-				"%s:%d: ihk_os_load failed with %d\n",
+				"%s:%d: ihk_os_kargs failed with %d\n",
 				__FILE__, __LINE__, ret);
 		}
 		goto out;
 	}
 
-	ret = ihk_os_kargs(os_index, kargs);
+	ret = ihk_os_load(os_index, (char *)kernel_image);
 	if (ret) {
 		if (err_msg) {
 			sprintf(err_msg,
-				"%s:%d: ihk_os_kargs failed with %d\n",
+				"%s:%d: ihk_os_load failed with %d\n",
 				__FILE__, __LINE__, ret);
 		}
 		goto out;
@@ -7,12 +7,14 @@
  * 	Copyright (C) 2017  Masamichi Takagi
  **/
 
-/**  
- *  Kill (and restart) ihkmond when destroying /dev/mcosX without notifying mcudevd by eventfd
- *  to clean-up fd and eventfd
+/**
+ *  One thread watches all the OS instances with epoll. Instances are
+ *  found at start-up and then followed by udev events of /dev/mcosX.
  **/
 
+#define _GNU_SOURCE /* sendmmsg, memrchr */
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -20,18 +22,26 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <pthread.h>
 #include <syslog.h>
+#include <paths.h>
+#include <poll.h>
+#include <time.h>
+#include <zlib.h>
 #include <libudev.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <config.h>
 #include <ihk/ihklib.h>
 #include <ihk/ihklib_private.h>
 #include <ihk/ihk_host_user.h>
+#include <ihk/ihk_kmsg_ring.h>
 
 //#define DEBUG
 
@@ -56,26 +66,125 @@
 		}																\
 	} while(0)
 
-#define IHKMOND_SIZE_FILEBUF_SLOT (1 * (1ULL << 20))
-#define IHKMOND_NUM_FILEBUF_SLOTS 64
-#define IHKMOND_TMP "/tmp/ihkmond"
+#define IHKMOND_HISTORY_BLOCK_SIZE (256 * (1UL << 10)) /* Before compression */
+#define IHKMOND_HISTORY_BUDGET 64 /* Default memory budget in MiB */
+#define IHKMOND_SYSLOG_BATCH 64 /* Messages per sendmmsg() */
+#define IHKMOND_SYSLOG_TIMEOUT 1000 /* ms to wait for syslogd to make room */
+#define IHKMOND_MAX_EVENTS 16 /* Events taken per epoll_wait() */
+
+/* Block of kmsg history compressed with zlib */
+struct history_block {
+	struct history_block *next;
+	unsigned long start; /* Offset in the history of the first byte */
+	size_t len; /* Bytes before compression */
+	size_t clen; /* Bytes of data */
+	unsigned char data[];
+};
+
+/* kmsg history of an OS instance, kept after it's destroyed until it's
+ * created again. Offsets count the bytes taken since then. */
+struct kmsg_history {
+	struct history_block *oldest;
+	struct history_block *newest;
+	size_t size; /* Memory taken by the blocks */
+	size_t budget; /* Limit of size, the oldest blocks are evicted */
+	char *open; /* Lines not compressed yet */
+	size_t open_len;
+	unsigned long start; /* Offset of the oldest byte kept */
+	unsigned long end; /* Offset past the newest byte */
+	unsigned long forwarded; /* Offset forwarded to syslog up to */
+};
 
-struct thr_args {
-	pthread_t thread;
-	pthread_mutex_t lock;
-	int mcos_added;
-	pthread_cond_t cond_mcos_added; /* Cond for add event */
-	int ret; /* Return value */
+/* kmsg_buf of an OS instance */
+struct kmsg_map {
+	void *handle; /* Returned by IHK_DEVICE_GET_KMSG_BUF */
+	struct ihk_kmsg_buf *kmsg; /* Read-only mapping, NULL if not mapped */
+	unsigned long head; /* Position read up to in the mapping */
+	unsigned long dropped; /* Bytes overwritten before read */
+	unsigned long dropped_reported;
+};
+
+/* Forwarder of kmsg lines to the local syslog socket */
+struct syslog_fwd {
+	int fd; /* Connected to _PATH_LOG, -1 to fall back to syslog() */
+	int facility;
+	const char *logid;
+	int num_msgs; /* Messages queued */
+	int prios[IHKMOND_SYSLOG_BATCH];
+	struct mmsghdr msgs[IHKMOND_SYSLOG_BATCH];
+	struct iovec iovs[IHKMOND_SYSLOG_BATCH][2];
+	char hdrs[IHKMOND_SYSLOG_BATCH][128];
+	unsigned long sent; /* Messages accepted by the socket */
+	unsigned long dropped; /* Messages given up on */
+	unsigned long dropped_reported;
+	int stalled; /* Waited IHKMOND_SYSLOG_TIMEOUT in vain, don't wait */
+};
+
+/* What an epoll event is about */
+enum watch_type {
+	WATCH_UDEV, /* Add and remove of /dev/mcosX */
+	WATCH_HUNGUP_TIMER,
+	WATCH_KMSG,
+	WATCH_STATUS,
+	WATCH_HISTORY_LISTEN,
+	WATCH_HISTORY_CLIENT,
+};
+
+/* Pointed to by epoll_event.data.ptr */
+struct watch {
+	enum watch_type type;
+	void *obj; /* struct mcos or struct history_client */
+};
+
+/* OS instance, kept after it's destroyed for its kmsg history */
+struct mcos {
+	struct mcos *next;
+	int os_index;
+	int added; /* /dev/mcosX exists */
+	int add_failed; /* Setting up failed, retried by the hungup timer */
+	int evfd_kmsg; /* Notification of new messages */
+	int evfd_status; /* Notification of panic or hungup */
+	struct watch watch_kmsg;
+	struct watch watch_status;
+	struct kmsg_map map;
+#ifndef ENABLE_KMSG_REDIRECT
+	struct kmsg_history *history;
+	int lfd; /* Listening for ihkosctl kmsg --history */
+	struct watch watch_listen;
+#endif
+};
 
-	int dev_index; /* device index */
-	int os_index; /* OS index */
-	int facility; /* facility field for syslog */
-	char* logid; /* id field for syslog */
-	int interval; /* Polling interval */
+/* ihkosctl kmsg --history being served without blocking */
+struct history_client {
+	int fd;
+	struct mcos *mcos;
+	unsigned long from; /* Offset in the history to take next */
+	char *buf; /* Chunk of the history */
+	char *data; /* Part of the chunk not sent yet */
+	size_t len;
+	struct watch watch;
+};
 
-	int evfd_mcos_removed; /* Remove event */
+struct ihkmond {
+	int epfd;
+	/* Device to send requests to. The driver looks OS instances up
+	 * by index in tables shared by all devices. */
+	int dev_index;
+	int enable_kmsg;
+	int interval; /* Polling interval (in second) for hungup, -1 to disable */
+	size_t history_budget;
+	struct mcos *mcos_list;
+	struct syslog_fwd fwd;
+	struct udev *udev;
+	struct udev_monitor *mon_mcos;
+	int tfd; /* Hungup polling timer */
+	struct watch watch_udev;
+	struct watch watch_timer;
 };
 
+/* Messages read at a time, too large for the stack */
+static char kmsg_buf[IHK_KMSG_SIZE + 1];
+
 struct facility_list {
 		char name[12];
 		int code;
@@ -107,129 +216,113 @@ static ssize_t reap_event(int evfd) {
 	return ret;
 }
 
-static void* detect_hungup(void* _arg) {
-	struct thr_args *arg = (struct thr_args *)_arg;
-	int devfd = -1, epfd = -1;
-	struct epoll_event event;
-	struct epoll_event events[1];
-	int ret = 0, ret_lib;
-	int i;
-	char fn[32];
-	struct stat st;
-
-	epfd = epoll_create(1);
-	CHKANDJUMP(epfd == -1, 255, "epoll_create failed\n");
-	
-	memset(&event, 0, sizeof(struct epoll_event));
-	event.events = EPOLLIN;
-	event.data.fd = arg->evfd_mcos_removed;
-	ret_lib = epoll_ctl(epfd, EPOLL_CTL_ADD, arg->evfd_mcos_removed, &event);
-	CHKANDJUMP(ret_lib != 0, -EINVAL, "epoll_ctl failed\n");
-
- wait_for_add:
-	dprintf("wait_for_add,os_index=%d\n", arg->os_index);
-
-	ret_lib = pthread_mutex_lock(&arg->lock);
-	CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_lock failed\n");
-	while (arg->mcos_added == 0) {
-		ret_lib = pthread_cond_wait(&arg->cond_mcos_added, &arg->lock);
-	}
-	arg->mcos_added = 0;
-	pthread_mutex_unlock(&arg->lock);
-
-	i = 0;
-	snprintf(fn, sizeof(fn), "/dev/mcos%d", arg->os_index);
-	while (stat(fn, &st) == -1) {
-		CHKANDJUMP(errno != ENOENT, -errno,
-			"/dev/mcosX access failed\n");
-		usleep(200);
-		i++;
-
-		/* about 10s timeout check */
-		CHKANDJUMP(50 * 1000 < i, -ETIMEDOUT,
-			"/dev/mcosX create timeout\n");
-	}
-
- next:
-	dprintf("next\n");
-
-	devfd = ihklib_device_open(arg->os_index);
-	if (devfd < 0) {
-		dprintf("%s: error: ihklib_device_open failed with %d\n",
+/* Map kmsg_buf so that new messages are read in place instead of
+ * having the driver copy the whole buffer. Falls back to
+ * IHK_DEVICE_READ_KMSG_BUF when it fails, e.g. with an older driver.
+ */
+static void map_kmsg(int devfd, int os_index, struct kmsg_map *map)
+{
+	map->kmsg = mmap(NULL, sizeof(struct ihk_kmsg_buf), PROT_READ,
+			 MAP_SHARED, devfd,
+			 IHK_DEVICE_KMSG_MMAP_OFFSET(os_index));
+	if (map->kmsg == MAP_FAILED) {
+		dprintf("%s: mmap failed with %d, using ioctl\n",
 			__func__, errno);
-		ret = devfd;
-		goto out;
+		map->kmsg = NULL;
+		return;
 	}
 
-	ret_lib = ioctl(devfd, IHK_DEVICE_DETECT_HUNGUP,
-			(unsigned long)arg->dev_index);
-	if(ret_lib == -1) {
-		if(errno == EAGAIN) { /* OS is booting */
-			dprintf("%s: ioctl IHK_DEVICE_DETECT_HUNGUP returned EAGAIN\n", __FUNCTION__);
-		} else {
-			dprintf("%s: ioctl IHK_DEVICE_DETECT_HUNGUP returned %s\n", __FUNCTION__, strerror(errno));
-		}
-	} else {
-		dprintf("%s: ioctl IHK_DEVICE_DETECT_HUNGUP returned %d\n", __FUNCTION__, ret_lib);
+	map->head = IHK_KMSG_ACCESS_ONCE(map->kmsg->head);
+}
+
+static void unmap_kmsg(struct kmsg_map *map)
+{
+	if (map->kmsg) {
+		munmap(map->kmsg, sizeof(struct ihk_kmsg_buf));
+		map->kmsg = NULL;
 	}
-	close(devfd);
-	devfd = -1;
+}
 
-	do {
-		int nfd = epoll_wait(epfd, events, 1, arg->interval * 1000);
-		if (nfd < 0 && errno == EINTR)
-			continue;
-		CHKANDJUMP(nfd < 0, -EINVAL, "epoll_wait failed\n");
-		if (nfd == 0) {
-			goto next;
-		}
-		for (i = 0; i < nfd; i++) {
-			if (events[i].data.fd == arg->evfd_mcos_removed) {
-				dprintf("mcos remove event detected\n");
-				ret = reap_event(events[i].data.fd);
-				if (ret) {
-					dprintf("%s: warning: reap_event failed with %d\n",
-						__func__, ret);
-				}
-				goto wait_for_add;
-			}
+/* Copy the messages not read yet to buf, which must hold IHK_KMSG_SIZE
+ * bytes, and consume them when shift is set
+ */
+static ssize_t read_kmsg(int dev_index, struct kmsg_map *map, char *buf,
+			 int shift)
+{
+	ssize_t nread;
+	int devfd = -1;
+	unsigned long head, kmsg_head, dropped = 0;
+	struct ihk_device_read_kmsg_buf_desc desc = {
+		.handle = map->handle, .shift = shift, .buf = buf };
+	struct ihk_device_shift_kmsg_buf_desc desc_shift = {
+		.handle = map->handle };
+
+	if (!map->kmsg) {
+		devfd = ihklib_device_open(dev_index);
+		if (devfd < 0) {
+			return -errno;
 		}
-	} while (1);
 
-out:
-	if (devfd >= 0) {
+		nread = ioctl(devfd, IHK_DEVICE_READ_KMSG_BUF,
+			      (unsigned long)&desc);
+		if (nread < 0) {
+			nread = -errno;
+		}
 		close(devfd);
+		return nread;
+	}
+
+	/* Skip what has been consumed by others, e.g. ihkosctl kmsg -c */
+	kmsg_head = IHK_KMSG_ACCESS_ONCE(map->kmsg->head);
+	if ((long)(kmsg_head - map->head) > 0) {
+		map->head = kmsg_head;
+	}
+
+	head = map->head;
+	nread = ihk_kmsg_read(map->kmsg, &head, buf, &dropped);
+	if (!shift) {
+		return nread;
+	}
+	map->head = head;
+	map->dropped += dropped;
+
+	if (head == kmsg_head) {
+		return nread;
 	}
-	if (epfd >= 0) {
-		close(epfd);
+
+	/* The header is read-only, let the driver move the cursor so
+	 * that the LWK sees the space freed
+	 */
+	desc_shift.head = head;
+	desc_shift.dropped = dropped;
+	devfd = ihklib_device_open(dev_index);
+	if (devfd < 0) {
+		return -errno;
 	}
-	arg->ret = ret;
-	return NULL;
+
+	if (ioctl(devfd, IHK_DEVICE_SHIFT_KMSG_BUF, &desc_shift)) {
+		nread = -errno;
+	}
+	close(devfd);
+	return nread;
 }
 
 #ifdef ENABLE_KMSG_REDIRECT
-static int printk_kmsg(int dev_index, void *handle)
+static int printk_kmsg(int dev_index, struct kmsg_map *map)
 {
 	int ret;
-	int devfd = -1;
 	ssize_t nread;
-	char buf[IHK_KMSG_SIZE];
+	char *buf = kmsg_buf;
 	char *car, *cdr;
-	struct ihk_device_read_kmsg_buf_desc desc = {
-		.handle = handle, .shift = 1, .buf = buf };
-
-	devfd = ihklib_device_open(dev_index);
-	CHKANDJUMP(devfd < 0, -errno, "ihklib_device_open returned %d\n",
-		   -errno);
 
-	nread = ioctl(devfd, IHK_DEVICE_READ_KMSG_BUF, (unsigned long)&desc);
-	CHKANDJUMP(nread < 0 || nread > IHK_KMSG_SIZE, nread, "ioctl failed\n");
+	nread = read_kmsg(dev_index, map, buf, 1);
+	CHKANDJUMP(nread < 0 || nread > IHK_KMSG_SIZE, nread,
+		   "read_kmsg failed\n");
 	if (nread == 0) {
 		dprintf("nread is zero\n");
 		goto out;
 	}
-	close(devfd);
-	devfd = -1;
+	buf[nread] = 0;
 
 	cdr = buf;
 	while ((car = strsep(&cdr, "\n"))) {
@@ -239,123 +332,405 @@ static int printk_kmsg(int dev_index, void *handle)
 
 	ret = 0;
  out:
-	if (devfd >= 0) {
-		close(devfd);
-	}
 	return ret;
 }
 #endif
 
-static int fwrite_kmsg(int dev_index, void* handle, int os_index, FILE **fps, int *sizes, int *prod, int shift) {
+#ifndef ENABLE_KMSG_REDIRECT
+/* Move the lines of the open block to a new compressed block. Lines are
+ * kept whole so that a block can be forwarded on its own unless a line
+ * is longer than a block. */
+static int history_seal(struct kmsg_history *h)
+{
 	int ret = 0, ret_lib;
-	int devfd = -1;
-	ssize_t nread;
-	char buf[IHK_KMSG_SIZE];
-	char fn[256];
-	int next_slot = 0;
-	struct ihk_device_read_kmsg_buf_desc desc = {
-		.handle = handle, .shift = shift, .buf = buf };
-	
-	devfd = ihklib_device_open(dev_index);
-	CHKANDJUMP(devfd < 0, -errno, "ihklib_device_open returned %d\n",
-		   -errno);
+	struct history_block *block = NULL, *shrunk, *evicted;
+	char *eol;
+	size_t len;
+	uLongf clen;
+
+	eol = memrchr(h->open, '\n', h->open_len);
+	len = eol ? eol - h->open + 1 : h->open_len;
+
+	clen = compressBound(len);
+	block = malloc(sizeof(*block) + clen);
+	CHKANDJUMP(block == NULL, -ENOMEM, "malloc failed\n");
+
+	ret_lib = compress2(block->data, &clen, (Bytef *)h->open, len,
+			    Z_BEST_SPEED);
+	CHKANDJUMP(ret_lib != Z_OK, -EINVAL, "compress2 returned %d\n",
+		   ret_lib);
+
+	/* Give back what compression saved */
+	shrunk = realloc(block, sizeof(*block) + clen);
+	if (shrunk) {
+		block = shrunk;
+	}
+	block->next = NULL;
+	block->start = h->end - h->open_len;
+	block->len = len;
+	block->clen = clen;
 
-	nread = ioctl(devfd, IHK_DEVICE_READ_KMSG_BUF, (unsigned long)&desc);
-	CHKANDJUMP(nread < 0 || nread > IHK_KMSG_SIZE, nread, "ioctl failed\n");
-	if (nread == 0) {
-		dprintf("nread is zero\n");
-		goto out;
+	if (h->newest) {
+		h->newest->next = block;
+	} else {
+		h->oldest = block;
 	}
-	close(devfd);
-	devfd = -1;
+	h->newest = block;
+	h->size += sizeof(*block) + clen;
+	block = NULL;
+
+	/* Evict the oldest lines to stay within the budget */
+	while (h->size > h->budget && h->oldest != h->newest) {
+		evicted = h->oldest;
+		h->oldest = evicted->next;
+		h->start = h->oldest->start;
+		h->size -= sizeof(*evicted) + evicted->clen;
+		free(evicted);
+	}
+ out:
+	/* On failure the lines are lost rather than stop taking kmsg,
+	 * history_read() skips the hole */
+	memmove(h->open, h->open + len, h->open_len - len);
+	h->open_len -= len;
+	free(block);
+	return ret;
+}
+
+/* Append kmsg text to the history */
+static void history_append(struct kmsg_history *h, const char *buf,
+			   size_t len)
+{
+	size_t n;
 
-	if (sizes[*prod] + nread > IHKMOND_SIZE_FILEBUF_SLOT) {
-		*prod = (*prod + 1) % IHKMOND_NUM_FILEBUF_SLOTS;
-		next_slot = 1;
+	while (len > 0) {
+		n = IHKMOND_HISTORY_BLOCK_SIZE - h->open_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(h->open + h->open_len, buf, n);
+		h->open_len += n;
+		h->end += n;
+		buf += n;
+		len -= n;
+
+		if (h->open_len == IHKMOND_HISTORY_BLOCK_SIZE) {
+			history_seal(h);
+		}
 	}
+}
 
-	if (next_slot || fps[*prod] == NULL) {
-		if (fps[*prod] == NULL) {
-			sprintf(fn, IHKMOND_TMP);
-			ret_lib = mkdir(fn, 0755);
-			CHKANDJUMP(ret_lib != 0 && errno != EEXIST, -errno, "mkdir failed\n");
+/* Drop the history, called when a new instance is created */
+static void history_reset(struct kmsg_history *h)
+{
+	struct history_block *block;
+
+	while ((block = h->oldest)) {
+		h->oldest = block->next;
+		free(block);
+	}
+	h->newest = NULL;
+	h->size = 0;
+	h->open_len = 0;
+	h->start = h->end = h->forwarded = 0;
+}
+
+/* Pass the history from *from to the end to func() in chunks of at most
+ * IHKMOND_HISTORY_BLOCK_SIZE bytes, decompressed to buf. *from is moved
+ * past what is passed, skipping what has been evicted. Stops when
+ * func() returns non-zero, so that a reader can take one chunk at a
+ * time. */
+static int history_read(struct kmsg_history *h, unsigned long *from,
+			char *buf, int (*func)(void *, char *, size_t),
+			void *arg)
+{
+	int ret = 0, ret_lib;
+	struct history_block *block;
+	unsigned long start;
+	uLongf len;
+
+	do {
+		if (*from < h->start) {
+			*from = h->start;
+		}
+		if (*from >= h->end) {
+			break;
+		}
+
+		for (block = h->oldest; block; block = block->next) {
+			if (*from < block->start + block->len) {
+				break;
+			}
+		}
 
-			sprintf(fn, IHKMOND_TMP "/mcos%d", os_index);
-			ret_lib = mkdir(fn, 0755);
-			CHKANDJUMP(ret_lib != 0 && errno != EEXIST, -errno, "mkdir failed\n");
+		if (block) {
+			start = block->start;
+			len = IHKMOND_HISTORY_BLOCK_SIZE;
+			ret_lib = uncompress((Bytef *)buf, &len, block->data,
+					     block->clen);
 		} else {
-			fclose(fps[*prod]);
-			fps[*prod] = NULL;
+			start = h->end - h->open_len;
+			len = h->open_len;
+			memcpy(buf, h->open, len);
+			ret_lib = Z_OK;
 		}
+		CHKANDJUMP(ret_lib != Z_OK, -EINVAL,
+			   "uncompress returned %d\n", ret_lib);
 
-		sprintf(fn, IHKMOND_TMP "/mcos%d/kmsg%d", os_index, *prod);
-		fps[*prod] = fopen(fn, "w+");
-		CHKANDJUMP(fps[*prod] == NULL, -EINVAL, "fopen failed\n"); 
-		sizes[*prod] = 0;
-		dprintf("fn=%s\n", fn);
+		if (*from < start) {
+			*from = start;
+		}
+		len -= *from - start;
+		ret = func(arg, buf + (*from - start), len);
+		*from += len;
+	} while (ret == 0);
+ out:
+	return ret;
+}
+
+static int history_kmsg(int dev_index, struct kmsg_map *map,
+			struct kmsg_history *h, int shift)
+{
+	int ret = 0;
+	ssize_t nread;
+	char *buf = kmsg_buf;
+
+	nread = read_kmsg(dev_index, map, buf, shift);
+	CHKANDJUMP(nread < 0 || nread > IHK_KMSG_SIZE, nread,
+		   "read_kmsg failed\n");
+	if (nread == 0) {
+		dprintf("nread is zero\n");
+		goto out;
 	}
 
-	ret = fwrite(buf, 1, nread, fps[*prod]); 
-	sizes[*prod] += nread;
-	dprintf("fwrite returned %d\n", ret);
+	history_append(h, buf, nread);
+	ret = nread;
  out:
-	if (devfd >= 0) {
-		close(devfd);
-	}
 	return ret;
 }
+#endif
 
-static ssize_t syslog_kmsg(FILE **fps, int prod) {
-	int ret = 0;
-	char *buf = NULL;
-	char *cur;
-	char *token;
-	int cons;
-	int i;
+static int syslog_fwd_connect(struct syslog_fwd *fwd)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
-	buf = malloc(IHKMOND_SIZE_FILEBUF_SLOT + 1);
-	CHKANDJUMP(buf == NULL, -ENOMEM, "malloc failed");
+	if (fwd->fd == -1) {
+		fwd->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fwd->fd == -1) {
+			return -errno;
+		}
+	}
 
-	for(i = IHKMOND_NUM_FILEBUF_SLOTS - 1; i >= 0; i--) {
-		if (fps[i] == NULL) {
-			cons = 0;
-			goto no_wrap_around;
+	strncpy(addr.sun_path, _PATH_LOG, sizeof(addr.sun_path) - 1);
+	if (connect(fwd->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fwd->fd);
+		fwd->fd = -1;
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void syslog_fwd_open(struct syslog_fwd *fwd, const char *logid,
+			    int facility)
+{
+	int ret;
+
+	memset(fwd, 0, sizeof(*fwd));
+	fwd->fd = -1;
+	fwd->logid = logid;
+	fwd->facility = facility;
+
+	ret = syslog_fwd_connect(fwd);
+	if (ret) {
+		dprintf("%s: connecting to " _PATH_LOG " failed with %d, "
+			"using syslog()\n", __func__, ret);
+	}
+}
+
+static void syslog_fwd_close(struct syslog_fwd *fwd)
+{
+	if (fwd->fd != -1) {
+		close(fwd->fd);
+		fwd->fd = -1;
+	}
+}
+
+/* Send the queued messages with as few system calls as possible. The
+ * socket is non-blocking so that a slow syslogd is waited for only as
+ * long as it takes to make room, up to IHKMOND_SYSLOG_TIMEOUT, instead
+ * of sleeping after each message. Once that wait has timed out, messages
+ * are dropped without waiting until the socket takes one again, so that
+ * a stalled syslogd doesn't hold up the event loop batch after batch.
+ */
+static void syslog_fwd_flush(struct syslog_fwd *fwd)
+{
+	struct pollfd pfd;
+	int i = 0, n, reconnected = 0;
+
+	if (fwd->fd == -1) {
+		for (i = 0; i < fwd->num_msgs; i++) {
+			syslog(fwd->prios[i], "%.*s",
+			       (int)fwd->iovs[i][1].iov_len,
+			       (char *)fwd->iovs[i][1].iov_base);
 		}
+		fwd->sent += fwd->num_msgs;
+		fwd->num_msgs = 0;
+		return;
 	}
-	cons = (prod + 1) % IHKMOND_NUM_FILEBUF_SLOTS;
- no_wrap_around:
-	dprintf("%s: prod=%d,cons=%d\n", __FUNCTION__, prod, cons);
 
-	for(i = 0; i < IHKMOND_NUM_FILEBUF_SLOTS && fps[cons] != NULL; i++, cons = (cons + 1) % IHKMOND_NUM_FILEBUF_SLOTS) {
-		dprintf("cons=%d\n", cons);
-		rewind(fps[cons]);
-		cur = buf;
-		while((ret = fread(cur, 1, IHKMOND_SIZE_FILEBUF_SLOT - (cur - buf) - 1, fps[cons])), ret > 0) {
-			cur += ret;
+	while (i < fwd->num_msgs) {
+		n = sendmmsg(fwd->fd, fwd->msgs + i, fwd->num_msgs - i,
+			     MSG_DONTWAIT);
+		if (n > 0) {
+			i += n;
+			fwd->sent += n;
+			fwd->stalled = 0;
+			continue;
+		}
+
+		if (errno == EINTR) {
+			continue;
 		}
-		CHKANDJUMP(ferror(fps[cons]), -EINVAL, "ferror()\n");
-		*cur = 0;
-		dprintf("total=%ld\n", (unsigned long)(cur - buf));
 
-		/* Mark as consumed for duplicated call to this function */
-		fclose(fps[cons]);
-		fps[cons] = NULL;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (fwd->stalled) {
+				break;
+			}
+			pfd.fd = fwd->fd;
+			pfd.events = POLLOUT;
+			n = poll(&pfd, 1, IHKMOND_SYSLOG_TIMEOUT);
+			if (n > 0 || (n == -1 && errno == EINTR)) {
+				continue;
+			}
+			dprintf("%s: syslogd doesn't take messages, "
+				"dropping until it does\n", __func__);
+			fwd->stalled = 1;
+			break;
+		}
 
-		cur = buf;
-		token = strsep(&cur, "\n");
-		while (token != NULL) {
-			if(*token == 0) {
-				goto empty_token;
+		/* syslogd has been restarted */
+		if ((errno == ECONNREFUSED || errno == ENOTCONN) &&
+		    !reconnected) {
+			reconnected = 1;
+			if (syslog_fwd_connect(fwd) == 0) {
+				fwd->stalled = 0;
+				continue;
 			}
-			dprintf("token=%s\n", token);
-			syslog(LOG_INFO, "%s", token);
-			usleep(200); /* Prevent syslog from dropping messages */
-		empty_token:
-			token = strsep(&cur, "\n");
 		}
 
+		dprintf("%s: sendmmsg failed with %d\n", __func__, errno);
+		break;
 	}
-	dprintf("%d slot(s) transferred\n", i);
+
+	fwd->dropped += fwd->num_msgs - i;
+	fwd->num_msgs = 0;
+
+	if (fwd->fd == -1) {
+		syslog_fwd_connect(fwd);
+	}
+}
+
+/* Queue a message. msg needs to stay until syslog_fwd_flush(). */
+static void syslog_fwd_queue(struct syslog_fwd *fwd, int priority,
+			     char *msg, size_t len)
+{
+	struct mmsghdr *mmsg;
+	struct iovec *iov;
+	char *hdr;
+	time_t now;
+	struct tm tm;
+	size_t hdr_len;
+
+	if (fwd->num_msgs == IHKMOND_SYSLOG_BATCH) {
+		syslog_fwd_flush(fwd);
+	}
+
+	mmsg = &fwd->msgs[fwd->num_msgs];
+	iov = fwd->iovs[fwd->num_msgs];
+	hdr = fwd->hdrs[fwd->num_msgs];
+
+	/* Same format as syslog() uses for _PATH_LOG */
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	hdr_len = snprintf(hdr, sizeof(fwd->hdrs[0]), "<%d>",
+			   priority | fwd->facility);
+	hdr_len += strftime(hdr + hdr_len, sizeof(fwd->hdrs[0]) - hdr_len,
+			    "%h %e %T ", &tm);
+	hdr_len += snprintf(hdr + hdr_len, sizeof(fwd->hdrs[0]) - hdr_len,
+			    "%s[%d]: ", fwd->logid, getpid());
+	if (hdr_len >= sizeof(fwd->hdrs[0])) {
+		hdr_len = sizeof(fwd->hdrs[0]) - 1;
+	}
+
+	fwd->prios[fwd->num_msgs] = priority;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdr_len;
+	iov[1].iov_base = msg;
+	iov[1].iov_len = len;
+
+	memset(mmsg, 0, sizeof(*mmsg));
+	mmsg->msg_hdr.msg_iov = iov;
+	mmsg->msg_hdr.msg_iovlen = 2;
+	fwd->num_msgs++;
+}
+
+/* Report messages lost since the last report */
+static void syslog_fwd_report(struct syslog_fwd *fwd, struct kmsg_map *map)
+{
+	char msg[128];
+	int len;
+
+	if (fwd->dropped == fwd->dropped_reported &&
+	    map->dropped == map->dropped_reported) {
+		return;
+	}
+
+	len = snprintf(msg, sizeof(msg),
+		       "kmsg: %lu lines forwarded, %lu dropped by ihkmond, "
+		       "%lu bytes overwritten by the LWK before read",
+		       fwd->sent, fwd->dropped, map->dropped);
+	fwd->dropped_reported = fwd->dropped;
+	map->dropped_reported = map->dropped;
+
+	syslog_fwd_queue(fwd, LOG_WARNING, msg, len);
+	syslog_fwd_flush(fwd);
+}
+
+#ifndef ENABLE_KMSG_REDIRECT
+/* Forward the lines of a chunk of the history, buf holds one more byte */
+static int syslog_lines(void *arg, char *buf, size_t len)
+{
+	struct syslog_fwd *fwd = arg;
+	char *cur;
+	char *token;
+
+	buf[len] = 0;
+	cur = buf;
+	token = strsep(&cur, "\n");
+	while (token != NULL) {
+		if(*token == 0) {
+			goto empty_token;
+		}
+		dprintf("token=%s\n", token);
+		syslog_fwd_queue(fwd, LOG_INFO, token, strlen(token));
+	empty_token:
+		token = strsep(&cur, "\n");
+	}
+
+	/* Tokens point to buf */
+	syslog_fwd_flush(fwd);
+	return 0;
+}
+
+static ssize_t syslog_kmsg(struct syslog_fwd *fwd, struct kmsg_history *h) {
+	int ret = 0;
+	char *buf = NULL;
+
+	buf = malloc(IHKMOND_HISTORY_BLOCK_SIZE + 1);
+	CHKANDJUMP(buf == NULL, -ENOMEM, "malloc failed");
+
+	ret = history_read(h, &h->forwarded, buf, syslog_lines, fwd);
+	dprintf("forwarded up to %lu\n", h->forwarded);
 
  out:
 	if (buf) {
@@ -363,217 +738,552 @@ static ssize_t syslog_kmsg(FILE **fps, int prod) {
 	}
 	return ret;
 }
+#endif
 
-static void* redirect_kmsg(void* _arg) {
-	struct thr_args *arg = (struct thr_args *)_arg;
-	int devfd = -1, evfd_kmsg = -1, evfd_status = -1, epfd = -1;
+static int watch_fd(struct ihkmond *mond, int fd, uint32_t events,
+		    struct watch *watch)
+{
 	struct epoll_event event;
-	struct epoll_event events[2];
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = watch;
+	if (epoll_ctl(mond->epfd, EPOLL_CTL_ADD, fd, &event)) {
+		return -errno;
+	}
+	return 0;
+}
+
+#ifndef ENABLE_KMSG_REDIRECT
+static struct kmsg_history *history_alloc(size_t budget)
+{
+	struct kmsg_history *h;
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		return NULL;
+	}
+
+	h->open = malloc(IHKMOND_HISTORY_BLOCK_SIZE);
+	if (!h->open) {
+		free(h);
+		return NULL;
+	}
+
+	h->budget = budget;
+	return h;
+}
+
+/* Listen for ihkosctl kmsg --history on an abstract name so that
+ * nothing is left behind when killed */
+static int history_listen(struct ihkmond *mond, struct mcos *mcos)
+{
 	int ret = 0, ret_lib;
-	int i;
-	FILE* fps[IHKMOND_NUM_FILEBUF_SLOTS];
-	int sizes[IHKMOND_NUM_FILEBUF_SLOTS];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+
+	mcos->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   0);
+	CHKANDJUMP(mcos->lfd == -1, -errno, "socket failed\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	ret_lib = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+			   IHKMOND_HISTORY_SOCKET, mcos->os_index);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + ret_lib;
+
+	ret_lib = bind(mcos->lfd, (struct sockaddr *)&addr, addrlen);
+	CHKANDJUMP(ret_lib == -1, -errno, "bind failed: %s\n", strerror(errno));
+
+	ret_lib = listen(mcos->lfd, 8);
+	CHKANDJUMP(ret_lib == -1, -errno, "listen failed\n");
+
+	mcos->watch_listen.type = WATCH_HISTORY_LISTEN;
+	mcos->watch_listen.obj = mcos;
+	ret = watch_fd(mond, mcos->lfd, EPOLLIN, &mcos->watch_listen);
+	CHKANDJUMP(ret, ret, "epoll_ctl failed\n");
+ out:
+	if (ret && mcos->lfd != -1) {
+		close(mcos->lfd);
+		mcos->lfd = -1;
+	}
+	return ret;
+}
+
+static void history_accept(struct ihkmond *mond, struct mcos *mcos)
+{
+	int ret_lib;
+	int fd;
+	struct ucred cred;
+	socklen_t credlen;
+	struct history_client *client;
+
+	while ((fd = accept4(mcos->lfd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		/* Only root can read kmsg, as with /dev/mcosX */
+		credlen = sizeof(cred);
+		ret_lib = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred,
+				     &credlen);
+		if (ret_lib || cred.uid != 0) {
+			close(fd);
+			continue;
+		}
+
+		client = calloc(1, sizeof(*client));
+		if (client) {
+			client->buf = malloc(IHKMOND_HISTORY_BLOCK_SIZE);
+		}
+		if (!client || !client->buf) {
+			eprintf("%s: malloc failed\n", __func__);
+			free(client);
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->mcos = mcos;
+		client->watch.type = WATCH_HISTORY_CLIENT;
+		client->watch.obj = client;
+
+		/* Sent as the socket takes it */
+		if (watch_fd(mond, fd, EPOLLOUT, &client->watch)) {
+			eprintf("%s: epoll_ctl failed\n", __func__);
+			free(client->buf);
+			free(client);
+			close(fd);
+		}
+	}
+}
+
+static int history_take_chunk(void *arg, char *buf, size_t len)
+{
+	struct history_client *client = arg;
+
+	client->data = buf;
+	client->len = len;
+	return 1;
+}
+
+/* Send as much of the history as the socket takes and close it when
+ * it's all sent */
+static void history_send(struct history_client *client)
+{
+	ssize_t n;
+
+	do {
+		if (client->len == 0) {
+			history_read(client->mcos->history, &client->from,
+				     client->buf, history_take_chunk, client);
+			if (client->len == 0) {
+				break;
+			}
+		}
+
+		n = send(client->fd, client->data, client->len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			dprintf("%s: send failed with %d\n", __func__, errno);
+			break;
+		}
+		client->data += n;
+		client->len -= n;
+	} while (1);
+
+	close(client->fd);
+	free(client->buf);
+	free(client);
+}
+#endif
+
+/* Find the instance, creating it when create is set */
+static struct mcos *mcos_get(struct ihkmond *mond, int os_index, int create)
+{
+	struct mcos *mcos;
+
+	for (mcos = mond->mcos_list; mcos; mcos = mcos->next) {
+		if (mcos->os_index == os_index) {
+			return mcos;
+		}
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	mcos = calloc(1, sizeof(*mcos));
+	if (!mcos) {
+		return NULL;
+	}
+
+	mcos->os_index = os_index;
+	mcos->evfd_kmsg = -1;
+	mcos->evfd_status = -1;
+	mcos->watch_kmsg.type = WATCH_KMSG;
+	mcos->watch_kmsg.obj = mcos;
+	mcos->watch_status.type = WATCH_STATUS;
+	mcos->watch_status.obj = mcos;
+
 #ifndef ENABLE_KMSG_REDIRECT
-	int prod = 0; /* Producer pointer */
+	mcos->lfd = -1;
+	if (mond->enable_kmsg) {
+		mcos->history = history_alloc(mond->history_budget);
+		if (!mcos->history) {
+			free(mcos);
+			return NULL;
+		}
+
+		/* Not fatal, kmsg is still forwarded */
+		history_listen(mond, mcos);
+	}
 #endif
-	struct ihk_device_get_kmsg_buf_desc desc_get;
 
-	memset(fps, 0, IHKMOND_NUM_FILEBUF_SLOTS * sizeof(FILE *));
-	memset(sizes, 0, IHKMOND_NUM_FILEBUF_SLOTS * sizeof(int));
+	mcos->next = mond->mcos_list;
+	mond->mcos_list = mcos;
+	return mcos;
+}
 
-	openlog(arg->logid, LOG_PID, arg->facility);
+/* Take the new messages, and forward them to syslog when forward is
+ * set or they're redirected to Linux kmsg */
+static int mcos_take_kmsg(struct ihkmond *mond, struct mcos *mcos, int forward)
+{
+	int ret = 0, ret_lib;
 
-	epfd = epoll_create(1);
-	CHKANDJUMP(epfd == -1, 255, "epoll_create failed\n");
-	
-	/* mcos remove event live longer than /dev/mcosX itself */
-	memset(&event, 0, sizeof(struct epoll_event));
-	event.events = EPOLLIN;
-	event.data.fd = arg->evfd_mcos_removed;
-	ret_lib = epoll_ctl(epfd, EPOLL_CTL_ADD, arg->evfd_mcos_removed, &event);
-	CHKANDJUMP(ret_lib != 0, -EINVAL, "epoll_ctl failed\n");
+#ifdef ENABLE_KMSG_REDIRECT
+	ret_lib = printk_kmsg(mond->dev_index, &mcos->map);
+	CHKANDJUMP(ret_lib < 0, -EINVAL, "printk_kmsg returned %d\n", ret_lib);
+#else
+	ret_lib = history_kmsg(mond->dev_index, &mcos->map, mcos->history, 1);
+	CHKANDJUMP(ret_lib < 0, -EINVAL, "history_kmsg returned %d\n", ret_lib);
 
- wait_for_mcos:
-	dprintf("wait for mcos add, dev_index=%d, os_index=%d\n", arg->dev_index, arg->os_index);
+	if (forward) {
+		ret_lib = syslog_kmsg(&mond->fwd, mcos->history);
+		CHKANDJUMP(ret_lib < 0, ret_lib, "syslog_kmsg returned %d\n", ret_lib);
+		syslog_fwd_report(&mond->fwd, &mcos->map);
+	}
+#endif
+ out:
+	return ret;
+}
 
-	/* Wait for add /dev/mcosX event */
-	ret_lib = pthread_mutex_lock(&arg->lock);
-	CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_lock failed\n");
-	while (arg->mcos_added == 0) {
-		ret_lib = pthread_cond_wait(&arg->cond_mcos_added, &arg->lock);
+/* Release (i.e. unref) kmsg_buf and stop watching the eventfds */
+static void mcos_release_kmsg(struct ihkmond *mond, struct mcos *mcos)
+{
+	int devfd;
+
+	unmap_kmsg(&mcos->map);
+	if (mcos->map.handle) {
+		devfd = ihklib_device_open(mond->dev_index);
+		if (devfd < 0 ||
+		    ioctl(devfd, IHK_DEVICE_RELEASE_KMSG_BUF, mcos->map.handle)) {
+			eprintf("IHK_DEVICE_RELEASE_KMSG_BUF failed\n");
+		}
+		if (devfd >= 0) {
+			close(devfd);
+		}
 	}
-	arg->mcos_added = 0;
-	pthread_mutex_unlock(&arg->lock);
+	memset(&mcos->map, 0, sizeof(mcos->map));
 
-	dprintf("mcos add detected\n");
+	/* Closing removes them from the epoll set */
+	if (mcos->evfd_kmsg != -1) {
+		close(mcos->evfd_kmsg);
+		mcos->evfd_kmsg = -1;
+	}
+	if (mcos->evfd_status != -1) {
+		close(mcos->evfd_status);
+		mcos->evfd_status = -1;
+	}
+}
+
+static int mcos_add(struct ihkmond *mond, int os_index)
+{
+	int ret = 0, ret_lib;
+	int devfd = -1;
+	struct mcos *mcos;
+	struct ihk_device_get_kmsg_buf_desc desc_get;
+
+	dprintf("mcos add detected, os_index=%d\n", os_index);
+
+	mcos = mcos_get(mond, os_index, 1);
+	CHKANDJUMP(mcos == NULL, -ENOMEM, "mcos_get failed\n");
+
+	/* Found by both the scan at start-up and udev */
+	if (mcos->added) {
+		goto out;
+	}
+	mcos->added = 1;
+	mcos->add_failed = 0;
+
+	if (!mond->enable_kmsg) {
+		goto out;
+	}
+
+#ifndef ENABLE_KMSG_REDIRECT
+	/* The history of the previous instance isn't needed any more */
+	history_reset(mcos->history);
+#endif
 
 	/* Get (i.e. ref) kmsg_buf */
-	devfd = ihklib_device_open(arg->dev_index);
-	CHKANDJUMP(devfd < 0, -errno, "ihklib_device_open returned %d\n",
+	devfd = ihklib_device_open(mond->dev_index);
+	CHKANDJUMP(devfd < 0, devfd, "ihklib_device_open returned %d\n",
 		   devfd);
 
 	memset(&desc_get, 0, sizeof(desc_get));
-	desc_get.os_index = arg->os_index;
+	desc_get.os_index = os_index;
 	ret_lib = ioctl(devfd, IHK_DEVICE_GET_KMSG_BUF, &desc_get);
-	CHKANDJUMP(ret_lib < 0, ret_lib, "IHK_DEVICE_GET_KMSG_BUF returned %d\n", ret_lib);
+	CHKANDJUMP(ret_lib < 0, -errno, "IHK_DEVICE_GET_KMSG_BUF failed\n");
+
+	mcos->map.handle = desc_get.handle;
+	map_kmsg(devfd, os_index, &mcos->map);
 
-	close(devfd);
-	devfd = -1;
-	
 	/* Get notification when the amount of kmsg exceeds a threshold */
-	evfd_kmsg = ihk_os_get_eventfd(arg->os_index, IHK_OS_EVENTFD_TYPE_KMSG);
-	CHKANDJUMP(evfd_kmsg < 0, -EINVAL, "ihk_os_get_eventfd\n");
+	mcos->evfd_kmsg = ihk_os_get_eventfd(os_index, IHK_OS_EVENTFD_TYPE_KMSG);
+	CHKANDJUMP(mcos->evfd_kmsg < 0, mcos->evfd_kmsg, "ihk_os_get_eventfd\n");
 
-	memset(&event, 0, sizeof(struct epoll_event));
-	event.events = EPOLLIN;
-	event.data.fd = evfd_kmsg;
-	ret_lib = epoll_ctl(epfd, EPOLL_CTL_ADD, evfd_kmsg, &event);
-	CHKANDJUMP(ret_lib != 0, -EINVAL, "epoll_ctl failed\n");
+	ret = watch_fd(mond, mcos->evfd_kmsg, EPOLLIN, &mcos->watch_kmsg);
+	CHKANDJUMP(ret, ret, "epoll_ctl failed\n");
 
 	/* Get notification when LWK panics or gets hungup */
-	evfd_status = ihk_os_get_eventfd(arg->os_index, IHK_OS_EVENTFD_TYPE_STATUS);
-	CHKANDJUMP(evfd_status < 0, -EINVAL, "ihk_os_get_eventfd\n");
+	mcos->evfd_status = ihk_os_get_eventfd(os_index, IHK_OS_EVENTFD_TYPE_STATUS);
+	CHKANDJUMP(mcos->evfd_status < 0, mcos->evfd_status, "ihk_os_get_eventfd\n");
 
-	memset(&event, 0, sizeof(struct epoll_event));
-	event.events = EPOLLIN;
-	event.data.fd = evfd_status;
-	ret_lib = epoll_ctl(epfd, EPOLL_CTL_ADD, evfd_status, &event);
-	CHKANDJUMP(ret_lib != 0, -EINVAL, "epoll_ctl failed\n");
+	ret = watch_fd(mond, mcos->evfd_status, EPOLLIN, &mcos->watch_status);
+	CHKANDJUMP(ret, ret, "epoll_ctl failed\n");
 
-	do {
-		int nfd = epoll_wait(epfd, events, 2, -1);
-		if (nfd < 0 && errno == EINTR)
-			continue;
-		CHKANDJUMP(nfd < 0, -EINVAL, "epoll_wait failed\n");
-		for (i = 0; i < nfd; i++) {
-			if (events[i].data.fd == evfd_kmsg) {
-				reap_event(events[i].data.fd);
-				dprintf("kmsg event detected\n");
-#ifdef ENABLE_KMSG_REDIRECT
-				ret_lib = printk_kmsg(arg->dev_index, desc_get.handle);
-#else
-				ret_lib = fwrite_kmsg(arg->dev_index, desc_get.handle, arg->os_index, fps, sizes, &prod, 1);
-#endif
-				CHKANDJUMP(ret_lib < 0, -EINVAL, "fwrite_kmsg returned %d\n", ret_lib);
-			} else if (events[i].data.fd == evfd_status) {
-				reap_event(events[i].data.fd);
-				dprintf("LWK status event detected\n");
-#ifdef ENABLE_KMSG_REDIRECT
-				ret_lib = printk_kmsg(arg->dev_index, desc_get.handle);
-				CHKANDJUMP(ret_lib < 0, -EINVAL, "printk_kmsg returned %d\n", ret_lib);
-#else
-				ret_lib = fwrite_kmsg(arg->dev_index, desc_get.handle, arg->os_index, fps, sizes, &prod, 1);
-				CHKANDJUMP(ret_lib < 0, -EINVAL, "fwrite_kmsg returned %d\n", ret_lib);
+	/* Messages written before the notification was set up */
+	mcos_take_kmsg(mond, mcos, 0);
+ out:
+	if (ret && mcos) {
+		mcos_release_kmsg(mond, mcos);
+		mcos->added = 0;
+		mcos->add_failed = 1;
+	}
+	if (devfd >= 0) {
+		close(devfd);
+	}
+	return ret;
+}
 
-				ret_lib = syslog_kmsg(fps, prod);
-				CHKANDJUMP(ret_lib < 0, ret_lib, "syslog_kmsg returned %d\n", ret_lib);
-#endif
-			} else if (events[i].data.fd == arg->evfd_mcos_removed) {
-				reap_event(events[i].data.fd);
-				dprintf("mcos remove event detected\n");
-#ifdef ENABLE_KMSG_REDIRECT
-				ret_lib = printk_kmsg(arg->dev_index, desc_get.handle);
-				CHKANDJUMP(ret_lib < 0, -EINVAL, "printk_kmsg returned %d\n", ret_lib);
-#else
-				ret_lib = fwrite_kmsg(arg->dev_index, desc_get.handle, arg->os_index, fps, sizes, &prod, 1);
-				CHKANDJUMP(ret_lib < 0, -EINVAL, "fwrite_kmsg returned %d\n", ret_lib);
+static void mcos_remove(struct ihkmond *mond, int os_index)
+{
+	struct mcos *mcos;
 
-				ret_lib = syslog_kmsg(fps, prod);
-				CHKANDJUMP(ret_lib < 0, ret_lib, "syslog_kmsg returned %d\n", ret_lib);
-				dprintf("after syslog_kmsg for destroy\n");
-#endif
+	dprintf("mcos remove detected, os_index=%d\n", os_index);
 
-				/* Release (i.e. unref) kmsg_buf */
-				devfd = ihklib_device_open(arg->dev_index);
-				CHKANDJUMP(devfd < 0, -errno,
-					   "ihklib_device_open returned %d\n",
-					   devfd);
-				ret_lib = ioctl(devfd, IHK_DEVICE_RELEASE_KMSG_BUF, desc_get.handle);
-				CHKANDJUMP(ret_lib != 0, ret_lib, "IHK_DEVICE_RELEASE_KMSG_BUF failed\n");
-				close(devfd);
-				devfd = -1;
-
-				ret_lib = epoll_ctl(epfd, EPOLL_CTL_DEL, evfd_kmsg, &event);
-				CHKANDJUMP(ret_lib != 0, -EINVAL, "epoll_ctl failed\n");
-				close(evfd_kmsg);
-				evfd_kmsg = -1;
-
-				ret_lib = epoll_ctl(epfd, EPOLL_CTL_DEL, evfd_status, &event);
-				CHKANDJUMP(ret_lib != 0, -EINVAL, "epoll_ctl failed\n");
-				close(evfd_status);
-				evfd_status = -1;
-
-				for (i = 0; i < IHKMOND_NUM_FILEBUF_SLOTS; i++) {
-					if(fps[i] != NULL) {
-						fclose(fps[i]);
-						fps[i] = NULL;
-#if 0
-						char fn[256];
-						sprintf(fn, IHKMOND_TMP "/mcos%d/kmsg%d", arg->os_index, i);
-						ret_lib = unlink(fn);
-						CHKANDJUMP(ret_lib != 0, -EINVAL, "unlink failed\n");
-						sprintf(fn, IHKMOND_TMP "/mcos%d", arg->os_index);
-						ret_lib = rmdir(fn);
-						CHKANDJUMP(ret_lib != 0, -EINVAL, "rmdir failed\n");
-						sprintf(fn, IHKMOND_TMP);
-						ret_lib = rmdir(fn);
-						CHKANDJUMP(ret_lib != 0, -EINVAL, "rmdir failed\n");
-#endif
-					}
-				}
-				goto wait_for_mcos;
-			}
+	mcos = mcos_get(mond, os_index, 0);
+	if (!mcos) {
+		return;
+	}
+	mcos->add_failed = 0;
+	if (!mcos->added) {
+		return;
+	}
+
+	if (mcos->map.handle) {
+		mcos_take_kmsg(mond, mcos, 1);
+	}
+	mcos_release_kmsg(mond, mcos);
+	mcos->added = 0;
+}
+
+/* OS index of /dev/mcosX, -1 when it isn't one */
+static int mcos_index(struct udev_device *dev)
+{
+	const char *sysname = udev_device_get_sysname(dev);
+	int os_index;
+
+	if (!sysname || sscanf(sysname, "mcos%d", &os_index) != 1) {
+		return -1;
+	}
+	return os_index;
+}
+
+static void mcos_udev_event(struct ihkmond *mond)
+{
+	struct udev_device *dev;
+	const char *action;
+	int os_index;
+
+	/* Don't reap_event(evfd), it's harmful. */
+	dev = udev_monitor_receive_device(mond->mon_mcos);
+	if (!dev) {
+		eprintf("udev_monitor_receive_device failed\n");
+		return;
+	}
+
+	os_index = mcos_index(dev);
+	action = udev_device_get_action(dev);
+	if (os_index != -1 && action) {
+		if (strcmp(action, "add") == 0) {
+			mcos_add(mond, os_index);
+		} else if (strcmp(action, "remove") == 0) {
+			mcos_remove(mond, os_index);
 		}
-	} while (1);
+	}
 
-out:
-	if (devfd >= 0) {
-		close(devfd);
+	udev_device_unref(dev);
+}
+
+/* Pick up the instances created before start-up */
+static int mcos_scan(struct ihkmond *mond)
+{
+	int ret = 0, ret_lib;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	struct udev_device *dev;
+	int os_index;
+
+	enumerate = udev_enumerate_new(mond->udev);
+	CHKANDJUMP(enumerate == NULL, -ENOMEM, "udev_enumerate_new failed\n");
+
+	ret_lib = udev_enumerate_add_match_subsystem(enumerate, "mcos");
+	CHKANDJUMP(ret_lib < 0, ret_lib, "udev_enumerate_add_match_subsystem returned %s\n", strerror(-ret_lib));
+
+	ret_lib = udev_enumerate_scan_devices(enumerate);
+	CHKANDJUMP(ret_lib < 0, ret_lib, "udev_enumerate_scan_devices returned %s\n", strerror(-ret_lib));
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		dev = udev_device_new_from_syspath(mond->udev,
+				udev_list_entry_get_name(entry));
+		if (!dev) {
+			continue;
+		}
+
+		os_index = mcos_index(dev);
+		if (os_index != -1) {
+			mcos_add(mond, os_index);
+		}
+		udev_device_unref(dev);
 	}
-	if (evfd_kmsg >= 0) {
-		close(evfd_kmsg);
+ out:
+	if (enumerate) {
+		udev_enumerate_unref(enumerate);
 	}
-	if (evfd_status >= 0) {
-		close(evfd_status);
+	return ret;
+}
+
+/* Let the driver compare the counters of the LWK CPUs with the ones of
+ * the last call. It signals the status eventfd when one is stuck. */
+static void detect_hungup(struct ihkmond *mond)
+{
+	uint64_t expirations;
+	int devfd;
+	int ret_lib;
+	struct mcos *mcos;
+
+	if (read(mond->tfd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations)) {
+		return;
 	}
-	if (epfd >= 0) {
-		close(epfd);
+
+	devfd = ihklib_device_open(mond->dev_index);
+	if (devfd < 0) {
+		dprintf("%s: error: ihklib_device_open failed with %d\n",
+			__func__, devfd);
+		return;
 	}
-	arg->ret = ret;
-	closelog();
-	return NULL;
+
+	for (mcos = mond->mcos_list; mcos; mcos = mcos->next) {
+		if (mcos->add_failed) {
+			mcos_add(mond, mcos->os_index);
+		}
+		if (!mcos->added) {
+			continue;
+		}
+
+		ret_lib = ioctl(devfd, IHK_DEVICE_DETECT_HUNGUP,
+				(unsigned long)mcos->os_index);
+		if(ret_lib == -1) {
+			if(errno == EAGAIN) { /* OS is booting */
+				dprintf("%s: ioctl IHK_DEVICE_DETECT_HUNGUP returned EAGAIN\n", __FUNCTION__);
+			} else {
+				dprintf("%s: ioctl IHK_DEVICE_DETECT_HUNGUP returned %s\n", __FUNCTION__, strerror(errno));
+			}
+		} else {
+			dprintf("%s: ioctl IHK_DEVICE_DETECT_HUNGUP returned %d\n", __FUNCTION__, ret_lib);
+		}
+	}
+
+	close(devfd);
 }
 
-#define MCKUDEV_MAX_NUM_OS_INSTANCES 1
+static void handle_event(struct ihkmond *mond, struct epoll_event *event)
+{
+	struct watch *watch = event->data.ptr;
+	struct mcos *mcos = watch->obj;
+
+	switch (watch->type) {
+	case WATCH_UDEV:
+		mcos_udev_event(mond);
+		break;
+	case WATCH_HUNGUP_TIMER:
+		detect_hungup(mond);
+		break;
+	case WATCH_KMSG:
+		/* Released by an event handled before in the same batch */
+		if (mcos->evfd_kmsg == -1) {
+			break;
+		}
+		reap_event(mcos->evfd_kmsg);
+		dprintf("kmsg event detected\n");
+		mcos_take_kmsg(mond, mcos, 0);
+		break;
+	case WATCH_STATUS:
+		if (mcos->evfd_status == -1) {
+			break;
+		}
+		reap_event(mcos->evfd_status);
+		dprintf("LWK status event detected\n");
+		mcos_take_kmsg(mond, mcos, 1);
+		break;
+#ifndef ENABLE_KMSG_REDIRECT
+	case WATCH_HISTORY_LISTEN:
+		history_accept(mond, mcos);
+		break;
+	case WATCH_HISTORY_CLIENT:
+		history_send(watch->obj);
+		break;
+#else
+	default:
+		break;
+#endif
+	}
+}
 
 static void show_usage(char** argv) {
-	printf("%s [--help|-?] [-f <facility_name>] [-k <redirect_kmsg>] [-n <detect_hungup>]\n"
+	printf("%s [--help|-?] [-f <facility_name>] [-k <redirect_kmsg>] [-n <detect_hungup>] [-m <history_budget>]\n"
 		   "--help            \tShow usage\n"
 		   "-f <facility_name>\tUse <facility_name> when redirecting kmsg by using syslog()\n"
 		   "-k <redirect_kmsg>\t1: Redirect kmsg\n"
 		   "                  \t0: Otherwise\n"
 		   "-i <monitor_interval>\t!=-1: Polling interval (in second) for detecting hungup\n"
-		   "                  \t-1: Don't detect hungup\n",
-		   strrchr(argv[0], '/') + 1);
+		   "                  \t-1: Don't detect hungup\n"
+		   "-m <history_budget>\tMemory (in MiB) for the kmsg history of each OS instance (default: %d)\n",
+		   strrchr(argv[0], '/') + 1, IHKMOND_HISTORY_BUDGET);
 }
 
 int main(int argc, char** argv) {
 	int ret = 0, ret_lib;
 	int opt;
-	int evfd_mcos = -1, epfd = -1;
-	struct epoll_event event;
-	struct epoll_event events[1];
 	int i;
-	struct udev *udev = NULL;
-	struct udev_monitor *mon_mcos = NULL;
-	pthread_attr_t attr;
-	struct thr_args mon_args[MCKUDEV_MAX_NUM_OS_INSTANCES];
-	struct thr_args kmsg_args[MCKUDEV_MAX_NUM_OS_INSTANCES];
+	struct epoll_event events[IHKMOND_MAX_EVENTS];
+	struct itimerspec its;
+	struct ihkmond mond;
 	int facility = LOG_LOCAL6;
-	int enable_kmsg = 1;
-	int mon_interval = 600; /* sec */
+	char *logid = strrchr(argv[0], '/') + 1;
+	long history_budget = IHKMOND_HISTORY_BUDGET; /* MiB */
+
+	memset(&mond, 0, sizeof(mond));
+	mond.epfd = -1;
+	mond.tfd = -1;
+	mond.enable_kmsg = 1;
+	mond.interval = 600; /* sec */
 
-	while ((opt = getopt_long(argc, argv, "f:k:i:", longopt, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "f:k:i:m:", longopt, NULL)) != -1) {
 		switch (opt) {
 		case 'f':
 			for (i = 0; i < 8; i++) {
@@ -586,10 +1296,14 @@ int main(int argc, char** argv) {
 		found:;
 			break;
 		case 'k':
-			enable_kmsg = atoi(optarg);
+			mond.enable_kmsg = atoi(optarg);
 			break;
 		case 'i':
-			mon_interval = atoi(optarg);
+			mond.interval = atoi(optarg);
+			break;
+		case 'm':
+			history_budget = atol(optarg);
+			CHKANDJUMP(history_budget <= 0, 255, "Invalid history budget\n");
 			break;
 		case '?':
 		default:
@@ -597,8 +1311,9 @@ int main(int argc, char** argv) {
 			break;
 		}
 	}
+	mond.history_budget = history_budget << 20;
 
-	dprintf("enable_kmsg=%d,mon_interval=%d\n", enable_kmsg, mon_interval);
+	dprintf("enable_kmsg=%d,mon_interval=%d\n", mond.enable_kmsg, mond.interval);
 
 #ifdef DEBUG
 	ret = daemon(1, 1);
@@ -609,169 +1324,77 @@ int main(int argc, char** argv) {
 		ret = -errno;
 		dprintf("%s:%d: daemon failed with %d\n",
 			__FILE__, __LINE__, -ret);
-		goto out_early;
-	}
-
-	ret_lib = pthread_attr_init(&attr);
-	CHKANDJUMP(ret_lib != 0, 255, "pthread_attr_init returned %s\n", strerror(ret_lib));
-	ret_lib = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	CHKANDJUMP(ret_lib != 0, 255, "pthread_attr_setdetachstate returned %s\n", strerror(ret_lib));
-
-	for (i = 0; i < MCKUDEV_MAX_NUM_OS_INSTANCES; i++) {
-		if (mon_interval != -1) {
-			mon_args[i].dev_index = 0;
-			mon_args[i].os_index = i;
-			mon_args[i].interval = mon_interval;
-			mon_args[i].evfd_mcos_removed = eventfd(0, 0);
-			CHKANDJUMP(mon_args[i].evfd_mcos_removed == -1, 255, "eventfd failed\n");
-			
-			ret_lib = pthread_cond_init(&mon_args[i].cond_mcos_added, NULL);
-			CHKANDJUMP(ret_lib != 0, 255, "pthread_cond_init returned %s\n", strerror(ret_lib));
-			
-			ret_lib = pthread_mutex_init(&mon_args[i].lock, NULL);
-			CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_init returned %s\n", strerror(ret_lib));
-			mon_args[i].mcos_added = 0;
-			
-			ret_lib = pthread_create(&mon_args[i].thread, &attr, detect_hungup, &mon_args[i]);
-			CHKANDJUMP(ret_lib != 0, 255, "pthread_create returned %s\n", strerror(ret_lib));
-		}
-
-		if (enable_kmsg) {
-			kmsg_args[i].dev_index = 0;
-			kmsg_args[i].os_index = i;
-			kmsg_args[i].logid = strrchr(argv[0], '/') + 1;
-			kmsg_args[i].facility = facility;
-			kmsg_args[i].evfd_mcos_removed = eventfd(0, 0);
-			CHKANDJUMP(kmsg_args[i].evfd_mcos_removed == -1, 255, "eventfd failed\n");
-			
-			ret_lib = pthread_cond_init(&kmsg_args[i].cond_mcos_added, NULL);
-			CHKANDJUMP(ret_lib != 0, 255, "pthread_cond_init returned %s\n", strerror(ret_lib));
-
-			ret_lib = pthread_mutex_init(&kmsg_args[i].lock, NULL);
-			CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_init returned %s\n", strerror(ret_lib));
-			kmsg_args[i].mcos_added = 0;
-			
-			ret_lib = pthread_create(&kmsg_args[i].thread, &attr, redirect_kmsg, &kmsg_args[i]);
-			CHKANDJUMP(ret_lib != 0, 255, "pthread_create returned %s\n", strerror(ret_lib));
-		}
-	}
-
-
-	udev = udev_new();
-	CHKANDJUMP(udev == NULL, 255, "udev_new failed\n");
-
-	/* Obtain evfd for add /dev/mcosX event */
-	mon_mcos = udev_monitor_new_from_netlink(udev, "udev");
-	CHKANDJUMP(mon_mcos == NULL, 255, "udev_monitor_new_from_netlink failed\n");
-
-	ret_lib = udev_monitor_filter_add_match_subsystem_devtype(mon_mcos, "mcos", NULL);
+		goto out;
+	}
+
+	openlog(logid, LOG_PID, facility);
+	syslog_fwd_open(&mond.fwd, logid, facility);
+
+	mond.epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHKANDJUMP(mond.epfd == -1, 255, "epoll_create failed\n");
+
+	mond.udev = udev_new();
+	CHKANDJUMP(mond.udev == NULL, 255, "udev_new failed\n");
+
+	/* Obtain evfd for add and remove /dev/mcosX event */
+	mond.mon_mcos = udev_monitor_new_from_netlink(mond.udev, "udev");
+	CHKANDJUMP(mond.mon_mcos == NULL, 255, "udev_monitor_new_from_netlink failed\n");
+
+	ret_lib = udev_monitor_filter_add_match_subsystem_devtype(mond.mon_mcos, "mcos", NULL);
 	CHKANDJUMP(ret_lib < 0, 255, "udev_monitor_filter_add_match_subsystem_devtype returned %s\n", strerror(-ret_lib));
 
-	ret_lib = udev_monitor_enable_receiving(mon_mcos);
+	ret_lib = udev_monitor_enable_receiving(mond.mon_mcos);
 	CHKANDJUMP(ret_lib < 0, 255, "udev_monitor_enable_receiving %s\n", strerror(-ret_lib));
-	
-	evfd_mcos = udev_monitor_get_fd(mon_mcos);
-	CHKANDJUMP(evfd_mcos < 0, 255, "udev_monitor_get_fd returned %s\n", strerror(-evfd_mcos));
-
-	/* Add evfds to epoll fd */
-	epfd = epoll_create(1);
-	CHKANDJUMP(epfd == -1, 255, "epoll_create failed\n");
-	
-	memset(&event, 0, sizeof(struct epoll_event));
-	event.events = EPOLLIN;
-	event.data.fd = evfd_mcos;
-	ret_lib = epoll_ctl(epfd, EPOLL_CTL_ADD, evfd_mcos, &event);
+
+	ret_lib = udev_monitor_get_fd(mond.mon_mcos);
+	CHKANDJUMP(ret_lib < 0, 255, "udev_monitor_get_fd returned %s\n", strerror(-ret_lib));
+
+	mond.watch_udev.type = WATCH_UDEV;
+	ret_lib = watch_fd(&mond, ret_lib, EPOLLIN, &mond.watch_udev);
 	CHKANDJUMP(ret_lib != 0, 255, "epoll_ctl failed\n");
 
+	if (mond.interval != -1) {
+		mond.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		CHKANDJUMP(mond.tfd == -1, 255, "timerfd_create failed\n");
+
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = mond.interval;
+		its.it_interval.tv_sec = mond.interval;
+		ret_lib = timerfd_settime(mond.tfd, 0, &its, NULL);
+		CHKANDJUMP(ret_lib != 0, 255, "timerfd_settime failed\n");
+
+		mond.watch_timer.type = WATCH_HUNGUP_TIMER;
+		ret_lib = watch_fd(&mond, mond.tfd, EPOLLIN, &mond.watch_timer);
+		CHKANDJUMP(ret_lib != 0, 255, "epoll_ctl failed\n");
+	}
+
+	/* After enabling the monitor so that none is missed */
+	ret_lib = mcos_scan(&mond);
+	CHKANDJUMP(ret_lib != 0, 255, "mcos_scan returned %d\n", ret_lib);
+
 	do {
-		int nfd = epoll_wait(epfd, events, 1, -1);
+		int nfd = epoll_wait(mond.epfd, events, IHKMOND_MAX_EVENTS, -1);
+		if (nfd < 0 && errno == EINTR)
+			continue;
+		CHKANDJUMP(nfd < 0, 255, "epoll_wait failed\n");
 		for (i = 0; i < nfd; i++) {
-			if (events[i].data.fd == evfd_mcos) {
-#define SZ_LINE 256
-				char action[SZ_LINE];
-				char node[SZ_LINE];
-				struct udev_device *dev;
-				int os_index;
-
-				/* Don't reap_event(evfd), it's harmful. */
-				dev = udev_monitor_receive_device(mon_mcos);
-				CHKANDJUMP(dev == NULL, 255, "udev_monitor_receive_device failed\n");
-				
-				strncpy(node, udev_device_get_devnode(dev), SZ_LINE);
-				node[SZ_LINE - 1] = 0;
-				dprintf("Node: %s\n", node);
-
-				os_index = atoi(node + 4);
-
-				strncpy(action, udev_device_get_action(dev), SZ_LINE);
-				action[SZ_LINE - 1] = 0;
-				
-				if (strcmp(action, "add") == 0) {
-					dprintf("mcos add detected\n");
-					if (mon_interval != -1) {
-						ret_lib = pthread_mutex_lock(&mon_args[os_index].lock);
-						CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_lock failed\n");
-						mon_args[os_index].mcos_added = 1;
-						ret_lib = pthread_cond_signal(&mon_args[os_index].cond_mcos_added);
-						if (ret_lib != 0) {
-							pthread_mutex_unlock(&mon_args[os_index].lock);
-							eprintf("pthread_cond_signal failed\n");
-							ret = 255;
-							goto out;
-						}
-						ret_lib = pthread_mutex_unlock(&mon_args[os_index].lock);
-						CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_unlock failed\n");
-					}
-					if (enable_kmsg) {
-						ret_lib = pthread_mutex_lock(&kmsg_args[os_index].lock);
-						CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_lock failed\n");
-						kmsg_args[os_index].mcos_added = 1;
-						ret_lib = pthread_cond_signal(&kmsg_args[os_index].cond_mcos_added);
-						if (ret_lib != 0) {
-							pthread_mutex_unlock(&kmsg_args[os_index].lock);
-							eprintf("pthread_cond_signal failed\n");
-							ret = 255;
-							goto out;
-						}
-						ret_lib = pthread_mutex_unlock(&kmsg_args[os_index].lock);
-						CHKANDJUMP(ret_lib != 0, 255, "pthread_mutex_unlock failed\n");
-					}
-				} else if (strcmp(action, "remove") == 0) {
-					uint64_t counter = 1;
-					dprintf("mcos remove detected\n");
-					if (mon_interval != -1) {
-						ret_lib = write(mon_args[os_index].evfd_mcos_removed, &counter, sizeof(counter));
-						CHKANDJUMP(ret_lib != sizeof(counter), 255, "write failed\n");
-					}
-					if (enable_kmsg) {
-						ret_lib = write(kmsg_args[os_index].evfd_mcos_removed, &counter, sizeof(counter));
-						CHKANDJUMP(ret_lib != sizeof(counter), 255, "write failed\n");
-					}
-				}
-			}
+			handle_event(&mond, &events[i]);
 		}
 	} while (1);
  out:
-	udev_monitor_unref(mon_mcos);
-	udev_unref(udev);
-	for (i = 0; i < MCKUDEV_MAX_NUM_OS_INSTANCES; i++) {
-		if (mon_interval != -1) {
-			if (mon_args[i].evfd_mcos_removed != -1) {
-				close(mon_args[i].evfd_mcos_removed);
-			}
-		}
-		if (enable_kmsg) {
-			if (kmsg_args[i].evfd_mcos_removed != -1) {
-				close(kmsg_args[i].evfd_mcos_removed);
-			}
-		}
+	if (mond.mon_mcos) {
+		udev_monitor_unref(mond.mon_mcos);
+	}
+	if (mond.udev) {
+		udev_unref(mond.udev);
 	}
- out_early:
-	if (evfd_mcos != -1) {
-		close(evfd_mcos);
+	if (mond.tfd != -1) {
+		close(mond.tfd);
 	}
-	if (epfd != -1) {
-		close(epfd);
+	if (mond.epfd != -1) {
+		close(mond.epfd);
 	}
+	syslog_fwd_close(&mond.fwd);
+	closelog();
 	return ret;
 }
@@ -8,6 +8,7 @@
  * \author Balazs Gerofi  <bgerofi@riken.jp> \par
  * Copyright (C) 2011-2017 RIKEN AICS>
  */
+#define _GNU_SOURCE /* struct ucred */
 #include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,6 +17,9 @@
 #include <ctype.h>
 #include "ihk/ihk_host_user.h"
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
@@ -74,12 +78,17 @@ static int usage(char **arg)
 	fprintf(stderr, "    query_free_mem\n");
 	fprintf(stderr, "    kargs (kernel arg)\n");
 	fprintf(stderr, "    get status\n");
-	fprintf(stderr, "    kmsg\n");
+	fprintf(stderr, "    kmsg [--history]\n");
 	fprintf(stderr, "    clear_kmsg\n");
+	fprintf(stderr, "    hang_info\n");
+	fprintf(stderr, "    panic_info\n");
 	fprintf(stderr, "    intr cpu irq_vector\n");
 	fprintf(stderr, "    ioctl (req) (arg)\n");
 #ifdef ENABLE_MEMDUMP
-	fprintf(stderr, "    dump [-d level] [file]\n");
+	fprintf(stderr, "    dump [-d level] [-z [-j threads]] [file]\n");
+	fprintf(stderr, "    dump [-d level] --stream (file|-)\n");
+	fprintf(stderr, "    dump --convert (stream|-) [file]\n");
+	fprintf(stderr, "    dump --snapshot (file|-)\n");
 #endif /* ENABLE_MEMDUMP */
 
 	return 0;
@@ -690,17 +699,93 @@ static int do_kargs(int fd)
 	return r;
 }
 
+/* Print the kmsg history ihkmond keeps, also after the OS is destroyed */
+static int print_kmsg_history(int os_index)
+{
+	int ret;
+	int fd = -1;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	char buf[4096];
+	ssize_t n;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	ret = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+		       IHKMOND_HISTORY_SOCKET, os_index);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + ret;
+
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* Any user can bind the name, only trust ihkmond running as root */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (cred.uid != 0) {
+		fprintf(stderr, "error: kmsg history server is run by uid %d, "
+			"not root\n", cred.uid);
+		ret = -EPERM;
+		goto out;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+			goto out;
+		}
+		fwrite(buf, 1, n, stdout);
+	}
+
+	ret = 0;
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
 static int do_kmsg(int os_index)
 {
 	int ret;
 	char *buf = NULL;
 
+	if (__argc > 3 && !strcmp(__argv[3], "--history")) {
+		ret = print_kmsg_history(os_index);
+		if (ret) {
+			fprintf(stderr, "error querying kmsg history of ihkmond: %s\n",
+				strerror(-ret));
+		}
+		return ret;
+	}
+
 	buf = calloc(IHK_KMSG_SIZE, sizeof(char));
 	if (!buf) {
 		return -ENOMEM;
 	}
 
 	ret = ihk_os_kmsg(os_index, buf, (ssize_t)IHK_KMSG_SIZE);
+	if (ret < 0 && print_kmsg_history(os_index) == 0) {
+		/* The instance is gone but ihkmond has its kmsg */
+		ret = 0;
+		goto out;
+	}
+
 	if (ret >= 0) {
 		buf[ret] = 0;
 		printf("%s\n", buf);
@@ -716,6 +801,87 @@ static int do_kmsg(int os_index)
 	return ret;
 }
 
+/* What each LWK CPU was doing, to tell which one hung up and where */
+static int do_hang_info(int os_index)
+{
+	int ret;
+	int i, j, n;
+	struct ihk_cpu_hang_info *info = NULL;
+
+	n = ihk_os_get_hang_info(os_index, NULL, 0);
+	if (n < 0) {
+		fprintf(stderr, "error querying hang info: %s\n",
+			strerror(-n));
+		return n;
+	}
+
+	info = calloc(n, sizeof(*info));
+	if (!info) {
+		return -ENOMEM;
+	}
+
+	ret = ihk_os_get_hang_info(os_index, info, n);
+	if (ret < 0) {
+		fprintf(stderr, "error querying hang info: %s\n",
+			strerror(-ret));
+		goto out;
+	}
+
+	for (i = 0; i < n && i < ret; i++) {
+		printf("cpu %d: status %d%s, counter %lu, last entry: pc 0x%lx, syscall %ld, ts %lu\n",
+		       info[i].cpu, info[i].status,
+		       info[i].stuck ? " (stuck)" : "",
+		       info[i].counter, info[i].last_pc,
+		       info[i].last_syscall, info[i].last_ts);
+
+		if (!info[i].captured) {
+			continue;
+		}
+
+		printf("  on hangup: pc 0x%lx, sp 0x%lx, fp 0x%lx, ts %lu\n",
+		       info[i].pc, info[i].sp, info[i].fp, info[i].ts);
+		for (j = 0; j < info[i].depth; j++) {
+			printf("  #%d 0x%lx\n", j, info[i].stack[j]);
+		}
+	}
+
+	ret = 0;
+ out:
+	free(info);
+	return ret;
+}
+
+static int do_panic_info(int os_index)
+{
+	int ret;
+	int i;
+	struct ihk_panic_info info;
+
+	ret = ihk_os_get_panic_info(os_index, &info);
+	if (ret == -ENOENT) {
+		printf("no panic\n");
+		return 0;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "error querying panic info: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+
+	printf("panic on cpu %d: %s\n", info.cpu, info.msg);
+	printf("pc 0x%lx, sp 0x%lx, fp 0x%lx, ts %lu\n",
+	       info.pc, info.sp, info.fp, info.ts);
+	for (i = 0; i < info.nr_regs; i++) {
+		printf("  r%-2d 0x%016lx%s", i, info.regs[i],
+		       i % 4 == 3 || i == info.nr_regs - 1 ? "\n" : "");
+	}
+	for (i = 0; i < info.depth; i++) {
+		printf("  #%d 0x%lx\n", i, info.stack[i]);
+	}
+
+	return 0;
+}
+
 static int do_clear_kmsg(int fd)
 {
 	int r = ioctl(fd, IHK_OS_CLEAR_KMSG, 0);
@@ -759,6 +925,36 @@ static struct option do_dump_options[] = {
 		.flag =		0,
 		.val =		1
 	},
+	{
+		.name =		"compress",
+		.has_arg =	no_argument,
+		.flag =		0,
+		.val =		'z'
+	},
+	{
+		.name =		"threads",
+		.has_arg =	required_argument,
+		.flag =		0,
+		.val =		'j'
+	},
+	{
+		.name =		"stream",
+		.has_arg =	required_argument,
+		.flag =		0,
+		.val =		's'
+	},
+	{
+		.name =		"convert",
+		.has_arg =	required_argument,
+		.flag =		0,
+		.val =		'c'
+	},
+	{
+		.name =		"snapshot",
+		.has_arg =	required_argument,
+		.flag =		0,
+		.val =		'S'
+	},
 	/* end */
 	{ NULL, 0, NULL, 0}
 };
@@ -768,8 +964,12 @@ static int do_dump(int os_index) {
 	char *dump_file;
 	int dump_level = DUMP_LEVEL_ALL;
 	int opt, interactive = 0;
+	int compress = 0, nr_threads = 0;
+	char *stream = NULL, *convert = NULL;
+	int snapshot = 0;
+	int fd, ret;
 
-	while ((opt = getopt_long(__argc, __argv, "id:", do_dump_options, NULL)) != -1) {
+	while ((opt = getopt_long(__argc, __argv, "id:zj:s:c:S:", do_dump_options, NULL)) != -1) {
 		switch (opt) {
 			case 1:   /* '--interactive' */
 			case 'i': /* '-i' */
@@ -778,10 +978,53 @@ static int do_dump(int os_index) {
 			case 'd': /* '-d' */
 				dump_level = atoi(optarg);
 				break;
+			case 'z': /* '-z', '--compress' */
+				compress = 1;
+				break;
+			case 'j': /* '-j', '--threads' */
+				nr_threads = atoi(optarg);
+				break;
+			case 's': /* '-s', '--stream' */
+				stream = optarg;
+				break;
+			case 'c': /* '-c', '--convert' */
+				convert = optarg;
+				break;
+			case 'S': /* '-S', '--snapshot' */
+				stream = optarg;
+				snapshot = 1;
+				break;
 			default: /* '?' */
-				fprintf(stderr, "dump [-d level] [-i|--interactive] [file]\n");
+				fprintf(stderr, "dump [-d level] [-i|--interactive] [-z|--compress [-j|--threads N]] [file]\n");
+				fprintf(stderr, "dump [-d level] -s|--stream (file|-)\n");
+				fprintf(stderr, "dump -c|--convert (stream|-) [file]\n");
+				fprintf(stderr, "dump -S|--snapshot (file|-)\n");
+				return 1;
+		}
+	}
+
+	/* Sequential dump or snapshot to stdout, a FIFO or a file */
+	if (stream) {
+		if (!strcmp(stream, "-")) {
+			fd = STDOUT_FILENO;
+		} else {
+			fd = open(stream, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) {
+				perror("open");
 				return 1;
+			}
+		}
+
+		if (snapshot) {
+			ret = ihk_os_snapshot(os_index, fd);
+		} else {
+			ret = ihk_os_makedumpfile_stream(os_index, fd,
+							 dump_level);
+		}
+		if (fd != STDOUT_FILENO && close(fd) && !ret) {
+			ret = -errno;
 		}
+		return ret;
 	}
 
 	dprintf("%s: __argc=%d,optind=%d\n", __FUNCTION__, __argc, optind);
@@ -812,6 +1055,26 @@ static int do_dump(int os_index) {
 		dump_file = path;
 	}
 	dprintf("%s: os_index=%d,dump_file=%s,dump_level=%d,interactive=%d\n", __FUNCTION__, os_index, dump_file, dump_level, interactive);
+
+	if (convert) {
+		if (!strcmp(convert, "-")) {
+			return ihk_dump_stream_to_elf(STDIN_FILENO, dump_file);
+		}
+
+		fd = open(convert, O_RDONLY);
+		if (fd < 0) {
+			perror("open");
+			return 1;
+		}
+
+		ret = ihk_dump_stream_to_elf(fd, dump_file);
+		close(fd);
+		return ret;
+	}
+
+	if (compress && !interactive)
+		return ihk_os_makedumpfile_compressed(os_index, dump_file,
+						      dump_level, nr_threads);
 	return ihk_os_makedumpfile(os_index, dump_file, dump_level, interactive);
 }
 #else /* ENABLE_MEMDUMP */
@@ -840,6 +1103,8 @@ int main(int argc, char **argv)
 	HANDLER_WITH_INDEX(get)
 	else HANDLER_WITH_INDEX(dump)
 	else HANDLER_WITH_INDEX(kmsg)
+	else HANDLER_WITH_INDEX(hang_info)
+	else HANDLER_WITH_INDEX(panic_info)
 
 	sprintf(fn, "/dev/mcos%d", atoi(argv[1]));
 
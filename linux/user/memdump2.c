@@ -24,18 +24,27 @@ unsigned long str_to_ul(char *str)
 int main(int argc, char **argv)
 {
 	int i, n, fd;
-	unsigned long offset, len;
-	unsigned char buf[BPL];
+	unsigned long offset, len, map_offset, map_len;
+	long page_size = sysconf(_SC_PAGESIZE);
+	char dev[32];
+	unsigned char *map, *p;
 
 	if (argc < 3) {
-		fprintf(stderr, "Usage: %s [-k] (offset) (length)\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-k | -o os_index] (offset) (length)\n", argv[0]);
 		return 1;
 	}
-	if (!strcmp(argv[1], "-k")) {
+	if (!strcmp(argv[1], "-k") && argc > 3) {
 		offset = str_to_ul(argv[2]);
 		len = str_to_ul(argv[3]);
 
 		fd = open("/dev/kmem", O_RDONLY);
+	} else if (!strcmp(argv[1], "-o") && argc > 4) {
+		/* Memory of the OS instance, mapped with large pages */
+		offset = str_to_ul(argv[3]);
+		len = str_to_ul(argv[4]);
+
+		snprintf(dev, sizeof(dev), "/dev/mcos%d", atoi(argv[2]));
+		fd = open(dev, O_RDONLY);
 	} else {
 		offset = str_to_ul(argv[1]);
 		len = str_to_ul(argv[2]);
@@ -47,26 +56,30 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		perror("lseek");
+	if (len == 0) {
+		close(fd);
+		return 0;
+	}
+
+	/* Map the whole range at once instead of page by page */
+	map_offset = offset & ~(page_size - 1);
+	map_len = (offset + len - map_offset + page_size - 1) &
+		~(page_size - 1);
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_offset);
+	if (map == MAP_FAILED) {
+		perror("mmap");
 		return 1;
 	}
-	
+	p = map + (offset - map_offset);
+
 	printf("Dump Offset : %016lx, Dump Length: %016lx\n", offset, len);
 	printf("(Address)-------  "
 	       "+0 +1 +2 +3 +4 +5 +6 +7 +8 +9 +a +b +c +d +e +f\n");
 
 	while (len > 0) {
-		char *p;
-
 		printf("%016lx: ", offset);
-		
-		p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, offset);
-		if (p == MAP_FAILED) {
-			perror("mmap");
-			return 1;
-		}
-		n = 4096;
+
+		n = BPL;
 		if (n > len) {
 			n = len;
 		}
@@ -75,12 +88,13 @@ int main(int argc, char **argv)
 		}
 
 		printf("\n");
-		munmap(p, 4096);
 
 		len -= n;
 		offset += n;
+		p += n;
 	}
 
+	munmap(map, map_len);
 	close(fd);
 
 	return 0;
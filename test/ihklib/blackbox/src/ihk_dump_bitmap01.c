@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ihk/ihk_dump_bitmap.h>
+#include "okng.h"
+#include "params.h"
+
+#define NR_WORDS 8
+#define NR_BITS (NR_WORDS * 64)
+#define MAX_RUNS (NR_BITS + 1)
+
+const char param[] = "dump page bitmap";
+const char *values[] = {
+	"all clear",
+	"all set",
+	"alternating bits",
+	"runs crossing word boundaries",
+	"single bits at word edges",
+	"random",
+	"random, partial last word",
+};
+
+struct run {
+	unsigned long start;
+	unsigned long len;
+};
+
+/* Reference: the per-bit scan used by the driver before */
+static int runs_per_bit(unsigned long *map, unsigned long nbits, int set,
+			struct run *runs)
+{
+	unsigned long i, count = 0, start = 0;
+	int nr = 0;
+
+	for (i = 0; i < nbits; i++) {
+		if (((map[i / 64] >> (i % 64)) & 0x1) == set) {
+			if (!count)
+				start = i;
+			count++;
+		} else if (count) {
+			runs[nr].start = start;
+			runs[nr].len = count;
+			nr++;
+			count = 0;
+		}
+	}
+
+	if (count) {
+		runs[nr].start = start;
+		runs[nr].len = count;
+		nr++;
+	}
+
+	return nr;
+}
+
+static int runs_per_word(unsigned long *map, unsigned long nbits, int set,
+			 struct run *runs)
+{
+	unsigned long pos = 0;
+	int nr = 0;
+
+	while (ihk_dump_bitmap_next_run(map, nbits, &pos, set,
+					&runs[nr].start, &runs[nr].len))
+		nr++;
+
+	return nr;
+}
+
+static int check_runs(unsigned long *map, unsigned long nbits)
+{
+	static struct run expected[MAX_RUNS], result[MAX_RUNS];
+	int nr_expected, nr_result;
+	int set;
+
+	for (set = 0; set <= 1; set++) {
+		nr_expected = runs_per_bit(map, nbits, set, expected);
+		nr_result = runs_per_word(map, nbits, set, result);
+
+		if (nr_expected != nr_result) {
+			INFO("%s runs: expected %d, got %d\n",
+			     set ? "set" : "clear", nr_expected, nr_result);
+			return 1;
+		}
+
+		if (memcmp(expected, result, sizeof(struct run) * nr_result)) {
+			INFO("%s runs differ\n", set ? "set" : "clear");
+			return 1;
+		}
+
+		if (set &&
+		    ihk_dump_bitmap_nr_runs(map, nbits) != nr_expected) {
+			INFO("ihk_dump_bitmap_nr_runs returned %lu, expected %d\n",
+			     ihk_dump_bitmap_nr_runs(map, nbits), nr_expected);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_set_range(unsigned long start, unsigned long len)
+{
+	unsigned long expected[NR_WORDS] = { 0 };
+	unsigned long result[NR_WORDS] = { 0 };
+	unsigned long i;
+
+	for (i = start; i < start + len; i++)
+		expected[i / 64] |= 1UL << (i % 64);
+
+	ihk_dump_bitmap_set_range(result, start, len);
+
+	return memcmp(expected, result, sizeof(expected)) ? 1 : 0;
+}
+
+static int check_clear_range(unsigned long start, unsigned long len)
+{
+	unsigned long expected[NR_WORDS];
+	unsigned long result[NR_WORDS];
+	unsigned long i;
+
+	memset(expected, 0xff, sizeof(expected));
+	memset(result, 0xff, sizeof(result));
+
+	for (i = start; i < start + len; i++)
+		expected[i / 64] &= ~(1UL << (i % 64));
+
+	ihk_dump_bitmap_clear_range(result, start, len);
+
+	return memcmp(expected, result, sizeof(expected)) ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int i, j;
+	unsigned long map[NR_WORDS];
+	unsigned long nbits[] = {
+		NR_BITS, NR_BITS, NR_BITS, NR_BITS, NR_BITS, NR_BITS,
+		NR_BITS - 37,
+	};
+	unsigned long starts[] = { 0, 0, 1, 63, 64, 65, 100 };
+	unsigned long lens[] = { 0, 1, 63, 2, 64, 200, NR_BITS - 100 };
+
+	params_getopt(argc, argv);
+
+	srandom(1);
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		START("test-case: %s: %s\n", param, values[i]);
+
+		switch (i) {
+		case 0:
+			memset(map, 0, sizeof(map));
+			break;
+		case 1:
+			memset(map, 0xff, sizeof(map));
+			break;
+		case 2:
+			for (j = 0; j < NR_WORDS; j++)
+				map[j] = 0x5555555555555555UL;
+			break;
+		case 3:
+			memset(map, 0, sizeof(map));
+			map[0] = 0xffff000000000000UL;
+			map[1] = ~0UL;
+			map[2] = 0x00000000000000ffUL;
+			map[4] = 0xf00000000000000fUL;
+			map[5] = 0xf00000000000000fUL;
+			map[7] = 0x8000000000000000UL;
+			break;
+		case 4:
+			for (j = 0; j < NR_WORDS; j++)
+				map[j] = 0x8000000000000001UL;
+			break;
+		case 5:
+		case 6:
+			for (j = 0; j < NR_WORDS; j++)
+				map[j] = ((unsigned long)random() << 33) ^
+					((unsigned long)random() << 2) ^
+					(unsigned long)random();
+			break;
+		}
+
+		ret = check_runs(map, nbits[i]);
+		OKNG(ret == 0, "range output matches per-bit output\n");
+	}
+
+	START("test-case: %s: %s\n", param, "set range");
+	for (i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+		ret = check_set_range(starts[i], lens[i]);
+		OKNG(ret == 0, "start %lu, length %lu\n", starts[i], lens[i]);
+	}
+
+	START("test-case: %s: %s\n", param, "clear range");
+	for (i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+		ret = check_clear_range(starts[i], lens[i]);
+		OKNG(ret == 0, "start %lu, length %lu\n", starts[i], lens[i]);
+	}
+
+	ret = 0;
+ out:
+	return ret;
+}
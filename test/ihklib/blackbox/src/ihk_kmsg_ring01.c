@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <ihk/ihk_kmsg_ring.h>
+#include "okng.h"
+#include "params.h"
+
+#define NR_WRITERS 8
+#define NR_LINES 10000
+
+const char param[] = "kmsg ring";
+const char *values[] = {
+	"single writer",
+	"concurrent writers and reader",
+	"writers lapping the reader",
+	"records of concurrent writers",
+	"records of a writer lapping the reader",
+};
+
+static struct ihk_kmsg_buf *kmsg;
+static char *buf;
+
+struct writer {
+	pthread_t thread;
+	int id;
+	int nr_lines;
+};
+
+static void *write_lines(void *arg)
+{
+	struct writer *w = arg;
+	char line[64];
+	int i, len;
+
+	for (i = 0; i < w->nr_lines; i++) {
+		len = sprintf(line, "writer %d line %d\n", w->id, i);
+		ihk_kmsg_write(kmsg, line, len, w->id % 8, w->id, i);
+	}
+
+	return NULL;
+}
+
+/* Check that text is made of intact lines whose numbers increase by
+ * one for each writer. Lines older than the first seen may be lost
+ * only when lossy is set. */
+static int check_lines(char *text, int len, int *next, int lossy)
+{
+	char *line, *save = NULL;
+	int id, nr;
+
+	text[len] = '\0';
+	for (line = strtok_r(text, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "writer %d line %d", &id, &nr) != 2 ||
+		    id < 0 || id >= NR_WRITERS) {
+			INFO("broken line: %s\n", line);
+			return 1;
+		}
+
+		if (next[id] < 0 && lossy) {
+			next[id] = nr;
+		}
+
+		if (nr != next[id]) {
+			INFO("writer %d: line %d, expected %d\n",
+			     id, nr, next[id]);
+			return 1;
+		}
+		next[id]++;
+	}
+
+	return 0;
+}
+
+/* Check that the header of each record matches its text and that
+ * sequence numbers are contiguous except where the reader was lapped,
+ * where the gap is the number of lines lost
+ */
+static int check_records(int *next, unsigned long *nr_recs)
+{
+	struct ihk_kmsg_rec rec;
+	unsigned long head = kmsg->head, dropped, next_seq = 0;
+	int id, nr;
+
+	*nr_recs = 0;
+	for (;;) {
+		dropped = 0;
+		if (!ihk_kmsg_read_rec(kmsg, &head, &rec, buf, &dropped)) {
+			break;
+		}
+		buf[rec.len] = '\0';
+
+		if (sscanf(buf, "writer %d line %d", &id, &nr) != 2 ||
+		    id < 0 || id >= NR_WRITERS) {
+			INFO("broken record: %s\n", buf);
+			return 1;
+		}
+
+		if (rec.cpu != id || rec.level != id % 8 || rec.ts != nr) {
+			INFO("header of \"%s\": cpu %d, level %d, ts %lu\n",
+			     buf, rec.cpu, rec.level, rec.ts);
+			return 1;
+		}
+
+		if (dropped && next[id] >= 0 &&
+		    rec.seq - next_seq != nr - next[id]) {
+			INFO("%lu records skipped, %d lines lost\n",
+			     rec.seq - next_seq, nr - next[id]);
+			return 1;
+		}
+
+		if (!dropped && next[id] >= 0 && nr != next[id]) {
+			INFO("writer %d: line %d, expected %d\n",
+			     id, nr, next[id]);
+			return 1;
+		}
+
+		next[id] = nr + 1;
+		if ((long)(rec.seq + 1 - next_seq) > 0) {
+			next_seq = rec.seq + 1;
+		}
+		(*nr_recs)++;
+	}
+
+	kmsg->head = head;
+	return 0;
+}
+
+static void reset(void)
+{
+	ihk_kmsg_init(kmsg, sizeof(kmsg->str));
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int i, j, len;
+	int next[NR_WRITERS];
+	int nr_writers[] = { 1, NR_WRITERS, 1, NR_WRITERS, 1 };
+	int nr_lines[] = { NR_LINES, NR_LINES / 2, NR_LINES * 20,
+			   NR_LINES / 2, NR_LINES * 20 };
+	unsigned long nr_recs;
+	struct writer writers[NR_WRITERS];
+
+	params_getopt(argc, argv);
+
+	kmsg = calloc(1, sizeof(*kmsg));
+	buf = malloc(sizeof(kmsg->str) + 1);
+	INTERR(!kmsg || !buf, "malloc failed\n");
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		START("test-case: %s: %s\n", param, values[i]);
+
+		reset();
+
+		/* The header at position 0 starts out zeroed */
+		if (i == 0) {
+			ihk_kmsg_reserve(kmsg, 8);
+			len = ihk_kmsg_read(kmsg, &kmsg->head, buf,
+					    &kmsg->dropped);
+			OKNG(len == 0 && kmsg->head == 0,
+			     "record not committed yet isn't read\n");
+			reset();
+		}
+
+		for (j = 0; j < NR_WRITERS; j++) {
+			next[j] = i == 2 ? -1 : 0;
+		}
+
+		for (j = 0; j < nr_writers[i]; j++) {
+			writers[j].id = j;
+			writers[j].nr_lines = nr_lines[i];
+			ret = pthread_create(&writers[j].thread, NULL,
+					     write_lines, &writers[j]);
+			INTERR(ret, "pthread_create returned %d\n", ret);
+		}
+
+		/* Read while the writers are running */
+		if (i == 1) {
+			while (IHK_KMSG_ACCESS_ONCE(kmsg->reserve) == 0) {
+			}
+
+			for (j = 0, ret = 0; j < 100 && !ret; j++) {
+				len = ihk_kmsg_read(kmsg, &kmsg->head, buf,
+						    &kmsg->dropped);
+				ret = check_lines(buf, len, next, 0);
+			}
+			OKNG(ret == 0, "lines read while writing are intact\n");
+		}
+
+		for (j = 0; j < nr_writers[i]; j++) {
+			pthread_join(writers[j].thread, NULL);
+		}
+
+		if (i >= 3) {
+			ret = check_records(next, &nr_recs);
+			OKNG(ret == 0, "records are intact and in order\n");
+
+			OKNG(kmsg->seq == nr_writers[i] * nr_lines[i],
+			     "sequence numbers taken: %lu, expected: %d\n",
+			     kmsg->seq, nr_writers[i] * nr_lines[i]);
+
+			OKNG(i == 4 ? nr_recs < kmsg->seq :
+			     nr_recs == kmsg->seq,
+			     "records read: %lu\n", nr_recs);
+			continue;
+		}
+
+		len = ihk_kmsg_read(kmsg, &kmsg->head, buf, &kmsg->dropped);
+		ret = check_lines(buf, len, next, i == 2);
+		OKNG(ret == 0, "lines are intact and in order\n");
+
+		for (j = 0; j < nr_writers[i]; j++) {
+			OKNG(next[j] == nr_lines[i],
+			     "writer %d: last line read: %d, expected: %d\n",
+			     j, next[j] - 1, nr_lines[i] - 1);
+		}
+
+		OKNG(i == 2 ? kmsg->dropped > 0 : kmsg->dropped == 0,
+		     "dropped bytes: %lu\n", kmsg->dropped);
+
+		OKNG(kmsg->head == kmsg->reserve,
+		     "head reached the end of the ring\n");
+
+		len = ihk_kmsg_read(kmsg, &kmsg->head, buf, &kmsg->dropped);
+		OKNG(len == 0, "nothing left to read\n");
+	}
+
+	ret = 0;
+ out:
+	free(buf);
+	free(kmsg);
+	return ret;
+}
@@ -0,0 +1,132 @@
+#include <string.h>
+#include <errno.h>
+#include <ihklib.h>
+#include <ihk/ihk_monitor.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "CPU set and timeout";
+const char *values[] = {
+	"empty set",
+	"negative timeout",
+	"all LWK CPUs, no wait",
+	"all LWK CPUs, wait 10 sec",
+	"first LWK CPU, wait 10 sec",
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int i;
+	unsigned long cpu_set[IHK_OS_MONITOR_CPU_WORDS];
+	unsigned long first_cpu_set[IHK_OS_MONITOR_CPU_WORDS] = { 1 };
+	unsigned long os_set[1] = { 1 };
+	int num_cpus;
+
+	params_getopt(argc, argv);
+
+	int nr_cpus[] = { 0, 1, -1, -1, -1 };
+	int timeouts[] = { 0, -1, 0, 10000, 10000 };
+	int ret_expected[] = { -EINVAL, -EINVAL, 0, 0, 0 };
+	/* Freezing a subset doesn't change the OS status */
+	int status_expected[] = { 0, 0, IHK_STATUS_FROZEN, IHK_STATUS_FROZEN,
+				  IHK_STATUS_RUNNING };
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os_wait_for_status timeout %d\n", ret);
+
+	num_cpus = ihk_os_get_num_assigned_cpus(0);
+	INTERR(num_cpus <= 1, "ihk_os_get_num_assigned_cpus returned %d\n",
+	       num_cpus);
+
+	memset(cpu_set, 0, sizeof(cpu_set));
+	for (i = 0; i < num_cpus; i++) {
+		cpu_set[i / 64] |= (1UL << (i % 64));
+	}
+
+	/* Activate and check */
+	for (i = 0; i < 5; i++) {
+		START("test-case: %s: %s\n", param, values[i]);
+
+		ret = ihk_os_freeze_cpus(0, i == 4 ? first_cpu_set : cpu_set,
+					 nr_cpus[i] == -1 ? num_cpus : nr_cpus[i],
+					 timeouts[i]);
+		OKNG(ret == ret_expected[i],
+		     "return value: %d, expected: %d\n",
+		     ret, ret_expected[i]);
+
+		if (ret_expected[i] != 0) {
+			continue;
+		}
+
+		if (status_expected[i] == IHK_STATUS_FROZEN) {
+			ret = os_wait_for_status(IHK_STATUS_FROZEN);
+			OKNG(ret == 0,
+			     "os status %s to FROZEN\n",
+			     ret == 0 ? "has changed" : "didn't change");
+		} else {
+			ret = ihk_os_get_status(0);
+			OKNG(ret == status_expected[i],
+			     "os status: %d, expected: %d\n",
+			     ret, status_expected[i]);
+		}
+
+		ret = ihk_os_thaw(os_set, sizeof(unsigned long) * 8);
+		INTERR(ret, "ihk_os_thaw returned %d\n", ret);
+
+		ret = os_wait_for_status(IHK_STATUS_RUNNING);
+		INTERR(ret, "os_wait_for_status timeout %d\n", ret);
+	}
+
+	ret = 0;
+ out:
+	if (ihk_get_num_os_instances(0)) {
+		if (ihk_os_get_status(0) == IHK_STATUS_FROZEN) {
+			ihk_os_thaw(os_set, sizeof(unsigned long) * 8);
+			os_wait_for_status(IHK_STATUS_RUNNING);
+		}
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <ihklib.h>
+#include <ihk/ihklib_private.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "user.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "hang info";
+const char *values[] = {
+	"running OS",
+	"invalid buffer",
+	"hung-up OS",
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int i, n, nr_stuck;
+	int fd;
+	pid_t pid = -1;
+	struct ihk_cpu_hang_info *info = NULL;
+
+	params_getopt(argc, argv);
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+	n = ihk_os_get_hang_info(0, NULL, 0);
+	OKNG(n == ihk_os_get_num_assigned_cpus(0),
+	     "number of LWK CPUs: %d, expected: %d\n",
+	     n, ihk_os_get_num_assigned_cpus(0));
+	INTERR(n <= 0, "no LWK CPU\n");
+
+	info = calloc(n, sizeof(*info));
+	INTERR(!info, "calloc failed\n");
+
+	ret = ihk_os_get_hang_info(0, info, n);
+	OKNG(ret == n, "ihk_os_get_hang_info returned %d\n", ret);
+
+	for (i = 0, nr_stuck = 0; i < n; i++) {
+		if (info[i].stuck || info[i].captured) {
+			nr_stuck++;
+		}
+	}
+	OKNG(nr_stuck == 0, "no CPU is stuck\n");
+
+	START("test-case: %s: %s\n", param, values[1]);
+	ret = ihk_os_get_hang_info(0, NULL, 1);
+	OKNG(ret == -EINVAL, "ihk_os_get_hang_info returned %d\n", ret);
+
+	START("test-case: %s: %s\n", param, values[2]);
+	ret = user_fork_exec("hungup", &pid);
+	INTERR(ret < 0, "user_fork_exec returned %d\n", ret);
+
+	/* wait until McKernel start ihk_mc_delay_us() */
+	usleep(0.25 * 1000000);
+
+	fd = ihklib_device_open(0);
+	INTERR(fd < 0, "ihklib_device_open returned %d\n", fd);
+
+	ioctl(fd, IHK_DEVICE_DETECT_HUNGUP, 0);
+	usleep(0.25 * 1000000);
+	ioctl(fd, IHK_DEVICE_DETECT_HUNGUP, 0);
+
+	close(fd);
+
+	ret = os_wait_for_status(IHK_STATUS_HUNGUP);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_HUNGUP);
+
+	ret = ihk_os_get_hang_info(0, info, n);
+	INTERR(ret != n, "ihk_os_get_hang_info returned %d\n", ret);
+
+	for (i = 0, nr_stuck = 0; i < n; i++) {
+		if (!info[i].stuck) {
+			continue;
+		}
+
+		nr_stuck++;
+		INFO("cpu %d: last entry: pc 0x%lx, syscall %ld, %s\n",
+		     info[i].cpu, info[i].last_pc, info[i].last_syscall,
+		     info[i].captured ? "registers saved" :
+		     "no registers saved");
+	}
+	OKNG(nr_stuck == 1, "stuck CPUs: %d, expected: 1\n", nr_stuck);
+
+	ret = 0;
+ out:
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+	}
+	if (pid != -1) {
+		user_wait(&pid);
+		linux_kill_mcexec();
+	}
+	if (ihk_get_num_os_instances(0)) {
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+	free(info);
+
+	return ret;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <ihklib.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "user.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "panic info";
+const char *values[] = {
+	"running OS",
+	"invalid buffer",
+	"panic",
+	"after shutdown",
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int fd_event = -1;
+	pid_t pid = -1;
+	uint64_t counter;
+	struct pollfd pfd;
+	struct ihk_panic_info info;
+
+	params_getopt(argc, argv);
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	fd_event = ihk_os_get_eventfd(0, IHK_OS_EVENTFD_TYPE_PANIC);
+	INTERR(fd_event < 0, "ihk_os_get_eventfd returned %d\n", fd_event);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+	ret = ihk_os_get_panic_info(0, &info);
+	OKNG(ret == -ENOENT, "ihk_os_get_panic_info returned %d\n", ret);
+
+	START("test-case: %s: %s\n", param, values[1]);
+	ret = ihk_os_get_panic_info(0, NULL);
+	OKNG(ret == -EINVAL, "ihk_os_get_panic_info returned %d\n", ret);
+
+	START("test-case: %s: %s\n", param, values[2]);
+	ret = user_fork_exec("panic", &pid);
+	INTERR(ret < 0, "user_fork_exec returned %d\n", ret);
+
+	pfd.fd = fd_event;
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 10000);
+	OKNG(ret == 1, "panic event detected\n");
+
+	ret = read(fd_event, &counter, sizeof(counter));
+	INTERR(ret != sizeof(counter), "read returned %d\n", errno);
+
+	ret = ihk_os_get_panic_info(0, &info);
+	OKNG(ret == 0, "ihk_os_get_panic_info returned %d\n", ret);
+
+	OKNG(strstr(info.msg, "sys_panic") != NULL,
+	     "panic message: %s\n", info.msg);
+	OKNG(info.cpu >= 0 && info.cpu < ihk_os_get_num_assigned_cpus(0),
+	     "panic on cpu %d\n", info.cpu);
+	INFO("pc 0x%lx, %d registers, %d return addresses saved\n",
+	     info.pc, info.nr_regs, info.depth);
+
+	ret = os_wait_for_status(IHK_STATUS_PANIC);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_PANIC);
+
+	START("test-case: %s: %s\n", param, values[3]);
+	user_wait(&pid);
+	linux_kill_mcexec();
+
+	ret = ihk_os_shutdown(0);
+	INTERR(ret, "ihk_os_shutdown returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_INACTIVE);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_INACTIVE);
+
+	ret = ihk_os_get_panic_info(0, &info);
+	OKNG(ret == -ENOENT, "ihk_os_get_panic_info returned %d\n", ret);
+
+	ret = 0;
+ out:
+	if (fd_event >= 0) {
+		close(fd_event);
+	}
+	if (pid > 0) {
+		user_wait(&pid);
+		linux_kill_mcexec();
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <ihklib.h>
+#include <ihk/ihklib_private.h>
+#include <ihk/ihk_host_user.h>
+#include <ihk/ihk_kmsg_ring.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "mapping of kmsg_buf";
+const char *values[] = {
+	"read-only",
+	"writable",
+	"shift the cursor",
+	"shift the cursor past the end",
+	"access after destroy",
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int fd = -1;
+	struct ihk_kmsg_buf *kmsg = MAP_FAILED;
+	void *map;
+	char *buf = NULL;
+	unsigned long head, dropped = 0, reserve;
+	struct ihk_device_get_kmsg_buf_desc desc_get = { 0 };
+	struct ihk_device_shift_kmsg_buf_desc desc_shift = { 0 };
+
+	params_getopt(argc, argv);
+
+	buf = malloc(IHK_KMSG_SIZE + 1);
+	INTERR(!buf, "malloc failed\n");
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	fd = ihklib_device_open(0);
+	INTERR(fd < 0, "ihklib_device_open returned %d\n", fd);
+
+	desc_get.os_index = 0;
+	ret = ioctl(fd, IHK_DEVICE_GET_KMSG_BUF, &desc_get);
+	INTERR(ret, "IHK_DEVICE_GET_KMSG_BUF returned %d\n", errno);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+	kmsg = mmap(NULL, sizeof(*kmsg), PROT_READ, MAP_SHARED, fd,
+		    IHK_DEVICE_KMSG_MMAP_OFFSET(0));
+	OKNG(kmsg != MAP_FAILED, "mmap succeeded\n");
+
+	head = kmsg->head;
+	ret = ihk_kmsg_read(kmsg, &head, buf, &dropped);
+	buf[ret] = '\0';
+	OKNG(strstr(buf, "booted") != NULL,
+	     "expected string found in the mapping\n");
+
+	START("test-case: %s: %s\n", param, values[1]);
+	map = mmap(NULL, sizeof(*kmsg), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, IHK_DEVICE_KMSG_MMAP_OFFSET(0));
+	OKNG(map == MAP_FAILED, "mmap failed with %d\n", errno);
+
+	START("test-case: %s: %s\n", param, values[2]);
+	desc_shift.handle = desc_get.handle;
+	desc_shift.head = head;
+	ret = ioctl(fd, IHK_DEVICE_SHIFT_KMSG_BUF, &desc_shift);
+	OKNG(ret == 0, "IHK_DEVICE_SHIFT_KMSG_BUF returned %d\n",
+	     ret ? errno : 0);
+	OKNG(kmsg->head == head, "head: %lu, expected: %lu\n",
+	     kmsg->head, head);
+
+	START("test-case: %s: %s\n", param, values[3]);
+	desc_shift.head = kmsg->reserve + IHK_KMSG_BLOCK_SIZE;
+	ret = ioctl(fd, IHK_DEVICE_SHIFT_KMSG_BUF, &desc_shift);
+	OKNG(ret == -1 && errno == EINVAL,
+	     "IHK_DEVICE_SHIFT_KMSG_BUF failed with %d, expected: %d\n",
+	     errno, EINVAL);
+	OKNG(kmsg->head == head, "head didn't move\n");
+
+	START("test-case: %s: %s\n", param, values[4]);
+	ret = ihk_os_shutdown(0);
+	INTERR(ret, "ihk_os_shutdown returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_INACTIVE);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_INACTIVE);
+
+	ret = mems_os_release();
+	INTERR(ret, "mems_os_release returned %d\n", ret);
+
+	ret = cpus_os_release();
+	INTERR(ret, "cpus_os_release returned %d\n", ret);
+
+	reserve = kmsg->reserve;
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os with the mapping returned %d\n", ret);
+	OKNG(kmsg->reserve == reserve, "mapping is still readable\n");
+
+	ret = 0;
+ out:
+	if (kmsg != MAP_FAILED) {
+		munmap(kmsg, sizeof(*kmsg));
+	}
+	if (desc_get.handle) {
+		ioctl(fd, IHK_DEVICE_RELEASE_KMSG_BUF, desc_get.handle);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <ihklib.h>
+#include <ihk/ihk_host_user.h>
+#include <ihk/ihk_debug.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+#define SYSFS_KMSG "/sys/class/mcos/mcos0/kmsg/"
+#define NR_NOTIFICATIONS 1000
+
+const char param[] = "kmsg notification";
+const char *values[] = {
+	"default tunables",
+	"set tunables",
+	"set out-of-range tunables",
+	"burst of notifications",
+	"byte threshold reached",
+};
+
+static int sysfs_read(const char *name, unsigned long *val)
+{
+	char path[256];
+	FILE *fp;
+	int ret;
+
+	sprintf(path, SYSFS_KMSG "%s", name);
+	fp = fopen(path, "r");
+	if (!fp) {
+		return -errno;
+	}
+	ret = fscanf(fp, "%lu", val) == 1 ? 0 : -EINVAL;
+	fclose(fp);
+	return ret;
+}
+
+static int sysfs_write(const char *name, unsigned long val)
+{
+	char path[256];
+	char buf[32];
+	int fd, len, ret = 0;
+
+	sprintf(path, SYSFS_KMSG "%s", name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	len = sprintf(buf, "%lu\n", val);
+	if (write(fd, buf, len) != len) {
+		ret = -errno;
+	}
+	close(fd);
+	return ret;
+}
+
+/* Number of wakeups pending on the eventfd */
+static uint64_t reap(int evfd)
+{
+	uint64_t counter = 0;
+
+	if (read(evfd, &counter, sizeof(counter)) != sizeof(counter)) {
+		return 0;
+	}
+	return counter;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int i;
+	int fd = -1, evfd = -1;
+	unsigned long val, notifications, wakeups;
+	uint64_t counter;
+
+	params_getopt(argc, argv);
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	fd = open("/dev/mcos0", O_RDONLY);
+	INTERR(fd < 0, "open /dev/mcos0 failed with %d\n", errno);
+
+	evfd = ihk_os_get_eventfd(0, IHK_OS_EVENTFD_TYPE_KMSG);
+	INTERR(evfd < 0, "ihk_os_get_eventfd returned %d\n", evfd);
+
+	ret = fcntl(evfd, F_SETFL, O_NONBLOCK);
+	INTERR(ret, "fcntl failed with %d\n", errno);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+	ret = sysfs_read("notify_interval_us", &val);
+	OKNG(ret == 0 && val == IHK_KMSG_NOTIFY_INTERVAL,
+	     "notify_interval_us: %lu, expected: %d\n",
+	     val, IHK_KMSG_NOTIFY_INTERVAL);
+
+	ret = sysfs_read("notify_bytes", &val);
+	OKNG(ret == 0 && val == IHK_KMSG_NOTIFY_BYTES,
+	     "notify_bytes: %lu, expected: %d\n",
+	     val, IHK_KMSG_NOTIFY_BYTES);
+
+	ret = sysfs_read("bytes", &val);
+	OKNG(ret == 0 && val > 0, "bytes written while booting: %lu\n", val);
+
+	ret = sysfs_read("dropped", &val);
+	OKNG(ret == 0 && val == 0, "dropped: %lu\n", val);
+
+	START("test-case: %s: %s\n", param, values[1]);
+	ret = sysfs_write("notify_interval_us", 500000);
+	INTERR(ret, "writing notify_interval_us failed with %d\n", ret);
+	ret = sysfs_read("notify_interval_us", &val);
+	OKNG(ret == 0 && val == 500000,
+	     "notify_interval_us: %lu, expected: %d\n", val, 500000);
+
+	ret = sysfs_write("notify_bytes", IHK_KMSG_SIZE);
+	INTERR(ret, "writing notify_bytes failed with %d\n", ret);
+	ret = sysfs_read("notify_bytes", &val);
+	OKNG(ret == 0 && val == IHK_KMSG_SIZE,
+	     "notify_bytes: %lu, expected: %d\n", val, IHK_KMSG_SIZE);
+
+	START("test-case: %s: %s\n", param, values[2]);
+	ret = sysfs_write("notify_interval_us", 2000000);
+	OKNG(ret == -EINVAL, "writing notify_interval_us returned %d\n", ret);
+
+	ret = sysfs_write("notify_bytes", IHK_KMSG_SIZE + 1);
+	OKNG(ret == -EINVAL, "writing notify_bytes returned %d\n", ret);
+
+	START("test-case: %s: %s\n", param, values[3]);
+	/* Start a new interval */
+	usleep(600000);
+	ret = ioctl(fd, IHK_OS_EVENTFD, IHK_OS_EVENTFD_TYPE_KMSG);
+	INTERR(ret, "IHK_OS_EVENTFD failed with %d\n", errno);
+	reap(evfd);
+
+	ret = sysfs_read("notifications", &notifications);
+	INTERR(ret, "reading notifications failed with %d\n", ret);
+	ret = sysfs_read("wakeups", &wakeups);
+	INTERR(ret, "reading wakeups failed with %d\n", ret);
+
+	for (i = 0; i < NR_NOTIFICATIONS; i++) {
+		ret = ioctl(fd, IHK_OS_EVENTFD, IHK_OS_EVENTFD_TYPE_KMSG);
+		INTERR(ret, "IHK_OS_EVENTFD failed with %d\n", errno);
+	}
+
+	counter = reap(evfd);
+	OKNG(counter == 0, "no wakeup within the interval, got %lu\n",
+	     (unsigned long)counter);
+
+	usleep(600000);
+	counter = reap(evfd);
+	OKNG(counter == 1, "one wakeup at the end of the interval, got %lu\n",
+	     (unsigned long)counter);
+
+	ret = sysfs_read("notifications", &val);
+	OKNG(ret == 0 && val - notifications >= NR_NOTIFICATIONS,
+	     "notifications counted: %lu\n", val - notifications);
+
+	ret = sysfs_read("wakeups", &val);
+	OKNG(ret == 0 && val - wakeups == 1, "wakeups counted: %lu\n",
+	     val - wakeups);
+
+	START("test-case: %s: %s\n", param, values[4]);
+	ret = sysfs_write("notify_bytes", 0);
+	INTERR(ret, "writing notify_bytes failed with %d\n", ret);
+
+	for (i = 0; i < 10; i++) {
+		ret = ioctl(fd, IHK_OS_EVENTFD, IHK_OS_EVENTFD_TYPE_KMSG);
+		INTERR(ret, "IHK_OS_EVENTFD failed with %d\n", errno);
+	}
+
+	counter = reap(evfd);
+	OKNG(counter == 10, "every notification woke up, got %lu\n",
+	     (unsigned long)counter);
+
+	ret = 0;
+ out:
+	if (evfd >= 0) {
+		close(evfd);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
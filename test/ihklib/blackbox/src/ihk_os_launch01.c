@@ -0,0 +1,118 @@
+#include <string.h>
+#include <errno.h>
+#include <ihklib.h>
+#include <ihk/ihklib_private.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "kernel image";
+const char *values[] = {
+	"non-existent image",
+	"valid image",
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int i;
+	struct cpus cpus = { 0 };
+	struct mems mems = { 0 };
+	struct ihk_os_launch_attr attr = { 0 };
+	char fn[2][4096];
+	char kargs[] = "hidos";
+
+	params_getopt(argc, argv);
+
+	sprintf(fn[0], "%s/%s/kernel/no_such_image.img",
+		QUOTE(WITH_MCK), QUOTE(BUILD_TARGET));
+	sprintf(fn[1], "%s/%s/kernel/mckernel.img",
+		QUOTE(WITH_MCK), QUOTE(BUILD_TARGET));
+
+	int ret_expected[] = { -ENOENT, 0 };
+	int num_os_expected[] = { 0, 1 };
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = cpus_reserved(&cpus);
+	INTERR(ret, "cpus_reserved returned %d\n", ret);
+
+	ret = mems_reserved(&mems);
+	INTERR(ret, "mems_reserved returned %d\n", ret);
+
+	attr.cpus = cpus.cpus;
+	attr.num_cpus = cpus.ncpus;
+	attr.mem_chunks = mems.mem_chunks;
+	attr.num_mem_chunks = mems.num_mem_chunks;
+	attr.kargs = kargs;
+	attr.boot = 1;
+
+	for (i = 0; i < 2; i++) {
+		START("test-case: %s: %s\n", param, values[i]);
+
+		attr.kernel_image = fn[i];
+		ret = ihk_os_launch(0, &attr);
+		OKNG(ret == ret_expected[i],
+		     "return value (os index when positive): %d, expected: %d\n",
+		     ret, ret_expected[i]);
+
+		/* Failed launch must be rolled back */
+		ret = ihk_get_num_os_instances(0);
+		OKNG(ret == num_os_expected[i],
+		     "# of os instances: %d, expected: %d\n",
+		     ret, num_os_expected[i]);
+
+		if (ret_expected[i] == 0) {
+			ret = ihk_os_get_status(0);
+			OKNG(ret == IHK_STATUS_RUNNING,
+			     "status: %d, expected: %d\n",
+			     ret, IHK_STATUS_RUNNING);
+
+			ret = ihk_os_shutdown(0);
+			INTERR(ret, "ihk_os_shutdown returned %d\n", ret);
+
+			ret = os_wait_for_status(IHK_STATUS_INACTIVE);
+			INTERR(ret, "os status didn't change to %d\n",
+			       IHK_STATUS_INACTIVE);
+
+			ret = cpus_os_release();
+			INTERR(ret, "cpus_os_release returned %d\n", ret);
+
+			ret = mems_os_release();
+			INTERR(ret, "mems_os_release returned %d\n", ret);
+
+			ret = ihk_destroy_os(0, 0);
+			INTERR(ret, "ihk_destroy_os returned %d\n", ret);
+		} else {
+			/* Resources must be back to the device */
+			ret = cpus_check_reserved(&cpus);
+			OKNG(ret == 0, "reserved cpus as expected\n");
+		}
+	}
+
+	ret = 0;
+ out:
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+	return ret;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ihklib.h>
+#include <ihk/ihk_host_user.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "number of threads";
+const char *values[] = {
+	"1",
+	"4",
+	"number of online CPUs",
+};
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int opt;
+	char *fn = NULL;
+	char elf_fn[PATH_MAX] = "";
+	int fd;
+
+	params_getopt(argc, argv);
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fn = optarg;
+			break;
+		default: /* '?' */
+			printf("unknown option %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	int nr_threads[] = { 1, 4, 0 };
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	struct mems mems = { 0 };
+	int excess;
+
+	ret = mems_ls(&mems);
+	INTERR(ret, "mems_ls returned %d\n", ret);
+
+	excess = mems.num_mem_chunks - 4;
+	if (excess > 0) {
+		ret = mems_shift(&mems, excess);
+		INTERR(ret, "mems_shift returned %d\n", ret);
+	}
+
+	mems_fill(&mems, (1UL << 29) / mems.num_mem_chunks);
+
+	ret = ihk_reserve_mem(0, mems.mem_chunks,
+			      mems.num_mem_chunks);
+	INTERR(ret, "ihk_reserve_mem returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	/* Activate and check */
+	for (i = 0; i < 3; i++) {
+		START("test-case: %s: %s\n", param, values[i]);
+
+		if (!(access(fn, F_OK))) {
+			unlink(fn);
+		}
+
+		ret = ihk_os_makedumpfile_compressed(0, fn, 24,
+						     nr_threads[i]);
+		OKNG(ret == 0, "return value: %d, expected: 0\n", ret);
+
+		/* Blocks are inflated on the way */
+		sprintf(elf_fn, "%s.elf", fn);
+		fd = open(fn, O_RDONLY);
+		INTERR(fd == -1, "open returned %d\n", errno);
+
+		ret = ihk_dump_stream_to_elf(fd, elf_fn);
+		close(fd);
+		OKNG(ret == 0, "converted to ELF\n");
+
+		ret = unlink(elf_fn);
+		INTERR(ret, "unlink returned %d\n", ret);
+
+		ret = unlink(fn);
+		INTERR(ret, "unlink returned %d\n", ret);
+	}
+
+	ret = 0;
+ out:
+	if (!(access(fn, F_OK))) {
+		unlink(fn);
+	}
+	if (elf_fn[0] && !(access(elf_fn, F_OK))) {
+		unlink(elf_fn);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
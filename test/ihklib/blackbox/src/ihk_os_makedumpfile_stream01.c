@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ihklib.h>
+#include <ihk/ihk_host_user.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "stream dump";
+const char *values[] = {
+	"through a pipe, converted to ELF on the fly",
+	"truncated stream",
+};
+
+/* Convert what the child reads from in into fn, return its result */
+static int convert_in_child(int in, char *fn, pid_t *pid)
+{
+	*pid = fork();
+	if (*pid == -1) {
+		return -errno;
+	}
+
+	if (*pid == 0) {
+		_exit(ihk_dump_stream_to_elf(in, fn) ? 1 : 0);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int opt;
+	char *fn = NULL;
+	char stream_fn[PATH_MAX];
+	int fds[2];
+	int fd;
+	pid_t pid;
+	int status;
+	struct stat st;
+
+	params_getopt(argc, argv);
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fn = optarg;
+			break;
+		default: /* '?' */
+			printf("unknown option %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	struct mems mems = { 0 };
+	int excess;
+
+	ret = mems_ls(&mems);
+	INTERR(ret, "mems_ls returned %d\n", ret);
+
+	excess = mems.num_mem_chunks - 4;
+	if (excess > 0) {
+		ret = mems_shift(&mems, excess);
+		INTERR(ret, "mems_shift returned %d\n", ret);
+	}
+
+	mems_fill(&mems, (1UL << 29) / mems.num_mem_chunks);
+
+	ret = ihk_reserve_mem(0, mems.mem_chunks,
+			      mems.num_mem_chunks);
+	INTERR(ret, "ihk_reserve_mem returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+
+	ret = pipe(fds);
+	INTERR(ret, "pipe returned %d\n", errno);
+
+	ret = convert_in_child(fds[0], fn, &pid);
+	INTERR(ret, "fork returned %d\n", ret);
+	close(fds[0]);
+
+	ret = ihk_os_makedumpfile_stream(0, fds[1], 24);
+	close(fds[1]);
+	OKNG(ret == 0, "return value: %d, expected: 0\n", ret);
+
+	ret = waitpid(pid, &status, 0);
+	INTERR(ret == -1, "waitpid returned %d\n", errno);
+
+	OKNG(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	     "converted to ELF\n");
+
+	START("test-case: %s: %s\n", param, values[1]);
+
+	sprintf(stream_fn, "%s.stream", fn);
+	fd = open(stream_fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	INTERR(fd == -1, "open returned %d\n", errno);
+
+	ret = ihk_os_makedumpfile_stream(0, fd, 24);
+	INTERR(ret, "ihk_os_makedumpfile_stream returned %d\n", ret);
+
+	ret = fstat(fd, &st);
+	INTERR(ret, "fstat returned %d\n", errno);
+
+	/* Cut in the middle of the data */
+	ret = ftruncate(fd, st.st_size / 2);
+	INTERR(ret, "ftruncate returned %d\n", errno);
+
+	lseek(fd, 0, SEEK_SET);
+	ret = ihk_dump_stream_to_elf(fd, fn);
+	close(fd);
+	unlink(stream_fn);
+	OKNG(ret == -EIO, "return value: %d, expected: %d\n", ret, -EIO);
+
+	ret = 0;
+ out:
+	if (!(access(fn, F_OK))) {
+		unlink(fn);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
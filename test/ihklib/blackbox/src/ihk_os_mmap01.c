@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ihklib.h>
+#include <ihk/ihk_host_user.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "mapping of /dev/mcos0";
+const char *values[] = {
+	"OS memory, read-only",
+	"OS memory, writable",
+	"crossing the end of OS memory",
+	"access after shutdown",
+};
+
+/* Get the first memory area of the OS through the dump interface */
+static int query_area(int fd, unsigned long *addr, unsigned long *size)
+{
+	dumpargs_t args = { 0 };
+	dump_mem_chunks_t *mem_chunks = NULL;
+	int ret;
+
+	args.cmd = DUMP_NMI;
+	if (ioctl(fd, IHK_OS_DUMP, &args)) {
+		return -errno;
+	}
+
+	args.cmd = DUMP_QUERY_NUM_MEM_AREAS;
+	args.size = 0;
+	if (ioctl(fd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		goto out;
+	}
+
+	mem_chunks = calloc(1, args.size);
+	if (!mem_chunks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	args.cmd = DUMP_QUERY_MEM_AREAS;
+	args.buf = mem_chunks;
+	if (ioctl(fd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (mem_chunks->nr_chunks == 0) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	*addr = mem_chunks->chunks[0].addr;
+	*size = mem_chunks->chunks[0].size;
+	ret = 0;
+ out:
+	args.cmd = DUMP_NMI_CONT;
+	ioctl(fd, IHK_OS_DUMP, &args);
+	free(mem_chunks);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int fd = -1;
+	unsigned long addr, size;
+	void *map;
+	pid_t pid;
+	int status;
+
+	params_getopt(argc, argv);
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	fd = open("/dev/mcos0", O_RDONLY);
+	INTERR(fd == -1, "open returned %d\n", errno);
+
+	ret = query_area(fd, &addr, &size);
+	INTERR(ret, "query_area returned %d\n", ret);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, addr);
+	OKNG(map != MAP_FAILED, "mmap succeeded\n");
+	INFO("first word: 0x%lx\n", *(volatile unsigned long *)map);
+	munmap(map, size);
+
+	START("test-case: %s: %s\n", param, values[1]);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr);
+	OKNG(map == MAP_FAILED, "mmap failed with %d\n", errno);
+
+	START("test-case: %s: %s\n", param, values[2]);
+	map = mmap(NULL, size + getpagesize(), PROT_READ, MAP_SHARED, fd,
+		   addr);
+	OKNG(map == MAP_FAILED && errno == EACCES,
+	     "mmap failed with %d, expected: %d\n", errno, EACCES);
+
+	START("test-case: %s: %s\n", param, values[3]);
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, addr);
+	INTERR(map == MAP_FAILED, "mmap returned %d\n", errno);
+
+	ret = ihk_os_shutdown(0);
+	INTERR(ret, "ihk_os_shutdown returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_INACTIVE);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_INACTIVE);
+
+	pid = fork();
+	INTERR(pid == -1, "fork returned %d\n", errno);
+
+	if (pid == 0) {
+		printf("%lx\n", *(volatile unsigned long *)map);
+		_exit(0);
+	}
+
+	ret = waitpid(pid, &status, 0);
+	INTERR(ret == -1, "waitpid returned %d\n", errno);
+
+	OKNG(WIFSIGNALED(status) && WTERMSIG(status) == SIGBUS,
+	     "access is killed by SIGBUS\n");
+	munmap(map, size);
+
+	ret = 0;
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ihklib.h>
+#include <ihk/ihk_host_user.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "params.h"
+#include "linux.h"
+
+const char param[] = "snapshot";
+const char *values[] = {
+	"first, all memory",
+	"second, memory written since the first",
+};
+
+/* Take a snapshot into fn, convert it to ELF and return its data size */
+static int take_snapshot(char *fn, unsigned long *data_size)
+{
+	struct ihk_sdump_header header;
+	char elf_fn[PATH_MAX];
+	int fd;
+	int ret;
+
+	fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return -errno;
+	}
+
+	ret = ihk_os_snapshot(0, fd);
+	if (ret) {
+		INFO("ihk_os_snapshot returned %d\n", ret);
+		goto out;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		ret = -EIO;
+		goto out;
+	}
+	*data_size = header.data_size;
+
+	sprintf(elf_fn, "%s.elf", fn);
+	lseek(fd, 0, SEEK_SET);
+	ret = ihk_dump_stream_to_elf(fd, elf_fn);
+	unlink(elf_fn);
+	if (ret) {
+		INFO("ihk_dump_stream_to_elf returned %d\n", ret);
+		goto out;
+	}
+
+	ret = 0;
+ out:
+	close(fd);
+	unlink(fn);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int opt;
+	char *fn = NULL;
+	unsigned long first, second;
+
+	params_getopt(argc, argv);
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fn = optarg;
+			break;
+		default: /* '?' */
+			printf("unknown option %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	struct mems mems = { 0 };
+	int excess;
+
+	ret = mems_ls(&mems);
+	INTERR(ret, "mems_ls returned %d\n", ret);
+
+	excess = mems.num_mem_chunks - 4;
+	if (excess > 0) {
+		ret = mems_shift(&mems, excess);
+		INTERR(ret, "mems_shift returned %d\n", ret);
+	}
+
+	mems_fill(&mems, (1UL << 29) / mems.num_mem_chunks);
+
+	ret = ihk_reserve_mem(0, mems.mem_chunks,
+			      mems.num_mem_chunks);
+	INTERR(ret, "ihk_reserve_mem returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+
+	ret = take_snapshot(fn, &first);
+	OKNG(ret == 0 && first > 0, "%lu bytes\n", first);
+
+	START("test-case: %s: %s\n", param, values[1]);
+
+	ret = take_snapshot(fn, &second);
+	OKNG(ret == 0 && second < first, "%lu bytes, less than %lu\n",
+	     second, first);
+
+	ret = 0;
+ out:
+	if (!(access(fn, F_OK))) {
+		unlink(fn);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
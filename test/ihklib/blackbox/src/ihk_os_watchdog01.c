@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <ihklib.h>
+#include "util.h"
+#include "okng.h"
+#include "cpu.h"
+#include "mem.h"
+#include "os.h"
+#include "user.h"
+#include "params.h"
+#include "linux.h"
+
+#define SYSFS_WATCHDOG "/sys/class/mcos/mcos0/watchdog/"
+#define THRESHOLD_MS 500
+
+const char param[] = "watchdog";
+const char *values[] = {
+	"default threshold",
+	"out-of-range threshold",
+	"CPU stuck in the kernel without ihkmond",
+};
+
+static int sysfs_read(const char *name, unsigned long *val)
+{
+	char path[256];
+	FILE *fp;
+	int ret;
+
+	sprintf(path, SYSFS_WATCHDOG "%s", name);
+	fp = fopen(path, "r");
+	if (!fp) {
+		return -errno;
+	}
+	ret = fscanf(fp, "%lu", val) == 1 ? 0 : -EINVAL;
+	fclose(fp);
+	return ret;
+}
+
+static int sysfs_write(const char *name, unsigned long val)
+{
+	char path[256];
+	char buf[32];
+	int fd, len, ret = 0;
+
+	sprintf(path, SYSFS_WATCHDOG "%s", name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	len = sprintf(buf, "%lu\n", val);
+	if (write(fd, buf, len) != len) {
+		ret = -errno;
+	}
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int evfd = -1;
+	pid_t pid = -1;
+	unsigned long val;
+	struct pollfd pfd;
+
+	params_getopt(argc, argv);
+
+	/* Precondition */
+	ret = linux_insmod(0);
+	INTERR(ret, "linux_insmod returned %d\n", ret);
+
+	ret = cpus_reserve();
+	INTERR(ret, "cpus_reserve returned %d\n", ret);
+
+	ret = mems_reserve();
+	INTERR(ret, "mems_reserve returned %d\n", ret);
+
+	ret = ihk_create_os(0);
+	INTERR(ret, "ihk_create_os returned %d\n", ret);
+
+	ret = cpus_os_assign();
+	INTERR(ret, "cpus_os_assign returned %d\n", ret);
+
+	ret = mems_os_assign();
+	INTERR(ret, "mems_os_assign returned %d\n", ret);
+
+	ret = os_load();
+	INTERR(ret, "os_load returned %d\n", ret);
+
+	ret = os_kargs();
+	INTERR(ret, "os_kargs returned %d\n", ret);
+
+	/* Activate and check */
+	START("test-case: %s: %s\n", param, values[0]);
+	ret = sysfs_read("threshold_ms", &val);
+	OKNG(ret == 0 && val == 0, "threshold_ms: %lu, expected: 0\n", val);
+
+	START("test-case: %s: %s\n", param, values[1]);
+	ret = sysfs_write("threshold_ms", 3600 * 1000 + 1);
+	OKNG(ret == -EINVAL, "writing threshold_ms returned %d\n", ret);
+
+	START("test-case: %s: %s\n", param, values[2]);
+	/* Set before boot, the watchdog starts with the LWK */
+	ret = sysfs_write("threshold_ms", THRESHOLD_MS);
+	INTERR(ret, "writing threshold_ms failed with %d\n", ret);
+
+	ret = ihk_os_boot(0);
+	INTERR(ret, "ihk_os_boot returned %d\n", ret);
+
+	ret = os_wait_for_status(IHK_STATUS_RUNNING);
+	INTERR(ret, "os status didn't change to %d\n",
+	       IHK_STATUS_RUNNING);
+
+	evfd = ihk_os_get_eventfd(0, IHK_OS_EVENTFD_TYPE_STATUS);
+	INTERR(evfd < 0, "ihk_os_get_eventfd returned %d\n", evfd);
+
+	/* Stays in the kernel for 4 sec, nobody calls
+	 * IHK_DEVICE_DETECT_HUNGUP
+	 */
+	ret = user_fork_exec("hungup", &pid);
+	INTERR(ret < 0, "user_fork_exec returned %d\n", ret);
+
+	pfd.fd = evfd;
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 3 * THRESHOLD_MS);
+	OKNG(ret == 1, "status event within %d ms\n", 3 * THRESHOLD_MS);
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_HUNGUP, "status: %d, expected: %d\n",
+	     ret, IHK_STATUS_HUNGUP);
+
+	ret = sysfs_read("hangups", &val);
+	OKNG(ret == 0 && val == 1, "hangups: %lu, expected: 1\n", val);
+
+	ret = 0;
+ out:
+	if (evfd >= 0) {
+		close(evfd);
+	}
+	if (ihk_get_num_os_instances(0)) {
+		ihk_os_shutdown(0);
+		os_wait_for_status(IHK_STATUS_INACTIVE);
+	}
+	if (pid != -1) {
+		user_wait(&pid);
+		linux_kill_mcexec();
+	}
+	if (ihk_get_num_os_instances(0)) {
+		cpus_os_release();
+		mems_os_release();
+		ihk_destroy_os(0, 0);
+	}
+	cpus_release();
+	mems_release();
+	linux_rmmod(1);
+
+	return ret;
+}
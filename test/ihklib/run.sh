@@ -48,7 +48,7 @@ case ${testname} in
 	printf "*** Apply ${testname}.patch to set kmsg buffer size to 256 and enable syscall #900 and recompile IHK/McKernel.\n"
 	;;
     013)
-	printf "*** Apply ${testname}.patch to set the size of the kmsg memory-buffer o 256 and enable syscall #900 and set the width of the kmsg file-buffer to 64 and its depth to 4 and then recompile IHK/McKernel.\n"
+	printf "*** Apply ${testname}.patch to set the size of the kmsg memory-buffer o 256 and enable syscall #900 and set the size of the kmsg history blocks of ihkmond to 64 and then recompile IHK/McKernel.\n"
 	;;
     014 | 015)
 	printf "*** Apply ${testname}.patch to enable syscall #900 and recompile IHK/McKernel.\n"